@@ -56,6 +56,11 @@
 #include <CoreServices/CoreServices.h>
 #include <CoreAudio/CoreAudio.h>
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <utility>
+
 // borrow some useful macros from Qt:
 #ifndef QGLOBAL_H
 #	define QT_DARWIN_PLATFORM_SDK_EQUAL_OR_ABOVE(macos, ios, tvos, watchos) \
@@ -81,6 +86,10 @@ using AudioPropertyListenerProc = AudioObjectPropertyListenerProc;
 #endif
 
 class AudioDeviceList;
+class RejectedRates;
+class DeviceReaper;
+class DeviceJournal;
+class SwitchCosts;
 
 class AudioDevice {
 public:
@@ -89,16 +98,154 @@ public:
 	AudioDevice(AudioDeviceID devid, AudioPropertyListenerProc lProc, bool isInput=false);
 	~AudioDevice();
 
+	// devices are allocated from a small pool set aside with the program, so that following
+	// the default device from one to another doesn't go to the heap; the heap takes over
+	// when the pool is exhausted
+	static void *operator new(size_t size);
+	static void operator delete(void *p);
+
 	void Init(AudioPropertyListenerProc lProc);
 
 	bool Valid() { return mID != kAudioDeviceUnknown; }
 
 	void SetBufferSize(UInt32 size);
+	// Buffer size auto-tuning: when a target duration is set, every rate change rescales
+	// the I/O buffer so it holds that many milliseconds at the new rate, within the
+	// device's kAudioDevicePropertyBufferFrameSizeRange. 0 disables the feature.
+	static void SetBufferDuration(double milliSeconds)
+	{
+		sBufferDurationMS = milliSeconds;
+	}
+	UInt32 TunedBufferSize(Float64 sampleRate);
+	UInt32 BufferSize()
+	{
+		return mBufferSizeFrames;
+	}
+
+	// The end-to-end latency of the device at its current rate, in frames and in microseconds.
+	// It is recomputed whenever the rate, buffer size or physical format change.
+	struct LatencyInfo {
+		Float64 sampleRate;
+		UInt32 deviceFrames, streamFrames, safetyOffsetFrames, bufferFrames;
+		Float64 deviceMicroSeconds, streamMicroSeconds, safetyOffsetMicroSeconds, bufferMicroSeconds;
+		Float64 totalMicroSeconds;
+	};
+	OSStatus UpdateLatency();
+	const LatencyInfo &Latency()
+	{
+		return mLatency;
+	}
+	// the number of times the nominal rate was actually changed through SetNominalSampleRate()
+	// or ResetNominalSampleRate(), and when that happened last (steady clock, in seconds)
+	UInt32 Switches()
+	{
+		return mSwitches;
+	}
+	double LastSwitchTime()
+	{
+		return mLastSwitchTime;
+	}
+	// the number of HAL calls (property get/set/has and listener registrations) that all
+	// AudioDevice instances together have made so far
+	static unsigned long HALCalls()
+	{
+		return sHALCalls.load(std::memory_order_relaxed);
+	}
+	static void CountHALCall()
+	{
+		sHALCalls.fetch_add(1, std::memory_order_relaxed);
+	}
+	// Overload telemetry: the processor overloads and abnormal I/O stops the HAL reports for
+	// the device are counted, and attributed to the window before, during or after a rate
+	// switch when they occur within sOverloadWindow seconds of one. The time spent at, and the
+	// events seen at each combination of nominal rate and buffer size give the overload rate
+	// of that setting.
+	struct OverloadStats {
+		UInt32 overloads, ioStops;
+		UInt32 beforeSwitch, duringSwitch, afterSwitch;
+	};
+	struct ConfigurationLoad {
+		double seconds;
+		UInt32 events;
+	};
+	// keyed by (nominal rate, buffer size in frames)
+	typedef std::map<std::pair<Float64, UInt32>, ConfigurationLoad> ConfigurationLoadMap;
+	static void SetOverloadWindow(double seconds)
+	{
+		sOverloadWindow = seconds;
+	}
+	void NoteOverload(AudioObjectPropertySelector selector);
+	OverloadStats Overloads();
+	// includes the time spent so far in the current configuration
+	ConfigurationLoadMap OverloadRates();
+	void LogOverloads();
+	// Rejected rates: rates the device refused to switch to, or accepted without switching to
+	// them, are skipped by ClosestNominalSampleRate(), which picks the next-best rate instead.
+	// A device starts with the rates recorded for its UID in the store set here, and adds
+	// the ones it finds to it; without a store, they are only remembered for the instance.
+	static void SetRejectedRates(RejectedRates *store)
+	{
+		sRejectedRates = store;
+	}
+	bool IsRejectedRate(Float64 sampleRate);
+	const char *GetUID()
+	{
+		return mDevUID;
+	}
 	OSStatus NominalSampleRate(Float64 &sampleRate);
 	inline Float64 ClosestNominalSampleRate(Float64 sampleRate);
+	// with the physical formats matched to the content if physical format matching is on,
+	// and the buffer tuned to the buffer duration, if set
 	OSStatus SetNominalSampleRate(Float64 sampleRate, Boolean force=false);
+	// Reconfiguration transactions: the rate, the physical formats and the buffer size are
+	// changed together, in the order that costs the device the fewest reconfigurations. A
+	// physical format that has to change is set at the new rate, which takes the nominal rate
+	// along with it, so that the rate is only set by itself if it didn't follow; the buffer
+	// size comes last, as the valid sizes can depend on the rate. Reconfigure() then waits
+	// once for the hardware to lock on the new rate, rather than after each change.
+	struct Reconfiguration {
+		Float64 sampleRate;
+		// the content format the physical formats are matched to; 0 bits leaves them alone
+		UInt32 contentBits, contentChannels;
+		// 0 tunes the buffer to the buffer duration (see SetBufferDuration()), if there is one
+		UInt32 bufferFrames;
+		// how long to wait for the actual rate to follow, in seconds; 0 doesn't wait
+		double settleTimeout;
+		bool force;
+		// return to the state the device was opened in: the initial clock source and physical
+		// formats are restored first, and sampleRate (the initial rate) is set itself rather than
+		// the closest rate the device supports and hasn't rejected, which must not stand in its way
+		bool restore;
+	};
+	struct ReconfigurationReport {
+		// the set calls made, and the changes they caused by kind; the reconfigurations are
+		// the sum of the changes
+		UInt32 setCalls, reconfigurations;
+		UInt32 rateChanges, formatChanges, bufferChanges, clockSourceChanges;
+		// whether the actual rate reached the nominal rate within the settle timeout
+		bool settled;
+		double applySeconds, settleSeconds;
+	};
+	OSStatus Reconfigure(const Reconfiguration &target, ReconfigurationReport *report=NULL);
 	OSStatus ResetNominalSampleRate(Boolean force=false);
 	OSStatus SetStreamBasicDescription(AudioStreamBasicDescription *desc);
+
+	// Physical format matching: when enabled, every rate change also selects, for each of
+	// the device's streams, the available physical format that best matches the content
+	// (integer samples of the content's bit depth and channel count), so that the HAL
+	// doesn't have to convert from float. The initial physical formats are restored
+	// exactly by ResetNominalSampleRate() and when the device is released.
+	static void SetPhysicalFormatMatching(bool enable)
+	{
+		sMatchPhysicalFormat = enable;
+	}
+	void SetContentFormat(UInt32 bitsPerChannel, UInt32 channelsPerFrame)
+	{
+		mContentBits = bitsPerChannel;
+		mContentChannels = channelsPerFrame;
+	}
+	OSStatus MatchPhysicalFormat(Float64 sampleRate, ReconfigurationReport *report=NULL);
+	OSStatus RestorePhysicalFormat(ReconfigurationReport *report=NULL);
 	int CountChannels();
 	char *GetName(char *buf=NULL, UInt32 maxlen=0);
 
@@ -111,31 +258,200 @@ public:
     {
         return currentNominalSR;
     }
+	// the content rate last passed to SetNominalSampleRate(), 0 after a reset
+	Float64 ContentSampleRate()
+	{
+		return mContentSR;
+	}
+	// true when the device could not be set to a multiple of the content rate, in which case
+	// a player that embeds this class should convert the content itself (see Resampler/Resampler.h)
+	bool ContentNeedsResampling();
 
 	AudioDeviceID ID()
 	{
 		return mID;
 	}
 
+	bool IsInput()
+	{
+		return mForInput;
+	}
+
+	// devices with the same non-zero clock domain share their clock and thus their rate
+	UInt32 ClockDomain()
+	{
+		return mClockDomain;
+	}
+	// Clock source selection: some devices have a master clock for each family of rates (the
+	// multiples of 44.1kHz and those of 48kHz), and are slow to lock to a rate outside the family
+	// of the selected clock. A device maps its clock sources to the families by their names when
+	// it is opened ("Internal 44.1kHz", "48k Crystal"); when enabled here, a rate change to the
+	// other family selects the source made for it in the same reconfiguration, just before the
+	// rate. A device on a source of neither family (an external clock) is left on it. The
+	// initial source is restored with the initial rate.
+	static void SetClockSourceSelection(bool enable)
+	{
+		sSelectClockSource = enable;
+	}
+	// the selected clock source, 0 if the device doesn't have any
+	UInt32 ClockSource()
+	{
+		return mClockSource;
+	}
+	// 44100 for the multiples of 11025Hz, 48000 for those of 4000Hz, 0 for other rates
+	static Float64 RateFamily(Float64 sampleRate);
+
+	// these release dev if it isn't the requested device
 	static AudioDevice *GetDefaultDevice(Boolean forInput, OSStatus &err, AudioDevice *dev=NULL);
 	static AudioDevice *GetDevice(AudioDeviceID devId, Boolean forInput, AudioDevice *dev=NULL);
+	// Releasing a device restores its initial settings. With a reaper set here, that happens
+	// on the reaper's thread, and a device waits for the release of an earlier instance with
+	// the same ID before it reads or changes the device's state; without one, Release()
+	// deletes the device on the spot.
+	static void SetReaper(DeviceReaper *reaper)
+	{
+		sReaper = reaper;
+	}
+	static void Release(AudioDevice *dev);
+	// stop listening to the HAL, without restoring anything: for a device that is abandoned
+	// rather than released (see DeviceReaper::Flush()), and mustn't be called into once the
+	// code that embeds it is gone. Its journal entry is left for the next session to restore.
+	void RemoveListeners();
+	// Switch costs: with a store set here, every change of the nominal rate is timed from the
+	// start of the reconfiguration until the actual rate has followed (as the HAL reports it),
+	// and added to the store, which learns the cost of each transition of the device.
+	static void SetSwitchCosts(SwitchCosts *store)
+	{
+		sSwitchCosts = store;
+	}
+	// the time a switch for content at sampleRate is expected to interrupt the audio, in
+	// seconds: 0 if the device is at the rate it would choose already, -1 if it isn't known
+	double ExpectedSwitchCost(Float64 sampleRate);
+	// the actual rate may have changed; called by the telemetry listener
+	void NoteActualRate();
+	// Crash-safe restoration: with a journal set here, a device records its initial settings
+	// in it before it changes any of them, and clears its entry once it has restored them.
+	static void SetJournal(DeviceJournal *journal)
+	{
+		sJournal = journal;
+	}
+	// the streams a device keeps track of (and the journal records the formats of)
+	enum { kMaxStreams = 16 };
 
 protected:
 	AudioDevice(AudioDeviceID devid, bool quick, bool isInput);
+
+	struct Stream {
+		AudioStreamID mID;
+		AudioStreamBasicDescription mInitialPhysicalFormat;
+		AudioStreamBasicDescription mPhysicalFormat;
+		UInt32 mNumPhysicalFormats;
+		AudioStreamRangedDescription *mPhysicalFormats;
+	};
+	void InitStreams();
+	void InitClockSources();
+	OSStatus SetClockSource(UInt32 source);
+	OSStatus SelectClockSource(Float64 sampleRate, ReconfigurationReport *report);
+	int BestPhysicalFormat(Stream &stream, Float64 sampleRate);
+	OSStatus SetPhysicalFormat(Stream &stream, const AudioStreamBasicDescription &format);
+	void BeginSwitch();
+	void EndSwitch();
+	void AccountConfiguration(double now);
+	void RejectRate(Float64 sampleRate, OSStatus status);
+	void ForgetRate(Float64 sampleRate);
+	bool WaitForActualRate(Float64 sampleRate, double timeout);
+	void ConfirmNominalSampleRate();
+
 	AudioStreamBasicDescription mInitialFormat;
-	AudioPropertyListenerProc listenerProc;
+	AudioPropertyListenerProc listenerProc = NULL;
 	OSStatus GetPropertyDataSize( AudioObjectPropertySelector property, UInt32 *size, AudioObjectPropertyAddress *propertyAddress=NULL );
 	Float64 currentNominalSR;
 	Float64 minNominalSR, maxNominalSR;
-	UInt32 nominalSampleRates;
-	Float64 *nominalSampleRateList = NULL;
+	// the rates the device supports, or those of the standard rates within its ranges
+	enum { kMaxNominalRates = 64 };
+	UInt32 nominalSampleRates = 0;
+	Float64 nominalSampleRateList[kMaxNominalRates];
 	bool discreteSampleRateList;
 	const AudioDeviceID mID;
 	const bool mForInput;
 	UInt32 mSafetyOffset;
 	UInt32 mBufferSizeFrames;
+	UInt32 mInitialBufferSizeFrames = 0;
+	AudioValueRange mBufferSizeRange = { 0, 0 };
+	static double sBufferDurationMS;
+	UInt32 mClockDomain = 0;
+	// the clock sources and the family of each (see RateFamily()), the one selected when the
+	// device was opened, and the one selected now
+	enum { kMaxClockSources = 16 };
+	UInt32 mClockSources[kMaxClockSources];
+	Float64 mClockSourceFamilies[kMaxClockSources];
+	UInt32 mNumClockSources = 0;
+	UInt32 mInitialClockSource = 0, mClockSource = 0;
+	static bool sSelectClockSource;
 	AudioStreamBasicDescription mFormat;
 	char mDevName[256] = "";
+	char mDevUID[256] = "";
+	Stream mStreams[kMaxStreams];
+	UInt32 mNumStreams = 0;
+	// the available physical formats of all streams: in the device itself unless there
+	// are more than kMaxPhysicalFormats, in which case InitStreams() allocates them
+	enum { kMaxPhysicalFormats = 96 };
+	AudioStreamRangedDescription mPhysicalFormatStore[kMaxPhysicalFormats];
+	AudioStreamRangedDescription *mPhysicalFormatArena = NULL;
+	bool mPhysicalFormatChanged = false;
+	UInt32 mPhysicalFormatChanges = 0;
+	LatencyInfo mLatency = {};
+	UInt32 mContentBits = 0, mContentChannels = 0;
+	Float64 mContentSR = 0;
+	UInt32 mSwitches = 0;
+	double mLastSwitchTime = 0;
+	static bool sMatchPhysicalFormat;
+	enum { kMaxRejectedRates = 16 };
+	Float64 mRejectedRates[kMaxRejectedRates];
+	UInt32 mNumRejectedRates = 0;
+	// the rate of the last successful set call until the device confirms it, and the rate before;
+	// when the call was made and how long the device has to confirm it. The rate the device was
+	// found to have ignored once, which it is only rejected for the second time.
+	Float64 mUnconfirmedSR = 0, mUnconfirmedFromSR = 0;
+	double mUnconfirmedSince = 0, mUnconfirmedTimeout = 0;
+	Float64 mSuspectedSR = 0;
+	static RejectedRates *sRejectedRates;
+	static DeviceReaper *sReaper;
+	static DeviceJournal *sJournal;
+	static SwitchCosts *sSwitchCosts;
+	bool mJournaled = false;
+	// record the initial settings in the journal before the first change
+	void Journal();
+	// wait until the reaper has released any earlier instance of this device
+	void AwaitRelease();
+
+	// overload telemetry; the listener runs on a HAL thread, hence the lock
+	std::mutex mOverloadLock;
+	bool mOverloadListening = false;
+	OverloadStats mOverloads = {};
+	// events not (yet) attributed to a switch, the most recent last
+	enum { kOverloadHistory = 32 };
+	double mRecentOverloads[kOverloadHistory];
+	UInt32 mNumRecentOverloads = 0;
+	bool mSwitching = false;
+	double mSwitchEnd = 0;
+	// the switch being timed until the actual rate reaches mTimedToSR (0 if none), and when it began
+	Float64 mTimedFromSR = 0, mTimedToSR = 0;
+	double mTimedSince = 0;
+	void TimeSwitch(Float64 fromSR, double since, bool settled);
+	// the configurations seen so far, in a table of fixed size so that a switch never allocates
+	enum { kMaxConfigurations = 32 };
+	struct ConfigurationEntry {
+		std::pair<Float64, UInt32> configuration;
+		ConfigurationLoad load;
+	};
+	ConfigurationEntry mConfigurationLoad[kMaxConfigurations];
+	UInt32 mNumConfigurations = 0;
+	ConfigurationLoad *LoadOf(const std::pair<Float64, UInt32> &configuration);
+	std::pair<Float64, UInt32> mConfiguration;
+	double mConfigurationSince = 0;
+	static double sOverloadWindow;
+	static std::atomic<unsigned long> sHALCalls;
 
 	bool mInitialised = false;
 
@@ -148,4 +464,7 @@ public:
 
 AudioDevice *GetDefaultDevice(Boolean isInput, OSStatus &err, AudioDevice *dev=NULL);
 
+// NSLog() for use in plain C++ translation units
+void ADLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
 #endif // __AudioDevice_h__
@@ -47,7 +47,33 @@
 */
 
 #include "AudioDevice.h"
-#import <Cocoa/Cocoa.h>
+#include "RejectedRates.h"
+#include "DeviceReaper.h"
+#include "DeviceJournal.h"
+#include "SwitchCosts.h"
+#ifndef BP_SIMULATED_HAL
+#	import <Cocoa/Cocoa.h>
+#endif
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// every HAL call made in this file is counted for AudioDevice::HALCalls()
+#define AudioObjectHasProperty(...)               (AudioDevice::CountHALCall(), AudioObjectHasProperty(__VA_ARGS__))
+#define AudioObjectIsPropertySettable(...)        (AudioDevice::CountHALCall(), AudioObjectIsPropertySettable(__VA_ARGS__))
+#define AudioObjectGetPropertyDataSize(...)       (AudioDevice::CountHALCall(), AudioObjectGetPropertyDataSize(__VA_ARGS__))
+#define AudioObjectGetPropertyData(...)           (AudioDevice::CountHALCall(), AudioObjectGetPropertyData(__VA_ARGS__))
+#define AudioObjectSetPropertyData(...)           (AudioDevice::CountHALCall(), AudioObjectSetPropertyData(__VA_ARGS__))
+#define AudioObjectAddPropertyListener(...)       (AudioDevice::CountHALCall(), AudioObjectAddPropertyListener(__VA_ARGS__))
+#define AudioObjectRemovePropertyListener(...)    (AudioDevice::CountHALCall(), AudioObjectRemovePropertyListener(__VA_ARGS__))
 
 char *OSTStr(OSType type)
 {
@@ -60,6 +86,30 @@ char *OSTStr(OSType type)
     return ltype.str;
 }
 
+static double SteadyTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ADLog(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    // formatted on the stack rather than into an NSString of our own; we may be called on a HAL
+    // thread that has no autorelease pool, and @autoreleasepool provides one without allocating
+    char message[1024];
+    vsnprintf(message, sizeof(message), format, ap);
+#ifdef BP_SIMULATED_HAL
+    // in a single write, so that lines from the reaper's and the HAL's threads don't mix
+    fprintf(stderr, "%s\n", message);
+#else
+    @autoreleasepool {
+        NSLog(@"%s", message);
+    }
+#endif
+    va_end(ap);
+}
+
 // the sample rates that can be found in the selections proposed by Audio Midi Setup. Are these representative
 // for the devices I have at my disposal, or are they determined by discrete supported values hardcoded into
 // CoreAudio or the HAL? Is there any advantage in using one of these rates, as opposed to using a different rate
@@ -69,6 +119,27 @@ static Float64 supportedSRateList[] = {6400, 8000, 11025, 12000, 16000, 22050,
                                       };
 static UInt32 supportedSRates = sizeof(supportedSRateList) / sizeof(Float64);
 
+bool AudioDevice::sMatchPhysicalFormat = false;
+bool AudioDevice::sSelectClockSource = false;
+double AudioDevice::sBufferDurationMS = 0;
+double AudioDevice::sOverloadWindow = 2.0;
+std::atomic<unsigned long> AudioDevice::sHALCalls(0);
+RejectedRates *AudioDevice::sRejectedRates = NULL;
+DeviceReaper *AudioDevice::sReaper = NULL;
+DeviceJournal *AudioDevice::sJournal = NULL;
+SwitchCosts *AudioDevice::sSwitchCosts = NULL;
+// how long a device waits for the release of an earlier instance
+static const double kReleaseTimeout = 5.0;
+// how long a device has at least to report a new nominal rate before it can be found to have ignored it
+static const double kConfirmTimeout = 2.0;
+
+// the HAL signals that the telemetry listener subscribes to: the overloads, and the actual rate
+// for the switch costs
+static const AudioObjectPropertySelector telemetrySelectors[] = {
+    kAudioDeviceProcessorOverload, kAudioDevicePropertyIOStoppedAbnormally, kAudioDevicePropertyActualSampleRate
+};
+static const UInt32 numTelemetrySelectors = sizeof(telemetrySelectors) / sizeof(AudioObjectPropertySelector);
+
 #ifdef DEPRECATED_LISTENER_API
 
 OSStatus DefaultListener(AudioDeviceID inDevice, UInt32 inChannel, Boolean forInput,
@@ -78,9 +149,9 @@ OSStatus DefaultListener(AudioDeviceID inDevice, UInt32 inChannel, Boolean forIn
     UInt32 size;
     Float64 sampleRate;
     AudioDevice *dev = (AudioDevice *) inClientData;
-    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-    NSString *msg = [NSString stringWithFormat:@"Property %s of device %u changed; data=%p",
-                     OSTStr((OSType)inPropertyID), (unsigned int)inDevice, inClientData ];
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Property %s of device %u changed; data=%p",
+             OSTStr((OSType)inPropertyID), (unsigned int)inDevice, inClientData);
     AudioObjectPropertyAddress theAddress = { inPropertyID,
                                               forInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
                                               kAudioObjectPropertyElementMaster
@@ -91,7 +162,7 @@ OSStatus DefaultListener(AudioDeviceID inDevice, UInt32 inChannel, Boolean forIn
             size = sizeof(sampleRate);
             if (AudioObjectGetPropertyData(inPropertyID, &theAddress, 0, NULL, &size, &sampleRate) == noErr
                     && (dev && !dev->listenerSilentFor)) {
-                NSLog(@"%@\n\tkAudioDevicePropertyNominalSampleRate=%g\n", msg, sampleRate);
+                ADLog("%s\n\tkAudioDevicePropertyNominalSampleRate=%g\n", msg, sampleRate);
             }
             break;
         case kAudioDevicePropertyActualSampleRate:
@@ -100,22 +171,19 @@ OSStatus DefaultListener(AudioDeviceID inDevice, UInt32 inChannel, Boolean forIn
                 // update the rate we should reset to
                 dev->SetInitialNominalSampleRate(sampleRate);
                 if (!dev->listenerSilentFor) {
-                    NSLog(@"%@\n\tkAudioDevicePropertyActualSampleRate=%g\n", msg, sampleRate);
+                    ADLog("%s\n\tkAudioDevicePropertyActualSampleRate=%g\n", msg, sampleRate);
                 }
             }
             break;
         default:
             if ((dev && !dev->listenerSilentFor)) {
-                NSLog(msg);
+                ADLog("%s", msg);
             }
             break;
     }
     if (dev && dev->listenerSilentFor) {
         dev->listenerSilentFor -= 1;
     }
-    if (pool) {
-        [pool drain];
-    }
     return noErr;
 }
 
@@ -128,17 +196,17 @@ static OSStatus DefaultListener(AudioObjectID inObjectID, UInt32 inNumberPropert
     UInt32 size;
     Float64 sampleRate;
     AudioDevice *dev = static_cast<AudioDevice *>(inClientData);
-    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    char msg[128];
     for (int i = 0 ; i < inNumberProperties ; ++i) {
-        NSString *msg = [NSString stringWithFormat:@"#%d Property %s of device %u changed; data=%p", i,
-                         OSTStr((OSType)propTable[i].mElement), (unsigned int)inObjectID, inClientData ];
+        snprintf(msg, sizeof(msg), "#%d Property %s of device %u changed; data=%p", i,
+                 OSTStr((OSType)propTable[i].mElement), (unsigned int)inObjectID, inClientData);
         switch (propTable[i].mElement) {
             case kAudioDevicePropertyNominalSampleRate:
                 size = sizeof(sampleRate);
                 if (AudioObjectGetPropertyData(inObjectID, &propTable[i], 0, NULL, &size, &sampleRate) == noErr
                         && (dev && !dev->listenerSilentFor)
                    ) {
-                    NSLog(@"%@\n\tkAudioDevicePropertyNominalSampleRate=%g\n", msg, sampleRate);
+                    ADLog("%s\n\tkAudioDevicePropertyNominalSampleRate=%g\n", msg, sampleRate);
                 }
                 break;
             case kAudioDevicePropertyActualSampleRate:
@@ -147,13 +215,13 @@ static OSStatus DefaultListener(AudioObjectID inObjectID, UInt32 inNumberPropert
                     // update the rate we should reset to
                     dev->SetInitialNominalSampleRate(sampleRate);
                     if (!dev->listenerSilentFor) {
-                        NSLog(@"%@\n\tkAudioDevicePropertyActualSampleRate=%g\n", msg, sampleRate);
+                        ADLog("%s\n\tkAudioDevicePropertyActualSampleRate=%g\n", msg, sampleRate);
                     }
                 }
                 break;
             default:
                 if ((dev && !dev->listenerSilentFor)) {
-                    NSLog(msg);
+                    ADLog("%s", msg);
                 }
                 break;
         }
@@ -161,8 +229,36 @@ static OSStatus DefaultListener(AudioObjectID inObjectID, UInt32 inNumberPropert
     if (dev && dev->listenerSilentFor) {
         dev->listenerSilentFor -= 1;
     }
-    if (pool) {
-        [pool drain];
+    return noErr;
+}
+#endif
+
+// The telemetry listener is kept apart from the (possibly user supplied) listenerProc, so that
+// it sees every event regardless of listenerSilentFor.
+#ifdef DEPRECATED_LISTENER_API
+static OSStatus TelemetryListener(AudioDeviceID inDevice, UInt32 inChannel, Boolean forInput,
+                                 AudioDevicePropertyID inPropertyID,
+                                 void *inClientData)
+{
+    if (inPropertyID == kAudioDevicePropertyActualSampleRate) {
+        static_cast<AudioDevice *>(inClientData)->NoteActualRate();
+    } else {
+        static_cast<AudioDevice *>(inClientData)->NoteOverload(inPropertyID);
+    }
+    return noErr;
+}
+#else
+static OSStatus TelemetryListener(AudioObjectID inObjectID, UInt32 inNumberProperties,
+                                 const AudioObjectPropertyAddress propTable[],
+                                 void *inClientData)
+{
+    AudioDevice *dev = static_cast<AudioDevice *>(inClientData);
+    for (UInt32 i = 0 ; i < inNumberProperties ; ++i) {
+        if (propTable[i].mSelector == kAudioDevicePropertyActualSampleRate) {
+            dev->NoteActualRate();
+        } else {
+            dev->NoteOverload(propTable[i].mSelector);
+        }
     }
     return noErr;
 }
@@ -175,10 +271,32 @@ void AudioDevice::Init(AudioPropertyListenerProc lProc = DefaultListener)
     }
 	OSStatus err = noErr;
 
+    // the initial state must not be read while an earlier instance is still restoring it
+    AwaitRelease();
+
 	// getting the device name can be surprisingly slow, so we get and cache it here
 	GetName();
 
-    UInt32 propsize = sizeof(Float32);
+    // the UID identifies the device across sessions in the record of rejected rates
+    CFStringRef uid = NULL;
+    UInt32 propsize = sizeof(CFStringRef);
+    AudioObjectPropertyAddress uidAddress = { kAudioDevicePropertyDeviceUID,
+                                              kAudioObjectPropertyScopeGlobal,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    if (AudioObjectGetPropertyData(mID, &uidAddress, 0, NULL, &propsize, &uid) == noErr && uid) {
+        CFStringGetCString(uid, mDevUID, sizeof(mDevUID), kCFStringEncodingUTF8);
+        CFRelease(uid);
+    }
+    if (sRejectedRates && *mDevUID) {
+        mNumRejectedRates = (UInt32) std::min<size_t>(sRejectedRates->RatesFor(mDevUID, mRejectedRates, kMaxRejectedRates),
+                                                      kMaxRejectedRates);
+        for (UInt32 i = 0 ; i < mNumRejectedRates ; ++i) {
+            ADLog("\"%s\" is known not to take %gHz", GetName(), mRejectedRates[i]);
+        }
+    }
+
+    propsize = sizeof(Float32);
 
     AudioObjectPropertyAddress theAddress = { kAudioDevicePropertySafetyOffset,
                                               mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
@@ -189,6 +307,23 @@ void AudioDevice::Init(AudioPropertyListenerProc lProc = DefaultListener)
     propsize = sizeof(UInt32);
     theAddress.mSelector = kAudioDevicePropertyBufferFrameSize;
     verify_noerr(AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &mBufferSizeFrames));
+    mInitialBufferSizeFrames = mBufferSizeFrames;
+    propsize = sizeof(AudioValueRange);
+    theAddress.mSelector = kAudioDevicePropertyBufferFrameSizeRange;
+    if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &mBufferSizeRange) != noErr) {
+        mBufferSizeRange.mMinimum = mBufferSizeRange.mMaximum = mBufferSizeFrames;
+    }
+
+    // devices that share a clock domain change rate together. 0 means the device doesn't say.
+    AudioObjectPropertyAddress domainAddress = { kAudioDevicePropertyClockDomain,
+                                                 kAudioObjectPropertyScopeGlobal,
+                                                 kAudioObjectPropertyElementMaster
+                                               };
+    propsize = sizeof(UInt32);
+    if (AudioObjectGetPropertyData(mID, &domainAddress, 0, NULL, &propsize, &mClockDomain) != noErr) {
+        mClockDomain = 0;
+    }
+    InitClockSources();
 
     listenerProc = lProc;
     listenerSilentFor = 0;
@@ -203,48 +338,67 @@ void AudioDevice::Init(AudioPropertyListenerProc lProc = DefaultListener)
                                             kAudioObjectPropertyElementMaster
                                           };
         if ((err = AudioObjectAddPropertyListener(mID, &prop, lProc, this)) != noErr) {
-            NSLog(@"Couldn't register property listener for actual sample rate: %d (%s)", err, OSTStr(err));
+            ADLog("Couldn't register property listener for actual sample rate: %d (%s)", err, OSTStr(err));
         }
         prop.mElement = kAudioDevicePropertyNominalSampleRate;
         if ((err = AudioObjectAddPropertyListener(mID, &prop, lProc, this)) != noErr) {
-            NSLog(@"Couldn't register property listener for nominal sample rate: %d (%s)", err, OSTStr(err));
+            ADLog("Couldn't register property listener for nominal sample rate: %d (%s)", err, OSTStr(err));
         }
         prop.mElement = kAudioHardwarePropertyDefaultOutputDevice;
         if ((err = AudioObjectAddPropertyListener(mID, &prop, lProc, this)) != noErr) {
-            NSLog(@"Couldn't register property listener for selected default device: %d (%s)", err, OSTStr(err));
+            ADLog("Couldn't register property listener for selected default device: %d (%s)", err, OSTStr(err));
         }
 #endif
     } else {
-        NSLog(@"Warning: no CoreAudio event listener has been defined");
+        ADLog("Warning: no CoreAudio event listener has been defined");
+    }
+    for (UInt32 i = 0 ; i < numTelemetrySelectors ; ++i) {
+#ifdef DEPRECATED_LISTENER_API
+        err = AudioDeviceAddPropertyListener(mID, 0, mForInput, telemetrySelectors[i], TelemetryListener, this);
+#else
+        AudioObjectPropertyAddress prop = { telemetrySelectors[i],
+                                            kAudioObjectPropertyScopeGlobal,
+                                            kAudioObjectPropertyElementMaster
+                                          };
+        err = AudioObjectAddPropertyListener(mID, &prop, TelemetryListener, this);
+#endif
+        if (err != noErr) {
+            ADLog("Couldn't register the %s listener: %d (%s)", OSTStr(telemetrySelectors[i]), err, OSTStr(err));
+        } else {
+            mOverloadListening = true;
+        }
     }
     propsize = sizeof(Float64);
     theAddress.mSelector = kAudioDevicePropertyNominalSampleRate;
     verify_noerr(AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &currentNominalSR));
+    if (IsRejectedRate(currentNominalSR)) {
+        ForgetRate(currentNominalSR);
+    }
     propsize = sizeof(AudioStreamBasicDescription);
     theAddress.mSelector = kAudioDevicePropertyStreamFormat;
     verify_noerr(AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &mInitialFormat));
     mFormat = mInitialFormat;
+    InitStreams();
     propsize = 0;
     theAddress.mSelector = kAudioDevicePropertyAvailableNominalSampleRates;
     // attempt to build a list of the supported sample rates
     if ((err = AudioObjectGetPropertyDataSize(mID, &theAddress, 0, NULL, &propsize)) == noErr) {
-        AudioValueRange *list;
-        // use a fall-back value of 100 supported rates:
-        if (propsize == 0) {
-            propsize = 100 * sizeof(AudioValueRange);
+        // use a fall-back value of 100 supported rates, which is also the maximum we read
+        AudioValueRange list[100];
+        if (propsize == 0 || propsize > sizeof(list)) {
+            propsize = sizeof(list);
         }
-        if ((list = (AudioValueRange *) calloc(1, propsize))) {
+        {
             theAddress.mSelector = kAudioDevicePropertyAvailableNominalSampleRates;
             err = AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, list);
-            if (err == noErr) {
+            if (err == noErr && propsize >= sizeof(AudioValueRange)) {
                 UInt32 i;
-                NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
-                NSMutableArray *a = [NSMutableArray arrayWithCapacity:nominalSampleRates];
+                Float64 rates[kMaxNominalRates];
+                UInt32 numRates = 0;
                 nominalSampleRates = propsize / sizeof(AudioValueRange);
-                a = [NSMutableArray arrayWithCapacity:nominalSampleRates];
                 minNominalSR = list[0].mMinimum;
                 maxNominalSR = list[0].mMaximum;
-                // store the returned sample rates in [a] and record the extreme values
+                // store the returned sample rates in [rates] and record the extreme values
                 for (i = 0 ; i < nominalSampleRates ; i++) {
                     if (minNominalSR > list[i].mMinimum) {
                         minNominalSR = list[i].mMinimum;
@@ -252,61 +406,63 @@ void AudioDevice::Init(AudioPropertyListenerProc lProc = DefaultListener)
                     if (maxNominalSR < list[i].mMaximum) {
                         maxNominalSR = list[i].mMaximum;
                     }
-                    if (a) {
-                        if (list[i].mMinimum != list[i].mMaximum) {
-                            UInt32 j;
-                            discreteSampleRateList = false;
-                            // the 'guessing' case: the device specifies one or more ranges, without
-                            // indicating which rates in that range(s) are supported. We assume the
-                            // rates that Audio Midi Setup shows.
-                            for (j = 0 ; j < supportedSRates ; j++) {
-                                if (supportedSRateList[j] >= list[i].mMinimum
-                                        && supportedSRateList[j] <= list[i].mMaximum
-                                   ) {
-                                    [a addObject:[NSNumber numberWithDouble:supportedSRateList[j]]];
-                                }
-                            }
-                        } else {
-                            // there's at least one part of the sample rate list that contains discrete
-                            // supported values. I don't know if there are devices that "do this" or if they all
-                            // either give discrete rates or a single continuous range. So we take the easy
-                            // opt-out solution: this only costs a few cycles attempting to match a requested
-                            // non-listed rate (with the potential "risk" of matching to a listed integer multiple,
-                            // which should not cause any aliasing).
-                            discreteSampleRateList = true;
-                            // the easy case: the device specifies one or more discrete rates
-                            if (![a containsObject:[NSNumber numberWithDouble:list[i].mMinimum]]) {
-                                [a addObject:[NSNumber numberWithDouble:list[i].mMinimum]];
+                    if (list[i].mMinimum != list[i].mMaximum) {
+                        UInt32 j;
+                        discreteSampleRateList = false;
+                        // the 'guessing' case: the device specifies one or more ranges, without
+                        // indicating which rates in that range(s) are supported. We assume the
+                        // rates that Audio Midi Setup shows.
+                        for (j = 0 ; j < supportedSRates ; j++) {
+                            if (supportedSRateList[j] >= list[i].mMinimum
+                                    && supportedSRateList[j] <= list[i].mMaximum
+                                    && numRates < kMaxNominalRates
+                               ) {
+                                rates[numRates++] = supportedSRateList[j];
                             }
                         }
+                    } else {
+                        // there's at least one part of the sample rate list that contains discrete
+                        // supported values. I don't know if there are devices that "do this" or if they all
+                        // either give discrete rates or a single continuous range. So we take the easy
+                        // opt-out solution: this only costs a few cycles attempting to match a requested
+                        // non-listed rate (with the potential "risk" of matching to a listed integer multiple,
+                        // which should not cause any aliasing).
+                        discreteSampleRateList = true;
+                        // the easy case: the device specifies one or more discrete rates
+                        if (numRates < kMaxNominalRates) {
+                            rates[numRates++] = list[i].mMinimum;
+                        }
                     }
                 }
-                if (a) {
-                    // sort the array (should be the case but one never knows)
-                    [a sortUsingSelector:@selector(compare:)];
-                    // retrieve the number of unique rates:
-                    nominalSampleRates = [a count];
-                    // now copy the rates into a simple C array for faster access
-                    if ((nominalSampleRateList = new Float64[nominalSampleRates])) {
-                        for (i = 0 ; i < nominalSampleRates ; i++) {
-                            nominalSampleRateList[i] = [[a objectAtIndex:i] doubleValue];
+                // sort the rates (should be the case but one never knows) and drop the duplicates
+                std::sort(rates, rates + numRates);
+                nominalSampleRates = (UInt32) (std::unique(rates, rates + numRates) - rates);
+                // now copy the rates into the device's list
+                char rateDescription[512] = "continuous";
+                {
+                    size_t len = 0;
+                    for (i = 0 ; i < nominalSampleRates ; i++) {
+                        nominalSampleRateList[i] = rates[i];
+                        if (discreteSampleRateList && len < sizeof(rateDescription)) {
+                            len += snprintf(&rateDescription[len], sizeof(rateDescription) - len, "%s%g",
+                                            i ? ", " : "(", rates[i]);
                         }
                     }
-                    NSLog(@"Using audio device %u \"%s\", %u sample rates in %u range(s); [%g,%g] %@; current sample rate %gHz",
-                          mID, GetName(), nominalSampleRates, propsize / sizeof(AudioValueRange),
-                          minNominalSR, maxNominalSR, (discreteSampleRateList) ? [a description] : @"continuous", currentNominalSR);
-                } else {
-                    NSLog(@"Using audio device %u \"%s\", %u sample rates in %u range(s); [%g,%g] %s; current sample rate %gHz",
-                          mID, GetName(), nominalSampleRates, propsize / sizeof(AudioValueRange),
-                          minNominalSR, maxNominalSR, (discreteSampleRateList) ? "" : "continuous", currentNominalSR);
+                    if (discreteSampleRateList && len < sizeof(rateDescription)) {
+                        snprintf(&rateDescription[len], sizeof(rateDescription) - len, ")");
+                    }
                 }
-                // [a] will be flushed down the drain:
-                [pool drain];
+                ADLog("Using audio device %u \"%s\", %u sample rates in %u range(s); [%g,%g] %s; current sample rate %gHz; clock domain %u",
+                      (unsigned int) mID, GetName(), (unsigned int) nominalSampleRates, (unsigned int) (propsize / sizeof(AudioValueRange)),
+                      minNominalSR, maxNominalSR, rateDescription, currentNominalSR,
+                      (unsigned int) mClockDomain);
             }
-            free(list);
         }
         mInitialised = true;
     }
+    UpdateLatency();
+    mConfiguration = std::make_pair(currentNominalSR, mBufferSizeFrames);
+    mConfigurationSince = SteadyTime();
 }
 
 AudioDevice::AudioDevice()
@@ -345,38 +501,125 @@ AudioDevice::~AudioDevice()
         OSStatus err;
 		AudioDeviceID devId = mID;
         // RJVB 20120902: setting the StreamFormat to the initially read values will set the channel bitdepth to 16??
-		// so we reset just the nominal sample rate.
-        err = SetNominalSampleRate(mInitialFormat.mSampleRate);
+		// so we reset just the nominal sample rate, after restoring the physical formats of the streams
+		// if we changed them (which does restore the bit depth).
+        mContentBits = 0;
+        // the initial clock source, formats, rate and buffer size in a single transaction
+        Reconfiguration initial = { mInitialFormat.mSampleRate, 0, 0, mInitialBufferSizeFrames, 0, false, true };
+        err = Reconfigure(initial);
         if (err != noErr) {
             fprintf(stderr, "Cannot reset initial settings for device %u (%s): err %s, %ld\n",
                     (unsigned int) mID, GetName(), OSTStr(err), (long) err);
+        } else if (mJournaled && sJournal) {
+            sJournal->Clear(mDevUID, mForInput);
         }
-        if (listenerProc) {
+        LogOverloads();
+        ADLog("AudioDevice %s (%u) released", mDevName, devId);
+    }
+    // after the restore, whose notifications the listeners still get
+    RemoveListeners();
+    if (mPhysicalFormatArena != mPhysicalFormatStore) {
+        free(mPhysicalFormatArena);
+    }
+}
+
+void AudioDevice::RemoveListeners()
+{
+    if (listenerProc) {
+#ifdef DEPRECATED_LISTENER_API
+        AudioDeviceRemovePropertyListener(mID, 0, false, kAudioDevicePropertyActualSampleRate, listenerProc);
+        AudioDeviceRemovePropertyListener(mID, 0, false, kAudioDevicePropertyNominalSampleRate, listenerProc);
+        AudioDeviceRemovePropertyListener(mID, 0, false, kAudioHardwarePropertyDefaultOutputDevice, listenerProc);
+#else
+        AudioObjectPropertyAddress prop = { kAudioDevicePropertyActualSampleRate,
+                                            kAudioObjectPropertyScopeGlobal,
+                                            kAudioObjectPropertyElementMaster
+                                          };
+        verify_noerr(AudioObjectRemovePropertyListener(mID, &prop, listenerProc, this));
+        prop.mElement = kAudioDevicePropertyNominalSampleRate;
+        verify_noerr(AudioObjectRemovePropertyListener(mID, &prop, listenerProc, this));
+        prop.mElement = kAudioHardwarePropertyDefaultOutputDevice;
+        verify_noerr(AudioObjectRemovePropertyListener(mID, &prop, listenerProc, this));
+#endif
+        listenerProc = NULL;
+    }
+    if (mOverloadListening) {
+        for (UInt32 i = 0 ; i < numTelemetrySelectors ; ++i) {
 #ifdef DEPRECATED_LISTENER_API
-            AudioDeviceRemovePropertyListener(mID, 0, false, kAudioDevicePropertyActualSampleRate, listenerProc);
-            AudioDeviceRemovePropertyListener(mID, 0, false, kAudioDevicePropertyNominalSampleRate, listenerProc);
-            AudioDeviceRemovePropertyListener(mID, 0, false, kAudioHardwarePropertyDefaultOutputDevice, listenerProc);
+            AudioDeviceRemovePropertyListener(mID, 0, mForInput, telemetrySelectors[i], TelemetryListener);
 #else
-            AudioObjectPropertyAddress prop = { kAudioDevicePropertyActualSampleRate,
+            AudioObjectPropertyAddress prop = { telemetrySelectors[i],
                                                 kAudioObjectPropertyScopeGlobal,
                                                 kAudioObjectPropertyElementMaster
                                               };
-            verify_noerr(AudioObjectRemovePropertyListener(mID, &prop, listenerProc, this));
-            prop.mElement = kAudioDevicePropertyNominalSampleRate;
-            verify_noerr(AudioObjectRemovePropertyListener(mID, &prop, listenerProc, this));
-            prop.mElement = kAudioHardwarePropertyDefaultOutputDevice;
-            verify_noerr(AudioObjectRemovePropertyListener(mID, &prop, listenerProc, this));
+            AudioObjectRemovePropertyListener(mID, &prop, TelemetryListener, this);
 #endif
         }
-        if (nominalSampleRateList) {
-            delete nominalSampleRateList;
+        mOverloadListening = false;
+    }
+}
+
+void AudioDevice::Release(AudioDevice *dev)
+{
+    if (dev && !(sReaper && sReaper->Release(dev))) {
+        delete dev;
+    }
+}
+
+void AudioDevice::Journal()
+{
+    if (mJournaled || !sJournal || !mInitialised || !*mDevUID) {
+        return;
+    }
+    static_assert((int) DeviceJournal::kMaxStreams == (int) kMaxStreams, "the journal must record the formats of all streams");
+    AudioStreamBasicDescription formats[kMaxStreams];
+    for (UInt32 i = 0 ; i < mNumStreams ; ++i) {
+        formats[i] = mStreams[i].mInitialPhysicalFormat;
+    }
+    mJournaled = sJournal->Record(mDevUID, mForInput, mInitialFormat.mSampleRate, mInitialBufferSizeFrames,
+                                  mInitialClockSource, formats, mNumStreams);
+}
+
+void AudioDevice::AwaitRelease()
+{
+    if (sReaper && !sReaper->Wait(mID, kReleaseTimeout)) {
+        ADLog("AudioDevice %u: an earlier instance is still being released after %gs", (unsigned int) mID, kReleaseTimeout);
+    }
+}
+
+// the slots of the device pool, and which of them are taken (one bit each)
+enum { kDevicePoolSize = 4 };
+alignas(AudioDevice) static unsigned char devicePool[kDevicePoolSize][sizeof(AudioDevice)];
+static std::atomic<unsigned int> devicePoolUsed(0);
+
+void *AudioDevice::operator new(size_t size)
+{
+    unsigned int used = devicePoolUsed.load();
+    for (unsigned int i = 0 ; i < kDevicePoolSize && size <= sizeof(AudioDevice) ; ) {
+        if (used & (1U << i)) {
+            ++i;
+        } else if (devicePoolUsed.compare_exchange_weak(used, used | (1U << i))) {
+            return devicePool[i];
+        }
+        // else used has been reloaded; try the same slot again
+    }
+    return ::operator new(size);
+}
+
+void AudioDevice::operator delete(void *p)
+{
+    for (unsigned int i = 0 ; i < kDevicePoolSize ; ++i) {
+        if (p == devicePool[i]) {
+            devicePoolUsed.fetch_and(~(1U << i));
+            return;
         }
-        NSLog(@"AudioDevice %s (%u) released", mDevName, devId);
     }
+    ::operator delete(p);
 }
 
 void AudioDevice::SetBufferSize(UInt32 size)
 {
+    Journal();
     UInt32 propsize = sizeof(UInt32);
     AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyBufferFrameSize,
                                               mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
@@ -387,6 +630,76 @@ void AudioDevice::SetBufferSize(UInt32 size)
     verify_noerr(AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &mBufferSizeFrames));
 }
 
+// the buffer size that holds sBufferDurationMS at sampleRate, within the device's range; 0 if
+// there is no buffer duration to keep
+UInt32 AudioDevice::TunedBufferSize(Float64 sampleRate)
+{
+    if (sBufferDurationMS <= 0 || sampleRate <= 0) {
+        return 0;
+    }
+    Float64 frames = floor(sampleRate * sBufferDurationMS / 1000.0 + 0.5);
+    if (frames < mBufferSizeRange.mMinimum) {
+        frames = mBufferSizeRange.mMinimum;
+    }
+    if (mBufferSizeRange.mMaximum > 0 && frames > mBufferSizeRange.mMaximum) {
+        frames = mBufferSizeRange.mMaximum;
+    }
+    return (UInt32) frames;
+}
+
+/*!
+    Compute the full latency at the current rate: the device's latency, the largest latency
+    of its streams, the safety offset and the I/O buffer, converted to microseconds.
+ */
+OSStatus AudioDevice::UpdateLatency()
+{
+    OSStatus err;
+    UInt32 propsize = sizeof(UInt32);
+    LatencyInfo &l = mLatency;
+    AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyLatency,
+                                              mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    l.sampleRate = currentNominalSR;
+    if ((err = AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &l.deviceFrames)) != noErr) {
+        l.deviceFrames = 0;
+    }
+    // the safety offset can depend on the sample rate
+    propsize = sizeof(UInt32);
+    theAddress.mSelector = kAudioDevicePropertySafetyOffset;
+    if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, &mSafetyOffset) != noErr) {
+        err = (err == noErr) ? kAudioHardwareUnspecifiedError : err;
+    }
+    l.safetyOffsetFrames = mSafetyOffset;
+    l.streamFrames = 0;
+    theAddress.mSelector = kAudioStreamPropertyLatency;
+    theAddress.mScope = kAudioObjectPropertyScopeGlobal;
+    for (UInt32 i = 0 ; i < mNumStreams ; ++i) {
+        UInt32 frames;
+        propsize = sizeof(UInt32);
+        if (AudioObjectGetPropertyData(mStreams[i].mID, &theAddress, 0, NULL, &propsize, &frames) == noErr
+                && frames > l.streamFrames
+           ) {
+            l.streamFrames = frames;
+        }
+    }
+    l.bufferFrames = mBufferSizeFrames;
+    if (l.sampleRate > 0) {
+        Float64 usPerFrame = 1e6 / l.sampleRate;
+        l.deviceMicroSeconds = l.deviceFrames * usPerFrame;
+        l.streamMicroSeconds = l.streamFrames * usPerFrame;
+        l.safetyOffsetMicroSeconds = l.safetyOffsetFrames * usPerFrame;
+        l.bufferMicroSeconds = l.bufferFrames * usPerFrame;
+    } else {
+        l.deviceMicroSeconds = l.streamMicroSeconds = l.safetyOffsetMicroSeconds = l.bufferMicroSeconds = 0;
+    }
+    l.totalMicroSeconds = l.deviceMicroSeconds + l.streamMicroSeconds + l.safetyOffsetMicroSeconds + l.bufferMicroSeconds;
+    ADLog("%s latency of \"%s\" at %gHz: device %u + stream %u + safety offset %u + buffer %u frames = %.0fus",
+          mForInput ? "Input" : "Output", GetName(), l.sampleRate, (unsigned int) l.deviceFrames, (unsigned int) l.streamFrames,
+          (unsigned int) l.safetyOffsetFrames, (unsigned int) l.bufferFrames, l.totalMicroSeconds);
+    return err;
+}
+
 OSStatus AudioDevice::NominalSampleRate(Float64 &sampleRate)
 {
     UInt32 size = sizeof(Float64);
@@ -398,24 +711,100 @@ OSStatus AudioDevice::NominalSampleRate(Float64 &sampleRate)
     err = AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &size, &sampleRate);
     if (err == noErr) {
         currentNominalSR = sampleRate;
+        if (sampleRate == mUnconfirmedSR) {
+            mUnconfirmedSR = 0;
+        }
+        if (IsRejectedRate(sampleRate)) {
+            ForgetRate(sampleRate);
+        }
     }
     return err;
 }
 
+bool AudioDevice::IsRejectedRate(Float64 sampleRate)
+{
+    for (UInt32 i = 0 ; i < mNumRejectedRates ; i++) {
+        if (mRejectedRates[i] == sampleRate) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AudioDevice::RejectRate(Float64 sampleRate, OSStatus status)
+{
+    if (!IsRejectedRate(sampleRate) && mNumRejectedRates < kMaxRejectedRates) {
+        mRejectedRates[mNumRejectedRates++] = sampleRate;
+    }
+    if (sRejectedRates && *mDevUID) {
+        sRejectedRates->Reject(mDevUID, sampleRate, status);
+    }
+}
+
+// the device is at a rate it was thought not to take: it takes it after all
+void AudioDevice::ForgetRate(Float64 sampleRate)
+{
+    for (UInt32 i = 0 ; i < mNumRejectedRates ; i++) {
+        if (mRejectedRates[i] == sampleRate) {
+            mRejectedRates[i] = mRejectedRates[--mNumRejectedRates];
+            break;
+        }
+    }
+    if (mSuspectedSR == sampleRate) {
+        mSuspectedSR = 0;
+    }
+    ADLog("Device \"%s\" is at %gHz: no longer a rejected rate", GetName(), sampleRate);
+    if (sRejectedRates && *mDevUID) {
+        sRejectedRates->Forget(mDevUID, sampleRate);
+    }
+}
+
+// Some devices accept any rate they advertise, and then stay where they are. Such a
+// set call is only detected later: if the device hasn't reported the new rate by the
+// time we next change rate, and still reports the rate it had before, it ignored us.
+// A device can also just be slow to report it (a slow relock), and a stop or skip right
+// after the switch doesn't give it the time: a rate is only rejected when that happens
+// after the device has had the time to report it, and for the second time.
+void AudioDevice::ConfirmNominalSampleRate()
+{
+    if (mUnconfirmedSR <= 0) {
+        return;
+    }
+    Float64 requested = mUnconfirmedSR, actual;
+    double elapsed = SteadyTime() - mUnconfirmedSince;
+    mUnconfirmedSR = 0;
+    if (NominalSampleRate(actual) == noErr && actual != requested && actual == mUnconfirmedFromSR) {
+        if (elapsed < mUnconfirmedTimeout) {
+            ADLog("Device \"%s\" hasn't reported %gHz yet after %.0fms", GetName(), requested, elapsed * 1000);
+        } else if (mSuspectedSR != requested) {
+            ADLog("Device \"%s\" may have ignored the change to %gHz and stayed at %gHz", GetName(), requested, actual);
+            mSuspectedSR = requested;
+        } else {
+            ADLog("Device \"%s\" ignored the change to %gHz and stayed at %gHz", GetName(), requested, actual);
+            mSuspectedSR = 0;
+            RejectRate(requested, RejectedRates::kIgnored);
+        }
+    }
+}
+
 inline Float64 AudioDevice::ClosestNominalSampleRate(Float64 sampleRate)
 {
     if (sampleRate > 0) {
 #ifndef FORCE_STANDARD_SAMPLERATES
-        if (!discreteSampleRateList && sampleRate >= minNominalSR && sampleRate <= maxNominalSR) {
+        if (!discreteSampleRateList && sampleRate >= minNominalSR && sampleRate <= maxNominalSR
+                && !IsRejectedRate(sampleRate)) {
             // the device suggests it supports this exact sample rate; use it.
             listenerSilentFor = 0;
             return sampleRate;
         }
 #endif
-        if (nominalSampleRateList && sampleRate >= minNominalSR && sampleRate <= maxNominalSR) {
+        if (nominalSampleRates && sampleRate >= minNominalSR && sampleRate <= maxNominalSR) {
             Float64 minRemainder = 1;
             Float64 closest = 0;
             for (UInt32 i = 0 ; i < nominalSampleRates ; i++) {
+                if (IsRejectedRate(nominalSampleRateList[i])) {
+                    continue;
+                }
                 // check if we have a hit:
                 if (sampleRate == nominalSampleRateList[i]) {
                     return sampleRate;
@@ -469,60 +858,390 @@ inline Float64 AudioDevice::ClosestNominalSampleRate(Float64 sampleRate)
                     sampleRate = minNominalSR;
                 }
             }
-            // note that we really ought to resample the content if we're sending it to a 
-            // device running at a lower sample rate!
+            // note that the content ought to be resampled if we're sending it to a device running
+            // at a lower sample rate: see ContentNeedsResampling().
+        }
+        if (IsRejectedRate(sampleRate) && currentNominalSR > 0) {
+            // nothing better than a rate the device won't take: stay where we are
+            sampleRate = currentNominalSR;
         }
     }
     return sampleRate;
 }
 
 OSStatus AudioDevice::SetNominalSampleRate(Float64 sampleRate, Boolean force)
+{
+    Reconfiguration target = { sampleRate, sMatchPhysicalFormat ? mContentBits : 0, mContentChannels, 0, 0, (bool) force };
+    return Reconfigure(target);
+}
+
+/*!
+    Change the rate, and the physical formats and buffer size with it, costing the device as
+    few reconfigurations as possible (see the description of Reconfiguration)
+ */
+OSStatus AudioDevice::Reconfigure(const Reconfiguration &target, ReconfigurationReport *report)
 {
     UInt32 size = sizeof(Float64);
-    OSStatus err;
-    if (sampleRate <= 0) {
+    OSStatus err = noErr;
+    ReconfigurationReport r;
+    memset(&r, 0, sizeof(r));
+    if (target.sampleRate <= 0) {
         return paramErr;
     }
+    double start = SteadyTime();
+    Float64 sampleRate = target.sampleRate;
+    AwaitRelease();
     listenerSilentFor = 2;
-    Float64 sampleRate2 = ClosestNominalSampleRate(sampleRate);
-    NSLog(@"SetNominalSampleRate(%g) setting rate to %gHz", sampleRate, sampleRate2);
-    if (sampleRate2 != currentNominalSR || force) {
+    ConfirmNominalSampleRate();
+    Float64 previousSR = currentNominalSR;
+    UInt32 previousBufferSize = mBufferSizeFrames, previousFormatChanges = mPhysicalFormatChanges;
+    Float64 sampleRate2 = target.restore ? sampleRate : ClosestNominalSampleRate(sampleRate);
+    ADLog("SetNominalSampleRate(%g) setting rate to %gHz", sampleRate, sampleRate2);
+    mContentSR = target.restore ? 0 : sampleRate;
+    if (sampleRate2 != currentNominalSR || target.force
+            || (target.restore && (mPhysicalFormatChanged || mClockSource != mInitialClockSource))) {
+        BeginSwitch();
+    }
+    if (target.restore) {
+        if (mClockSource != mInitialClockSource) {
+            // the initial clock first, so that the formats and the rate are restored on it
+            r.setCalls += 1;
+            if (SetClockSource(mInitialClockSource) == noErr) {
+                r.clockSourceChanges += 1;
+            }
+        }
+        // the formats carry the rate: the first that changes takes the nominal rate along, mostly to sampleRate
+        RestorePhysicalFormat(&r);
+    } else if (sSelectClockSource && sampleRate2 != currentNominalSR) {
+        // the clock made for the new rate before anything else, so that the device locks to it once
+        SelectClockSource(sampleRate2, &r);
+    }
+    if (target.contentBits) {
+        SetContentFormat(target.contentBits, target.contentChannels);
+        // the formats at the new rate: the first that changes takes the nominal rate along
+        if (MatchPhysicalFormat(sampleRate2, &r) == noErr && r.formatChanges) {
+            Float64 rate;
+            NominalSampleRate(rate);
+        }
+    }
+    if (sampleRate2 != currentNominalSR || (target.force && !r.formatChanges)) {
         AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyNominalSampleRate,
                                                   mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
                                                   kAudioObjectPropertyElementMaster
                                                 };
+        Journal();
+        Float64 fromSR = currentNominalSR;
+        r.setCalls += 1;
         err = AudioObjectSetPropertyData(mID, &theAddress, 0, NULL, size, &sampleRate2);
+        if (!target.restore && (err == kAudioDeviceUnsupportedFormatError || err == kAudioHardwareIllegalOperationError
+                              || err == kAudioHardwareUnsupportedOperationError)) {
+            // the device won't take this rate, now or later: remember that, and try the next-best one
+            ADLog("Device \"%s\" refuses %gHz: %d (%s)", GetName(), sampleRate2, err, OSTStr(err));
+            RejectRate(sampleRate2, err);
+            sampleRate2 = ClosestNominalSampleRate(sampleRate);
+            if (sampleRate2 == currentNominalSR) {
+                err = noErr;
+            } else if (!IsRejectedRate(sampleRate2)) {
+                ADLog("SetNominalSampleRate(%g) setting rate to %gHz instead", sampleRate, sampleRate2);
+                r.setCalls += 1;
+                err = AudioObjectSetPropertyData(mID, &theAddress, 0, NULL, size, &sampleRate2);
+            }
+        }
         if (err == noErr) {
+            if (sampleRate2 != currentNominalSR && !target.restore) {
+                mUnconfirmedSR = sampleRate2;
+                mUnconfirmedFromSR = currentNominalSR;
+                mUnconfirmedSince = SteadyTime();
+                mUnconfirmedTimeout = std::max(target.settleTimeout, kConfirmTimeout);
+            }
             currentNominalSR = sampleRate2;
+            if (currentNominalSR != fromSR) {
+                r.rateChanges += 1;
+            }
         } else {
-            NSLog(@"Failure setting device \"%s\" to %gHz: %d (%s)", GetName(), sampleRate2, err, OSTStr(err));
+            ADLog("Failure setting device \"%s\" to %gHz: %d (%s)", GetName(), sampleRate2, err, OSTStr(err));
+        }
+    }
+    if (err == noErr && target.contentBits) {
+        // a no-op unless the rate isn't the one the formats were matched to
+        MatchPhysicalFormat(currentNominalSR, &r);
+    }
+    if (err == noErr && mInitialised) {
+        // last: the valid buffer sizes can depend on the rate
+        UInt32 frames = (target.bufferFrames) ? target.bufferFrames : TunedBufferSize(currentNominalSR);
+        if (frames && frames != mBufferSizeFrames) {
+            UInt32 previous = mBufferSizeFrames;
+            r.setCalls += 1;
+            SetBufferSize(frames);
+            if (mBufferSizeFrames != previous) {
+                r.bufferChanges += 1;
+            }
+            ADLog("Buffer size of \"%s\" at %gHz: %u -> %u frames (%gms)", GetName(), currentNominalSR,
+                  (unsigned int) previous, (unsigned int) mBufferSizeFrames, mBufferSizeFrames * 1000.0 / currentNominalSR);
         }
+    }
+    r.reconfigurations = r.rateChanges + r.formatChanges + r.bufferChanges + r.clockSourceChanges;
+    r.applySeconds = SteadyTime() - start;
+    if (r.reconfigurations && target.settleTimeout > 0) {
+        // a single wait for all of the changes
+        r.settled = WaitForActualRate(currentNominalSR, target.settleTimeout);
+        r.settleSeconds = SteadyTime() - start - r.applySeconds;
     } else {
-        err = noErr;
+        r.settled = true;
+    }
+    if (mInitialised && (currentNominalSR != previousSR || mBufferSizeFrames != previousBufferSize
+                         || mPhysicalFormatChanges != previousFormatChanges)) {
+        UpdateLatency();
+    }
+    if (currentNominalSR != previousSR) {
+        mSwitches += 1;
+        mLastSwitchTime = SteadyTime();
+        if (sSwitchCosts) {
+            TimeSwitch(previousSR, start, target.settleTimeout > 0 && r.settled);
+        }
+    }
+    if (mSwitching) {
+        EndSwitch();
+    }
+    if (err == noErr && ContentNeedsResampling()) {
+        ADLog("Content at %gHz cannot be played bit-perfect on \"%s\" at %gHz and ought to be resampled",
+              mContentSR, GetName(), currentNominalSR);
+    }
+    if (r.reconfigurations > 1 || !r.settled) {
+        ADLog("Reconfigured \"%s\" with %u set calls: %u reconfigurations (%u rate, %u format, %u buffer, %u clock) "
+              "in %.1fms, %s after %.1fms", GetName(), (unsigned int) r.setCalls, (unsigned int) r.reconfigurations,
+              (unsigned int) r.rateChanges, (unsigned int) r.formatChanges, (unsigned int) r.bufferChanges,
+              (unsigned int) r.clockSourceChanges, r.applySeconds * 1000, r.settled ? "settled" : "not settled",
+              r.settleSeconds * 1000);
+    }
+    if (report) {
+        *report = r;
     }
     return err;
 }
 
 /*!
-    Reset the nominal sample rate to the value found when opening the device
+    Time the switch from fromSR to the current nominal rate that began at since, until the actual
+    rate follows: now if it is known to have settled, or else when the HAL reports it
  */
-OSStatus AudioDevice::ResetNominalSampleRate(Boolean force)
+void AudioDevice::TimeSwitch(Float64 fromSR, double since, bool settled)
 {
-    UInt32 size = sizeof(Float64);
-    Float64 sampleRate = mInitialFormat.mSampleRate;
-    OSStatus err = noErr;
-    if (sampleRate != currentNominalSR || force) {
-        listenerSilentFor = 2;
-        AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyNominalSampleRate,
-                                                  mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
-                                                  kAudioObjectPropertyElementMaster
-                                                };
-        err = AudioObjectSetPropertyData(mID, &theAddress, 0, NULL, size, &sampleRate);
-        if (err == noErr) {
-            currentNominalSR = sampleRate;
+    if (settled) {
+        std::lock_guard<std::mutex> lock(mOverloadLock);
+        mTimedToSR = 0;
+        sSwitchCosts->Record(mDevUID, fromSR, currentNominalSR, SteadyTime() - since);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mOverloadLock);
+        mTimedFromSR = fromSR;
+        mTimedToSR = currentNominalSR;
+        mTimedSince = since;
+    }
+    // the HAL may have reported it before the timing was armed
+    NoteActualRate();
+}
+
+void AudioDevice::NoteActualRate()
+{
+    AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyActualSampleRate,
+                                              mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    Float64 actual = 0;
+    UInt32 size = sizeof(actual);
+    if (!sSwitchCosts || AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &size, &actual) != noErr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mOverloadLock);
+    if (mTimedToSR > 0 && fabs(actual - mTimedToSR) <= mTimedToSR * 1e-3) {
+        sSwitchCosts->Record(mDevUID, mTimedFromSR, mTimedToSR, SteadyTime() - mTimedSince);
+        mTimedToSR = 0;
+    }
+}
+
+double AudioDevice::ExpectedSwitchCost(Float64 sampleRate)
+{
+    // ClosestNominalSampleRate() lifts the listener's silence, which is meant for the changes we make
+    UInt32 silentFor = listenerSilentFor;
+    Float64 rate = ClosestNominalSampleRate(sampleRate);
+    listenerSilentFor = silentFor;
+    if (rate == currentNominalSR) {
+        return 0;
+    }
+    return sSwitchCosts ? sSwitchCosts->Expected(mDevUID, currentNominalSR, rate) : -1;
+}
+
+/*!
+    Wait until the actual rate of the device is within 0.1% of sampleRate, polling it
+ */
+bool AudioDevice::WaitForActualRate(Float64 sampleRate, double timeout)
+{
+    AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyActualSampleRate,
+                                              mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    double deadline = SteadyTime() + timeout;
+    do {
+        Float64 actual = 0;
+        UInt32 size = sizeof(actual);
+        if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &size, &actual) == noErr
+                && fabs(actual - sampleRate) <= sampleRate * 1e-3) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } while (SteadyTime() < deadline);
+    return false;
+}
+
+void AudioDevice::NoteOverload(AudioObjectPropertySelector selector)
+{
+    std::lock_guard<std::mutex> lock(mOverloadLock);
+    double now = SteadyTime();
+    if (selector == kAudioDeviceProcessorOverload) {
+        mOverloads.overloads += 1;
+    } else if (selector == kAudioDevicePropertyIOStoppedAbnormally) {
+        mOverloads.ioStops += 1;
+    } else {
+        return;
+    }
+    ConfigurationLoad *load = (mConfigurationSince > 0) ? LoadOf(mConfiguration) : NULL;
+    if (load) {
+        load->events += 1;
+    }
+    if (mSwitching) {
+        mOverloads.duringSwitch += 1;
+    } else if (mSwitchEnd > 0 && now - mSwitchEnd <= sOverloadWindow) {
+        mOverloads.afterSwitch += 1;
+    } else {
+        // may turn out to precede a switch
+        if (mNumRecentOverloads == kOverloadHistory) {
+            memmove(mRecentOverloads, mRecentOverloads + 1, (kOverloadHistory - 1) * sizeof(double));
+            mNumRecentOverloads -= 1;
         }
+        mRecentOverloads[mNumRecentOverloads++] = now;
     }
-    return err;
+}
+
+void AudioDevice::BeginSwitch()
+{
+    std::lock_guard<std::mutex> lock(mOverloadLock);
+    double now = SteadyTime();
+    for (UInt32 i = 0 ; i < mNumRecentOverloads ; ++i) {
+        if (now - mRecentOverloads[i] <= sOverloadWindow) {
+            mOverloads.beforeSwitch += 1;
+        }
+    }
+    mNumRecentOverloads = 0;
+    mSwitching = true;
+}
+
+// the entry of a configuration, added if it is new; NULL once the table is full.
+// The table is kept sorted by rate and buffer size.
+AudioDevice::ConfigurationLoad *AudioDevice::LoadOf(const std::pair<Float64, UInt32> &configuration)
+{
+    UInt32 i = 0;
+    while (i < mNumConfigurations && mConfigurationLoad[i].configuration < configuration) {
+        ++i;
+    }
+    if (i < mNumConfigurations && mConfigurationLoad[i].configuration == configuration) {
+        return &mConfigurationLoad[i].load;
+    }
+    if (mNumConfigurations == kMaxConfigurations) {
+        return NULL;
+    }
+    std::copy_backward(mConfigurationLoad + i, mConfigurationLoad + mNumConfigurations,
+                       mConfigurationLoad + mNumConfigurations + 1);
+    mNumConfigurations += 1;
+    ConfigurationEntry &entry = mConfigurationLoad[i];
+    entry.configuration = configuration;
+    entry.load.seconds = 0;
+    entry.load.events = 0;
+    return &entry.load;
+}
+
+// add the time spent in the current configuration to its total, and start timing the new one
+void AudioDevice::AccountConfiguration(double now)
+{
+    if (mConfigurationSince > 0) {
+        ConfigurationLoad *load = LoadOf(mConfiguration);
+        if (load) {
+            load->seconds += now - mConfigurationSince;
+        }
+        mConfigurationSince = now;
+    }
+}
+
+void AudioDevice::EndSwitch()
+{
+    std::lock_guard<std::mutex> lock(mOverloadLock);
+    double now = SteadyTime();
+    mSwitching = false;
+    mSwitchEnd = now;
+    AccountConfiguration(now);
+    mConfiguration = std::make_pair(currentNominalSR, mBufferSizeFrames);
+}
+
+AudioDevice::OverloadStats AudioDevice::Overloads()
+{
+    std::lock_guard<std::mutex> lock(mOverloadLock);
+    return mOverloads;
+}
+
+AudioDevice::ConfigurationLoadMap AudioDevice::OverloadRates()
+{
+    std::lock_guard<std::mutex> lock(mOverloadLock);
+    AccountConfiguration(SteadyTime());
+    ConfigurationLoadMap load;
+    for (UInt32 i = 0 ; i < mNumConfigurations ; ++i) {
+        load[mConfigurationLoad[i].configuration] = mConfigurationLoad[i].load;
+    }
+    return load;
+}
+
+void AudioDevice::LogOverloads()
+{
+    OverloadStats stats;
+    ConfigurationEntry load[kMaxConfigurations];
+    UInt32 n;
+    {
+        // a copy, without the map of OverloadRates(): this is called on every stop
+        std::lock_guard<std::mutex> lock(mOverloadLock);
+        AccountConfiguration(SteadyTime());
+        stats = mOverloads;
+        n = mNumConfigurations;
+        std::copy(mConfigurationLoad, mConfigurationLoad + n, load);
+    }
+    ADLog("\"%s\": %u processor overloads and %u abnormal I/O stops; %u before, %u during and %u after a rate switch",
+          GetName(), (unsigned int) stats.overloads, (unsigned int) stats.ioStops, (unsigned int) stats.beforeSwitch,
+          (unsigned int) stats.duringSwitch, (unsigned int) stats.afterSwitch);
+    for (UInt32 i = 0 ; i < n ; ++i) {
+        if (load[i].load.seconds > 0) {
+            ADLog("\t%gHz, %u frames: %u events in %.0fs (%.2f per hour)", load[i].configuration.first,
+                  (unsigned int) load[i].configuration.second, (unsigned int) load[i].load.events, load[i].load.seconds,
+                  load[i].load.events * 3600.0 / load[i].load.seconds);
+        }
+    }
+}
+
+bool AudioDevice::ContentNeedsResampling()
+{
+    if (mContentSR <= 0 || currentNominalSR <= 0) {
+        return false;
+    }
+    double dec, ent;
+    dec = modf(currentNominalSR / mContentSR, &ent);
+    return dec != 0 || ent < 1;
+}
+
+/*!
+    Reset the nominal sample rate to the value found when opening the device, and the clock source,
+    physical formats and buffer size with it
+ */
+OSStatus AudioDevice::ResetNominalSampleRate(Boolean force)
+{
+    Reconfiguration initial = { mInitialFormat.mSampleRate, 0, 0, mInitialBufferSizeFrames, 0, (bool) force, true };
+    return Reconfigure(initial);
 }
 
 OSStatus AudioDevice::SetStreamBasicDescription(AudioStreamBasicDescription *desc)
@@ -541,6 +1260,336 @@ OSStatus AudioDevice::SetStreamBasicDescription(AudioStreamBasicDescription *des
     return err;
 }
 
+static const char *FormatDescription(const AudioStreamBasicDescription &format, char *buf, size_t len)
+{
+    snprintf(buf, len, "%u-bit %s %uch @%gHz", (unsigned int) format.mBitsPerChannel,
+             (format.mFormatFlags & kAudioFormatFlagIsFloat) ? "float" : "integer",
+             (unsigned int) format.mChannelsPerFrame, format.mSampleRate);
+    return buf;
+}
+
+// enumerate the device's streams in our scope, with their current and available physical formats
+void AudioDevice::InitStreams()
+{
+    UInt32 propsize = 0;
+    AudioStreamID streams[kMaxStreams];
+    AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyStreams,
+                                              mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    mNumStreams = 0;
+    propsize = sizeof(streams);
+    if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propsize, streams) != noErr) {
+        return;
+    }
+    theAddress.mScope = kAudioObjectPropertyScopeGlobal;
+    // the number of available formats of each stream first, so that all of them can go into a single arena
+    UInt32 numFormats = 0;
+    for (UInt32 i = 0 ; i < propsize / sizeof(AudioStreamID) ; ++i) {
+        Stream &stream = mStreams[mNumStreams];
+        UInt32 size = sizeof(AudioStreamBasicDescription);
+        stream.mID = streams[i];
+        stream.mNumPhysicalFormats = 0;
+        stream.mPhysicalFormats = NULL;
+        theAddress.mSelector = kAudioStreamPropertyPhysicalFormat;
+        if (AudioObjectGetPropertyData(stream.mID, &theAddress, 0, NULL, &size, &stream.mInitialPhysicalFormat) != noErr) {
+            continue;
+        }
+        stream.mPhysicalFormat = stream.mInitialPhysicalFormat;
+        theAddress.mSelector = kAudioStreamPropertyAvailablePhysicalFormats;
+        if (AudioObjectGetPropertyDataSize(stream.mID, &theAddress, 0, NULL, &size) == noErr) {
+            stream.mNumPhysicalFormats = size / sizeof(AudioStreamRangedDescription);
+            numFormats += stream.mNumPhysicalFormats;
+        }
+        mNumStreams += 1;
+    }
+    if (numFormats <= kMaxPhysicalFormats) {
+        mPhysicalFormatArena = mPhysicalFormatStore;
+    } else {
+        mPhysicalFormatArena = (AudioStreamRangedDescription *) calloc(numFormats, sizeof(AudioStreamRangedDescription));
+    }
+    if (!numFormats || !mPhysicalFormatArena) {
+        for (UInt32 i = 0 ; i < mNumStreams ; ++i) {
+            mStreams[i].mNumPhysicalFormats = 0;
+        }
+        return;
+    }
+    theAddress.mSelector = kAudioStreamPropertyAvailablePhysicalFormats;
+    AudioStreamRangedDescription *formats = mPhysicalFormatArena;
+    for (UInt32 i = 0 ; i < mNumStreams ; ++i) {
+        Stream &stream = mStreams[i];
+        UInt32 size = stream.mNumPhysicalFormats * sizeof(AudioStreamRangedDescription);
+        stream.mPhysicalFormats = formats;
+        formats += stream.mNumPhysicalFormats;
+        if (size && AudioObjectGetPropertyData(stream.mID, &theAddress, 0, NULL, &size, stream.mPhysicalFormats) == noErr) {
+            stream.mNumPhysicalFormats = size / sizeof(AudioStreamRangedDescription);
+        } else {
+            stream.mNumPhysicalFormats = 0;
+        }
+    }
+}
+
+Float64 AudioDevice::RateFamily(Float64 sampleRate)
+{
+    if (sampleRate > 0 && fmod(sampleRate, 11025) == 0) {
+        return 44100;
+    }
+    return (sampleRate > 0 && fmod(sampleRate, 4000) == 0) ? 48000 : 0;
+}
+
+// the family of the rate a clock source's name mentions, in Hz or kHz ("Internal 44.1kHz",
+// "48000 Crystal"); 0 for a source without one, like an external or word clock
+static Float64 ClockSourceFamily(const char *name)
+{
+    for (const char *p = name ; *p ; ) {
+        if (!isdigit((unsigned char) *p)) {
+            p += 1;
+            continue;
+        }
+        char *end;
+        double rate = strtod(p, &end);
+        p = end;
+        if (rate >= 22 && rate <= 768) {
+            rate = round(rate * 1000);
+        }
+        if (rate >= 22050 && rate <= 768000 && AudioDevice::RateFamily(rate) > 0) {
+            return AudioDevice::RateFamily(rate);
+        }
+    }
+    return 0;
+}
+
+/*!
+    Read the device's clock sources and map each to the rate family it is made for
+ */
+void AudioDevice::InitClockSources()
+{
+    AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyClockSource,
+                                              mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    UInt32 size = sizeof(UInt32);
+    mNumClockSources = 0;
+    if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &size, &mClockSource) != noErr) {
+        // most devices have a single clock, and don't say
+        mClockSource = mInitialClockSource = 0;
+        return;
+    }
+    mInitialClockSource = mClockSource;
+    theAddress.mSelector = kAudioDevicePropertyClockSources;
+    size = sizeof(mClockSources);
+    if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &size, mClockSources) != noErr) {
+        return;
+    }
+    mNumClockSources = size / sizeof(UInt32);
+    theAddress.mSelector = kAudioDevicePropertyClockSourceNameForIDCFString;
+    char description[512] = "";
+    size_t len = 0;
+    for (UInt32 i = 0 ; i < mNumClockSources ; ++i) {
+        char name[128] = "";
+        CFStringRef cfName = NULL;
+        AudioValueTranslation translation = { &mClockSources[i], sizeof(UInt32), &cfName, sizeof(CFStringRef) };
+        size = sizeof(translation);
+        if (AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &size, &translation) == noErr && cfName) {
+            CFStringGetCString(cfName, name, sizeof(name), kCFStringEncodingUTF8);
+            CFRelease(cfName);
+        }
+        mClockSourceFamilies[i] = ClockSourceFamily(name);
+        if (len < sizeof(description)) {
+            len += snprintf(&description[len], sizeof(description) - len, "%s%u \"%s\" (%g)", i ? ", " : "",
+                            (unsigned int) mClockSources[i], name, mClockSourceFamilies[i]);
+        }
+    }
+    ADLog("\"%s\" has %u clock sources: %s; %u is selected", GetName(), (unsigned int) mNumClockSources,
+          description, (unsigned int) mClockSource);
+}
+
+OSStatus AudioDevice::SetClockSource(UInt32 source)
+{
+    AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyClockSource,
+                                              mForInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    OSStatus err = AudioObjectSetPropertyData(mID, &theAddress, 0, NULL, sizeof(UInt32), &source);
+    if (err == noErr) {
+        mClockSource = source;
+    } else {
+        ADLog("Cannot select clock source %u of \"%s\": %d (%s)", (unsigned int) source, GetName(), err, OSTStr(err));
+    }
+    return err;
+}
+
+/*!
+    Select the clock source made for the family of sampleRate, if the selected one is made for the other
+    family; a device without sources for either family, or on another source, is left alone
+ */
+OSStatus AudioDevice::SelectClockSource(Float64 sampleRate, ReconfigurationReport *report)
+{
+    Float64 family = RateFamily(sampleRate), current = 0;
+    UInt32 source = 0;
+    for (UInt32 i = 0 ; i < mNumClockSources ; ++i) {
+        if (mClockSources[i] == mClockSource) {
+            current = mClockSourceFamilies[i];
+        } else if (!source && family > 0 && mClockSourceFamilies[i] == family) {
+            source = mClockSources[i];
+        }
+    }
+    if (!current || current == family || !source) {
+        return noErr;
+    }
+    Journal();
+    UInt32 previous = mClockSource;
+    report->setCalls += 1;
+    OSStatus err = SetClockSource(source);
+    if (err == noErr) {
+        report->clockSourceChanges += 1;
+        ADLog("Clock source of \"%s\" for %gHz: %u -> %u", GetName(), sampleRate, (unsigned int) previous,
+              (unsigned int) source);
+    }
+    return err;
+}
+
+// Select the available physical format of the stream that best fits the content at the given
+// device sample rate; returns its index or -1. In order of importance we want an integer
+// format (no float->int conversion in the HAL), the content's bit depth (or the smallest
+// depth above it), the content's channel count (or the stream's current count) and to
+// remain mixable.
+int AudioDevice::BestPhysicalFormat(Stream &stream, Float64 sampleRate)
+{
+    int best = -1;
+    long bestScore = -1;
+    UInt32 bits = mContentBits, channels = mContentChannels;
+    for (UInt32 i = 0 ; i < stream.mNumPhysicalFormats ; ++i) {
+        const AudioStreamRangedDescription &ranged = stream.mPhysicalFormats[i];
+        const AudioStreamBasicDescription &format = ranged.mFormat;
+        if (format.mFormatID != kAudioFormatLinearPCM) {
+            continue;
+        }
+        if (format.mSampleRate != sampleRate
+                && (sampleRate < ranged.mSampleRateRange.mMinimum || sampleRate > ranged.mSampleRateRange.mMaximum)
+           ) {
+            continue;
+        }
+        long score = 0;
+        if (!(format.mFormatFlags & kAudioFormatFlagIsFloat)) {
+            score += 10000;
+        }
+        if (format.mBitsPerChannel == bits) {
+            score += 5000;
+        } else if (format.mBitsPerChannel > bits) {
+            score += 3000 - format.mBitsPerChannel;
+        } else {
+            score += format.mBitsPerChannel;
+        }
+        if (channels && format.mChannelsPerFrame == channels) {
+            score += 200;
+        } else if (format.mChannelsPerFrame == stream.mPhysicalFormat.mChannelsPerFrame) {
+            score += 100;
+        }
+        if (!(format.mFormatFlags & kAudioFormatFlagIsNonMixable)) {
+            score += 10;
+        }
+        if (score > bestScore) {
+            bestScore = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+OSStatus AudioDevice::SetPhysicalFormat(Stream &stream, const AudioStreamBasicDescription &format)
+{
+    AudioObjectPropertyAddress theAddress = { kAudioStreamPropertyPhysicalFormat,
+                                              kAudioObjectPropertyScopeGlobal,
+                                              kAudioObjectPropertyElementMaster
+                                            };
+    UInt32 size = sizeof(AudioStreamBasicDescription);
+    Journal();
+    listenerSilentFor = 2;
+    OSStatus err = AudioObjectSetPropertyData(stream.mID, &theAddress, 0, NULL, size, &format);
+    if (err == noErr) {
+        mPhysicalFormatChanges += 1;
+        // read back what the HAL actually did
+        if (AudioObjectGetPropertyData(stream.mID, &theAddress, 0, NULL, &size, &stream.mPhysicalFormat) != noErr) {
+            stream.mPhysicalFormat = format;
+        }
+    }
+    return err;
+}
+
+OSStatus AudioDevice::MatchPhysicalFormat(Float64 sampleRate, ReconfigurationReport *report)
+{
+    OSStatus ret = noErr;
+    for (UInt32 i = 0 ; i < mNumStreams ; ++i) {
+        Stream &stream = mStreams[i];
+        int best = BestPhysicalFormat(stream, sampleRate);
+        if (best < 0) {
+            continue;
+        }
+        AudioStreamBasicDescription format = stream.mPhysicalFormats[best].mFormat;
+        format.mSampleRate = sampleRate;
+        if (memcmp(&format, &stream.mPhysicalFormat, sizeof(format)) == 0) {
+            continue;
+        }
+        char buf[2][64];
+        AudioStreamBasicDescription previous = stream.mPhysicalFormat;
+        OSStatus err = SetPhysicalFormat(stream, format);
+        if (report) {
+            report->setCalls += 1;
+            if (err == noErr && memcmp(&previous, &stream.mPhysicalFormat, sizeof(previous)) != 0) {
+                report->formatChanges += 1;
+            }
+        }
+        if (err == noErr) {
+            mPhysicalFormatChanged = true;
+            ADLog("Stream %u of \"%s\": physical format %s (content %u-bit %uch)", (unsigned int) stream.mID, GetName(),
+                  FormatDescription(stream.mPhysicalFormat, buf[0], sizeof(buf[0])),
+                  (unsigned int) mContentBits, (unsigned int) mContentChannels);
+        } else {
+            ADLog("Failure setting stream %u of \"%s\" to %s: %d (%s)", (unsigned int) stream.mID, GetName(),
+                  FormatDescription(format, buf[1], sizeof(buf[1])), err, OSTStr(err));
+            ret = err;
+        }
+    }
+    return ret;
+}
+
+/*!
+    Restore the physical formats the streams had when opening the device
+ */
+OSStatus AudioDevice::RestorePhysicalFormat(ReconfigurationReport *report)
+{
+    OSStatus ret = noErr;
+    if (!mPhysicalFormatChanged) {
+        return noErr;
+    }
+    for (UInt32 i = 0 ; i < mNumStreams ; ++i) {
+        Stream &stream = mStreams[i];
+        if (memcmp(&stream.mInitialPhysicalFormat, &stream.mPhysicalFormat, sizeof(AudioStreamBasicDescription)) != 0) {
+            AudioStreamBasicDescription previous = stream.mPhysicalFormat;
+            OSStatus err = SetPhysicalFormat(stream, stream.mInitialPhysicalFormat);
+            if (report) {
+                report->setCalls += 1;
+                if (err == noErr && memcmp(&previous, &stream.mPhysicalFormat, sizeof(previous)) != 0) {
+                    report->formatChanges += 1;
+                }
+            }
+            if (err != noErr) {
+                ADLog("Failure restoring the physical format of stream %u of \"%s\": %d (%s)",
+                      (unsigned int) stream.mID, GetName(), err, OSTStr(err));
+                ret = err;
+            }
+        }
+    }
+    if (ret == noErr) {
+        mPhysicalFormatChanged = false;
+        // the nominal rate follows the physical format
+        Float64 sampleRate;
+        NominalSampleRate(sampleRate);
+    }
+    return ret;
+}
+
 // AudioDeviceGetPropertyInfo() is deprecated, so we wrap AudioObjectGetPropertyDataSize().
 OSStatus AudioDevice::GetPropertyDataSize(AudioObjectPropertySelector property, UInt32 *size, AudioObjectPropertyAddress *propertyAddress)
 {
@@ -567,14 +1616,24 @@ int AudioDevice::CountChannels()
         return 0;
     }
 
-    AudioBufferList *buflist = (AudioBufferList *)malloc(propSize);
+    // on the stack unless the device has an unusual number of buffers
+    union {
+        AudioBufferList list;
+        UInt8 bytes[offsetof(AudioBufferList, mBuffers) + kMaxStreams * sizeof(AudioBuffer)];
+    } local;
+    AudioBufferList *buflist = (propSize <= sizeof(local)) ? &local.list : (AudioBufferList *)malloc(propSize);
+    if (!buflist) {
+        return 0;
+    }
     err = AudioObjectGetPropertyData(mID, &theAddress, 0, NULL, &propSize, buflist);
     if (!err) {
         for (UInt32 i = 0; i < buflist->mNumberBuffers; ++i) {
             result += buflist->mBuffers[i].mNumberChannels;
         }
     }
-    free(buflist);
+    if (buflist != &local.list) {
+        free(buflist);
+    }
     return result;
 }
 
@@ -612,7 +1671,7 @@ AudioDevice *AudioDevice::GetDefaultDevice(Boolean forInput, OSStatus &err, Audi
     if (err == noErr) {
         if (dev) {
             if (dev->ID() != defaultDeviceID) {
-                delete dev;
+                Release(dev);
             } else {
                 goto bail;
             }
@@ -628,7 +1687,7 @@ AudioDevice *AudioDevice::GetDevice(AudioDeviceID devId, Boolean forInput, Audio
 {
     if (dev) {
         if (dev->ID() != devId) {
-            delete dev;
+            Release(dev);
         } else {
             goto bail;
         }
@@ -653,7 +1712,7 @@ AudioDevice *GetDefaultDevice(Boolean isInput, OSStatus &err, AudioDevice *dev)
 	if( err == noErr ){
 		if( dev ){
 			if( dev->ID() != defaultDeviceID ){
-				delete dev;
+				AudioDevice::Release( dev );
 			} else {
 				goto bail;
 			}
@@ -107,3 +107,23 @@ OSStatus AudioDeviceList::DefaultDevice(bool isInput, AudioDeviceID &defaultDevi
 	}
 	return err;
 }
+
+OSStatus AudioDeviceList::DeviceForUID(const char *uid, AudioDeviceID &deviceID)
+{
+	OSStatus err;
+	CFStringRef cfUID = CFStringCreateWithCString(kCFAllocatorDefault, uid, kCFStringEncodingUTF8);
+	if( !cfUID ){
+		return paramErr;
+	}
+	UInt32 propsize = sizeof(AudioDeviceID);
+	AudioObjectPropertyAddress theAddress = { kAudioHardwarePropertyTranslateUIDToDevice,
+											 kAudioObjectPropertyScopeGlobal,
+											 kAudioObjectPropertyElementMaster };
+	deviceID = kAudioDeviceUnknown;
+	err = AudioObjectGetPropertyData(kAudioObjectSystemObject, &theAddress, sizeof(CFStringRef), &cfUID, &propsize, &deviceID);
+	CFRelease(cfUID);
+	if( err == noErr && deviceID == kAudioDeviceUnknown ){
+		err = kAudioHardwareBadDeviceError;
+	}
+	return err;
+}
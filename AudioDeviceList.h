@@ -71,6 +71,7 @@ public:
 
 	DeviceList &GetList() { return mDevices; }
 	static OSStatus DefaultDevice(bool isInput, AudioDeviceID &defaultDeviceID, AudioDevice **defaultDevice);
+	static OSStatus DeviceForUID(const char *uid, AudioDeviceID &deviceID);
 
 protected:
 	void		BuildList();
@@ -0,0 +1,361 @@
+/*=============================================================================
+	AudioDeviceSet.cpp
+
+=============================================================================*/
+
+#include "AudioDeviceSet.h"
+#include "AudioDeviceList.h"
+#include "BPPreferences.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+
+// how long a follower waits for the leader of its clock domain before switching on its own
+static const double kLeaderTimeout = 2.0;
+// how long a follower gives its clock to settle on the leader's rate
+static const double kFollowTimeout = 0.25;
+
+static double SteadyTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AudioDeviceSet::AudioDeviceSet()
+	: mCount(0)
+	, mQuit(false)
+	, mGrouped(false)
+	, mRound(0)
+	, mPrimaryRound(0)
+	, mPrimaryErr(noErr)
+	, mPrimaryRate(0)
+	, mPrimaryID(kAudioDeviceUnknown)
+{
+}
+
+AudioDeviceSet::~AudioDeviceSet()
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mQuit = true;
+	}
+	mWork.notify_all();
+	mDone.notify_all();
+	for (int i = 0 ; i < mCount ; ++i) {
+		if (mTargets[i].worker.joinable()) {
+			mTargets[i].worker.join();
+		}
+		// this restores the device's initial rate, in the background if there is a reaper
+		AudioDevice::Release(mTargets[i].device);
+		mTargets[i].device = NULL;
+	}
+}
+
+bool AudioDeviceSet::AddTarget(AudioDevice *dev)
+{
+	if (!dev || !dev->Valid() || mCount >= kMaxTargets) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(mLock);
+	Slot &slot = mTargets[mCount];
+	slot.device = dev;
+	slot.posted = slot.handled = 0;
+	slot.round = slot.doneRound = 0;
+	memset(&slot.status, 0, sizeof(slot.status));
+	slot.status.deviceRate = dev->CurrentNominalSampleRate();
+	slot.status.leader = kOwnLeader;
+	slot.worker = std::thread(&AudioDeviceSet::Worker, this, mCount);
+	mCount += 1;
+	mGrouped = false;
+	return true;
+}
+
+int AudioDeviceSet::AddTargetsFromPreferences()
+{
+	char uids[kMaxTargets][256];
+	int n = BPPrefStringList("TargetDevices", uids, kMaxTargets), added = 0;
+	for (int i = 0 ; i < n ; ++i) {
+		const char *uid = uids[i];
+		bool forInput = false;
+		AudioDeviceID devID;
+		OSStatus err;
+		if (strncmp(uid, "input:", 6) == 0) {
+			forInput = true;
+			uid += 6;
+		}
+		if (strcmp(uid, "default") == 0) {
+			err = AudioDeviceList::DefaultDevice(forInput, devID, NULL);
+		} else {
+			err = AudioDeviceList::DeviceForUID(uid, devID);
+		}
+		if (err != noErr) {
+			ADLog("AudioDeviceSet: no %s device with UID \"%s\" (%d)", forInput ? "input" : "output", uid, (int) err);
+			continue;
+		}
+		AudioDevice *dev = new AudioDevice(devID, forInput);
+		if (AddTarget(dev)) {
+			ADLog("AudioDeviceSet: added %s target %u \"%s\"", forInput ? "input" : "output",
+				  (unsigned int) devID, dev->GetName());
+			added += 1;
+		} else {
+			delete dev;
+		}
+	}
+	return added;
+}
+
+bool AudioDeviceSet::GetStatus(int i, TargetStatus &status)
+{
+	if (i < 0 || i >= mCount) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(mLock);
+	status = mTargets[i].status;
+	return true;
+}
+
+void AudioDeviceSet::LogClockDomains(AudioDevice *primary)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	bool logged[kMaxTargets] = { false };
+	for (int i = -1 ; i < mCount ; ++i) {
+		AudioDevice *dev = (i < 0) ? primary : mTargets[i].device;
+		if (!dev || !dev->ClockDomain() || (i >= 0 && logged[i])) {
+			continue;
+		}
+		char line[1024];
+		int len = snprintf(line, sizeof(line), "clock domain %u:", (unsigned int) dev->ClockDomain());
+		if (i < 0) {
+			len += snprintf(&line[len], sizeof(line) - len, " \"%s\" (primary)", primary->GetName());
+		}
+		int members = (i < 0) ? 1 : 0;
+		for (int j = (i < 0) ? 0 : i ; j < mCount && len < (int) sizeof(line) ; ++j) {
+			Slot &slot = mTargets[j];
+			if (!logged[j] && slot.device->ClockDomain() == dev->ClockDomain()) {
+				const char *role;
+				char follows[32];
+				if (slot.status.leader == kPrimaryLeader) {
+					role = "follows primary";
+				} else if (slot.status.leader == kOwnLeader) {
+					role = "leader";
+				} else {
+					snprintf(follows, sizeof(follows), "follows target #%d", slot.status.leader);
+					role = follows;
+				}
+				len += snprintf(&line[len], sizeof(line) - len, " \"%s\" (target #%d %s, %s)",
+								slot.device->GetName(), j, slot.device->IsInput() ? "input" : "output", role);
+				logged[j] = true;
+				members += 1;
+			}
+		}
+		if (members > 1) {
+			ADLog("AudioDeviceSet: %s", line);
+		}
+	}
+}
+
+// group the targets by clock domain. Must be called with mLock held.
+void AudioDeviceSet::AssignLeaders(AudioDevice *primary)
+{
+	UInt32 primaryDomain = (primary) ? primary->ClockDomain() : 0;
+	for (int i = 0 ; i < mCount ; ++i) {
+		Slot &slot = mTargets[i];
+		UInt32 domain = slot.device->ClockDomain();
+		int leader = kOwnLeader;
+		if (domain) {
+			if (domain == primaryDomain) {
+				leader = kPrimaryLeader;
+			} else {
+				for (int j = 0 ; j < i ; ++j) {
+					if (mTargets[j].status.leader == kOwnLeader && mTargets[j].device->ClockDomain() == domain) {
+						leader = j;
+						break;
+					}
+				}
+			}
+		}
+		slot.status.leader = leader;
+	}
+}
+
+void AudioDeviceSet::Post(AudioDevice *primary, const Job &job)
+{
+	double now = SteadyTime();
+	bool regrouped = false;
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		AudioDeviceID primaryID = (primary) ? primary->ID() : kAudioDeviceUnknown;
+		if (!mGrouped || primaryID != mPrimaryID) {
+			AssignLeaders(primary);
+			mPrimaryID = primaryID;
+			mGrouped = true;
+			regrouped = true;
+		}
+		mRound += 1;
+		for (int i = 0 ; i < mCount ; ++i) {
+			Slot &slot = mTargets[i];
+			// the primary already gets the change on the calling thread
+			if (primary && slot.device->ID() == primary->ID() && slot.device->IsInput() == primary->IsInput()) {
+				continue;
+			}
+			// a job that is still queued is simply superseded by the new one
+			slot.job = job;
+			slot.posted += 1;
+			slot.round = mRound;
+			slot.status.state = kTargetPending;
+			slot.status.requestedRate = job.sampleRate;
+			slot.status.issuedAt = now;
+		}
+	}
+	mWork.notify_all();
+	if (regrouped && mCount > 0) {
+		LogClockDomains(primary);
+	}
+}
+
+void AudioDeviceSet::PrimaryDone(AudioDevice *primary, OSStatus err)
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mPrimaryRound = mRound;
+		mPrimaryErr = (primary) ? err : (OSStatus) kAudioHardwareBadDeviceError;
+		mPrimaryRate = (primary) ? primary->CurrentNominalSampleRate() : 0;
+	}
+	mDone.notify_all();
+}
+
+// wait, with mLock held through lock, until the clock domain leader of slot has completed
+// the current round. Returns false if the job was superseded or the set is being destroyed.
+bool AudioDeviceSet::WaitForLeader(Slot &slot, unsigned long posted, std::unique_lock<std::mutex> &lock,
+								   OSStatus &leaderErr, Float64 &leaderRate)
+{
+	int leader = slot.status.leader;
+	bool ready = mDone.wait_for(lock, std::chrono::duration<double>(kLeaderTimeout), [&] {
+		if (mQuit || slot.posted != posted) {
+			return true;
+		}
+		return (leader == kPrimaryLeader) ? (mPrimaryRound >= slot.round) : (mTargets[leader].doneRound >= slot.round);
+	});
+	if (mQuit || slot.posted != posted) {
+		return false;
+	}
+	if (!ready) {
+		leaderErr = kAudioHardwareNotRunningError;
+	} else if (leader == kPrimaryLeader) {
+		leaderErr = mPrimaryErr;
+		leaderRate = mPrimaryRate;
+	} else {
+		leaderErr = mTargets[leader].status.err;
+		leaderRate = mTargets[leader].status.deviceRate;
+	}
+	return true;
+}
+
+// check that a follower's clock has followed its leader to leaderRate.
+OSStatus AudioDeviceSet::Verify(Slot &slot, const Job &job, Float64 leaderRate)
+{
+	double deadline = SteadyTime() + kFollowTimeout;
+	Float64 rate = 0;
+	do {
+		if (slot.device->NominalSampleRate(rate) == noErr && rate == leaderRate) {
+			return noErr;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	} while (SteadyTime() < deadline);
+	ADLog("AudioDeviceSet: target %u \"%s\" didn't follow its clock domain to %gHz (at %gHz)",
+		  (unsigned int) slot.device->ID(), slot.device->GetName(), leaderRate, rate);
+	return kAudioHardwareUnspecifiedError;
+}
+
+void AudioDeviceSet::Worker(int i)
+{
+	Slot &slot = mTargets[i];
+	std::unique_lock<std::mutex> lock(mLock);
+	while (true) {
+		mWork.wait(lock, [&] { return mQuit || slot.posted != slot.handled; });
+		if (mQuit) {
+			break;
+		}
+		Job job = slot.job;
+		unsigned long posted = slot.posted, round = slot.round;
+		double issuedAt = slot.status.issuedAt;
+		bool follower = (slot.status.leader != kOwnLeader), verified = false;
+		OSStatus err = noErr, leaderErr = noErr;
+		Float64 leaderRate = 0;
+
+		if (follower && !WaitForLeader(slot, posted, lock, leaderErr, leaderRate)) {
+			// superseded by a newer job
+			continue;
+		}
+		lock.unlock();
+
+		if (follower && leaderErr == noErr) {
+			verified = (Verify(slot, job, leaderRate) == noErr);
+		}
+		if (!job.reset && job.contentBits) {
+			slot.device->SetContentFormat(job.contentBits, job.contentChannels);
+		}
+		if (!verified) {
+			err = (job.reset) ? slot.device->ResetNominalSampleRate() : slot.device->SetNominalSampleRate(job.sampleRate);
+		}
+		double duration = SteadyTime() - issuedAt;
+
+		lock.lock();
+		slot.handled = posted;
+		slot.doneRound = round;
+		slot.status.err = err;
+		slot.status.deviceRate = slot.device->CurrentNominalSampleRate();
+		slot.status.duration = duration;
+		slot.status.verified = verified;
+		// don't overwrite the state of a job that was posted while we were busy
+		if (slot.posted == posted) {
+			slot.status.state = (err == noErr) ? kTargetDone : kTargetFailed;
+		}
+		mDone.notify_all();
+		lock.unlock();
+		ADLog("AudioDeviceSet: target %u \"%s\" %s %gHz in %gms (err=%d)",
+			  (unsigned int) slot.device->ID(), slot.device->GetName(),
+			  (err != noErr) ? "failed to switch to" : (verified) ? "followed its clock domain to" : "at",
+			  (err == noErr) ? slot.device->CurrentNominalSampleRate() : job.sampleRate,
+			  duration * 1000.0, (int) err);
+		lock.lock();
+	}
+}
+
+OSStatus AudioDeviceSet::SetNominalSampleRate(AudioDevice *primary, Float64 sampleRate,
+											  UInt32 contentBits, UInt32 contentChannels)
+{
+	Job job = { false, sampleRate, contentBits, contentChannels };
+	Post(primary, job);
+	OSStatus err = noErr;
+	if (primary) {
+		if (contentBits) {
+			primary->SetContentFormat(contentBits, contentChannels);
+		}
+		err = primary->SetNominalSampleRate(sampleRate);
+	}
+	PrimaryDone(primary, err);
+	return err;
+}
+
+OSStatus AudioDeviceSet::ResetNominalSampleRate(AudioDevice *primary)
+{
+	Job job = { true, 0, 0, 0 };
+	Post(primary, job);
+	OSStatus err = (primary) ? primary->ResetNominalSampleRate() : noErr;
+	PrimaryDone(primary, err);
+	return err;
+}
+
+bool AudioDeviceSet::WaitForCompletion(double timeout)
+{
+	std::unique_lock<std::mutex> lock(mLock);
+	return mDone.wait_for(lock, std::chrono::duration<double>(timeout), [&] {
+		for (int i = 0 ; i < mCount ; ++i) {
+			if (mTargets[i].posted != mTargets[i].handled) {
+				return false;
+			}
+		}
+		return true;
+	});
+}
@@ -0,0 +1,119 @@
+/*=============================================================================
+	AudioDeviceSet.h
+
+	A set of additional audio devices (output or input scope) that follow the
+	sample rate of the content together with the default output device.
+	Each target device is serviced by its own worker thread so that rate
+	changes are issued in parallel, and a slow device cannot hold up the
+	others. The default output device (the "primary") is handled on the
+	calling thread, exactly as before.
+	Devices that share a clock domain change rate together, so only one
+	member of each domain (the primary if it is a member) gets the change;
+	the others merely verify that they followed, which avoids repeated
+	relocks of the shared clock.
+=============================================================================*/
+
+#ifndef __AudioDeviceSet_h__
+#define __AudioDeviceSet_h__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "AudioDevice.h"
+
+class AudioDeviceSet {
+public:
+	enum { kMaxTargets = 8 };
+
+	// the leader of a target that doesn't follow another device
+	enum {
+		kOwnLeader = -1,
+		kPrimaryLeader = -2
+	};
+
+	enum TargetState {
+		kTargetIdle = 0,
+		kTargetPending,
+		kTargetDone,
+		kTargetFailed
+	};
+
+	struct TargetStatus {
+		TargetState state;
+		Float64 requestedRate;
+		Float64 deviceRate;		// the device's nominal rate after the last completed change
+		OSStatus err;
+		double issuedAt;		// in seconds, steady clock
+		double duration;		// in seconds, time the last change took to complete
+		int leader;				// kOwnLeader, kPrimaryLeader or the index of the target followed
+		bool verified;			// the last change was verified rather than applied
+	};
+
+	AudioDeviceSet();
+	~AudioDeviceSet();
+
+	// add a target device. The set takes ownership of dev.
+	bool AddTarget(AudioDevice *dev);
+	// add the targets listed in the "TargetDevices" setting: an array of device UIDs,
+	// each optionally prefixed with "input:" to select the input scope. The UID
+	// "default" designates the default device for the given scope.
+	int AddTargetsFromPreferences();
+
+	int Count()
+	{
+		return mCount;
+	}
+	AudioDevice *Target(int i)
+	{
+		return (i >= 0 && i < mCount) ? mTargets[i].device : NULL;
+	}
+	bool GetStatus(int i, TargetStatus &status);
+	// log the clock domain groups formed by the primary and the targets
+	void LogClockDomains(AudioDevice *primary);
+
+	// issue the change to all targets in parallel, then apply it to the primary
+	// device on the calling thread; returns the primary's result. The content's
+	// bit depth and channel count are used for physical format matching, if known.
+	OSStatus SetNominalSampleRate(AudioDevice *primary, Float64 sampleRate,
+								  UInt32 contentBits = 0, UInt32 contentChannels = 0);
+	OSStatus ResetNominalSampleRate(AudioDevice *primary);
+	// wait until all targets have completed their last change; returns false on timeout.
+	bool WaitForCompletion(double timeout);
+
+protected:
+	struct Job {
+		bool reset;
+		Float64 sampleRate;
+		UInt32 contentBits, contentChannels;
+	};
+	struct Slot {
+		AudioDevice *device;
+		std::thread worker;
+		Job job;
+		unsigned long posted, handled;
+		// the round of the last job posted to this slot, and of the last one completed
+		unsigned long round, doneRound;
+		TargetStatus status;
+	};
+
+	void AssignLeaders(AudioDevice *primary);
+	void Post(AudioDevice *primary, const Job &job);
+	void PrimaryDone(AudioDevice *primary, OSStatus err);
+	bool WaitForLeader(Slot &slot, unsigned long posted, std::unique_lock<std::mutex> &lock, OSStatus &leaderErr, Float64 &leaderRate);
+	OSStatus Verify(Slot &slot, const Job &job, Float64 leaderRate);
+	void Worker(int i);
+
+	Slot mTargets[kMaxTargets];
+	int mCount;
+	bool mQuit, mGrouped;
+	// job rounds: every Post() starts a new one
+	unsigned long mRound, mPrimaryRound;
+	OSStatus mPrimaryErr;
+	Float64 mPrimaryRate;
+	AudioDeviceID mPrimaryID;
+	std::mutex mLock;
+	std::condition_variable mWork, mDone;
+};
+
+#endif // __AudioDeviceSet_h__
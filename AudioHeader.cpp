@@ -0,0 +1,290 @@
+/*=============================================================================
+	AudioHeader.cpp
+
+=============================================================================*/
+
+#include "AudioHeader.h"
+
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FOURCC(a,b,c,d)	(((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+static inline uint32_t BE16(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 8) | p[1];
+}
+
+static inline uint32_t BE32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline uint64_t BE64(const unsigned char *p)
+{
+	return ((uint64_t) BE32(p) << 32) | BE32(p + 4);
+}
+
+static inline uint32_t LE16(const unsigned char *p)
+{
+	return ((uint32_t) p[1] << 8) | p[0];
+}
+
+static inline uint32_t LE32(const unsigned char *p)
+{
+	return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+static bool Valid(AudioHeaderInfo &info)
+{
+	return info.sampleRate >= 1000 && info.sampleRate <= 1536000 && info.channels > 0;
+}
+
+// the 34 byte FLAC STREAMINFO block
+static bool ParseStreamInfo(const unsigned char *p, AudioHeaderInfo &info)
+{
+	info.sampleRate = (double)(((uint32_t) p[10] << 12) | ((uint32_t) p[11] << 4) | (p[12] >> 4));
+	info.channels = ((p[12] >> 1) & 7) + 1;
+	info.bitsPerChannel = (((p[12] & 1) << 4) | (p[13] >> 4)) + 1;
+	info.format = FOURCC('f','L','a','C');
+	return Valid(info);
+}
+
+static bool ParseFLAC(const unsigned char *data, uint64_t size, AudioHeaderInfo &info)
+{
+	uint64_t pos = 0;
+	// skip an ID3v2 tag some taggers put in front of the stream
+	if (size >= 10 && !memcmp(data, "ID3", 3)) {
+		pos = 10 + (((uint64_t)(data[6] & 0x7f) << 21) | ((data[7] & 0x7f) << 14) | ((data[8] & 0x7f) << 7) | (data[9] & 0x7f));
+		if (data[5] & 0x10) {
+			// footer present
+			pos += 10;
+		}
+	}
+	// the STREAMINFO block is mandatory and always comes first
+	if (pos + 8 + 34 > size || memcmp(data + pos, "fLaC", 4) || (data[pos + 4] & 0x7f) != 0) {
+		return false;
+	}
+	return ParseStreamInfo(data + pos + 8, info);
+}
+
+static bool ParseWAV(const unsigned char *data, uint64_t size, AudioHeaderInfo &info)
+{
+	uint64_t pos = 12;
+	while (pos + 8 <= size) {
+		uint64_t chunkSize = LE32(data + pos + 4);
+		if (!memcmp(data + pos, "fmt ", 4)) {
+			const unsigned char *fmt = data + pos + 8;
+			if (chunkSize < 16 || pos + 8 + chunkSize > size) {
+				return false;
+			}
+			info.channels = LE16(fmt + 2);
+			info.sampleRate = LE32(fmt + 4);
+			info.bitsPerChannel = LE16(fmt + 14);
+			if (LE16(fmt) == 0xFFFE && chunkSize >= 24 && LE16(fmt + 18) > 0) {
+				// WAVE_FORMAT_EXTENSIBLE: prefer the number of valid bits
+				info.bitsPerChannel = LE16(fmt + 18);
+			}
+			info.format = FOURCC('W','A','V','E');
+			return Valid(info);
+		}
+		// RF64 keeps the actual size of the data chunk in ds64; the fmt chunk normally precedes it
+		if (chunkSize == 0xFFFFFFFF) {
+			return false;
+		}
+		pos += 8 + chunkSize + (chunkSize & 1);
+	}
+	return false;
+}
+
+// convert an 80 bit IEEE 754 extended precision number
+static double Extended80(const unsigned char *p)
+{
+	int exponent = (int)(((p[0] & 0x7f) << 8) | p[1]);
+	uint64_t mantissa = BE64(p + 2);
+	if (exponent == 0 && mantissa == 0) {
+		return 0;
+	}
+	double value = ldexp((double) mantissa, exponent - 16383 - 63);
+	return (p[0] & 0x80) ? -value : value;
+}
+
+static bool ParseAIFF(const unsigned char *data, uint64_t size, AudioHeaderInfo &info)
+{
+	uint64_t pos = 12;
+	while (pos + 8 <= size) {
+		uint64_t chunkSize = BE32(data + pos + 4);
+		if (!memcmp(data + pos, "COMM", 4)) {
+			const unsigned char *comm = data + pos + 8;
+			if (chunkSize < 18 || pos + 8 + chunkSize > size) {
+				return false;
+			}
+			info.channels = BE16(comm);
+			info.bitsPerChannel = BE16(comm + 6);
+			info.sampleRate = Extended80(comm + 8);
+			info.format = FOURCC('A','I','F','F');
+			return Valid(info);
+		}
+		pos += 8 + chunkSize + (chunkSize & 1);
+	}
+	return false;
+}
+
+// an audio sample entry in an MP4 stsd atom
+static bool ParseSampleEntry(const unsigned char *entry, uint64_t size, AudioHeaderInfo &info)
+{
+	if (size < 36) {
+		return false;
+	}
+	uint32_t type = BE32(entry + 4), version = BE16(entry + 16);
+	uint64_t children;
+	if (version == 2 && size >= 72) {
+		// QuickTime sound description v2 carries the rate as a double
+		uint64_t bits = BE64(entry + 40);
+		memcpy(&info.sampleRate, &bits, sizeof(double));
+		info.channels = BE32(entry + 48);
+		info.bitsPerChannel = BE32(entry + 56);
+		children = 72;
+	} else {
+		info.channels = BE16(entry + 24);
+		info.bitsPerChannel = BE16(entry + 26);
+		// 16.16 fixed point, which can't represent rates above 65535Hz
+		info.sampleRate = BE32(entry + 32) >> 16;
+		children = (version == 1) ? 52 : 36;
+	}
+	// the codec specific configuration has the authoritative values
+	for (uint64_t pos = children ; pos + 8 <= size ; ) {
+		uint64_t childSize = BE32(entry + pos);
+		if (childSize < 8 || pos + childSize > size) {
+			break;
+		}
+		const unsigned char *child = entry + pos;
+		if (type == FOURCC('a','l','a','c') && BE32(child + 4) == FOURCC('a','l','a','c') && childSize >= 36) {
+			// ALACSpecificConfig follows the version and flags
+			info.bitsPerChannel = child[17];
+			info.channels = child[21];
+			info.sampleRate = BE32(child + 32);
+		} else if (type == FOURCC('f','L','a','C') && BE32(child + 4) == FOURCC('d','f','L','a') && childSize >= 12 + 4 + 34) {
+			ParseStreamInfo(child + 16, info);
+		}
+		pos += childSize;
+	}
+	switch (type) {
+		case FOURCC('a','l','a','c'):
+		case FOURCC('f','L','a','C'):
+			info.format = type;
+			break;
+		case FOURCC('m','p','4','a'):
+			// lossy: the sample size field is meaningless
+			info.format = type;
+			info.bitsPerChannel = 0;
+			break;
+		default:
+			return false;
+	}
+	return Valid(info);
+}
+
+// walk the atoms in [data, data+size) down the path moov/trak/mdia/minf/stbl/stsd
+static bool ParseAtoms(const unsigned char *data, uint64_t size, int depth, AudioHeaderInfo &info)
+{
+	static const uint32_t path[] = {
+		FOURCC('m','o','o','v'), FOURCC('t','r','a','k'), FOURCC('m','d','i','a'),
+		FOURCC('m','i','n','f'), FOURCC('s','t','b','l'), FOURCC('s','t','s','d')
+	};
+	uint64_t pos = 0;
+	while (pos + 8 <= size) {
+		uint64_t atomSize = BE32(data + pos), header = 8;
+		uint32_t type = BE32(data + pos + 4);
+		if (atomSize == 1 && pos + 16 <= size) {
+			atomSize = BE64(data + pos + 8);
+			header = 16;
+		} else if (atomSize == 0) {
+			atomSize = size - pos;
+		}
+		if (atomSize < header || atomSize > size - pos) {
+			return false;
+		}
+		if (type == path[depth]) {
+			const unsigned char *body = data + pos + header;
+			uint64_t bodySize = atomSize - header;
+			if (depth == 5) {
+				// version and flags, entry count, then the sample entries
+				if (bodySize >= 16 && BE32(body + 4) > 0) {
+					uint64_t entrySize = BE32(body + 8);
+					if (entrySize <= bodySize - 8 && ParseSampleEntry(body + 8, entrySize, info)) {
+						return true;
+					}
+				}
+			} else if (ParseAtoms(body, bodySize, depth + 1, info)) {
+				// the first track with a supported audio sample entry wins
+				return true;
+			}
+		}
+		pos += atomSize;
+	}
+	return false;
+}
+
+bool ParseAudioHeader(const unsigned char *data, uint64_t size, AudioHeaderInfo &info)
+{
+	memset(&info, 0, sizeof(info));
+	info.fileSize = size;
+	if (size < 12) {
+		return false;
+	}
+	if (!memcmp(data, "fLaC", 4) || !memcmp(data, "ID3", 3)) {
+		return ParseFLAC(data, size, info);
+	} else if ((!memcmp(data, "RIFF", 4) || !memcmp(data, "RF64", 4) || !memcmp(data, "BW64", 4))
+			   && !memcmp(data + 8, "WAVE", 4)) {
+		return ParseWAV(data, size, info);
+	} else if (!memcmp(data, "FORM", 4) && (!memcmp(data + 8, "AIFF", 4) || !memcmp(data + 8, "AIFC", 4))) {
+		return ParseAIFF(data, size, info);
+	} else if (!memcmp(data + 4, "ftyp", 4)) {
+		return ParseAtoms(data, size, 0, info);
+	}
+	return false;
+}
+
+bool ReadAudioHeader(const char *path, AudioHeaderInfo &info)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	bool ok = false;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= 12) {
+		void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			// we only touch the headers, which in MP4 files can be at the end: don't read ahead
+			madvise(map, (size_t) st.st_size, MADV_RANDOM);
+			ok = ParseAudioHeader((const unsigned char *) map, (uint64_t) st.st_size, info);
+			munmap(map, (size_t) st.st_size);
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+bool IsAudioFileName(const char *name)
+{
+	static const char *extensions[] = {
+		".flac", ".wav", ".wave", ".aif", ".aiff", ".aifc", ".m4a", ".mp4", ".alac", NULL
+	};
+	const char *dot = strrchr(name, '.');
+	if (!dot) {
+		return false;
+	}
+	for (int i = 0 ; extensions[i] ; ++i) {
+		if (!strcasecmp(dot, extensions[i])) {
+			return true;
+		}
+	}
+	return false;
+}
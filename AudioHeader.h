@@ -0,0 +1,33 @@
+/*=============================================================================
+	AudioHeader.h
+
+	Reads the true sample rate, bit depth and channel count from the header
+	of an audio file, without decoding: FLAC STREAMINFO, WAV/RF64 "fmt ",
+	AIFF/AIFC COMM and the MP4 sample description (stsd) of ALAC, AAC and
+	FLAC-in-MP4 tracks. The file is memory-mapped so that only the pages
+	holding the headers are actually read.
+=============================================================================*/
+
+#ifndef __AudioHeader_h__
+#define __AudioHeader_h__
+
+#include <stdint.h>
+
+struct AudioHeaderInfo {
+	double sampleRate;
+	// 0 for lossy formats
+	uint32_t bitsPerChannel;
+	uint32_t channels;
+	// 'fLaC', 'WAVE', 'AIFF', 'alac', 'mp4a'
+	uint32_t format;
+	uint64_t fileSize;
+};
+
+// scan the file at path; returns false if it isn't one of the supported formats or is damaged.
+bool ReadAudioHeader(const char *path, AudioHeaderInfo &info);
+// scan a file that is already in memory
+bool ParseAudioHeader(const unsigned char *data, uint64_t size, AudioHeaderInfo &info);
+// true if the file name has the extension of one of the supported formats
+bool IsAudioFileName(const char *name);
+
+#endif // __AudioHeader_h__
@@ -0,0 +1,133 @@
+/*=============================================================================
+	BPPreferences.cpp
+
+=============================================================================*/
+
+#include "BPPreferences.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *EnvOverride(const char *key)
+{
+	char name[128];
+	snprintf(name, sizeof(name), "BPSR_%s", key);
+	return getenv(name);
+}
+
+static CFPropertyListRef CopyAppValue(const char *key)
+{
+	CFStringRef cfKey = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingUTF8);
+	CFPropertyListRef value = NULL;
+	if (cfKey) {
+		value = CFPreferencesCopyAppValue(cfKey, CFSTR(kBPPreferencesDomain));
+		CFRelease(cfKey);
+	}
+	return value;
+}
+
+bool BPPrefBool(const char *key, bool defaultValue)
+{
+	const char *env = EnvOverride(key);
+	if (env) {
+		return (strcasecmp(env, "yes") == 0 || strcasecmp(env, "true") == 0 || atoi(env) != 0);
+	}
+	bool ret = defaultValue;
+	CFPropertyListRef value = CopyAppValue(key);
+	if (value) {
+		if (CFGetTypeID(value) == CFBooleanGetTypeID()) {
+			ret = CFBooleanGetValue((CFBooleanRef) value);
+		} else if (CFGetTypeID(value) == CFNumberGetTypeID()) {
+			int i;
+			if (CFNumberGetValue((CFNumberRef) value, kCFNumberIntType, &i)) {
+				ret = (i != 0);
+			}
+		}
+		CFRelease(value);
+	}
+	return ret;
+}
+
+double BPPrefDouble(const char *key, double defaultValue)
+{
+	const char *env = EnvOverride(key);
+	if (env) {
+		return atof(env);
+	}
+	double ret = defaultValue;
+	CFPropertyListRef value = CopyAppValue(key);
+	if (value) {
+		if (CFGetTypeID(value) == CFNumberGetTypeID()) {
+			CFNumberGetValue((CFNumberRef) value, kCFNumberDoubleType, &ret);
+		} else if (CFGetTypeID(value) == CFStringGetTypeID()) {
+			ret = CFStringGetDoubleValue((CFStringRef) value);
+		}
+		CFRelease(value);
+	}
+	return ret;
+}
+
+bool BPPrefString(const char *key, char *buf, size_t buflen)
+{
+	const char *env = EnvOverride(key);
+	if (env) {
+		snprintf(buf, buflen, "%s", env);
+		return true;
+	}
+	bool ret = false;
+	CFPropertyListRef value = CopyAppValue(key);
+	if (value) {
+		if (CFGetTypeID(value) == CFStringGetTypeID()) {
+			ret = CFStringGetCString((CFStringRef) value, buf, buflen, kCFStringEncodingUTF8);
+		}
+		CFRelease(value);
+	}
+	return ret;
+}
+
+int BPPrefStringList(const char *key, char list[][256], int maxItems)
+{
+	int n = 0;
+	const char *env = EnvOverride(key);
+	if (env) {
+		const char *s = env;
+		while (*s && n < maxItems) {
+			size_t len = strcspn(s, ",");
+			if (len > 0) {
+				if (len > 255) {
+					len = 255;
+				}
+				memcpy(list[n], s, len);
+				list[n][len] = '\0';
+				n += 1;
+			}
+			s += len;
+			if (*s == ',') {
+				s += 1;
+			}
+		}
+		return n;
+	}
+	CFPropertyListRef value = CopyAppValue(key);
+	if (value) {
+		if (CFGetTypeID(value) == CFArrayGetTypeID()) {
+			CFArrayRef array = (CFArrayRef) value;
+			CFIndex count = CFArrayGetCount(array);
+			for (CFIndex i = 0 ; i < count && n < maxItems ; ++i) {
+				CFTypeRef item = CFArrayGetValueAtIndex(array, i);
+				if (CFGetTypeID(item) == CFStringGetTypeID()
+						&& CFStringGetCString((CFStringRef) item, list[n], 256, kCFStringEncodingUTF8)
+				   ) {
+					n += 1;
+				}
+			}
+		} else if (CFGetTypeID(value) == CFStringGetTypeID()) {
+			if (maxItems > 0 && CFStringGetCString((CFStringRef) value, list[0], 256, kCFStringEncodingUTF8)) {
+				n = 1;
+			}
+		}
+		CFRelease(value);
+	}
+	return n;
+}
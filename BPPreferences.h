@@ -0,0 +1,26 @@
+/*=============================================================================
+	BPPreferences.h
+
+	Access to the plugin's user settings. Settings are read from the
+	application domain of the plugin bundle, e.g.
+		defaults write com.apple.example.iTunesBitPerfectSampleRate <key> <value>
+	and can be overridden through environment variables of the form
+	BPSR_<key>, which is handy when running outside of iTunes.
+=============================================================================*/
+
+#ifndef __BPPreferences_h__
+#define __BPPreferences_h__
+
+#include <CoreServices/CoreServices.h>
+
+#define kBPPreferencesDomain	"com.apple.example.iTunesBitPerfectSampleRate"
+
+bool BPPrefBool(const char *key, bool defaultValue);
+double BPPrefDouble(const char *key, double defaultValue);
+// copies the value of a string setting into buf; returns false if the key is not set
+bool BPPrefString(const char *key, char *buf, size_t buflen);
+// copies up to maxItems values of a string array setting into list. An environment
+// override is a comma-separated list. Returns the number of items copied.
+int BPPrefStringList(const char *key, char list[][256], int maxItems);
+
+#endif // __BPPreferences_h__
@@ -0,0 +1,138 @@
+/*=============================================================================
+	BandwidthAnalyzer.cpp
+
+=============================================================================*/
+
+#include "BandwidthAnalyzer.h"
+
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#	include <arm_neon.h>
+#endif
+
+// a block whose mean magnitude is below this is considered silent
+static const uint32_t kMinBlockEnergy = BandwidthAnalyzer::kBins;
+// blocks needed before the estimate is trusted: about 5s at 30 pulses per second
+static const unsigned kMinBlocks = 150;
+// the level, relative to the spread between the noise floor and the loudest band,
+// above which a band is counted as carrying content
+static const double kThresholdFraction = 0.15;
+// and in absolute terms, in magnitude units per bin
+static const double kMinThreshold = 4;
+
+BandwidthAnalyzer::BandwidthAnalyzer()
+{
+	Reset(0);
+}
+
+void BandwidthAnalyzer::Reset(double nyquistHz)
+{
+	mNyquist = nyquistHz;
+	mBlocks = 0;
+	memset(mSums, 0, sizeof(mSums));
+}
+
+void BandwidthAnalyzer::BandSums(const uint8_t *spectrum, uint32_t sums[kBands])
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (unsigned i = 0 ; i < kBins ; i += 16) {
+		// psadbw against zero sums each group of 8 bytes into a 64 bit lane: 2 bands per load
+		__m128i s = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(spectrum + i)), zero);
+		sums[i / kBinsPerBand] = (uint32_t) _mm_cvtsi128_si32(s);
+		sums[i / kBinsPerBand + 1] = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (unsigned i = 0 ; i < kBins ; i += 16) {
+		uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vld1q_u8(spectrum + i))));
+		sums[i / kBinsPerBand] = (uint32_t) vgetq_lane_u64(s, 0);
+		sums[i / kBinsPerBand + 1] = (uint32_t) vgetq_lane_u64(s, 1);
+	}
+#else
+	for (unsigned b = 0 ; b < kBands ; ++b) {
+		uint32_t sum = 0;
+		for (unsigned i = 0 ; i < kBinsPerBand ; ++i) {
+			sum += spectrum[b * kBinsPerBand + i];
+		}
+		sums[b] = sum;
+	}
+#endif
+}
+
+void BandwidthAnalyzer::AddBlock(const uint8_t *const *channels, unsigned numChannels)
+{
+	uint32_t sums[kBands];
+	for (unsigned c = 0 ; c < numChannels ; ++c) {
+		BandSums(channels[c], sums);
+		uint32_t total = 0;
+		for (unsigned b = 0 ; b < kBands ; ++b) {
+			total += sums[b];
+		}
+		if (total < kMinBlockEnergy) {
+			continue;
+		}
+		for (unsigned b = 0 ; b < kBands ; ++b) {
+			mSums[b] += sums[b];
+		}
+		mBlocks += 1;
+	}
+}
+
+bool BandwidthAnalyzer::Confident() const
+{
+	return mBlocks >= kMinBlocks && mNyquist > 0;
+}
+
+double BandwidthAnalyzer::CutoffHz() const
+{
+	if (mBlocks == 0 || mNyquist <= 0) {
+		return mNyquist;
+	}
+	double mean[kBands], floor = HUGE_VAL, peak = 0;
+	for (unsigned b = 0 ; b < kBands ; ++b) {
+		mean[b] = (double) mSums[b] / ((double) mBlocks * kBinsPerBand);
+		if (mean[b] < floor) {
+			floor = mean[b];
+		}
+		if (mean[b] > peak) {
+			peak = mean[b];
+		}
+	}
+	double threshold = floor + kThresholdFraction * (peak - floor);
+	if (threshold - floor < kMinThreshold) {
+		// no clear edge: the content fills the whole band, or is too quiet to tell
+		return mNyquist;
+	}
+	int top = kBands - 1;
+	while (top > 0 && mean[top] < threshold) {
+		--top;
+	}
+	// the centre of the highest band that carries content
+	return (top + 0.5) * mNyquist / kBands;
+}
+
+double BandwidthAnalyzer::EffectiveRate(double contentRate) const
+{
+	double family;
+	if (fmod(contentRate, 44100) == 0) {
+		family = 44100;
+	} else if (fmod(contentRate, 48000) == 0) {
+		family = 48000;
+	} else {
+		return contentRate;
+	}
+	if (!Confident()) {
+		return contentRate;
+	}
+	double cutoff = CutoffHz();
+	for (double rate = family ; rate < contentRate ; rate *= 2) {
+		if (rate / 2 >= cutoff) {
+			return rate;
+		}
+	}
+	return contentRate;
+}
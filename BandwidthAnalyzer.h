@@ -0,0 +1,59 @@
+/*=============================================================================
+	BandwidthAnalyzer.h
+
+	Estimates the effective audio bandwidth of a track from the spectrum
+	blocks iTunes passes with its pulse messages. A "hi-res" file that was
+	upsampled from 44.1kHz material has next to no energy above ~22kHz;
+	playing it at 88.2 or 176.4kHz buys nothing and costs a relock, so the
+	estimate lets the plugin pick the lowest rate of the same family that
+	still covers the content.
+	The spectrum is summed into kBands bands of 8 bins per block, with the
+	SSE2 psadbw instruction (or NEON) doing one band per 8 bytes. All state
+	lives in fixed size arrays, so a block costs no allocation.
+=============================================================================*/
+
+#ifndef __BandwidthAnalyzer_h__
+#define __BandwidthAnalyzer_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+class BandwidthAnalyzer {
+public:
+	enum {
+		kBins = 512,
+		kBinsPerBand = 8,
+		kBands = kBins / kBinsPerBand
+	};
+
+	BandwidthAnalyzer();
+
+	// start analysing a new track whose spectrum spans 0 to nyquistHz
+	void Reset(double nyquistHz);
+	// add a spectrum block: numChannels arrays of kBins magnitudes. Blocks that are
+	// (nearly) silent are ignored since they say nothing about the bandwidth.
+	void AddBlock(const uint8_t *const *channels, unsigned numChannels);
+
+	// the number of blocks that contributed
+	unsigned Blocks() const
+	{
+		return mBlocks;
+	}
+	// true once enough blocks were seen for the estimate to be trusted
+	bool Confident() const;
+	// the frequency above which the spectrum is at the noise floor
+	double CutoffHz() const;
+	// the lowest rate in the family of contentRate (multiples of 44.1 or 48kHz) whose
+	// Nyquist frequency covers the cutoff; contentRate itself if it can't go lower.
+	double EffectiveRate(double contentRate) const;
+
+	// sum the spectrum in bands; exposed for benchmarking
+	static void BandSums(const uint8_t *spectrum, uint32_t sums[kBands]);
+
+protected:
+	double mNyquist;
+	unsigned mBlocks;
+	uint64_t mSums[kBands];
+};
+
+#endif // __BandwidthAnalyzer_h__
@@ -0,0 +1,325 @@
+/*=============================================================================
+	DeviceJournal.cpp
+
+=============================================================================*/
+
+#include "DeviceJournal.h"
+#include "AudioDeviceList.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+static bool ProcessRunning(uint32_t pid)
+{
+	return kill((pid_t) pid, 0) == 0 || errno == EPERM;
+}
+
+DeviceJournal::DeviceJournal(const char *path)
+	: mFile(NULL)
+	, mFD(-1)
+	, mPID((uint32_t) getpid())
+{
+	memset(mStale, 0, sizeof(mStale));
+	std::string file = path ? std::string(path) : DefaultPath();
+	for (size_t slash = file.find('/', 1) ; slash != std::string::npos ; slash = file.find('/', slash + 1)) {
+		mkdir(file.substr(0, slash).c_str(), 0755);
+	}
+	mFD = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (mFD < 0) {
+		ADLog("DeviceJournal: cannot open %s (%s)", file.c_str(), strerror(errno));
+		return;
+	}
+	struct stat st;
+	if (fstat(mFD, &st) != 0 || (st.st_size != sizeof(File) && ftruncate(mFD, sizeof(File)) != 0)) {
+		close(mFD);
+		mFD = -1;
+		return;
+	}
+	void *p = mmap(NULL, sizeof(File), PROT_READ | PROT_WRITE, MAP_SHARED, mFD, 0);
+	if (p == MAP_FAILED) {
+		close(mFD);
+		mFD = -1;
+		return;
+	}
+	mFile = static_cast<File *>(p);
+	flock(mFD, LOCK_EX);
+	if (mFile->magic != kMagic || mFile->version != kVersion || mFile->size != sizeof(File)) {
+		memset(mFile, 0, sizeof(File));
+		mFile->magic = kMagic;
+		mFile->version = kVersion;
+		mFile->size = sizeof(File);
+	}
+	for (int i = 0 ; i < kMaxEntries ; ++i) {
+		Entry &e = mFile->entries[i];
+		if (!e.pid || e.pid == mPID || ProcessRunning(e.pid)) {
+			continue;
+		}
+		if (e.sequence & 1) {
+			// the process died while it was writing the entry, so before it changed the device
+			memset(&e.pid, 0, sizeof(Entry) - offsetof(Entry, pid));
+			EndWrite(e);
+		} else {
+			// ours now, so that another instance doesn't restore it too
+			BeginWrite(e);
+			e.pid = mPID;
+			mStale[i] = true;
+			EndWrite(e);
+		}
+	}
+	flock(mFD, LOCK_UN);
+}
+
+DeviceJournal::~DeviceJournal()
+{
+	if (mFile) {
+		munmap(mFile, sizeof(File));
+	}
+	if (mFD >= 0) {
+		close(mFD);
+	}
+}
+
+std::string DeviceJournal::DefaultPath()
+{
+	const char *home = getenv("HOME");
+	return std::string(home ? home : "/tmp") + "/Library/Caches/iTunesBPSampleRate/DeviceJournal";
+}
+
+void DeviceJournal::BeginWrite(Entry &e)
+{
+	e.sequence += 1;
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void DeviceJournal::EndWrite(Entry &e)
+{
+	std::atomic_thread_fence(std::memory_order_release);
+	e.sequence += 1;
+	// the kernel keeps the pages if we crash; this gets them to disk in case the system does
+	msync(mFile, sizeof(File), MS_ASYNC);
+}
+
+// our entry for the device. Must be called with mLock held.
+DeviceJournal::Entry *DeviceJournal::Find(const char *uid, bool forInput, uint32_t pid)
+{
+	for (int i = 0 ; i < kMaxEntries ; ++i) {
+		Entry &e = mFile->entries[i];
+		if (e.pid == pid && !mStale[i] && e.forInput == (forInput ? 1U : 0U) && strcmp(e.uid, uid) == 0) {
+			return &e;
+		}
+	}
+	return NULL;
+}
+
+bool DeviceJournal::Record(const char *uid, bool forInput, Float64 nominalRate, UInt32 bufferFrames, UInt32 clockSource,
+						   const AudioStreamBasicDescription *formats, UInt32 numStreams)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	if (!mFile || !uid || !*uid) {
+		return false;
+	}
+	flock(mFD, LOCK_EX);
+	Entry *e = Find(uid, forInput, mPID);
+	if (e) {
+		BeginWrite(*e);
+		e->users += 1;
+		EndWrite(*e);
+	} else {
+		for (int i = 0 ; i < kMaxEntries && !e ; ++i) {
+			if (!mFile->entries[i].pid && !mStale[i]) {
+				e = &mFile->entries[i];
+			}
+		}
+		if (e) {
+			BeginWrite(*e);
+			e->users = 1;
+			e->forInput = forInput;
+			strncpy(e->uid, uid, sizeof(e->uid) - 1);
+			e->uid[sizeof(e->uid) - 1] = '\0';
+			e->nominalRate = nominalRate;
+			e->bufferFrames = bufferFrames;
+			e->clockSource = clockSource;
+			e->numStreams = std::min<UInt32>(numStreams, kMaxStreams);
+			memcpy(e->formats, formats, e->numStreams * sizeof(AudioStreamBasicDescription));
+			e->when = (double) time(NULL);
+			// last: an entry without a pid is free
+			e->pid = mPID;
+			EndWrite(*e);
+		}
+	}
+	flock(mFD, LOCK_UN);
+	if (!e) {
+		ADLog("DeviceJournal: no room to record device %s", uid);
+	}
+	return e != NULL;
+}
+
+void DeviceJournal::Clear(const char *uid, bool forInput)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	if (!mFile || !uid) {
+		return;
+	}
+	flock(mFD, LOCK_EX);
+	Entry *e = Find(uid, forInput, mPID);
+	if (e) {
+		BeginWrite(*e);
+		if (e->users > 1) {
+			e->users -= 1;
+		} else {
+			memset(&e->pid, 0, sizeof(Entry) - offsetof(Entry, pid));
+		}
+		EndWrite(*e);
+	}
+	flock(mFD, LOCK_UN);
+}
+
+size_t DeviceJournal::StaleCount()
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	size_t n = 0;
+	for (int i = 0 ; i < kMaxEntries ; ++i) {
+		n += mStale[i] ? 1 : 0;
+	}
+	return n;
+}
+
+// put the device back in the state recorded in the entry; runs on a thread of its own
+void DeviceJournal::Restore(const Entry *e, bool *restored)
+{
+	*restored = false;
+	AudioDeviceID devID;
+	OSStatus err = AudioDeviceList::DeviceForUID(e->uid, devID), ret = noErr;
+	if (err != noErr) {
+		ADLog("DeviceJournal: device %s is no longer present (%d)", e->uid, (int) err);
+		return;
+	}
+	AudioObjectPropertyScope scope = e->forInput ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput;
+	AudioObjectPropertyAddress theAddress = { kAudioDevicePropertyNominalSampleRate, scope, kAudioObjectPropertyElementMaster };
+	// the rate the device was left at, for the log
+	Float64 leftAt = 0, sampleRate = 0;
+	UInt32 size = sizeof(leftAt);
+	AudioObjectGetPropertyData(devID, &theAddress, 0, NULL, &size, &leftAt);
+	// the clock first, so that the rate is restored on it
+	UInt32 clockSource = 0;
+	size = sizeof(clockSource);
+	theAddress.mSelector = kAudioDevicePropertyClockSource;
+	if (e->clockSource && AudioObjectGetPropertyData(devID, &theAddress, 0, NULL, &size, &clockSource) == noErr
+			&& clockSource != e->clockSource) {
+		err = AudioObjectSetPropertyData(devID, &theAddress, 0, NULL, sizeof(UInt32), &e->clockSource);
+		if (err != noErr) {
+			ADLog("DeviceJournal: cannot restore the clock source of %s to %u (%d)", e->uid,
+				  (unsigned int) e->clockSource, (int) err);
+			ret = err;
+		}
+	}
+	AudioStreamID streams[64];
+	theAddress.mSelector = kAudioDevicePropertyStreams;
+	size = sizeof(streams);
+	// the physical formats first: changing them can change the nominal rate
+	if (e->numStreams && AudioObjectGetPropertyData(devID, &theAddress, 0, NULL, &size, streams) == noErr) {
+		theAddress.mScope = kAudioObjectPropertyScopeGlobal;
+		theAddress.mSelector = kAudioStreamPropertyPhysicalFormat;
+		for (UInt32 i = 0 ; i < e->numStreams && i < size / sizeof(AudioStreamID) ; ++i) {
+			AudioStreamBasicDescription format;
+			UInt32 formatSize = sizeof(format);
+			if (AudioObjectGetPropertyData(streams[i], &theAddress, 0, NULL, &formatSize, &format) == noErr
+					&& memcmp(&format, &e->formats[i], sizeof(format)) != 0) {
+				err = AudioObjectSetPropertyData(streams[i], &theAddress, 0, NULL, sizeof(format), &e->formats[i]);
+				if (err != noErr) {
+					ADLog("DeviceJournal: cannot restore the physical format of stream %u of %s (%d)",
+						  (unsigned int) streams[i], e->uid, (int) err);
+					ret = err;
+				}
+			}
+		}
+	}
+	size = sizeof(sampleRate);
+	theAddress.mSelector = kAudioDevicePropertyNominalSampleRate;
+	theAddress.mScope = scope;
+	if (AudioObjectGetPropertyData(devID, &theAddress, 0, NULL, &size, &sampleRate) == noErr
+			&& sampleRate != e->nominalRate) {
+		err = AudioObjectSetPropertyData(devID, &theAddress, 0, NULL, sizeof(Float64), &e->nominalRate);
+		if (err != noErr) {
+			ADLog("DeviceJournal: cannot restore %s to %gHz (%d)", e->uid, e->nominalRate, (int) err);
+			ret = err;
+		}
+	}
+	UInt32 bufferFrames = 0;
+	size = sizeof(bufferFrames);
+	theAddress.mSelector = kAudioDevicePropertyBufferFrameSize;
+	if (e->bufferFrames && AudioObjectGetPropertyData(devID, &theAddress, 0, NULL, &size, &bufferFrames) == noErr
+			&& bufferFrames != e->bufferFrames) {
+		err = AudioObjectSetPropertyData(devID, &theAddress, 0, NULL, sizeof(UInt32), &e->bufferFrames);
+		if (err != noErr) {
+			ADLog("DeviceJournal: cannot restore the buffer size of %s to %u frames (%d)", e->uid,
+				  (unsigned int) e->bufferFrames, (int) err);
+			ret = err;
+		}
+	}
+	if (ret == noErr) {
+		ADLog("DeviceJournal: restored %s %s to %gHz (from %gHz), %u frames (from %u)", e->forInput ? "input" : "output",
+			  e->uid, e->nominalRate, leftAt, (unsigned int) e->bufferFrames, (unsigned int) bufferFrames);
+		*restored = true;
+	}
+}
+
+size_t DeviceJournal::RestoreStale()
+{
+	Entry entries[kMaxEntries];
+	int index[kMaxEntries];
+	size_t n = 0;
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		for (int i = 0 ; i < kMaxEntries ; ++i) {
+			if (mStale[i]) {
+				entries[n] = mFile->entries[i];
+				index[n++] = i;
+			}
+		}
+	}
+	if (!n) {
+		return 0;
+	}
+	double start = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	bool restored[kMaxEntries];
+	std::thread workers[kMaxEntries];
+	for (size_t i = 0 ; i < n ; ++i) {
+		workers[i] = std::thread(Restore, &entries[i], &restored[i]);
+	}
+	size_t done = 0;
+	for (size_t i = 0 ; i < n ; ++i) {
+		workers[i].join();
+		done += restored[i] ? 1 : 0;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		flock(mFD, LOCK_EX);
+		// devices that could not be restored (most likely because they are gone) aren't retried
+		for (size_t i = 0 ; i < n ; ++i) {
+			Entry &e = mFile->entries[index[i]];
+			BeginWrite(e);
+			memset(&e.pid, 0, sizeof(Entry) - offsetof(Entry, pid));
+			EndWrite(e);
+			mStale[index[i]] = false;
+		}
+		flock(mFD, LOCK_UN);
+	}
+	double duration = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+	ADLog("DeviceJournal: restored %lu of %lu devices left changed by a process that ended, in %.1fms",
+		  (unsigned long) done, (unsigned long) n, duration * 1000);
+	return done;
+}
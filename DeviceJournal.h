@@ -0,0 +1,103 @@
+/*=============================================================================
+	DeviceJournal.h
+
+	A crash-safe record of the devices we have changed. Before a device's
+	rate, buffer size, clock source or physical formats are changed for the first time,
+	its initial settings are written to a small file mapped in memory, and
+	the entry is cleared once the device has been released and restored.
+	If iTunes crashes or is force-quit, the device is never released, but
+	the kernel keeps the pages of the mapping: the next time the plugin is
+	loaded it finds entries that belong to a process that no longer runs,
+	and restores those devices, all of them in parallel, before it opens
+	the devices it needs.
+	Each entry is written under a sequence number that is odd while the
+	entry is being changed, so a torn entry (which was never acted upon:
+	a device is only changed after its entry is complete) is ignored.
+	Entries are keyed by device UID and scope; two instances of the same
+	device share an entry, which keeps the settings seen by the first.
+=============================================================================*/
+
+#ifndef __DeviceJournal_h__
+#define __DeviceJournal_h__
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+#include "AudioDevice.h"
+
+class DeviceJournal {
+public:
+	enum {
+		kMagic = 0x42504a4e,		// 'BPJN'
+		kVersion = 3,
+		kMaxEntries = 16,
+		// all the streams AudioDevice tracks, so that none of their formats goes unrecorded
+		kMaxStreams = AudioDevice::kMaxStreams
+	};
+
+	struct Entry {
+		uint32_t sequence;
+		// the process that changed the device, 0 for a free entry
+		uint32_t pid;
+		// the number of instances of the device in that process
+		uint32_t users;
+		uint32_t forInput;
+		char uid[256];
+		Float64 nominalRate;
+		UInt32 bufferFrames;
+		// the selected clock source, 0 if the device doesn't have any
+		UInt32 clockSource;
+		UInt32 numStreams;
+		// the physical formats of the device's streams, in the order the HAL lists them
+		AudioStreamBasicDescription formats[kMaxStreams];
+		// when the entry was made, in seconds since the epoch
+		double when;
+	};
+
+	// the journal at path (DefaultPath() if NULL); the entries left by processes that are
+	// no longer running are taken over for RestoreStale()
+	DeviceJournal(const char *path = NULL);
+	~DeviceJournal();
+
+	bool Valid() const
+	{
+		return mFile != NULL;
+	}
+	// the number of stale entries found when the journal was opened and not yet restored
+	size_t StaleCount();
+	// restore the devices of the stale entries, each on its own thread, and wait until all
+	// are done; returns the number of devices restored
+	size_t RestoreStale();
+
+	// the initial settings of a device that is about to be changed; returns false if the
+	// journal is full (the device is then not covered).
+	bool Record(const char *uid, bool forInput, Float64 nominalRate, UInt32 bufferFrames, UInt32 clockSource,
+				const AudioStreamBasicDescription *formats, UInt32 numStreams);
+	// the device has been restored
+	void Clear(const char *uid, bool forInput);
+
+	// ~/Library/Caches/iTunesBPSampleRate/DeviceJournal
+	static std::string DefaultPath();
+
+protected:
+	struct File {
+		uint32_t magic, version, size;
+		Entry entries[kMaxEntries];
+	};
+
+	Entry *Find(const char *uid, bool forInput, uint32_t pid);
+	// change an entry under its sequence number
+	void BeginWrite(Entry &e);
+	void EndWrite(Entry &e);
+	static void Restore(const Entry *e, bool *restored);
+
+	File *mFile;
+	int mFD;
+	uint32_t mPID;
+	// the entries of dead processes
+	bool mStale[kMaxEntries];
+	std::mutex mLock;
+};
+
+#endif // __DeviceJournal_h__
@@ -0,0 +1,158 @@
+/*=============================================================================
+	DeviceReaper.cpp
+
+=============================================================================*/
+
+#include "DeviceReaper.h"
+
+#include <chrono>
+
+// how long the destructor lets the queued devices be released
+static const double kDestructorTimeout = 5.0;
+
+static double SteadyTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+DeviceReaper::DeviceReaper()
+	: mCurrent(NULL)
+	, mCurrentID(kAudioDeviceUnknown)
+	, mHead(0)
+	, mCount(0)
+	, mReleased(0)
+	, mReleaseTime(0)
+	, mMaxReleaseTime(0)
+	, mQuit(false)
+	, mFlushed(false)
+{
+	mThread = std::thread(&DeviceReaper::Worker, this);
+	mWorkerID = mThread.get_id();
+}
+
+DeviceReaper::~DeviceReaper()
+{
+	if (!mFlushed) {
+		Flush(kDestructorTimeout);
+	}
+	// waits for a device still in progress
+	if (mThread.joinable()) {
+		mThread.join();
+	}
+}
+
+bool DeviceReaper::Release(AudioDevice *dev)
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		if (mFlushed || mCount == kMaxPending) {
+			return false;
+		}
+		mPending[(mHead + mCount) % kMaxPending] = dev;
+		mCount += 1;
+	}
+	mWork.notify_one();
+	return true;
+}
+
+// whether a device with that ID (any device for kAudioDeviceUnknown) is queued or being released.
+// Must be called with mLock held.
+bool DeviceReaper::Busy(AudioDeviceID devId)
+{
+	if (devId == kAudioDeviceUnknown) {
+		return mCount || mCurrent;
+	}
+	if (mCurrent && mCurrentID == devId) {
+		return true;
+	}
+	for (size_t i = 0 ; i < mCount ; ++i) {
+		if (mPending[(mHead + i) % kMaxPending]->ID() == devId) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool DeviceReaper::Wait(AudioDeviceID devId, double timeout)
+{
+	if (std::this_thread::get_id() == mWorkerID) {
+		return true;
+	}
+	std::unique_lock<std::mutex> lock(mLock);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+		+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+	while (Busy(devId)) {
+		if (mDone.wait_until(lock, deadline) == std::cv_status::timeout) {
+			return !Busy(devId);
+		}
+	}
+	return true;
+}
+
+size_t DeviceReaper::Flush(double timeout)
+{
+	Wait(kAudioDeviceUnknown, timeout);
+	AudioDevice *queued[kMaxPending];
+	size_t nQueued, abandoned;
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mFlushed = mQuit = true;
+		for (nQueued = 0 ; nQueued < mCount ; ++nQueued) {
+			queued[nQueued] = mPending[(mHead + nQueued) % kMaxPending];
+		}
+		abandoned = mCount + (mCurrent ? 1 : 0);
+		if (mCurrent) {
+			ADLog("DeviceReaper: %s (%u) still being released after %gs", mCurrent->GetName(),
+				  (unsigned int) mCurrentID, timeout);
+		}
+		mCount = 0;
+	}
+	mWork.notify_one();
+	// the queued devices are not deleted, which would restore them for as long as that takes, but
+	// they mustn't stay registered with the HAL either: their journal entries restore them next time.
+	for (size_t i = 0 ; i < nQueued ; ++i) {
+		ADLog("DeviceReaper: %s (%u) left at its current settings", queued[i]->GetName(), (unsigned int) queued[i]->ID());
+		queued[i]->RemoveListeners();
+	}
+	return abandoned;
+}
+
+void DeviceReaper::Log()
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	if (mReleased) {
+		ADLog("DeviceReaper: %lu devices released in the background, mean %.1fms, max %.1fms", mReleased,
+			  mReleaseTime * 1000 / mReleased, mMaxReleaseTime * 1000);
+	}
+}
+
+void DeviceReaper::Worker()
+{
+	std::unique_lock<std::mutex> lock(mLock);
+	for (;;) {
+		while (!mQuit && !mCount) {
+			mWork.wait(lock);
+		}
+		if (mQuit) {
+			break;
+		}
+		AudioDevice *dev = mCurrent = mPending[mHead];
+		mCurrentID = dev->ID();
+		mHead = (mHead + 1) % kMaxPending;
+		mCount -= 1;
+		lock.unlock();
+		double start = SteadyTime();
+		// this restores the device's initial settings and removes its listeners
+		delete dev;
+		double duration = SteadyTime() - start;
+		lock.lock();
+		mCurrent = NULL;
+		mCurrentID = kAudioDeviceUnknown;
+		mReleased += 1;
+		mReleaseTime += duration;
+		if (duration > mMaxReleaseTime) {
+			mMaxReleaseTime = duration;
+		}
+		mDone.notify_all();
+	}
+}
@@ -0,0 +1,73 @@
+/*=============================================================================
+	DeviceReaper.h
+
+	Releases AudioDevice objects on a background thread. Deleting a device
+	restores its initial nominal rate, physical formats and buffer size and
+	removes its listeners, which takes as long as a rate change; when the
+	default output device changes on the way to playing a track, the track
+	shouldn't wait for that. A device that is (still) being released keeps
+	its ID busy: opening or switching a device with the same ID waits until
+	the release is done, so that the restore cannot overtake a newer
+	request or be read back as the device's initial state.
+	The queue has a fixed number of slots; a device that finds it full is
+	released on the calling thread.
+=============================================================================*/
+
+#ifndef __DeviceReaper_h__
+#define __DeviceReaper_h__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "AudioDevice.h"
+
+class DeviceReaper {
+public:
+	enum { kMaxPending = 8 };
+
+	DeviceReaper();
+	// flushes (see Flush()) with a timeout of a few seconds
+	~DeviceReaper();
+
+	// queue dev for release and take ownership of it; false if the queue is full or
+	// the reaper has been flushed, in which case the caller keeps dev.
+	bool Release(AudioDevice *dev);
+	// wait until no device with the given ID is being released, or until any queued device
+	// has been released for kAudioDeviceUnknown; false on timeout. Returns immediately when
+	// called on the reaper's own thread.
+	bool Wait(AudioDeviceID devId, double timeout);
+	// wait for all queued devices to be released, at most timeout seconds, and stop the thread.
+	// Returns the number of devices that were not released in time: the ones still queued
+	// are abandoned (left at their current settings, with their listeners removed, for the
+	// journal to restore next time) and the one in progress is left to complete on the thread,
+	// which then outlives the reaper's owner: the reaper must not be deleted in that case,
+	// nor anything the release uses (the journal, rejected rates and switch costs).
+	size_t Flush(double timeout);
+
+	unsigned long Released()
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		return mReleased;
+	}
+	void Log();
+
+protected:
+	bool Busy(AudioDeviceID devId);
+	void Worker();
+
+	AudioDevice *mPending[kMaxPending];
+	// the device being released by the worker, and the ID it had
+	AudioDevice *mCurrent;
+	AudioDeviceID mCurrentID;
+	size_t mHead, mCount;
+	unsigned long mReleased;
+	double mReleaseTime, mMaxReleaseTime;
+	bool mQuit, mFlushed;
+	std::thread mThread;
+	std::thread::id mWorkerID;
+	std::mutex mLock;
+	std::condition_variable mWork, mDone;
+};
+
+#endif // __DeviceReaper_h__
@@ -0,0 +1,123 @@
+/*=============================================================================
+	DropoutDetector.cpp
+
+=============================================================================*/
+
+#include "DropoutDetector.h"
+#include "SilenceDetector.h"
+#include "AudioDevice.h"
+
+// the shortest run of digital silence within a block that counts as a dropout, in seconds
+static const double kMinIntraBlockGap = 0.001;
+
+DropoutDetector::DropoutDetector(double window)
+	: mWindow(window)
+	, mWatching(false)
+	, mInGap(false)
+	, mSwitchTime(0)
+	, mGapStart(0)
+	, mLastBlock(0)
+	, mLastSilent(false)
+	, mLastTrailing(0)
+{
+}
+
+void DropoutDetector::NoteSwitch(const char *device, double t)
+{
+	if (mInGap) {
+		// a gap is already being timed; it belongs to the earlier switch
+		return;
+	}
+	if (mWatching) {
+		Record(0);
+	}
+	mDevice = device ? device : "";
+	mSwitchTime = t;
+	mWatching = true;
+}
+
+void DropoutDetector::Record(double duration)
+{
+	DeviceStats &s = mStats[mDevice];
+	s.switches += 1;
+	if (duration > 0) {
+		if (s.dropouts == 0 || duration < s.minDuration) {
+			s.minDuration = duration;
+		}
+		if (duration > s.maxDuration) {
+			s.maxDuration = duration;
+		}
+		s.dropouts += 1;
+		s.totalDuration += duration;
+		ADLog("Dropout of %.1fms on \"%s\", %.0fms after the switch", duration * 1000, mDevice.c_str(),
+			  (mGapStart - mSwitchTime) * 1000);
+	}
+	mWatching = mInGap = false;
+}
+
+void DropoutDetector::AddBlock(const uint8_t *const *channels, unsigned numChannels, size_t count,
+							   double t, double sampleRate)
+{
+	if (count > kMaxZeroRunSamples) {
+		count = kMaxZeroRunSamples;
+	}
+	if (mWatching && sampleRate > 0 && numChannels > 0) {
+		ZeroRuns runs;
+		FindZeroRuns(channels, numChannels, count, runs);
+		double blockDuration = count / sampleRate;
+		bool silent = (runs.total == count);
+		// the instant halfway through the unobserved stretch between the previous block and this one
+		double between = (mLastBlock > 0) ? (mLastBlock + blockDuration + t) / 2 : t;
+		if (!mInGap) {
+			if (silent) {
+				mInGap = true;
+				if (mLastBlock > 0 && !mLastSilent && mLastTrailing > 0) {
+					mGapStart = mLastBlock + (count - mLastTrailing) / sampleRate;
+				} else {
+					mGapStart = (between < mSwitchTime) ? mSwitchTime : between;
+				}
+			} else if (runs.trailing >= kMinIntraBlockGap * sampleRate) {
+				// a gap that may continue past this block
+				mInGap = true;
+				mGapStart = t + (count - runs.trailing) / sampleRate;
+			} else if (runs.longest >= kMinIntraBlockGap * sampleRate) {
+				mGapStart = t;
+				Record(runs.longest / sampleRate);
+			} else if (t - mSwitchTime > mWindow) {
+				Record(0);
+			}
+		} else if (!silent) {
+			double end = (runs.leading > 0) ? t + runs.leading / sampleRate : between;
+			Record(end - mGapStart);
+		} else if (t - mGapStart > 10 * mWindow) {
+			// not a dropout but a silent stretch of music, or a stalled player
+			Record(0);
+		}
+		mLastTrailing = runs.trailing;
+		mLastSilent = silent;
+	}
+	mLastBlock = t;
+}
+
+bool DropoutDetector::GetStats(const char *device, DeviceStats &stats)
+{
+	std::map<std::string, DeviceStats>::const_iterator it = mStats.find(device);
+	if (it == mStats.end()) {
+		return false;
+	}
+	stats = it->second;
+	return true;
+}
+
+void DropoutDetector::Log()
+{
+	for (std::map<std::string, DeviceStats>::const_iterator it = mStats.begin() ; it != mStats.end() ; ++it) {
+		const DeviceStats &s = it->second;
+		if (s.dropouts) {
+			ADLog("\"%s\": %lu dropouts in %lu switches; min %.1fms, mean %.1fms, max %.1fms", it->first.c_str(),
+				  s.dropouts, s.switches, s.minDuration * 1000, s.totalDuration * 1000 / s.dropouts, s.maxDuration * 1000);
+		} else {
+			ADLog("\"%s\": no dropouts in %lu switches", it->first.c_str(), s.switches);
+		}
+	}
+}
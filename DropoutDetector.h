@@ -0,0 +1,65 @@
+/*=============================================================================
+	DropoutDetector.h
+
+	Instrumentation that measures how long the audio actually drops out
+	when the output device switches rates. Every switch of the device opens
+	a window during which the waveform blocks of the pulse messages are
+	searched for digital silence (all samples exactly at the centre value
+	in all channels). A gap is timed from the pulses that bracket it, or
+	from the samples within a block for gaps shorter than a block. The
+	durations are collected per device, which tells which DACs need a
+	different switching strategy.
+	Outside the window, digital silence is ignored: 8 bit waveform samples
+	of a quiet passage are often exactly at the centre value too.
+=============================================================================*/
+
+#ifndef __DropoutDetector_h__
+#define __DropoutDetector_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+
+class DropoutDetector {
+public:
+	struct DeviceStats {
+		unsigned long switches;		// switches observed during playback
+		unsigned long dropouts;		// of which were followed by a gap
+		double totalDuration, minDuration, maxDuration;	// of the gaps, in seconds
+	};
+
+	DropoutDetector(double window = 3.0);
+
+	// how long after a switch the waveform is watched, in seconds
+	double Window() const
+	{
+		return mWindow;
+	}
+
+	// a switch of the named device completed at time t (steady clock, in seconds)
+	void NoteSwitch(const char *device, double t);
+	// a waveform block of count samples per channel, rendered at time t from audio at sampleRate
+	void AddBlock(const uint8_t *const *channels, unsigned numChannels, size_t count,
+				  double t, double sampleRate);
+
+	bool GetStats(const char *device, DeviceStats &stats);
+	// log the statistics of every device seen
+	void Log();
+
+protected:
+	void Record(double duration);
+
+	double mWindow;
+	// the switch being watched, if any
+	bool mWatching, mInGap;
+	std::string mDevice;
+	double mSwitchTime, mGapStart;
+	// time of the last block seen, and whether it was silent
+	double mLastBlock;
+	bool mLastSilent;
+	size_t mLastTrailing;
+	std::map<std::string, DeviceStats> mStats;
+};
+
+#endif // __DropoutDetector_h__
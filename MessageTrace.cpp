@@ -0,0 +1,290 @@
+/*=============================================================================
+	MessageTrace.cpp
+
+=============================================================================*/
+
+#include "MessageTrace.h"
+#include "SilenceDetector.h"
+
+#include <string.h>
+
+static const char kTraceMagic[4] = { 'B', 'P', 'M', 'T' };
+static const uint32_t kTraceVersion = 1;
+
+MessageTrace::MessageTrace()
+	: mFile(NULL)
+	, mWriting(false)
+	, mStart(-1)
+	, mCount(0)
+{
+	memset(&mTrackInfo, 0, sizeof(mTrackInfo));
+	memset(&mStreamInfo, 0, sizeof(mStreamInfo));
+	memset(&mRenderData, 0, sizeof(mRenderData));
+}
+
+MessageTrace::~MessageTrace()
+{
+	Close();
+}
+
+void MessageTrace::Close()
+{
+	if (mFile) {
+		fclose(mFile);
+		mFile = NULL;
+	}
+	mStart = -1;
+}
+
+bool MessageTrace::Write(const void *data, size_t size)
+{
+	return fwrite(data, size, 1, mFile) == 1;
+}
+
+bool MessageTrace::Read(void *data, size_t size)
+{
+	return fread(data, size, 1, mFile) == 1;
+}
+
+bool MessageTrace::Create(const char *path)
+{
+	Close();
+	mFile = fopen(path, "wb");
+	if (!mFile) {
+		return false;
+	}
+	mWriting = true;
+	mCount = 0;
+	if (!Write(kTraceMagic, sizeof(kTraceMagic)) || !Write(&kTraceVersion, sizeof(kTraceVersion))) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool MessageTrace::Open(const char *path)
+{
+	Close();
+	mFile = fopen(path, "rb");
+	if (!mFile) {
+		return false;
+	}
+	mWriting = false;
+	mCount = 0;
+	char magic[sizeof(kTraceMagic)];
+	uint32_t version;
+	if (!Read(magic, sizeof(magic)) || memcmp(magic, kTraceMagic, sizeof(magic))
+		|| !Read(&version, sizeof(version)) || version != kTraceVersion
+	) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void MessageTrace::Flush()
+{
+	if (mFile && mWriting) {
+		fflush(mFile);
+	}
+}
+
+void MessageTrace::WriteTrackInfo(const ITTrackInfo *trackInfo)
+{
+	uint8_t present = (trackInfo != NULL);
+	Write(&present, sizeof(present));
+	if (trackInfo) {
+		uint16_t length = trackInfo->fileName[0];
+		if (length > 255) {
+			length = 255;
+		}
+		Write(&trackInfo->validFields, sizeof(trackInfo->validFields));
+		Write(&trackInfo->sampleRateFloat, sizeof(trackInfo->sampleRateFloat));
+		Write(&trackInfo->sizeInBytes, sizeof(trackInfo->sizeInBytes));
+		Write(&trackInfo->totalTimeInMS, sizeof(trackInfo->totalTimeInMS));
+		Write(&length, sizeof(length));
+		Write(&trackInfo->fileName[1], length * sizeof(trackInfo->fileName[0]));
+	}
+}
+
+bool MessageTrace::ReadTrackInfo()
+{
+	uint8_t present;
+	uint16_t length;
+	memset(&mTrackInfo, 0, sizeof(mTrackInfo));
+	if (!Read(&present, sizeof(present))) {
+		return false;
+	}
+	if (!present) {
+		return true;
+	}
+	if (!Read(&mTrackInfo.validFields, sizeof(mTrackInfo.validFields))
+		|| !Read(&mTrackInfo.sampleRateFloat, sizeof(mTrackInfo.sampleRateFloat))
+		|| !Read(&mTrackInfo.sizeInBytes, sizeof(mTrackInfo.sizeInBytes))
+		|| !Read(&mTrackInfo.totalTimeInMS, sizeof(mTrackInfo.totalTimeInMS))
+		|| !Read(&length, sizeof(length)) || length > 255
+		|| (length && !Read(&mTrackInfo.fileName[1], length * sizeof(mTrackInfo.fileName[0])))
+	) {
+		return false;
+	}
+	mTrackInfo.fileName[0] = length;
+	return true;
+}
+
+void MessageTrace::Append(OSType message, const VisualPluginMessageInfo *messageInfo, double t)
+{
+	if (!mFile || !mWriting) {
+		return;
+	}
+	if (mStart < 0) {
+		mStart = t;
+	}
+	double time = t - mStart;
+	Write(&time, sizeof(time));
+	Write(&message, sizeof(message));
+	switch (message) {
+		case kVisualPluginPlayMessage: {
+			const AudioStreamBasicDescription &format = messageInfo->u.playMessage.audioFormat;
+			WriteTrackInfo(messageInfo->u.playMessage.trackInfo);
+			Write(&format.mSampleRate, sizeof(format.mSampleRate));
+			Write(&format.mFormatFlags, sizeof(format.mFormatFlags));
+			Write(&format.mBitsPerChannel, sizeof(format.mBitsPerChannel));
+			Write(&format.mChannelsPerFrame, sizeof(format.mChannelsPerFrame));
+			break;
+		}
+		case kVisualPluginChangeTrackMessage:
+			WriteTrackInfo(messageInfo->u.changeTrackMessage.trackInfo);
+			break;
+		case kVisualPluginPulseMessage: {
+			const VisualPluginPulseMessage &pulse = messageInfo->u.pulseMessage;
+			const RenderVisualData *rd = pulse.renderData;
+			uint8_t channels = rd ? rd->numWaveformChannels : 0xff;
+			if (channels != 0xff && channels > kVisualMaxDataChannels) {
+				channels = kVisualMaxDataChannels;
+			}
+			Write(&pulse.timeStampID, sizeof(pulse.timeStampID));
+			Write(&pulse.currentPositionInMS, sizeof(pulse.currentPositionInMS));
+			Write(&channels, sizeof(channels));
+			if (rd && channels) {
+				const uint8_t *blocks[kVisualMaxDataChannels] = { rd->waveformData[0], rd->waveformData[1] };
+				WaveformLevel loudest = { 0, 0 };
+				for (unsigned c = 0 ; c < channels ; ++c) {
+					WaveformLevel level;
+					MeasureWaveform(blocks[c], kVisualNumWaveformEntries, level);
+					if (level.sumAbs > loudest.sumAbs) {
+						loudest.sumAbs = level.sumAbs;
+					}
+					if (level.peak > loudest.peak) {
+						loudest.peak = level.peak;
+					}
+				}
+				ZeroRuns runs;
+				FindZeroRuns(blocks, channels, kVisualNumWaveformEntries, runs);
+				uint8_t peak = (uint8_t) (loudest.peak > 255 ? 255 : loudest.peak);
+				uint16_t leading = (uint16_t) runs.leading, trailing = (uint16_t) runs.trailing;
+				Write(&peak, sizeof(peak));
+				Write(&loudest.sumAbs, sizeof(loudest.sumAbs));
+				Write(&leading, sizeof(leading));
+				Write(&trailing, sizeof(trailing));
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	mCount += 1;
+}
+
+// a waveform block with the given level whose first leading and last trailing samples are digital silence
+static void SynthesiseWaveform(uint8_t *block, size_t count, unsigned peak, uint32_t sumAbs,
+							   size_t leading, size_t trailing)
+{
+	memset(block, 128, count);
+	if (leading + trailing >= count || peak == 0) {
+		return;
+	}
+	size_t middle = count - leading - trailing;
+	uint8_t *p = block + leading;
+	p[0] = (uint8_t) (128 + peak);
+	if (middle > 1) {
+		uint32_t rest = (sumAbs > peak) ? sumAbs - peak : 0;
+		uint32_t each = rest / (uint32_t) (middle - 1), extra = rest % (uint32_t) (middle - 1);
+		for (size_t i = 1 ; i < middle ; ++i) {
+			unsigned d = each + (i <= extra ? 1 : 0);
+			if (d > peak) {
+				d = peak;
+			}
+			p[i] = (uint8_t) ((i & 1) ? 128 - d : 128 + d);
+		}
+	}
+}
+
+bool MessageTrace::Next(OSType &message, VisualPluginMessageInfo &messageInfo, double &t)
+{
+	if (!mFile || mWriting) {
+		return false;
+	}
+	memset(&messageInfo, 0, sizeof(messageInfo));
+	if (!Read(&t, sizeof(t)) || !Read(&message, sizeof(message))) {
+		return false;
+	}
+	switch (message) {
+		case kVisualPluginPlayMessage: {
+			AudioStreamBasicDescription &format = messageInfo.u.playMessage.audioFormat;
+			if (!ReadTrackInfo()
+				|| !Read(&format.mSampleRate, sizeof(format.mSampleRate))
+				|| !Read(&format.mFormatFlags, sizeof(format.mFormatFlags))
+				|| !Read(&format.mBitsPerChannel, sizeof(format.mBitsPerChannel))
+				|| !Read(&format.mChannelsPerFrame, sizeof(format.mChannelsPerFrame))
+			) {
+				return false;
+			}
+			format.mFormatID = kAudioFormatLinearPCM;
+			messageInfo.u.playMessage.trackInfo = &mTrackInfo;
+			messageInfo.u.playMessage.streamInfo = &mStreamInfo;
+			break;
+		}
+		case kVisualPluginChangeTrackMessage:
+			if (!ReadTrackInfo()) {
+				return false;
+			}
+			messageInfo.u.changeTrackMessage.trackInfo = &mTrackInfo;
+			messageInfo.u.changeTrackMessage.streamInfo = &mStreamInfo;
+			break;
+		case kVisualPluginPulseMessage: {
+			VisualPluginPulseMessage &pulse = messageInfo.u.pulseMessage;
+			uint8_t channels;
+			if (!Read(&pulse.timeStampID, sizeof(pulse.timeStampID))
+				|| !Read(&pulse.currentPositionInMS, sizeof(pulse.currentPositionInMS))
+				|| !Read(&channels, sizeof(channels)) || (channels != 0xff && channels > kVisualMaxDataChannels)
+			) {
+				return false;
+			}
+			if (channels == 0xff) {
+				break;
+			}
+			memset(&mRenderData, 0, sizeof(mRenderData));
+			mRenderData.numWaveformChannels = channels;
+			if (channels) {
+				uint8_t peak;
+				uint32_t sumAbs;
+				uint16_t leading, trailing;
+				if (!Read(&peak, sizeof(peak)) || !Read(&sumAbs, sizeof(sumAbs))
+					|| !Read(&leading, sizeof(leading)) || !Read(&trailing, sizeof(trailing))
+				) {
+					return false;
+				}
+				for (unsigned c = 0 ; c < channels ; ++c) {
+					SynthesiseWaveform(mRenderData.waveformData[c], kVisualNumWaveformEntries, peak, sumAbs,
+									   leading, trailing);
+				}
+			}
+			pulse.renderData = &mRenderData;
+			break;
+		}
+		default:
+			break;
+	}
+	mCount += 1;
+	return true;
+}
@@ -0,0 +1,65 @@
+/*=============================================================================
+	MessageTrace.h
+
+	Records the messages iTunes sends to VisualPluginHandler into a compact
+	binary trace, and reads them back, so that a sequence that upset a
+	device (a relock storm, say) can be replayed against the simulated HAL
+	(tools/BPPluginHost -p). A record holds the message, its time since the
+	trace began and what the plugin uses of it: the ITTrackInfo fields of
+	Play and ChangeTrack (name, size, duration, sample rate), the audio
+	format of Play, and for a pulse the level and the edge runs of digital
+	silence of its waveform block instead of the samples. The replayed
+	waveform is synthesised from those, so that the quiet block and dropout
+	logic see what they saw when the trace was recorded. The spectrum is
+	not kept.
+
+	The file starts with "BPMT" and a version; the fields are stored in
+	the host's byte order.
+=============================================================================*/
+
+#ifndef __MessageTrace_h__
+#define __MessageTrace_h__
+
+#include "iTunesVisualAPI.h"
+
+#include <stdio.h>
+
+class MessageTrace {
+public:
+	MessageTrace();
+	~MessageTrace();
+
+	// start a new trace, replacing the file
+	bool Create(const char *path);
+	void Append(OSType message, const VisualPluginMessageInfo *messageInfo, double t);
+	void Flush();
+
+	bool Open(const char *path);
+	// the next message, with the time since the trace began. The pointers in messageInfo
+	// refer to storage of the trace that is reused by the next call.
+	bool Next(OSType &message, VisualPluginMessageInfo &messageInfo, double &t);
+
+	void Close();
+
+	unsigned long Count() const
+	{
+		return mCount;
+	}
+
+protected:
+	bool Write(const void *data, size_t size);
+	bool Read(void *data, size_t size);
+	void WriteTrackInfo(const ITTrackInfo *trackInfo);
+	bool ReadTrackInfo();
+
+	FILE *mFile;
+	bool mWriting;
+	double mStart;
+	unsigned long mCount;
+	// the storage behind the messages Next returns
+	ITTrackInfo mTrackInfo;
+	ITStreamInfo mStreamInfo;
+	RenderVisualData mRenderData;
+};
+
+#endif // __MessageTrace_h__
@@ -0,0 +1,363 @@
+/*=============================================================================
+	RateIndex.cpp
+
+=============================================================================*/
+
+#include "RateIndex.h"
+#include "AudioHeader.h"
+#include "WorkStealingPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+// file layout: a header followed by the records sorted by key, in host byte order
+struct RateIndexHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;
+};
+static const char kMagic[4] = { 'B', 'P', 'R', 'I' };
+static const uint32_t kVersion = 1;
+
+// 64 bit FNV-1a, folding ASCII to lower case since the usual file systems on OS X ignore case
+static uint64_t Hash(uint64_t h, const char *s)
+{
+	for ( ; *s ; ++s) {
+		unsigned char c = (unsigned char) *s;
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+		h = (h ^ c) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t Mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 33);
+}
+
+uint64_t RateIndex::PathKey(const char *path)
+{
+	return Mix(Hash(0xcbf29ce484222325ULL ^ 'P', path));
+}
+
+uint64_t RateIndex::NameKey(const char *name, uint64_t size)
+{
+	return Mix(Hash(0xcbf29ce484222325ULL ^ 'N', name) ^ (size * 0x9e3779b97f4a7c15ULL));
+}
+
+RateIndex::RateIndex()
+	: mEntries(NULL)
+	, mCount(0)
+	, mMap(NULL)
+	, mMapSize(0)
+{
+}
+
+RateIndex::~RateIndex()
+{
+	Unmap();
+}
+
+void RateIndex::Unmap()
+{
+	if (mMap) {
+		munmap(mMap, mMapSize);
+		mMap = NULL;
+		mMapSize = 0;
+	}
+	mEntries = NULL;
+	mCount = 0;
+}
+
+static bool EntryLess(const RateIndex::Entry &a, const RateIndex::Entry &b)
+{
+	return a.key < b.key;
+}
+
+// the state shared by the tasks of a scan
+struct RateScan {
+	WorkStealingPool *pool;
+	// one result list per worker, so the tasks don't contend for a lock
+	std::vector<std::vector<RateIndex::Entry> > results;
+	std::atomic<unsigned long> directories, files, scanned, failed;
+	std::atomic<uint64_t> bytes;
+
+	void ScanFile(const std::string &path, const char *name);
+	void ScanDirectory(const std::string &path);
+};
+
+void RateScan::ScanFile(const std::string &path, const char *name)
+{
+	AudioHeaderInfo info;
+	files += 1;
+	if (!ReadAudioHeader(path.c_str(), info)) {
+		failed += 1;
+		return;
+	}
+	scanned += 1;
+	bytes += info.fileSize;
+	RateIndex::Entry entry;
+	entry.sampleRate = (uint32_t)(info.sampleRate + 0.5);
+	entry.bitsPerChannel = (uint8_t) std::min<uint32_t>(info.bitsPerChannel, 255);
+	entry.channels = (uint8_t) std::min<uint32_t>(info.channels, 255);
+	entry.flags = 0;
+	std::vector<RateIndex::Entry> &list = results[WorkStealingPool::CurrentWorker()];
+	entry.key = RateIndex::PathKey(path.c_str());
+	list.push_back(entry);
+	entry.key = RateIndex::NameKey(name, info.fileSize);
+	list.push_back(entry);
+}
+
+void RateScan::ScanDirectory(const std::string &path)
+{
+	DIR *dir = opendir(path.c_str());
+	if (!dir) {
+		return;
+	}
+	directories += 1;
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		// skip ., .. and hidden files, which includes the AppleDouble ._ files on foreign volumes
+		if (e->d_name[0] == '.') {
+			continue;
+		}
+		std::string child = path + "/" + e->d_name;
+		bool isDir = false, isFile = false;
+#ifdef DT_DIR
+		if (e->d_type == DT_DIR) {
+			isDir = true;
+		} else if (e->d_type == DT_REG) {
+			isFile = true;
+		} else if (e->d_type == DT_UNKNOWN)
+#endif
+		{
+			struct stat st;
+			if (stat(child.c_str(), &st) == 0) {
+				isDir = S_ISDIR(st.st_mode);
+				isFile = S_ISREG(st.st_mode);
+			}
+		}
+		if (isDir) {
+			pool->Submit([this, child]() {
+				ScanDirectory(child);
+			});
+		} else if (isFile && IsAudioFileName(e->d_name)) {
+			// one task per file keeps enough requests in flight to saturate the disk
+			std::string name = e->d_name;
+			pool->Submit([this, child, name]() {
+				ScanFile(child, name.c_str());
+			});
+		}
+	}
+	closedir(dir);
+}
+
+bool RateIndex::Build(const std::vector<std::string> &folders, unsigned threads, ScanStats *stats)
+{
+	if (threads == 0) {
+		threads = 2 * std::max(1U, std::thread::hardware_concurrency());
+	}
+	double start = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	WorkStealingPool pool(threads);
+	RateScan scan;
+	scan.pool = &pool;
+	scan.results.resize(pool.Threads());
+	scan.directories = scan.files = scan.scanned = scan.failed = 0;
+	scan.bytes = 0;
+	for (size_t i = 0 ; i < folders.size() ; ++i) {
+		std::string folder = folders[i];
+		while (folder.size() > 1 && folder[folder.size() - 1] == '/') {
+			folder.erase(folder.size() - 1);
+		}
+		pool.Submit([&scan, folder]() {
+			scan.ScanDirectory(folder);
+		});
+	}
+	pool.Wait();
+
+	std::vector<Entry> all;
+	for (size_t i = 0 ; i < scan.results.size() ; ++i) {
+		all.insert(all.end(), scan.results[i].begin(), scan.results[i].end());
+	}
+	std::sort(all.begin(), all.end(), EntryLess);
+	// collapse duplicate keys: the same name and size in different folders is likely the same
+	// track, but if the formats differ we can't tell which one iTunes is playing.
+	size_t n = 0;
+	for (size_t i = 0 ; i < all.size() ; ++i) {
+		if (n > 0 && all[n - 1].key == all[i].key) {
+			Entry &e = all[n - 1];
+			if (e.sampleRate != all[i].sampleRate || e.bitsPerChannel != all[i].bitsPerChannel) {
+				e.flags |= kConflict;
+			}
+		} else {
+			all[n++] = all[i];
+		}
+	}
+	all.resize(n);
+
+	Unmap();
+	mBuilt.swap(all);
+	mEntries = mBuilt.empty() ? NULL : &mBuilt[0];
+	mCount = mBuilt.size();
+	if (stats) {
+		stats->directories = scan.directories;
+		stats->files = scan.files;
+		stats->scanned = scan.scanned;
+		stats->failed = scan.failed;
+		stats->bytes = scan.bytes;
+		stats->steals = pool.Steals();
+		stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+	}
+	return true;
+}
+
+static void MakeParentDirectories(const std::string &path)
+{
+	for (size_t slash = path.find('/', 1) ; slash != std::string::npos ; slash = path.find('/', slash + 1)) {
+		mkdir(path.substr(0, slash).c_str(), 0755);
+	}
+}
+
+bool RateIndex::Write(const char *path)
+{
+	std::string tmp = std::string(path) + ".tmp";
+	MakeParentDirectories(path);
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp) {
+		return false;
+	}
+	RateIndexHeader header;
+	memcpy(header.magic, kMagic, sizeof(kMagic));
+	header.version = kVersion;
+	header.count = mCount;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& (mCount == 0 || fwrite(mEntries, sizeof(Entry), mCount, fp) == mCount);
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) {
+		ok = rename(tmp.c_str(), path) == 0;
+	}
+	if (!ok) {
+		unlink(tmp.c_str());
+	}
+	return ok;
+}
+
+bool RateIndex::Load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(RateIndexHeader)) {
+		map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	const RateIndexHeader *header = (const RateIndexHeader *) map;
+	if (memcmp(header->magic, kMagic, sizeof(kMagic)) || header->version != kVersion
+			|| sizeof(RateIndexHeader) + header->count * sizeof(Entry) != (uint64_t) st.st_size) {
+		munmap(map, (size_t) st.st_size);
+		return false;
+	}
+	Unmap();
+	mBuilt.clear();
+	mMap = map;
+	mMapSize = (size_t) st.st_size;
+	mEntries = (const Entry *)((const char *) map + sizeof(RateIndexHeader));
+	mCount = (size_t) header->count;
+	return true;
+}
+
+std::string RateIndex::DefaultPath()
+{
+	const char *home = getenv("HOME");
+	return std::string(home ? home : "/tmp") + "/Library/Caches/iTunesBPSampleRate/RateIndex";
+}
+
+bool RateIndex::Find(uint64_t key, Entry &entry)
+{
+	if (!mEntries) {
+		return false;
+	}
+	Entry probe;
+	probe.key = key;
+	const Entry *e = std::lower_bound(mEntries, mEntries + mCount, probe, EntryLess);
+	if (e == mEntries + mCount || e->key != key || (e->flags & kConflict)) {
+		return false;
+	}
+	entry = *e;
+	return true;
+}
+
+bool RateIndex::LookupPath(const char *path, Entry &entry)
+{
+	return Find(PathKey(path), entry);
+}
+
+bool RateIndex::LookupName(const char *name, uint64_t size, Entry &entry)
+{
+	return Find(NameKey(name, size), entry);
+}
+
+bool RateIndex::LookupTrack(const uint16_t *fileName, uint64_t size, Entry &entry)
+{
+	// convert to UTF-8. Note that names are not normalised: OS X stores them decomposed
+	// and iTunes may not, so names with accented characters can fail to match.
+	char name[4 * 256 + 1];
+	size_t n = 0;
+	for (unsigned i = 1 ; i <= fileName[0] && i < 256 ; ++i) {
+		uint32_t c = fileName[i];
+		if (c >= 0xD800 && c < 0xDC00 && i < fileName[0] && fileName[i + 1] >= 0xDC00 && fileName[i + 1] < 0xE000) {
+			c = 0x10000 + ((c - 0xD800) << 10) + (fileName[++i] - 0xDC00);
+		}
+		if (c < 0x80) {
+			name[n++] = (char) c;
+		} else if (c < 0x800) {
+			name[n++] = (char)(0xC0 | (c >> 6));
+			name[n++] = (char)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			name[n++] = (char)(0xE0 | (c >> 12));
+			name[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			name[n++] = (char)(0x80 | (c & 0x3F));
+		} else {
+			name[n++] = (char)(0xF0 | (c >> 18));
+			name[n++] = (char)(0x80 | ((c >> 12) & 0x3F));
+			name[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			name[n++] = (char)(0x80 | (c & 0x3F));
+		}
+	}
+	name[n] = '\0';
+	if (n == 0) {
+		return false;
+	}
+	const char *base = strrchr(name, '/');
+	if (base) {
+		if (LookupPath(name, entry)) {
+			return true;
+		}
+		++base;
+	} else {
+		base = name;
+	}
+	return LookupName(base, size, entry);
+}
@@ -0,0 +1,83 @@
+/*=============================================================================
+	RateIndex.h
+
+	An index of the true sample rate and bit depth of the files in a music
+	library, for the tracks where iTunes doesn't report the rate or reports
+	it wrong (the 16.16 fixed point field of MP4 files can't hold rates
+	above 65535Hz, for instance).
+	The index is built by scanning folders in parallel on a work-stealing
+	pool, and stored as a compact array of fixed size records sorted by a
+	64 bit key, so that a lookup is a binary search in the memory-mapped
+	file. Every file is entered twice: under the hash of its full path, and
+	under the hash of its name combined with its size, because iTunes only
+	tells us the latter.
+=============================================================================*/
+
+#ifndef __RateIndex_h__
+#define __RateIndex_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+
+class RateIndex {
+public:
+	struct Entry {
+		uint64_t key;
+		uint32_t sampleRate;
+		uint8_t bitsPerChannel;
+		uint8_t channels;
+		// kConflict if different files with the same key had different formats
+		uint16_t flags;
+	};
+	enum { kConflict = 1 };
+
+	struct ScanStats {
+		unsigned long directories, files, scanned, failed;
+		uint64_t bytes;
+		double seconds;
+		unsigned long steals;
+	};
+
+	RateIndex();
+	~RateIndex();
+
+	// scan the given folders recursively with the given number of threads (0 = 2 per CPU,
+	// since the work is I/O bound) and replace the index in memory with the result.
+	bool Build(const std::vector<std::string> &folders, unsigned threads, ScanStats *stats = NULL);
+	// write the index to a file, atomically replacing any previous version
+	bool Write(const char *path);
+	// map an index file written by Write()
+	bool Load(const char *path);
+	// the default location: ~/Library/Caches/iTunesBPSampleRate/RateIndex
+	static std::string DefaultPath();
+
+	size_t Count()
+	{
+		return mCount;
+	}
+
+	// O(log n) lookups by full path, and by file name and size
+	bool LookupPath(const char *path, Entry &entry);
+	bool LookupName(const char *name, uint64_t size, Entry &entry);
+	// look up a track as iTunes describes it: fileName is an ITUniStr255 (UTF-16 with a
+	// leading length) holding either a file name or a full path.
+	bool LookupTrack(const uint16_t *fileName, uint64_t size, Entry &entry);
+
+	static uint64_t PathKey(const char *path);
+	static uint64_t NameKey(const char *name, uint64_t size);
+
+protected:
+	bool Find(uint64_t key, Entry &entry);
+	void Unmap();
+
+	// either the records built in memory, or the mapped file
+	std::vector<Entry> mBuilt;
+	const Entry *mEntries;
+	size_t mCount;
+	void *mMap;
+	size_t mMapSize;
+};
+
+#endif // __RateIndex_h__
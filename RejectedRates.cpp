@@ -0,0 +1,130 @@
+/*=============================================================================
+	RejectedRates.cpp
+
+=============================================================================*/
+
+#include "RejectedRates.h"
+#include "AudioDevice.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+RejectedRates::RejectedRates(const char *path, double maxAge)
+	: mPath(path ? std::string(path) : DefaultPath())
+	, mMaxAge(maxAge)
+	, mDirty(false)
+{
+	Load();
+}
+
+RejectedRates::~RejectedRates()
+{
+	Save();
+}
+
+std::string RejectedRates::DefaultPath()
+{
+	const char *home = getenv("HOME");
+	return std::string(home ? home : "/tmp") + "/Library/Caches/iTunesBPSampleRate/RejectedRates";
+}
+
+void RejectedRates::Load()
+{
+	FILE *fp = fopen(mPath.c_str(), "r");
+	if (!fp) {
+		return;
+	}
+	double now = (double) time(NULL);
+	double rate, when;
+	int status;
+	char uid[512];
+	// rate, status, time, and the UID, which may contain spaces, up to the end of the line
+	while (fscanf(fp, "%lf %d %lf %511[^\n]", &rate, &status, &when, uid) == 4) {
+		if (now - when > mMaxAge) {
+			// expired: the file gets rewritten without it
+			mDirty = true;
+			continue;
+		}
+		Rejection r = { status, when };
+		mRejections[std::make_pair(std::string(uid), rate)] = r;
+	}
+	fclose(fp);
+}
+
+size_t RejectedRates::RatesFor(const char *uid, double *rates, size_t maxRates) const
+{
+	std::lock_guard<std::recursive_mutex> lock(mLock);
+	size_t n = 0;
+	// a scan of the (short) record rather than a lookup, which would need a std::string of the UID
+	for (RejectionMap::const_iterator it = mRejections.begin() ; it != mRejections.end() ; ++it) {
+		if (it->first.first == uid) {
+			if (n < maxRates) {
+				rates[n] = it->first.second;
+			}
+			n += 1;
+		}
+	}
+	return n;
+}
+
+void RejectedRates::Reject(const char *uid, double rate, int32_t status)
+{
+	std::lock_guard<std::recursive_mutex> lock(mLock);
+	Rejection r = { status, (double) time(NULL) };
+	mRejections[std::make_pair(std::string(uid), rate)] = r;
+	mDirty = true;
+	// rejections are rare, and the point is to remember them even if iTunes doesn't quit cleanly
+	Save();
+}
+
+void RejectedRates::Forget(const char *uid, double rate)
+{
+	std::lock_guard<std::recursive_mutex> lock(mLock);
+	if (mRejections.erase(std::make_pair(std::string(uid), rate))) {
+		mDirty = true;
+		Save();
+	}
+}
+
+bool RejectedRates::Save()
+{
+	std::lock_guard<std::recursive_mutex> lock(mLock);
+	if (!mDirty) {
+		return true;
+	}
+	for (size_t slash = mPath.find('/', 1) ; slash != std::string::npos ; slash = mPath.find('/', slash + 1)) {
+		mkdir(mPath.substr(0, slash).c_str(), 0755);
+	}
+	std::string tmp = mPath + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) {
+		return false;
+	}
+	for (RejectionMap::const_iterator it = mRejections.begin() ; it != mRejections.end() ; ++it) {
+		fprintf(fp, "%.17g %d %.0f %s\n", it->first.second, (int) it->second.status, it->second.when,
+				it->first.first.c_str());
+	}
+	bool ok = (fclose(fp) == 0) && rename(tmp.c_str(), mPath.c_str()) == 0;
+	if (ok) {
+		mDirty = false;
+	} else {
+		unlink(tmp.c_str());
+	}
+	return ok;
+}
+
+void RejectedRates::Log() const
+{
+	std::lock_guard<std::recursive_mutex> lock(mLock);
+	for (RejectionMap::const_iterator it = mRejections.begin() ; it != mRejections.end() ; ++it) {
+		if (it->second.status == kIgnored) {
+			ADLog("Device %s ignores requests for %gHz", it->first.first.c_str(), it->first.second);
+		} else {
+			ADLog("Device %s refuses %gHz (%d)", it->first.first.c_str(), it->first.second, (int) it->second.status);
+		}
+	}
+}
@@ -0,0 +1,70 @@
+/*=============================================================================
+	RejectedRates.h
+
+	A persistent record of the nominal rates that devices would not take:
+	rates they advertise but refused when asked, and rates they accepted
+	without actually changing to them. AudioDevice consults it when it
+	chooses the rate for the content, so that a device is asked for such a
+	rate only once and the next-best rate is used from then on without
+	the cost of the failed call. Entries are keyed by the device's UID and
+	expire after a while, so that a firmware or driver update gets a new
+	chance. The record is kept in memory and written to a text file in the
+	plugin's cache folder when it changes. Devices may be released on
+	another thread (see DeviceReaper.h), so the record has a lock.
+=============================================================================*/
+
+#ifndef __RejectedRates_h__
+#define __RejectedRates_h__
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+class RejectedRates {
+public:
+	// the status recorded for a rate the device accepted but didn't switch to
+	enum { kIgnored = 0 };
+
+	struct Rejection {
+		// the error the set call returned, or kIgnored
+		int32_t status;
+		// when the rate was rejected last, in seconds since the epoch
+		double when;
+	};
+
+	// entries older than maxAge seconds are dropped when the record is loaded
+	RejectedRates(const char *path = NULL, double maxAge = 30 * 86400.0);
+	~RejectedRates();
+
+	// the rates the device rejected; returns their number, of which at most maxRates are stored
+	size_t RatesFor(const char *uid, double *rates, size_t maxRates) const;
+	void Reject(const char *uid, double rate, int32_t status);
+	// the rate was set successfully after all
+	void Forget(const char *uid, double rate);
+	// write the record if it has changed
+	bool Save();
+
+	size_t Count() const
+	{
+		std::lock_guard<std::recursive_mutex> lock(mLock);
+		return mRejections.size();
+	}
+	void Log() const;
+	// ~/Library/Caches/iTunesBPSampleRate/RejectedRates
+	static std::string DefaultPath();
+
+protected:
+	typedef std::map<std::pair<std::string, double>, Rejection> RejectionMap;
+
+	void Load();
+
+	std::string mPath;
+	double mMaxAge;
+	RejectionMap mRejections;
+	bool mDirty;
+	mutable std::recursive_mutex mLock;
+};
+
+#endif // __RejectedRates_h__
@@ -0,0 +1,378 @@
+/*=============================================================================
+	Resampler.cpp
+
+=============================================================================*/
+
+#include "Resampler.h"
+
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define RESAMPLER_X86_SIMD 1
+#	include <immintrin.h>
+#endif
+
+// input frames converted per pass through the history buffer
+static const size_t kBlockFrames = 4096;
+// the largest decimation factor M/L we accept
+static const unsigned kMaxDecimation = 16;
+
+// ---- inner products ----
+
+// all implementations require n to be a multiple of 8; the filter banks are padded accordingly.
+typedef float (*DotFunc)(const float *a, const float *b, unsigned n);
+
+static float DotScalar(const float *a, const float *b, unsigned n)
+{
+	// 4 independent accumulators so the compiler can keep the FPU pipelines busy
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	for (unsigned i = 0 ; i < n ; i += 4) {
+		s0 += a[i] * b[i];
+		s1 += a[i + 1] * b[i + 1];
+		s2 += a[i + 2] * b[i + 2];
+		s3 += a[i + 3] * b[i + 3];
+	}
+	return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef RESAMPLER_X86_SIMD
+
+__attribute__((target("sse2")))
+static float DotSSE2(const float *a, const float *b, unsigned n)
+{
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	for (unsigned i = 0 ; i < n ; i += 8) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	s0 = _mm_add_ps(s0, s1);
+	s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+	s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+	return _mm_cvtss_f32(s0);
+}
+
+__attribute__((target("avx2,fma")))
+static float DotAVX2(const float *a, const float *b, unsigned n)
+{
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	unsigned i = 0;
+	for ( ; i + 16 <= n ; i += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+	}
+	if (i < n) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+	}
+	s0 = _mm256_add_ps(s0, s1);
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+#endif // RESAMPLER_X86_SIMD
+
+static bool KernelSupported(Resampler::Kernel kernel)
+{
+	switch (kernel) {
+		case Resampler::kKernelScalar:
+			return true;
+#ifdef RESAMPLER_X86_SIMD
+		case Resampler::kKernelSSE2:
+			return __builtin_cpu_supports("sse2");
+		case Resampler::kKernelAVX2:
+			return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+		default:
+			return false;
+	}
+}
+
+static DotFunc KernelFunction(Resampler::Kernel kernel)
+{
+	switch (kernel) {
+#ifdef RESAMPLER_X86_SIMD
+		case Resampler::kKernelSSE2:
+			return DotSSE2;
+		case Resampler::kKernelAVX2:
+			return DotAVX2;
+#endif
+		default:
+			return DotScalar;
+	}
+}
+
+static Resampler::Kernel BestKernel()
+{
+	if (KernelSupported(Resampler::kKernelAVX2)) {
+		return Resampler::kKernelAVX2;
+	} else if (KernelSupported(Resampler::kKernelSSE2)) {
+		return Resampler::kKernelSSE2;
+	}
+	return Resampler::kKernelScalar;
+}
+
+static std::atomic<int> sKernel(-1);
+
+static DotFunc Dot()
+{
+	int kernel = sKernel.load(std::memory_order_relaxed);
+	if (kernel < 0) {
+		kernel = BestKernel();
+		sKernel.store(kernel, std::memory_order_relaxed);
+	}
+	return KernelFunction((Resampler::Kernel) kernel);
+}
+
+Resampler::Kernel Resampler::ActiveKernel()
+{
+	int kernel = sKernel.load(std::memory_order_relaxed);
+	return (kernel < 0) ? BestKernel() : (Kernel) kernel;
+}
+
+bool Resampler::SelectKernel(Kernel kernel)
+{
+	if (kernel == kKernelBest) {
+		kernel = BestKernel();
+	}
+	if (!KernelSupported(kernel)) {
+		return false;
+	}
+	sKernel.store(kernel, std::memory_order_relaxed);
+	return true;
+}
+
+const char *Resampler::KernelName(Kernel kernel)
+{
+	switch (kernel) {
+		case kKernelScalar:
+			return "scalar";
+		case kKernelSSE2:
+			return "SSE2";
+		case kKernelAVX2:
+			return "AVX2";
+		default:
+			return "best";
+	}
+}
+
+// ---- filter design ----
+
+// zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double BesselI0(double x)
+{
+	double sum = 1, term = 1, q = x * x / 4;
+	for (int k = 1 ; k < 64 && term > sum * 1e-17 ; ++k) {
+		term *= q / ((double) k * k);
+		sum += term;
+	}
+	return sum;
+}
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+bool Resampler::Ratio(double inRate, double outRate, unsigned &L, unsigned &M)
+{
+	if (inRate < 1 || outRate < 1 || inRate != floor(inRate) || outRate != floor(outRate)
+			|| inRate > 4e6 || outRate > 4e6) {
+		return false;
+	}
+	unsigned in = (unsigned) inRate, out = (unsigned) outRate, g = gcd(in, out);
+	L = out / g;
+	M = in / g;
+	return L <= kMaxPhases && M <= L * kMaxDecimation;
+}
+
+bool Resampler::Supports(double inRate, double outRate)
+{
+	unsigned L, M;
+	return Ratio(inRate, outRate, L, M);
+}
+
+/*!
+	Design a Kaiser-windowed sinc prototype for interpolation by L and decimation by M, and
+	split it into its L polyphase components. The cutoff sits halfway the passband edge and
+	the lower of the 2 Nyquist frequencies, which is where the stopband begins.
+ */
+static Resampler::FilterBank *DesignBank(unsigned L, unsigned M, Resampler::Quality quality)
+{
+	double passband, attenuation;
+	if (quality == Resampler::kQualityHigh) {
+		passband = 0.95;
+		attenuation = 100;
+	} else {
+		passband = 0.90;
+		attenuation = 70;
+	}
+	// all frequencies in cycles per input sample
+	double nyquist = 0.5 * std::min(1.0, (double) L / M);
+	double transition = (1 - passband) * nyquist;
+	double cutoff = (1 + passband) * nyquist / 2;
+	double beta = 0.1102 * (attenuation - 8.7);
+	unsigned taps = (unsigned) ceil((attenuation - 8) / (2.285 * 2 * M_PI * transition));
+	taps = (taps + 7) & ~7U;
+
+	Resampler::FilterBank *bank = new Resampler::FilterBank;
+	bank->L = L;
+	bank->M = M;
+	bank->quality = quality;
+	bank->tapsPerPhase = taps;
+	bank->coefficients.assign((size_t) L * taps, 0.0f);
+
+	size_t N = (size_t) L * taps;
+	double centre = (N - 1) / 2.0, i0beta = BesselI0(beta);
+	std::vector<double> sums(L, 0.0);
+	std::vector<double> h(N);
+	for (size_t j = 0 ; j < N ; ++j) {
+		double x = (j - centre) / L;
+		double arg = 2 * cutoff * x;
+		double sinc = (arg == 0) ? 1 : sin(M_PI * arg) / (M_PI * arg);
+		double r = (j - centre) / centre;
+		double w = BesselI0(beta * sqrt(std::max(0.0, 1 - r * r))) / i0beta;
+		h[j] = 2 * cutoff * sinc * w;
+		sums[j % L] += h[j];
+	}
+	// normalise every phase to unity gain at DC, and store the coefficients in reverse order
+	// so that they multiply the input in chronological order.
+	for (unsigned p = 0 ; p < L ; ++p) {
+		float *c = &bank->coefficients[(size_t) p * taps];
+		for (unsigned m = 0 ; m < taps ; ++m) {
+			c[taps - 1 - m] = (float)(h[p + (size_t) m * L] / sums[p]);
+		}
+	}
+	return bank;
+}
+
+std::shared_ptr<const Resampler::FilterBank> Resampler::Bank(unsigned L, unsigned M, Quality quality)
+{
+	static std::mutex lock;
+	static std::map<unsigned long long, std::shared_ptr<const FilterBank> > cache;
+	unsigned long long key = ((unsigned long long) L << 33) | ((unsigned long long) M << 1) | (quality == kQualityHigh);
+	std::lock_guard<std::mutex> guard(lock);
+	std::shared_ptr<const FilterBank> &bank = cache[key];
+	if (!bank) {
+		bank.reset(DesignBank(L, M, quality));
+	}
+	return bank;
+}
+
+// ---- conversion ----
+
+Resampler::Resampler(double inRate, double outRate, unsigned channels, Quality quality)
+	: mChannels(channels)
+	, mHistoryStride(0)
+	, mFill(0)
+	, mPos(0)
+	, mPhase(0)
+{
+	unsigned L, M;
+	if (channels > 0 && Ratio(inRate, outRate, L, M)) {
+		mBank = Bank(L, M, quality);
+		mHistoryStride = mBank->tapsPerPhase - 1 + kBlockFrames;
+		mHistory.resize(mHistoryStride * channels);
+		Reset();
+	}
+}
+
+void Resampler::Reset()
+{
+	if (mBank) {
+		std::fill(mHistory.begin(), mHistory.end(), 0.0f);
+		mFill = mPos = mBank->tapsPerPhase - 1;
+		mPhase = 0;
+	}
+}
+
+size_t Resampler::MaxOutputFrames(size_t inFrames) const
+{
+	return mBank ? (inFrames * mBank->L) / mBank->M + 2 : 0;
+}
+
+double Resampler::Latency() const
+{
+	return mBank ? ((double) mBank->L * mBank->tapsPerPhase - 1) / (2.0 * mBank->M) : 0;
+}
+
+void Resampler::Feed(const float *in, size_t frames)
+{
+	for (unsigned c = 0 ; c < mChannels ; ++c) {
+		float *h = &mHistory[c * mHistoryStride + mFill];
+		const float *s = in + c;
+		for (size_t i = 0 ; i < frames ; ++i, s += mChannels) {
+			h[i] = *s;
+		}
+	}
+	mFill += frames;
+}
+
+size_t Resampler::Drain(float *out)
+{
+	const unsigned L = mBank->L, M = mBank->M, taps = mBank->tapsPerPhase;
+	const float *coefficients = &mBank->coefficients[0];
+	const DotFunc dot = Dot();
+	size_t n = 0;
+	while (mPos < mFill) {
+		const float *c = coefficients + (size_t) mPhase * taps;
+		const float *h = &mHistory[mPos + 1 - taps];
+		for (unsigned ch = 0 ; ch < mChannels ; ++ch, h += mHistoryStride) {
+			*out++ = dot(c, h, taps);
+		}
+		++n;
+		mPhase += M;
+		mPos += mPhase / L;
+		mPhase %= L;
+	}
+	// keep the taps - 1 frames preceding the next output's alignment point
+	size_t start = std::min(mPos + 1 - taps, mFill);
+	if (start > 0) {
+		for (unsigned ch = 0 ; ch < mChannels ; ++ch) {
+			float *h = &mHistory[ch * mHistoryStride];
+			memmove(h, h + start, (mFill - start) * sizeof(float));
+		}
+		mFill -= start;
+		mPos -= start;
+	}
+	return n;
+}
+
+size_t Resampler::Process(const float *in, size_t inFrames, float *out)
+{
+	if (!mBank) {
+		return 0;
+	}
+	size_t written = 0;
+	while (inFrames > 0) {
+		size_t n = std::min(inFrames, mHistoryStride - mFill);
+		Feed(in, n);
+		in += n * mChannels;
+		inFrames -= n;
+		size_t produced = Drain(out);
+		out += produced * mChannels;
+		written += produced;
+	}
+	return written;
+}
+
+size_t Resampler::Flush(float *out)
+{
+	if (!mBank) {
+		return 0;
+	}
+	std::vector<float> silence((size_t) FlushFrames() * mChannels, 0.0f);
+	size_t written = Process(&silence[0], FlushFrames(), out);
+	Reset();
+	return written;
+}
@@ -0,0 +1,114 @@
+/*=============================================================================
+	Resampler.h
+
+	A polyphase sample rate converter for content whose rate the output
+	device cannot run at, e.g. 176.4kHz content on a device that tops out
+	at 96kHz. The conversion ratio is taken as the reduced fraction L/M of
+	the two rates, which covers the integer 2x/4x decimations and the
+	44.1kHz <-> 48kHz family conversions that ClosestNominalSampleRate()
+	can leave us with.
+	The filter banks are designed once per ratio and quality and shared by
+	all converters through a cache. The inner product is computed with
+	AVX2 or SSE2 when the CPU has them, and in plain C++ otherwise.
+	The code depends only on the C++ standard library so that it can be
+	built into an offline conversion tool as well as into any player that
+	embeds the device logic.
+=============================================================================*/
+
+#ifndef __Resampler_h__
+#define __Resampler_h__
+
+#include <stddef.h>
+#include <vector>
+#include <memory>
+
+class Resampler {
+public:
+	enum Quality {
+		// ~70dB stopband, passband up to 90% of the lower Nyquist frequency
+		kQualityMedium = 0,
+		// ~100dB stopband, passband up to 95% of the lower Nyquist frequency
+		kQualityHigh
+	};
+	enum Kernel {
+		kKernelScalar = 0,
+		kKernelSSE2,
+		kKernelAVX2,
+		kKernelBest
+	};
+	// the largest interpolation factor L we accept; 44.1 <-> 48kHz needs 160
+	enum { kMaxPhases = 1024 };
+
+	// a filter bank for a given ratio: L phases of tapsPerPhase coefficients each,
+	// stored reversed so that they can be applied to contiguous input.
+	struct FilterBank {
+		unsigned L, M;
+		Quality quality;
+		unsigned tapsPerPhase;
+		std::vector<float> coefficients;
+	};
+
+	Resampler(double inRate, double outRate, unsigned channels, Quality quality = kQualityHigh);
+
+	// false if the ratio between the rates is not supported
+	bool Valid()
+	{
+		return mBank != NULL;
+	}
+	static bool Supports(double inRate, double outRate);
+
+	// Convert inFrames interleaved frames from in, writing to out which must have
+	// room for at least MaxOutputFrames(inFrames) frames. Returns the number of frames written.
+	size_t Process(const float *in, size_t inFrames, float *out);
+	// push out the samples still held in the filter's history; out must have room
+	// for MaxOutputFrames(FlushFrames()) frames.
+	size_t Flush(float *out);
+	// forget all history
+	void Reset();
+
+	size_t MaxOutputFrames(size_t inFrames) const;
+	size_t FlushFrames() const
+	{
+		return mBank ? mBank->tapsPerPhase : 0;
+	}
+	// the delay introduced by the filter, in output frames
+	double Latency() const;
+	unsigned Channels() const
+	{
+		return mChannels;
+	}
+	unsigned InterpolationFactor() const
+	{
+		return mBank ? mBank->L : 0;
+	}
+	unsigned DecimationFactor() const
+	{
+		return mBank ? mBank->M : 0;
+	}
+
+	// the filter bank for a ratio, designed on first use and cached for the lifetime of the process.
+	static std::shared_ptr<const FilterBank> Bank(unsigned L, unsigned M, Quality quality);
+	// reduce inRate/outRate to L/M; returns false for non-integral rates or if L would exceed kMaxPhases.
+	static bool Ratio(double inRate, double outRate, unsigned &L, unsigned &M);
+
+	// the inner product implementation in use; the best one the CPU supports by default.
+	static Kernel ActiveKernel();
+	// select an implementation, e.g. for benchmarking. Returns false if the CPU doesn't support it.
+	static bool SelectKernel(Kernel kernel);
+	static const char *KernelName(Kernel kernel);
+
+protected:
+	void Feed(const float *in, size_t frames);
+	size_t Drain(float *out);
+
+	std::shared_ptr<const FilterBank> mBank;
+	unsigned mChannels;
+	// per channel history: tapsPerPhase - 1 older frames followed by the new input
+	std::vector<float> mHistory;
+	size_t mHistoryStride, mFill;
+	// index into the history of the input frame the next output frame is aligned on, and its phase
+	size_t mPos;
+	unsigned mPhase;
+};
+
+#endif // __Resampler_h__
@@ -0,0 +1,247 @@
+/*=============================================================================
+	SessionHistory.cpp
+
+=============================================================================*/
+
+#include "SessionHistory.h"
+#include "AudioDevice.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// the number of distinct content rates GetRateMix tells apart
+enum { kMaxMixRates = 32 };
+
+SessionHistory::SessionHistory(size_t capacity)
+	: mCapacity(std::max<size_t>(1, std::min<size_t>(capacity, kNoAlbum)))
+	, mHead(0)
+	, mCount(0)
+	, mOpen(false)
+	, mResumed(0)
+{
+	mArena = calloc(mCapacity, sizeof(Entry) + sizeof(Album));
+	mEntries = static_cast<Entry *>(mArena);
+	mAlbums = reinterpret_cast<Album *>(mEntries + mCapacity);
+	if (!mArena) {
+		mCapacity = 0;
+	}
+}
+
+SessionHistory::~SessionHistory()
+{
+	free(mArena);
+}
+
+uint16_t SessionHistory::InternAlbum(const uint16_t *album)
+{
+	if (!album || album[0] == 0) {
+		return kNoAlbum;
+	}
+	// 64 bit FNV-1a over the UTF-16 code units
+	uint64_t key = 0xcbf29ce484222325ULL;
+	for (unsigned i = 1 ; i <= album[0] && i < 256 ; ++i) {
+		key = (key ^ album[i]) * 0x100000001b3ULL;
+	}
+	size_t slot = mCapacity;
+	for (size_t i = 0 ; i < mCapacity ; ++i) {
+		if (mAlbums[i].refs) {
+			if (mAlbums[i].key == key) {
+				mAlbums[i].refs += 1;
+				return (uint16_t) i;
+			}
+		} else if (slot == mCapacity) {
+			slot = i;
+		}
+	}
+	// there is always a free slot: each record refers to one album at most
+	if (slot == mCapacity) {
+		return kNoAlbum;
+	}
+	mAlbums[slot].key = key;
+	mAlbums[slot].refs = 1;
+	return (uint16_t) slot;
+}
+
+void SessionHistory::ReleaseAlbum(uint16_t album)
+{
+	if (album < mCapacity && mAlbums[album].refs) {
+		mAlbums[album].refs -= 1;
+	}
+}
+
+bool SessionHistory::BeginTrack(uint64_t trackKey, double t, float contentRate, unsigned contentBits,
+								const uint16_t *album)
+{
+	if (!mCapacity) {
+		return false;
+	}
+	if (mCount && mEntries[mHead].trackKey == trackKey) {
+		// the same track again: new information, or playback resumed after a pause
+		Entry &e = mEntries[mHead];
+		e.contentRate = contentRate;
+		e.contentBits = (uint8_t) contentBits;
+		if (!mOpen) {
+			mOpen = true;
+			mResumed = t;
+		}
+		return false;
+	}
+	EndTrack(t);
+	if (mCount) {
+		mHead = (mHead + 1) % mCapacity;
+	}
+	if (mCount == mCapacity) {
+		// the oldest record makes room
+		ReleaseAlbum(mEntries[mHead].album);
+	} else {
+		mCount += 1;
+	}
+	Entry &e = mEntries[mHead];
+	memset(&e, 0, sizeof(e));
+	e.trackKey = trackKey;
+	e.start = mResumed = t;
+	e.contentRate = contentRate;
+	e.contentBits = (uint8_t) contentBits;
+	e.outcome = kNoSwitch;
+	e.album = InternAlbum(album);
+	mOpen = true;
+	return true;
+}
+
+void SessionHistory::NoteSwitch(Outcome outcome, uint32_t device, float deviceRate, double switchSeconds,
+								double holdSeconds)
+{
+	Entry *e = Current();
+	if (!e) {
+		return;
+	}
+	// a pending switch that was carried out or failed replaces its kHeld outcome,
+	// a later request for the same track that found the device at its rate doesn't
+	if (outcome == kUnchanged && e->outcome != kNoSwitch && e->outcome != kHeld) {
+		return;
+	}
+	e->outcome = (uint8_t) outcome;
+	e->device = device;
+	e->deviceRate = deviceRate;
+	e->switchSeconds = (float) switchSeconds;
+	e->holdSeconds = (float) holdSeconds;
+}
+
+void SessionHistory::EndTrack(double t)
+{
+	Entry *e = Current();
+	if (e) {
+		e->played += (float) (t - mResumed);
+		mOpen = false;
+	}
+}
+
+const SessionHistory::Entry *SessionHistory::Recent(size_t i) const
+{
+	if (i >= mCount) {
+		return NULL;
+	}
+	return &mEntries[(mHead + mCapacity - i) % mCapacity];
+}
+
+SessionHistory::Stats SessionHistory::GetStats(double now) const
+{
+	Stats s;
+	memset(&s, 0, sizeof(s));
+	double switchSeconds = 0;
+	for (size_t i = 0 ; i < mCount ; ++i) {
+		const Entry &e = *Recent(i);
+		s.tracks += 1;
+		s.played += e.played;
+		switch (e.outcome) {
+			case kSwitched:
+				s.switches += 1;
+				switchSeconds += e.switchSeconds;
+				s.maxSwitchSeconds = std::max<double>(s.maxSwitchSeconds, e.switchSeconds);
+				break;
+			case kUnchanged:
+				s.unchanged += 1;
+				break;
+			case kHeld:
+				s.held += 1;
+				break;
+			case kFailed:
+				s.failures += 1;
+				break;
+			case kSkipped:
+				s.skipped += 1;
+				break;
+		}
+	}
+	if (mCount && mOpen) {
+		s.played += now - mResumed;
+	}
+	for (size_t i = 0 ; i < mCapacity ; ++i) {
+		if (mAlbums[i].refs) {
+			s.albums += 1;
+		}
+	}
+	if (mCount) {
+		s.span = now - Recent(mCount - 1)->start;
+	}
+	if (s.span > 0) {
+		s.switchesPerHour = s.switches * 3600.0 / s.span;
+	}
+	if (s.switches) {
+		s.meanSwitchSeconds = switchSeconds / s.switches;
+	}
+	return s;
+}
+
+static bool MorePlayed(const SessionHistory::RateShare &a, const SessionHistory::RateShare &b)
+{
+	return (a.tracks != b.tracks) ? a.tracks > b.tracks : a.played > b.played;
+}
+
+size_t SessionHistory::GetRateMix(RateShare *mix, size_t maxRates) const
+{
+	RateShare rates[kMaxMixRates];
+	size_t n = 0;
+	for (size_t i = 0 ; i < mCount ; ++i) {
+		const Entry &e = *Recent(i);
+		size_t j = 0;
+		while (j < n && rates[j].contentRate != e.contentRate) {
+			++j;
+		}
+		if (j == n) {
+			if (n == kMaxMixRates) {
+				continue;
+			}
+			rates[n].contentRate = e.contentRate;
+			rates[n].tracks = 0;
+			rates[n].played = 0;
+			n += 1;
+		}
+		rates[j].tracks += 1;
+		rates[j].played += e.played;
+	}
+	std::sort(rates, rates + n, MorePlayed);
+	if (mix) {
+		std::copy(rates, rates + std::min(n, maxRates), mix);
+	}
+	return n;
+}
+
+void SessionHistory::Log(double now) const
+{
+	Stats s = GetStats(now);
+	if (!s.tracks) {
+		return;
+	}
+	ADLog("Session: %lu tracks from %u albums in %.1fh (%.1fh played); %lu switches (%.1f per hour, mean %.1fms, max %.1fms), "
+		  "%lu at the device's rate already, %lu held, %lu failed, %lu not worth it", s.tracks, s.albums, s.span / 3600,
+		  s.played / 3600, s.switches, s.switchesPerHour, s.meanSwitchSeconds * 1000, s.maxSwitchSeconds * 1000,
+		  s.unchanged, s.held, s.failures, s.skipped);
+	RateShare mix[8];
+	size_t n = std::min<size_t>(GetRateMix(mix, 8), 8);
+	for (size_t i = 0 ; i < n ; ++i) {
+		ADLog("\t%gHz: %lu tracks (%.0f%%), %.1f minutes", mix[i].contentRate, mix[i].tracks,
+			  mix[i].tracks * 100.0 / s.tracks, mix[i].played / 60);
+	}
+}
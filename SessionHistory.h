@@ -0,0 +1,117 @@
+/*=============================================================================
+	SessionHistory.h
+
+	A record of the tracks played in this session and of what the plugin
+	did for each: the content rate, the rate and device it chose, how the
+	switch went and how long it took. The records are kept in a ring of a
+	fixed number of entries, allocated once together with the table of
+	albums they refer to, so that the history's memory stays the same
+	however long iTunes runs; the oldest tracks make room for new ones.
+	Albums are interned: a record holds the index of its album's key (a
+	hash of the name) in a table with as many slots as the ring has
+	entries, and a slot is reused once no record refers to it any more.
+	All calls are made on the thread that delivers the plugin's messages.
+=============================================================================*/
+
+#ifndef __SessionHistory_h__
+#define __SessionHistory_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+class SessionHistory {
+public:
+	enum Outcome {
+		kNoSwitch = 0,		// no rate request for the track (yet)
+		kSwitched,			// the device changed rate
+		kUnchanged,			// the device was already at the chosen rate
+		kHeld,				// the switch waits for a quiet block
+		kFailed,
+		kSkipped			// not worth it for a track this short (see SwitchCosts.h)
+	};
+	enum { kNoAlbum = 0xffff };
+
+	struct Entry {
+		uint64_t trackKey;			// TrackHints::TrackKey of the track
+		double start;				// when it started (steady clock), and how long it played
+		float played;
+		float contentRate;			// the content's rate, after the rate index and hints
+		float deviceRate;			// the device's nominal rate after the switch
+		float switchSeconds;		// the time the switch took
+		float holdSeconds;			// the time the switch was held back for a quiet block
+		uint32_t device;			// the AudioDeviceID of the output device
+		uint16_t album;				// index into the album table, or kNoAlbum
+		uint8_t outcome;
+		uint8_t contentBits;
+	};
+
+	struct Stats {
+		unsigned long tracks, switches, unchanged, held, failures, skipped;
+		unsigned albums;
+		// the time covered by the recorded tracks, from the first start to now
+		double span, played;
+		double switchesPerHour;
+		double meanSwitchSeconds, maxSwitchSeconds;
+	};
+
+	struct RateShare {
+		float contentRate;
+		unsigned long tracks;
+		double played;
+	};
+
+	SessionHistory(size_t capacity = 1024);
+	~SessionHistory();
+
+	// start a record for a track, unless trackKey is the track of the current record
+	// (iTunes resends a track's information when it changes); album is an ITUniStr255
+	// or NULL. Returns false for a track that was already current.
+	bool BeginTrack(uint64_t trackKey, double t, float contentRate, unsigned contentBits, const uint16_t *album);
+	// the outcome of the switch for the current track
+	void NoteSwitch(Outcome outcome, uint32_t device, float deviceRate, double switchSeconds, double holdSeconds = 0);
+	// playback of the current track stopped
+	void EndTrack(double t);
+
+	size_t Count() const
+	{
+		return mCount;
+	}
+	size_t Capacity() const
+	{
+		return mCapacity;
+	}
+	// the i-th most recent record, 0 being the current one
+	const Entry *Recent(size_t i) const;
+
+	Stats GetStats(double now) const;
+	// the content rates of the recorded tracks, most played first; returns the number of rates
+	// found, of which at most maxRates are stored in mix.
+	size_t GetRateMix(RateShare *mix, size_t maxRates) const;
+	void Log(double now) const;
+
+protected:
+	struct Album {
+		uint64_t key;
+		uint32_t refs;
+	};
+
+	uint16_t InternAlbum(const uint16_t *album);
+	void ReleaseAlbum(uint16_t album);
+	Entry *Current()
+	{
+		return (mCount && mOpen) ? &mEntries[mHead] : NULL;
+	}
+
+	size_t mCapacity;
+	// the arena: mCapacity entries followed by mCapacity album slots
+	void *mArena;
+	Entry *mEntries;
+	Album *mAlbums;
+	// the current (most recent) record and the number of records in the ring
+	size_t mHead, mCount;
+	// whether the current record's track is playing, and since when
+	bool mOpen;
+	double mResumed;
+};
+
+#endif // __SessionHistory_h__
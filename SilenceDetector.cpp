@@ -0,0 +1,163 @@
+/*=============================================================================
+	SilenceDetector.cpp
+
+=============================================================================*/
+
+#include "SilenceDetector.h"
+
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#	include <arm_neon.h>
+#endif
+
+static void MeasureScalar(const uint8_t *samples, size_t count, WaveformLevel &level)
+{
+	for (size_t i = 0 ; i < count ; ++i) {
+		unsigned d = (samples[i] >= 128) ? samples[i] - 128 : 128 - samples[i];
+		if (d > level.peak) {
+			level.peak = d;
+		}
+		level.sumAbs += d;
+	}
+}
+
+void MeasureWaveform(const uint8_t *samples, size_t count, WaveformLevel &level)
+{
+	size_t i = 0;
+	level.peak = 0;
+	level.sumAbs = 0;
+#if defined(__SSE2__)
+	const __m128i centre = _mm_set1_epi8((char) 0x80);
+	__m128i peak = _mm_setzero_si128(), sum = _mm_setzero_si128();
+	for ( ; i + 16 <= count ; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+		// |v - 128| as unsigned bytes, and its horizontal sums in two 64 bit lanes
+		__m128i d = _mm_sub_epi8(_mm_max_epu8(v, centre), _mm_min_epu8(v, centre));
+		peak = _mm_max_epu8(peak, d);
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(v, centre));
+	}
+	peak = _mm_max_epu8(peak, _mm_srli_si128(peak, 8));
+	peak = _mm_max_epu8(peak, _mm_srli_si128(peak, 4));
+	peak = _mm_max_epu8(peak, _mm_srli_si128(peak, 2));
+	peak = _mm_max_epu8(peak, _mm_srli_si128(peak, 1));
+	level.peak = (unsigned) _mm_cvtsi128_si32(peak) & 0xff;
+	sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+	level.sumAbs = (uint32_t) _mm_cvtsi128_si32(sum);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t centre = vdupq_n_u8(0x80);
+	uint8x16_t peak = vdupq_n_u8(0);
+	uint32x4_t sum = vdupq_n_u32(0);
+	for ( ; i + 16 <= count ; i += 16) {
+		uint8x16_t d = vabdq_u8(vld1q_u8(samples + i), centre);
+		peak = vmaxq_u8(peak, d);
+		sum = vpadalq_u16(sum, vpaddlq_u8(d));
+	}
+	level.peak = vmaxvq_u8(peak);
+	level.sumAbs = vaddvq_u32(sum);
+#endif
+	if (i < count) {
+		WaveformLevel tail = { 0, 0 };
+		MeasureScalar(samples + i, count - i, tail);
+		if (tail.peak > level.peak) {
+			level.peak = tail.peak;
+		}
+		level.sumAbs += tail.sumAbs;
+	}
+}
+
+bool IsQuietWaveform(const uint8_t *const *channels, unsigned numChannels, size_t count,
+					 unsigned peakThreshold, double meanThreshold, WaveformLevel *loudest)
+{
+	bool quiet = (numChannels > 0 && count > 0);
+	WaveformLevel max = { 0, 0 };
+	for (unsigned c = 0 ; c < numChannels ; ++c) {
+		WaveformLevel level;
+		MeasureWaveform(channels[c], count, level);
+		if (level.peak > max.peak) {
+			max.peak = level.peak;
+		}
+		if (level.sumAbs > max.sumAbs) {
+			max.sumAbs = level.sumAbs;
+		}
+		if (level.peak > peakThreshold || level.sumAbs > meanThreshold * count) {
+			quiet = false;
+		}
+	}
+	if (loudest) {
+		*loudest = max;
+	}
+	return quiet;
+}
+
+// 1 bits for the samples that are exactly at the centre value, 64 samples per word
+static uint64_t ZeroMask64(const uint8_t *samples)
+{
+	uint64_t mask = 0;
+#if defined(__SSE2__)
+	const __m128i centre = _mm_set1_epi8((char) 0x80);
+	for (int i = 0 ; i < 4 ; ++i) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(samples + 16 * i)), centre);
+		mask |= (uint64_t)(uint16_t) _mm_movemask_epi8(eq) << (16 * i);
+	}
+#else
+	for (int i = 0 ; i < 64 ; ++i) {
+		mask |= (uint64_t)(samples[i] == 0x80) << i;
+	}
+#endif
+	return mask;
+}
+
+void FindZeroRuns(const uint8_t *const *channels, unsigned numChannels, size_t count, ZeroRuns &runs)
+{
+	uint64_t masks[kMaxZeroRunSamples / 64];
+	size_t words = count / 64;
+	if (words > kMaxZeroRunSamples / 64) {
+		words = kMaxZeroRunSamples / 64;
+	}
+	for (size_t w = 0 ; w < words ; ++w) {
+		uint64_t m = ~0ULL;
+		for (unsigned c = 0 ; c < numChannels ; ++c) {
+			m &= ZeroMask64(channels[c] + 64 * w);
+		}
+		masks[w] = numChannels ? m : 0;
+	}
+	runs.total = runs.longest = runs.leading = runs.trailing = 0;
+	size_t run = 0;
+	bool leading = true;
+	for (size_t w = 0 ; w < words ; ++w) {
+		uint64_t m = masks[w];
+		if (m == ~0ULL) {
+			run += 64;
+			runs.total += 64;
+			continue;
+		}
+		runs.total += __builtin_popcountll(m);
+		// walk the runs of 1 bits in this word
+		for (int bit = 0 ; bit < 64 ; ) {
+			if (m & (1ULL << bit)) {
+				++run;
+				++bit;
+			} else {
+				if (leading) {
+					runs.leading = run;
+					leading = false;
+				}
+				if (run > runs.longest) {
+					runs.longest = run;
+				}
+				run = 0;
+				// skip to the next silent sample
+				uint64_t rest = m >> bit;
+				bit = rest ? bit + __builtin_ctzll(rest) : 64;
+			}
+		}
+	}
+	if (leading) {
+		runs.leading = run;
+	}
+	runs.trailing = run;
+	if (run > runs.longest) {
+		runs.longest = run;
+	}
+}
@@ -0,0 +1,44 @@
+/*=============================================================================
+	SilenceDetector.h
+
+	Measures the level of the waveform blocks iTunes passes with its pulse
+	messages, so that a rate switch can be held back until the music is
+	quiet (a pause, the lead-in of a track) instead of cutting into it.
+	The waveform samples are unsigned 8 bit values centred on 128. The
+	measurement is vectorised (SSE2 or NEON) and takes a few tens of
+	nanoseconds for a stereo block of 2x512 samples.
+	FindZeroRuns locates stretches of digital silence, which is what a
+	dropout looks like in the waveform (see DropoutDetector).
+=============================================================================*/
+
+#ifndef __SilenceDetector_h__
+#define __SilenceDetector_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct WaveformLevel {
+	// the largest deviation from the centre value, 0..128
+	unsigned peak;
+	// the sum of the absolute deviations, i.e. the mean level times the number of samples
+	uint32_t sumAbs;
+};
+
+// measure count samples; count should be a multiple of 16 for the vectorised code to handle it all.
+void MeasureWaveform(const uint8_t *samples, size_t count, WaveformLevel &level);
+
+// true if all of the channels[0..numChannels-1] blocks of count samples peak at or below
+// peakThreshold, and have a mean deviation of at most meanThreshold.
+bool IsQuietWaveform(const uint8_t *const *channels, unsigned numChannels, size_t count,
+					 unsigned peakThreshold, double meanThreshold, WaveformLevel *loudest = NULL);
+
+// runs of digital silence (samples exactly at the centre value in all channels) in a block
+struct ZeroRuns {
+	// the number of silent samples, the longest run, and the runs touching the block's edges
+	size_t total, longest, leading, trailing;
+};
+// count must be a multiple of 64 and at most kMaxZeroRunSamples
+enum { kMaxZeroRunSamples = 1024 };
+void FindZeroRuns(const uint8_t *const *channels, unsigned numChannels, size_t count, ZeroRuns &runs);
+
+#endif // __SilenceDetector_h__
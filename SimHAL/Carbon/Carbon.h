@@ -0,0 +1,19 @@
+/*=============================================================================
+	Carbon/Carbon.h (simulated HAL)
+
+	The few Carbon types the iTunes plugin API refers to, so that the
+	plugin can be built against the simulated HAL.
+=============================================================================*/
+
+#ifndef __SimHAL_Carbon_h__
+#define __SimHAL_Carbon_h__
+
+#include <CoreServices/CoreServices.h>
+
+typedef struct FSRef {
+	UInt8 hidden[80];
+} FSRef;
+
+typedef const struct __CFData *CFDataRef;
+
+#endif // __SimHAL_Carbon_h__
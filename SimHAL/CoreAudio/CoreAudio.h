@@ -0,0 +1,161 @@
+/*=============================================================================
+	CoreAudio/CoreAudio.h (simulated HAL)
+
+	The subset of the AudioHardware API used by the device code, with the
+	same names, types and selector values as the real CoreAudio framework.
+	The calls are implemented by SimHAL.cpp on top of scriptable virtual
+	devices.
+=============================================================================*/
+
+#ifndef __SimHAL_CoreAudio_h__
+#define __SimHAL_CoreAudio_h__
+
+#include <CoreServices/CoreServices.h>
+#include <CoreAudio/CoreAudioTypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef UInt32	AudioObjectID;
+typedef UInt32	AudioClassID;
+typedef UInt32	AudioObjectPropertySelector;
+typedef UInt32	AudioObjectPropertyScope;
+typedef UInt32	AudioObjectPropertyElement;
+typedef AudioObjectID	AudioDeviceID;
+typedef AudioObjectID	AudioStreamID;
+typedef UInt32	AudioDevicePropertyID;
+
+struct AudioObjectPropertyAddress {
+	AudioObjectPropertySelector	mSelector;
+	AudioObjectPropertyScope	mScope;
+	AudioObjectPropertyElement	mElement;
+};
+typedef struct AudioObjectPropertyAddress AudioObjectPropertyAddress;
+
+typedef OSStatus (*AudioObjectPropertyListenerProc)(AudioObjectID inObjectID, UInt32 inNumberAddresses,
+		const AudioObjectPropertyAddress *inAddresses, void *inClientData);
+typedef OSStatus (*AudioDevicePropertyListenerProc)(AudioDeviceID inDevice, UInt32 inChannel, Boolean isInput,
+		AudioDevicePropertyID inPropertyID, void *inClientData);
+
+enum {
+	kAudioObjectUnknown					= 0,
+	kAudioDeviceUnknown					= kAudioObjectUnknown,
+	kAudioStreamUnknown					= kAudioObjectUnknown,
+	kAudioObjectSystemObject			= 1
+};
+
+enum {
+	kAudioObjectPropertyScopeGlobal		= 'glob',
+	kAudioObjectPropertyScopeInput		= 'inpt',
+	kAudioObjectPropertyScopeOutput		= 'outp',
+	kAudioObjectPropertyScopePlayThrough	= 'ptru',
+	kAudioObjectPropertyElementMaster	= 0,
+	kAudioObjectPropertyElementMain		= 0,
+	kAudioObjectPropertyElementWildcard	= 0xFFFFFFFF,
+	kAudioObjectPropertySelectorWildcard	= '****',
+	kAudioObjectPropertyScopeWildcard	= '****',
+
+	kAudioDevicePropertyScopeInput		= kAudioObjectPropertyScopeInput,
+	kAudioDevicePropertyScopeOutput		= kAudioObjectPropertyScopeOutput,
+	kAudioDevicePropertyScopePlayThrough	= kAudioObjectPropertyScopePlayThrough
+};
+
+enum {
+	kAudioHardwareNoError				= 0,
+	kAudioHardwareNotRunningError		= 'stop',
+	kAudioHardwareUnspecifiedError		= 'what',
+	kAudioHardwareUnknownPropertyError	= 'who?',
+	kAudioHardwareBadPropertySizeError	= '!siz',
+	kAudioHardwareIllegalOperationError	= 'nope',
+	kAudioHardwareBadObjectError		= '!obj',
+	kAudioHardwareBadDeviceError		= '!dev',
+	kAudioHardwareBadStreamError		= '!str',
+	kAudioHardwareUnsupportedOperationError	= 'unop',
+	kAudioDeviceUnsupportedFormatError	= '!dat',
+	kAudioDevicePermissionsError		= '!hog'
+};
+
+enum {
+	// system object
+	kAudioHardwarePropertyDevices					= 'dev#',
+	kAudioHardwarePropertyDefaultInputDevice		= 'dIn ',
+	kAudioHardwarePropertyDefaultOutputDevice		= 'dOut',
+	kAudioHardwarePropertyTranslateUIDToDevice		= 'uidd',
+
+	// generic object
+	kAudioObjectPropertyName						= 'lnam',
+
+	// devices
+	kAudioDevicePropertyDeviceName					= 'name',
+	kAudioDevicePropertyDeviceUID					= 'uid ',
+	kAudioDevicePropertyDeviceIsAlive				= 'livn',
+	kAudioDevicePropertyDeviceHasChanged			= 'diff',
+	kAudioDevicePropertyDeviceIsRunning				= 'goin',
+	kAudioDevicePropertyDeviceIsRunningSomewhere	= 'gone',
+	kAudioDeviceProcessorOverload					= 'over',
+	kAudioDevicePropertyIOStoppedAbnormally			= 'stpd',
+	kAudioDevicePropertyLatency						= 'ltnc',
+	kAudioDevicePropertySafetyOffset				= 'saft',
+	kAudioDevicePropertyStreams						= 'stm#',
+	kAudioDevicePropertyStreamConfiguration			= 'slay',
+	kAudioDevicePropertyStreamFormat				= 'sfmt',
+	kAudioDevicePropertyBufferFrameSize				= 'fsiz',
+	kAudioDevicePropertyBufferFrameSizeRange		= 'fsz#',
+	kAudioDevicePropertyNominalSampleRate			= 'nsrt',
+	kAudioDevicePropertyAvailableNominalSampleRates	= 'nsr#',
+	kAudioDevicePropertyActualSampleRate			= 'asrt',
+	kAudioDevicePropertyClockDomain					= 'clkd',
+	kAudioDevicePropertyClockSource					= 'csrc',
+	kAudioDevicePropertyClockSources				= 'csc#',
+	kAudioDevicePropertyClockSourceNameForIDCFString	= 'lcsn',
+
+	// streams
+	kAudioStreamPropertyDirection					= 'sdir',
+	kAudioStreamPropertyStartingChannel				= 'schn',
+	kAudioStreamPropertyLatency						= 'ltnc',
+	kAudioStreamPropertyVirtualFormat				= 'sfmt',
+	kAudioStreamPropertyAvailableVirtualFormats		= 'sfma',
+	kAudioStreamPropertyPhysicalFormat				= 'pft ',
+	kAudioStreamPropertyAvailablePhysicalFormats	= 'pfta'
+};
+
+struct AudioValueRange {
+	Float64	mMinimum;
+	Float64	mMaximum;
+};
+typedef struct AudioValueRange AudioValueRange;
+
+struct AudioValueTranslation {
+	void *	mInputData;
+	UInt32	mInputDataSize;
+	void *	mOutputData;
+	UInt32	mOutputDataSize;
+};
+typedef struct AudioValueTranslation AudioValueTranslation;
+
+struct AudioStreamRangedDescription {
+	AudioStreamBasicDescription	mFormat;
+	AudioValueRange				mSampleRateRange;
+};
+typedef struct AudioStreamRangedDescription AudioStreamRangedDescription;
+
+Boolean AudioObjectHasProperty(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress);
+OSStatus AudioObjectIsPropertySettable(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+		Boolean *outIsSettable);
+OSStatus AudioObjectGetPropertyDataSize(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+		UInt32 inQualifierDataSize, const void *inQualifierData, UInt32 *outDataSize);
+OSStatus AudioObjectGetPropertyData(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+		UInt32 inQualifierDataSize, const void *inQualifierData, UInt32 *ioDataSize, void *outData);
+OSStatus AudioObjectSetPropertyData(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+		UInt32 inQualifierDataSize, const void *inQualifierData, UInt32 inDataSize, const void *inData);
+OSStatus AudioObjectAddPropertyListener(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+		AudioObjectPropertyListenerProc inListener, void *inClientData);
+OSStatus AudioObjectRemovePropertyListener(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+		AudioObjectPropertyListenerProc inListener, void *inClientData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SimHAL_CoreAudio_h__
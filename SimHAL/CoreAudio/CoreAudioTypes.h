@@ -0,0 +1,59 @@
+/*=============================================================================
+	CoreAudio/CoreAudioTypes.h (simulated HAL)
+
+=============================================================================*/
+
+#ifndef __SimHAL_CoreAudioTypes_h__
+#define __SimHAL_CoreAudioTypes_h__
+
+#include <CoreServices/CoreServices.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct AudioStreamBasicDescription {
+	Float64	mSampleRate;
+	UInt32	mFormatID;
+	UInt32	mFormatFlags;
+	UInt32	mBytesPerPacket;
+	UInt32	mFramesPerPacket;
+	UInt32	mBytesPerFrame;
+	UInt32	mChannelsPerFrame;
+	UInt32	mBitsPerChannel;
+	UInt32	mReserved;
+};
+typedef struct AudioStreamBasicDescription AudioStreamBasicDescription;
+
+struct AudioBuffer {
+	UInt32	mNumberChannels;
+	UInt32	mDataByteSize;
+	void *	mData;
+};
+typedef struct AudioBuffer AudioBuffer;
+
+struct AudioBufferList {
+	UInt32		mNumberBuffers;
+	AudioBuffer	mBuffers[1];
+};
+typedef struct AudioBufferList AudioBufferList;
+
+enum {
+	kAudioFormatLinearPCM				= 'lpcm'
+};
+
+enum {
+	kAudioFormatFlagIsFloat				= (1U << 0),
+	kAudioFormatFlagIsBigEndian			= (1U << 1),
+	kAudioFormatFlagIsSignedInteger		= (1U << 2),
+	kAudioFormatFlagIsPacked			= (1U << 3),
+	kAudioFormatFlagIsAlignedHigh		= (1U << 4),
+	kAudioFormatFlagIsNonInterleaved	= (1U << 5),
+	kAudioFormatFlagIsNonMixable		= (1U << 6)
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SimHAL_CoreAudioTypes_h__
@@ -0,0 +1,68 @@
+/*=============================================================================
+	CoreFoundation/CoreFoundation.h (simulated HAL)
+
+	The small subset of CoreFoundation used by the device code: CFString
+	(creation, conversion, release), type identification and the
+	preferences API. There is no preferences store; settings come from the
+	BPSR_* environment overrides only.
+=============================================================================*/
+
+#ifndef __SimHAL_CoreFoundation_h__
+#define __SimHAL_CoreFoundation_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned char			Boolean;
+typedef long					CFIndex;
+typedef unsigned long			CFTypeID;
+typedef const void *			CFTypeRef;
+typedef const void *			CFPropertyListRef;
+typedef const struct __CFString *CFStringRef;
+typedef const struct __CFArray *CFArrayRef;
+typedef const struct __CFNumber *CFNumberRef;
+typedef const struct __CFBoolean *CFBooleanRef;
+typedef const struct __CFAllocator *CFAllocatorRef;
+typedef uint32_t				CFStringEncoding;
+
+#define kCFAllocatorDefault		((CFAllocatorRef) NULL)
+
+enum {
+	kCFStringEncodingUTF8 = 0x08000100
+};
+
+typedef enum {
+	kCFNumberIntType = 9,
+	kCFNumberDoubleType = 13
+} CFNumberType;
+
+CFStringRef __SimCFStringMakeConstant(const char *cStr);
+#define CFSTR(cStr)				__SimCFStringMakeConstant("" cStr "")
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding);
+Boolean CFStringGetCString(CFStringRef theString, char *buffer, CFIndex bufferSize, CFStringEncoding encoding);
+CFIndex CFStringGetLength(CFStringRef theString);
+double CFStringGetDoubleValue(CFStringRef str);
+CFTypeRef CFRetain(CFTypeRef cf);
+void CFRelease(CFTypeRef cf);
+CFTypeID CFGetTypeID(CFTypeRef cf);
+CFTypeID CFStringGetTypeID(void);
+CFTypeID CFArrayGetTypeID(void);
+CFTypeID CFNumberGetTypeID(void);
+CFTypeID CFBooleanGetTypeID(void);
+CFIndex CFArrayGetCount(CFArrayRef theArray);
+const void *CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx);
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr);
+Boolean CFBooleanGetValue(CFBooleanRef boolean);
+CFPropertyListRef CFPreferencesCopyAppValue(CFStringRef key, CFStringRef applicationID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SimHAL_CoreFoundation_h__
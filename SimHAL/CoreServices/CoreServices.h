@@ -0,0 +1,113 @@
+/*=============================================================================
+	CoreServices/CoreServices.h (simulated HAL)
+
+	The MacTypes and error codes the device and plugin code rely on.
+=============================================================================*/
+
+#ifndef __SimHAL_CoreServices_h__
+#define __SimHAL_CoreServices_h__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+// availability: pretend to be a recent macOS SDK
+#define __MAC_NA							9999
+#define __IPHONE_NA							99999
+#define __TVOS_NA							99999
+#define __WATCHOS_NA						99999
+#define __MAC_10_10							101000
+#define __MAC_10_11							101100
+#define __MAC_10_12							101200
+#define __MAC_10_13							101300
+#define __MAC_OS_X_VERSION_MAX_ALLOWED		__MAC_10_13
+#define __MAC_OS_X_VERSION_MIN_REQUIRED		__MAC_10_10
+
+// tells iTunesAPI.h that the Mac types are already defined
+#define __CONDITIONALMACROS__	1
+
+#ifndef nil
+#define nil					NULL
+#endif
+
+typedef uint8_t			UInt8;
+typedef int8_t			SInt8;
+typedef uint16_t		UInt16;
+typedef int16_t			SInt16;
+typedef uint32_t		UInt32;
+typedef int32_t			SInt32;
+typedef uint64_t		UInt64;
+typedef int64_t			SInt64;
+typedef float			Float32;
+typedef double			Float64;
+typedef SInt32			OSStatus;
+typedef UInt32			OSType;
+typedef UInt32			FourCharCode;
+typedef UInt32			OptionBits;
+typedef UInt16			UniChar;
+typedef UInt32			UnsignedFixed;
+typedef UInt8			Str255[256];
+typedef UInt8			Str63[64];
+typedef UInt8 *			StringPtr;
+typedef const UInt8 *	ConstStringPtr;
+typedef void *			LogicalAddress;
+typedef void **			Handle;
+
+struct NumVersion {
+	UInt8			nonRelRev;
+	UInt8			stage;
+	UInt8			minorAndBugRev;
+	UInt8			majorRev;
+};
+typedef struct NumVersion NumVersion;
+
+struct Point {
+	short			v;
+	short			h;
+};
+typedef struct Point Point;
+
+struct Rect {
+	short			top;
+	short			left;
+	short			bottom;
+	short			right;
+};
+typedef struct Rect Rect;
+
+enum {
+	developStage	= 0x20,
+	alphaStage		= 0x40,
+	betaStage		= 0x60,
+	finalStage		= 0x80
+};
+
+enum {
+	noErr			= 0,
+	unimpErr		= -4,
+	readErr			= -19,
+	writErr			= -20,
+	openErr			= -23,
+	ioErr			= -36,
+	fnfErr			= -43,
+	paramErr		= -50,
+	permErr			= -54,
+	memFullErr		= -108
+};
+
+#define EndianU32_BtoN(value)	ntohl(value)
+#define EndianU32_NtoB(value)	htonl(value)
+
+#ifndef verify_noerr
+#	ifdef DEBUG
+#		define verify_noerr(errorCode)	do { long __err = (long)(errorCode); \
+			if (__err != 0) { fprintf(stderr, "verify_noerr(%s) == %ld at %s:%d\n", #errorCode, __err, __FILE__, __LINE__); } \
+		} while (0)
+#	else
+#		define verify_noerr(errorCode)	do { (void)(errorCode); } while (0)
+#	endif
+#endif
+
+#endif // __SimHAL_CoreServices_h__
@@ -0,0 +1,158 @@
+/*=============================================================================
+	SimCoreFoundation.cpp
+
+	The CoreFoundation subset declared in CoreFoundation/CoreFoundation.h.
+	Only strings can be created; the other types exist so that code that
+	inspects property list values compiles and runs (it never sees one, as
+	CFPreferencesCopyAppValue always returns NULL).
+=============================================================================*/
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+enum {
+	kSimCFStringTypeID = 7,
+	kSimCFArrayTypeID = 19,
+	kSimCFNumberTypeID = 22,
+	kSimCFBooleanTypeID = 21
+};
+
+struct __CFString {
+	CFTypeID typeID;
+	std::atomic<long> refCount;
+	// constant strings (CFSTR) are never freed
+	bool constant;
+	std::string value;
+};
+
+static const __CFString *AsString(CFTypeRef cf)
+{
+	const __CFString *s = static_cast<const __CFString *>(cf);
+	return (s && s->typeID == kSimCFStringTypeID) ? s : NULL;
+}
+
+CFStringRef __SimCFStringMakeConstant(const char *cStr)
+{
+	static std::mutex lock;
+	static std::map<std::string, __CFString *> constants;
+	std::lock_guard<std::mutex> guard(lock);
+	__CFString *&s = constants[cStr];
+	if (!s) {
+		s = new __CFString;
+		s->typeID = kSimCFStringTypeID;
+		s->refCount = 1;
+		s->constant = true;
+		s->value = cStr;
+	}
+	return s;
+}
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding)
+{
+	if (!cStr) {
+		return NULL;
+	}
+	__CFString *s = new __CFString;
+	s->typeID = kSimCFStringTypeID;
+	s->refCount = 1;
+	s->constant = false;
+	s->value = cStr;
+	return s;
+}
+
+Boolean CFStringGetCString(CFStringRef theString, char *buffer, CFIndex bufferSize, CFStringEncoding encoding)
+{
+	const __CFString *s = AsString(theString);
+	if (!s || !buffer || bufferSize <= (CFIndex) s->value.size()) {
+		return false;
+	}
+	memcpy(buffer, s->value.c_str(), s->value.size() + 1);
+	return true;
+}
+
+CFIndex CFStringGetLength(CFStringRef theString)
+{
+	const __CFString *s = AsString(theString);
+	return s ? (CFIndex) s->value.size() : 0;
+}
+
+double CFStringGetDoubleValue(CFStringRef str)
+{
+	const __CFString *s = AsString(str);
+	return s ? atof(s->value.c_str()) : 0;
+}
+
+CFTypeRef CFRetain(CFTypeRef cf)
+{
+	const __CFString *s = AsString(cf);
+	if (s) {
+		const_cast<__CFString *>(s)->refCount += 1;
+	}
+	return cf;
+}
+
+void CFRelease(CFTypeRef cf)
+{
+	const __CFString *s = AsString(cf);
+	if (s && !s->constant && --const_cast<__CFString *>(s)->refCount == 0) {
+		delete s;
+	}
+}
+
+CFTypeID CFGetTypeID(CFTypeRef cf)
+{
+	return cf ? *static_cast<const CFTypeID *>(cf) : 0;
+}
+
+CFTypeID CFStringGetTypeID(void)
+{
+	return kSimCFStringTypeID;
+}
+
+CFTypeID CFArrayGetTypeID(void)
+{
+	return kSimCFArrayTypeID;
+}
+
+CFTypeID CFNumberGetTypeID(void)
+{
+	return kSimCFNumberTypeID;
+}
+
+CFTypeID CFBooleanGetTypeID(void)
+{
+	return kSimCFBooleanTypeID;
+}
+
+CFIndex CFArrayGetCount(CFArrayRef theArray)
+{
+	return 0;
+}
+
+const void *CFArrayGetValueAtIndex(CFArrayRef theArray, CFIndex idx)
+{
+	return NULL;
+}
+
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr)
+{
+	return false;
+}
+
+Boolean CFBooleanGetValue(CFBooleanRef boolean)
+{
+	return false;
+}
+
+CFPropertyListRef CFPreferencesCopyAppValue(CFStringRef key, CFStringRef applicationID)
+{
+	// there is no preferences store; BPPreferences falls back to its BPSR_* environment overrides
+	return NULL;
+}
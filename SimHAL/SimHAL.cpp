@@ -0,0 +1,1405 @@
+/*=============================================================================
+	SimHAL.cpp
+
+=============================================================================*/
+
+#include "SimHAL.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+SimFaults::SimFaults()
+	: slowCallProbability(0)
+	, slowCallSeconds(0)
+	, failureProbability(0)
+	, failureStatus(kAudioHardwareUnspecifiedError)
+	, spuriousNotificationsPerSecond(0)
+	, overloadsPerSecond(0)
+{
+}
+
+SimDeviceSpec::SimDeviceSpec()
+	: name("Simulated Output")
+	, nominalRate(44100)
+	, channels(2)
+	, bits(24)
+	, input(false)
+	, output(true)
+	, bufferFrames(512)
+	, minBufferFrames(14)
+	, maxBufferFrames(4096)
+	, latencyFrames(24)
+	, safetyOffsetFrames(32)
+	, streamLatencyFrames(0)
+	, clockDomain(0)
+	, setLatency(0.005)
+	, settleTime(0.05)
+	, notifyDelay(0.001)
+	, nominalLag(0)
+	, clockSource(1)
+	, relockTime(0.05)
+{
+	static const Float64 standard[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+	for (size_t i = 0 ; i < sizeof(standard) / sizeof(Float64) ; ++i) {
+		AudioValueRange r = { standard[i], standard[i] };
+		rates.push_back(r);
+	}
+}
+
+static double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void SleepFor(double seconds)
+{
+	if (seconds > 0) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	}
+}
+
+namespace {
+
+struct Device {
+	AudioDeviceID id;
+	AudioStreamID outputStream, inputStream;
+	SimDeviceSpec spec;
+	Float64 nominalRate, actualRate;
+	// the rate of the last rate change, which the nominal rate reports after the spec's nominalLag
+	Float64 targetRate;
+	UInt32 bufferFrames;
+	AudioStreamBasicDescription physicalFormat;
+	unsigned long rateChanges, reconfigurations;
+	UInt32 clockSource;
+	unsigned long clockSourceChanges;
+	// when the next injected notifications are due
+	double nextSpurious, nextOverload;
+};
+
+struct Listener {
+	AudioObjectID object;
+	AudioObjectPropertyAddress address;
+	AudioObjectPropertyListenerProc proc;
+	void *clientData;
+};
+
+struct Event {
+	double when;
+	unsigned long seq;
+	AudioObjectID object;
+	AudioObjectPropertySelector selector;
+	// the hardware locking to a new rate (the actual rate changes when the event is due), or
+	// reporting it (the nominal rate does)
+	bool setsActualRate, setsNominalRate;
+	Float64 rate;
+	bool operator<(const Event &other) const
+	{
+		return when < other.when || (when == other.when && seq < other.seq);
+	}
+};
+
+class HAL {
+public:
+	HAL();
+
+	// all state is protected by mLock. Listeners are called with mDeliveryLock held (and
+	// mLock released), so that removing a listener waits for its current invocation.
+	std::mutex mLock;
+	std::recursive_mutex mDeliveryLock;
+	std::condition_variable mWake, mFlushed;
+
+	std::map<AudioDeviceID, Device *> mDevices;
+	std::map<AudioStreamID, Device *> mStreams;
+	AudioDeviceID mNextID;
+	AudioDeviceID mDefaultOutput, mDefaultInput;
+	bool mPopulated;
+	std::vector<Listener> mListeners;
+	std::set<Event> mEvents;
+	unsigned long mNextSeq, mInFlight;
+	SimCallCounts mCalls;
+	std::mt19937_64 mRandom;
+
+	void Populate();
+	void Post(AudioObjectID object, AudioObjectPropertySelector selector, double delay,
+			  bool setsActualRate = false, Float64 rate = 0, bool setsNominalRate = false);
+	double Uniform()
+	{
+		return std::uniform_real_distribution<double>(0, 1)(mRandom);
+	}
+	double NextInterval(double perSecond)
+	{
+		return perSecond > 0 ? std::exponential_distribution<double>(perSecond)(mRandom) : 1e30;
+	}
+	Device *DeviceForObject(AudioObjectID object)
+	{
+		std::map<AudioDeviceID, Device *>::iterator it = mDevices.find(object);
+		if (it != mDevices.end()) {
+			return it->second;
+		}
+		std::map<AudioStreamID, Device *>::iterator st = mStreams.find(object);
+		return (st != mStreams.end()) ? st->second : NULL;
+	}
+	Device *FindDevice(const std::string &name)
+	{
+		for (std::map<AudioDeviceID, Device *>::iterator it = mDevices.begin() ; it != mDevices.end() ; ++it) {
+			if (it->second->spec.name == name || it->second->spec.uid == name) {
+				return it->second;
+			}
+		}
+		return NULL;
+	}
+	AudioDeviceID AddDevice(const SimDeviceSpec &spec, bool makeDefault);
+	void RemoveDevice(Device *dev);
+	void ScheduleFaults(Device *dev, double now)
+	{
+		dev->nextSpurious = now + NextInterval(dev->spec.faults.spuriousNotificationsPerSecond);
+		dev->nextOverload = now + NextInterval(dev->spec.faults.overloadsPerSecond);
+	}
+	// the stall to inflict on a call to the object, in seconds
+	double Stall(AudioObjectID object)
+	{
+		Device *dev = DeviceForObject(object);
+		if (dev && dev->spec.faults.slowCallProbability > 0 && Uniform() < dev->spec.faults.slowCallProbability) {
+			return dev->spec.faults.slowCallSeconds;
+		}
+		return 0;
+	}
+
+	OSStatus GetProperty(AudioObjectID object, const AudioObjectPropertyAddress &address,
+						 UInt32 qualifierSize, const void *qualifier, std::vector<unsigned char> &data,
+						 bool &isArray, bool sizeOnly);
+	OSStatus SetProperty(AudioObjectID object, const AudioObjectPropertyAddress &address,
+						 UInt32 size, const void *value, std::unique_lock<std::mutex> &lock);
+	OSStatus SetRate(Device *dev, Float64 rate, std::unique_lock<std::mutex> &lock);
+	void ReportRate(Device *dev, Float64 rate);
+	OSStatus SetClockSource(Device *dev, UInt32 source);
+
+	void Dispatch();
+	void Flush();
+};
+
+static HAL &TheHAL()
+{
+	// never destroyed: the notification thread may outlive static destruction
+	static HAL *hal = new HAL;
+	return *hal;
+}
+
+static bool Matches(const AudioObjectPropertyAddress &listening, const AudioObjectPropertyAddress &changed)
+{
+	return (listening.mSelector == changed.mSelector || listening.mSelector == kAudioObjectPropertySelectorWildcard)
+		&& (listening.mScope == changed.mScope || listening.mScope == kAudioObjectPropertyScopeWildcard
+			|| listening.mScope == kAudioObjectPropertyScopeGlobal || changed.mScope == kAudioObjectPropertyScopeGlobal)
+		&& (listening.mElement == changed.mElement || listening.mElement == kAudioObjectPropertyElementWildcard);
+}
+
+static bool SupportsRate(const SimDeviceSpec &spec, Float64 rate)
+{
+	for (size_t i = 0 ; i < spec.rates.size() ; ++i) {
+		if (rate >= spec.rates[i].mMinimum && rate <= spec.rates[i].mMaximum) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// 44100 for the multiples of 11025Hz, 48000 for those of 4000Hz, 0 for other rates
+static Float64 RateFamily(Float64 rate)
+{
+	if (rate > 0 && fmod(rate, 11025) == 0) {
+		return 44100;
+	}
+	return (rate > 0 && fmod(rate, 4000) == 0) ? 48000 : 0;
+}
+
+// the time the device takes to lock to rate on its current clock source
+static double LockTime(const Device *dev, Float64 rate)
+{
+	const std::vector<SimClockSource> &sources = dev->spec.clockSources;
+	if (dev->clockSource < 1 || dev->clockSource > sources.size()) {
+		return dev->spec.settleTime;
+	}
+	Float64 base = sources[dev->clockSource - 1].baseRate;
+	return (base > 0 && RateFamily(base) != RateFamily(rate)) ? dev->spec.relockTime : dev->spec.settleTime;
+}
+
+static AudioStreamBasicDescription MakeFormat(Float64 rate, UInt32 channels, UInt32 bits, bool isFloat)
+{
+	AudioStreamBasicDescription format;
+	memset(&format, 0, sizeof(format));
+	format.mSampleRate = rate;
+	format.mFormatID = kAudioFormatLinearPCM;
+	format.mFormatFlags = kAudioFormatFlagIsPacked
+		| (isFloat ? kAudioFormatFlagIsFloat : kAudioFormatFlagIsSignedInteger);
+	format.mChannelsPerFrame = channels;
+	format.mBitsPerChannel = bits;
+	format.mBytesPerFrame = format.mBytesPerPacket = channels * ((bits + 7) / 8);
+	format.mFramesPerPacket = 1;
+	return format;
+}
+
+// the physical formats offered by the streams: 16, 24 and 32 bit integer and 32 bit float, at every rate
+static std::vector<AudioStreamRangedDescription> PhysicalFormats(const SimDeviceSpec &spec, bool virtualOnly)
+{
+	static const struct { UInt32 bits; bool isFloat; } kinds[] = { { 16, false }, { 24, false }, { 32, false }, { 32, true } };
+	std::vector<AudioStreamRangedDescription> formats;
+	for (size_t r = 0 ; r < spec.rates.size() ; ++r) {
+		const AudioValueRange &range = spec.rates[r];
+		for (size_t k = 0 ; k < sizeof(kinds) / sizeof(kinds[0]) ; ++k) {
+			if (virtualOnly && !kinds[k].isFloat) {
+				continue;
+			}
+			AudioStreamRangedDescription d;
+			// a range of rates is described with a rate of 0 (kAudioStreamAnyRate)
+			d.mFormat = MakeFormat(range.mMinimum == range.mMaximum ? range.mMinimum : 0,
+								   spec.channels, kinds[k].bits, kinds[k].isFloat);
+			d.mSampleRateRange = range;
+			formats.push_back(d);
+		}
+	}
+	return formats;
+}
+
+template <typename T> static void Put(std::vector<unsigned char> &data, const T &value)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(&value);
+	data.insert(data.end(), p, p + sizeof(T));
+}
+
+HAL::HAL()
+	: mNextID(100)
+	, mDefaultOutput(kAudioDeviceUnknown)
+	, mDefaultInput(kAudioDeviceUnknown)
+	, mPopulated(false)
+	, mNextSeq(1)
+	, mInFlight(0)
+	, mRandom(5489)
+{
+	memset(&mCalls, 0, sizeof(mCalls));
+	std::thread(&HAL::Dispatch, this).detach();
+}
+
+// called with mLock held, on the first HAL call
+void HAL::Populate()
+{
+	if (mPopulated) {
+		return;
+	}
+	mPopulated = true;
+	const char *script = getenv("SIMHAL_SCRIPT");
+	if (script && *script) {
+		std::string error;
+		mLock.unlock();
+		if (!SimHAL::RunScript(script, &error)) {
+			fprintf(stderr, "SimHAL: %s\n", error.c_str());
+		}
+		mLock.lock();
+	}
+	if (mDevices.empty()) {
+		AddDevice(SimDeviceSpec(), true);
+	}
+}
+
+void HAL::Post(AudioObjectID object, AudioObjectPropertySelector selector, double delay,
+			   bool setsActualRate, Float64 rate, bool setsNominalRate)
+{
+	Event e = { Now() + delay, mNextSeq++, object, selector, setsActualRate, setsNominalRate, rate };
+	mEvents.insert(e);
+	mWake.notify_one();
+}
+
+AudioDeviceID HAL::AddDevice(const SimDeviceSpec &spec, bool makeDefault)
+{
+	Device *dev = new Device;
+	dev->spec = spec;
+	if (dev->spec.rates.empty()) {
+		AudioValueRange r = { spec.nominalRate, spec.nominalRate };
+		dev->spec.rates.push_back(r);
+	}
+	dev->id = mNextID++;
+	dev->outputStream = spec.output ? mNextID++ : kAudioStreamUnknown;
+	dev->inputStream = spec.input ? mNextID++ : kAudioStreamUnknown;
+	if (dev->spec.uid.empty()) {
+		char uid[64];
+		snprintf(uid, sizeof(uid), "SimHAL:%u", (unsigned int) dev->id);
+		dev->spec.uid = uid;
+	}
+	dev->nominalRate = dev->actualRate = dev->targetRate = spec.nominalRate;
+	dev->bufferFrames = spec.bufferFrames;
+	dev->physicalFormat = MakeFormat(spec.nominalRate, spec.channels, spec.bits, false);
+	dev->rateChanges = dev->reconfigurations = 0;
+	dev->clockSource = spec.clockSources.empty() ? 0 : std::min<UInt32>(std::max<UInt32>(spec.clockSource, 1),
+																		 (UInt32) spec.clockSources.size());
+	dev->clockSourceChanges = 0;
+	ScheduleFaults(dev, Now());
+	mDevices[dev->id] = dev;
+	if (dev->outputStream) {
+		mStreams[dev->outputStream] = dev;
+	}
+	if (dev->inputStream) {
+		mStreams[dev->inputStream] = dev;
+	}
+	mPopulated = true;
+	if (spec.output && (makeDefault || mDefaultOutput == kAudioDeviceUnknown)) {
+		mDefaultOutput = dev->id;
+		Post(kAudioObjectSystemObject, kAudioHardwarePropertyDefaultOutputDevice, 0);
+	}
+	if (spec.input && (makeDefault || mDefaultInput == kAudioDeviceUnknown)) {
+		mDefaultInput = dev->id;
+		Post(kAudioObjectSystemObject, kAudioHardwarePropertyDefaultInputDevice, 0);
+	}
+	Post(kAudioObjectSystemObject, kAudioHardwarePropertyDevices, 0);
+	return dev->id;
+}
+
+void HAL::RemoveDevice(Device *dev)
+{
+	mDevices.erase(dev->id);
+	mStreams.erase(dev->outputStream);
+	mStreams.erase(dev->inputStream);
+	Post(dev->id, kAudioDevicePropertyDeviceIsAlive, 0);
+	Post(kAudioObjectSystemObject, kAudioHardwarePropertyDevices, 0);
+	if (mDefaultOutput == dev->id || mDefaultInput == dev->id) {
+		AudioDeviceID *which = (mDefaultOutput == dev->id) ? &mDefaultOutput : &mDefaultInput;
+		*which = kAudioDeviceUnknown;
+		for (std::map<AudioDeviceID, Device *>::iterator it = mDevices.begin() ; it != mDevices.end() ; ++it) {
+			if ((which == &mDefaultOutput) ? it->second->spec.output : it->second->spec.input) {
+				*which = it->first;
+				break;
+			}
+		}
+		Post(kAudioObjectSystemObject, (which == &mDefaultOutput) ? kAudioHardwarePropertyDefaultOutputDevice
+			 : kAudioHardwarePropertyDefaultInputDevice, 0);
+	}
+	delete dev;
+}
+
+OSStatus HAL::GetProperty(AudioObjectID object, const AudioObjectPropertyAddress &address,
+						  UInt32 qualifierSize, const void *qualifier, std::vector<unsigned char> &data,
+						  bool &isArray, bool sizeOnly)
+{
+	isArray = false;
+	if (object == kAudioObjectSystemObject) {
+		switch (address.mSelector) {
+			case kAudioHardwarePropertyDevices:
+				isArray = true;
+				for (std::map<AudioDeviceID, Device *>::iterator it = mDevices.begin() ; it != mDevices.end() ; ++it) {
+					Put(data, it->first);
+				}
+				return noErr;
+			case kAudioHardwarePropertyDefaultOutputDevice:
+				Put(data, mDefaultOutput);
+				return noErr;
+			case kAudioHardwarePropertyDefaultInputDevice:
+				Put(data, mDefaultInput);
+				return noErr;
+			case kAudioHardwarePropertyTranslateUIDToDevice: {
+				AudioDeviceID found = kAudioDeviceUnknown;
+				char uid[256];
+				if (!sizeOnly && qualifierSize == sizeof(CFStringRef) && qualifier
+						&& CFStringGetCString(*(const CFStringRef *) qualifier, uid, sizeof(uid), kCFStringEncodingUTF8)) {
+					for (std::map<AudioDeviceID, Device *>::iterator it = mDevices.begin() ; it != mDevices.end() ; ++it) {
+						if (it->second->spec.uid == uid) {
+							found = it->first;
+						}
+					}
+				}
+				Put(data, found);
+				return noErr;
+			}
+			default:
+				return kAudioHardwareUnknownPropertyError;
+		}
+	}
+	Device *dev = DeviceForObject(object);
+	if (!dev) {
+		return kAudioHardwareBadObjectError;
+	}
+	const SimDeviceSpec &spec = dev->spec;
+	if (object != dev->id) {
+		// a stream
+		bool isInput = (object == dev->inputStream);
+		switch (address.mSelector) {
+			case kAudioStreamPropertyDirection:
+				Put(data, (UInt32) (isInput ? 1 : 0));
+				return noErr;
+			case kAudioStreamPropertyStartingChannel:
+				Put(data, (UInt32) 1);
+				return noErr;
+			case kAudioStreamPropertyLatency:
+				Put(data, spec.streamLatencyFrames);
+				return noErr;
+			case kAudioStreamPropertyVirtualFormat:
+				Put(data, MakeFormat(dev->nominalRate, spec.channels, 32, true));
+				return noErr;
+			case kAudioStreamPropertyPhysicalFormat:
+				Put(data, dev->physicalFormat);
+				return noErr;
+			case kAudioStreamPropertyAvailablePhysicalFormats:
+			case kAudioStreamPropertyAvailableVirtualFormats: {
+				std::vector<AudioStreamRangedDescription> formats =
+					PhysicalFormats(spec, address.mSelector == kAudioStreamPropertyAvailableVirtualFormats);
+				isArray = true;
+				for (size_t i = 0 ; i < formats.size() ; ++i) {
+					Put(data, formats[i]);
+				}
+				return noErr;
+			}
+			default:
+				return kAudioHardwareUnknownPropertyError;
+		}
+	}
+	bool inputScope = (address.mScope == kAudioObjectPropertyScopeInput);
+	bool outputScope = (address.mScope == kAudioObjectPropertyScopeOutput);
+	switch (address.mSelector) {
+		case kAudioObjectPropertyName:
+		case kAudioDevicePropertyDeviceUID:
+			// the caller releases the string
+			Put(data, sizeOnly ? (CFStringRef) NULL
+				: CFStringCreateWithCString(kCFAllocatorDefault,
+					(address.mSelector == kAudioObjectPropertyName ? spec.name : spec.uid).c_str(),
+					kCFStringEncodingUTF8));
+			return noErr;
+		case kAudioDevicePropertyDeviceName:
+			isArray = true;
+			data.insert(data.end(), spec.name.begin(), spec.name.end());
+			data.push_back(0);
+			return noErr;
+		case kAudioDevicePropertyDeviceIsAlive:
+			Put(data, (UInt32) 1);
+			return noErr;
+		case kAudioDevicePropertyDeviceIsRunning:
+		case kAudioDevicePropertyDeviceIsRunningSomewhere:
+		case kAudioDeviceProcessorOverload:
+		case kAudioDevicePropertyIOStoppedAbnormally:
+			Put(data, (UInt32) 0);
+			return noErr;
+		case kAudioDevicePropertyLatency:
+			Put(data, spec.latencyFrames);
+			return noErr;
+		case kAudioDevicePropertySafetyOffset:
+			Put(data, spec.safetyOffsetFrames);
+			return noErr;
+		case kAudioDevicePropertyStreams:
+			isArray = true;
+			if (dev->outputStream && !inputScope) {
+				Put(data, dev->outputStream);
+			}
+			if (dev->inputStream && !outputScope) {
+				Put(data, dev->inputStream);
+			}
+			return noErr;
+		case kAudioDevicePropertyStreamConfiguration: {
+			bool has = inputScope ? spec.input : spec.output;
+			UInt32 n = has ? 1 : 0;
+			std::vector<unsigned char> list(std::max(sizeof(AudioBufferList),
+													 offsetof(AudioBufferList, mBuffers) + n * sizeof(AudioBuffer)));
+			AudioBufferList *buffers = reinterpret_cast<AudioBufferList *>(&list[0]);
+			buffers->mNumberBuffers = n;
+			if (n) {
+				buffers->mBuffers[0].mNumberChannels = spec.channels;
+				buffers->mBuffers[0].mDataByteSize = dev->bufferFrames * spec.channels * sizeof(Float32);
+				buffers->mBuffers[0].mData = NULL;
+			}
+			data.insert(data.end(), list.begin(), list.end());
+			return noErr;
+		}
+		case kAudioDevicePropertyStreamFormat:
+			Put(data, MakeFormat(dev->nominalRate, spec.channels, 32, true));
+			return noErr;
+		case kAudioDevicePropertyBufferFrameSize:
+			Put(data, dev->bufferFrames);
+			return noErr;
+		case kAudioDevicePropertyBufferFrameSizeRange: {
+			AudioValueRange r = { (Float64) spec.minBufferFrames, (Float64) spec.maxBufferFrames };
+			Put(data, r);
+			return noErr;
+		}
+		case kAudioDevicePropertyNominalSampleRate:
+			Put(data, dev->nominalRate);
+			return noErr;
+		case kAudioDevicePropertyAvailableNominalSampleRates:
+			isArray = true;
+			for (size_t i = 0 ; i < spec.rates.size() ; ++i) {
+				Put(data, spec.rates[i]);
+			}
+			return noErr;
+		case kAudioDevicePropertyActualSampleRate:
+			Put(data, dev->actualRate);
+			return noErr;
+		case kAudioDevicePropertyClockDomain:
+			Put(data, spec.clockDomain);
+			return noErr;
+		case kAudioDevicePropertyClockSource:
+			if (spec.clockSources.empty()) {
+				return kAudioHardwareUnknownPropertyError;
+			}
+			Put(data, dev->clockSource);
+			return noErr;
+		case kAudioDevicePropertyClockSources:
+			if (spec.clockSources.empty()) {
+				return kAudioHardwareUnknownPropertyError;
+			}
+			isArray = true;
+			for (size_t i = 0 ; i < spec.clockSources.size() ; ++i) {
+				Put(data, (UInt32) (i + 1));
+			}
+			return noErr;
+		case kAudioDevicePropertyClockSourceNameForIDCFString: {
+			// a translation: the source ID comes in, and its name goes out, through the AudioValueTranslation
+			// passed as the data (see AudioObjectGetPropertyData)
+			if (spec.clockSources.empty()) {
+				return kAudioHardwareUnknownPropertyError;
+			}
+			AudioValueTranslation t;
+			memset(&t, 0, sizeof(t));
+			if (!sizeOnly) {
+				if (qualifierSize != sizeof(t) || !qualifier) {
+					return kAudioHardwareBadPropertySizeError;
+				}
+				t = *(const AudioValueTranslation *) qualifier;
+				UInt32 source = (t.mInputData && t.mInputDataSize == sizeof(UInt32)) ? *(const UInt32 *) t.mInputData : 0;
+				if (source < 1 || source > spec.clockSources.size() || !t.mOutputData || t.mOutputDataSize < sizeof(CFStringRef)) {
+					return kAudioHardwareIllegalOperationError;
+				}
+				// the caller releases the string
+				*(CFStringRef *) t.mOutputData = CFStringCreateWithCString(kCFAllocatorDefault,
+					spec.clockSources[source - 1].name.c_str(), kCFStringEncodingUTF8);
+			}
+			Put(data, t);
+			return noErr;
+		}
+		default:
+			return kAudioHardwareUnknownPropertyError;
+	}
+}
+
+// called with lock held; releases it while the "hardware" is busy
+OSStatus HAL::SetRate(Device *dev, Float64 rate, std::unique_lock<std::mutex> &lock)
+{
+	if (!SupportsRate(dev->spec, rate)
+			|| std::find(dev->spec.refusedRates.begin(), dev->spec.refusedRates.end(), rate) != dev->spec.refusedRates.end()) {
+		return kAudioDeviceUnsupportedFormatError;
+	}
+	if (rate == dev->targetRate
+			|| std::find(dev->spec.ignoredRates.begin(), dev->spec.ignoredRates.end(), rate) != dev->spec.ignoredRates.end()) {
+		return noErr;
+	}
+	AudioDeviceID id = dev->id;
+	double setLatency = dev->spec.setLatency;
+	lock.unlock();
+	SleepFor(setLatency);
+	lock.lock();
+	if (mDevices.find(id) == mDevices.end()) {
+		// removed in the meantime
+		return kAudioHardwareBadDeviceError;
+	}
+	dev->targetRate = rate;
+	dev->rateChanges += 1;
+	dev->reconfigurations += 1;
+	double lag = dev->spec.nominalLag;
+	if (lag > 0) {
+		// the nominal rate stays at the old rate until then, and the hardware locks after that
+		Post(id, kAudioDevicePropertyNominalSampleRate, lag, false, rate, true);
+	} else {
+		ReportRate(dev, rate);
+		Post(id, kAudioDevicePropertyNominalSampleRate, dev->spec.notifyDelay);
+	}
+	Post(id, kAudioDevicePropertyActualSampleRate, lag + LockTime(dev, rate), true, rate);
+	return noErr;
+}
+
+// called with lock held: the nominal rate, and the formats that carry it, read back as rate
+void HAL::ReportRate(Device *dev, Float64 rate)
+{
+	dev->nominalRate = rate;
+	dev->physicalFormat.mSampleRate = rate;
+	if (dev->outputStream) {
+		Post(dev->outputStream, kAudioStreamPropertyPhysicalFormat, dev->spec.notifyDelay);
+	}
+	if (dev->inputStream) {
+		Post(dev->inputStream, kAudioStreamPropertyPhysicalFormat, dev->spec.notifyDelay);
+	}
+}
+
+// called with lock held
+OSStatus HAL::SetClockSource(Device *dev, UInt32 source)
+{
+	if (source < 1 || source > dev->spec.clockSources.size()) {
+		return kAudioHardwareIllegalOperationError;
+	}
+	if (source != dev->clockSource) {
+		dev->clockSource = source;
+		dev->clockSourceChanges += 1;
+		dev->reconfigurations += 1;
+		Post(dev->id, kAudioDevicePropertyClockSource, dev->spec.notifyDelay);
+		// the hardware relocks to the current rate on the new clock
+		dev->actualRate = 0;
+		Post(dev->id, kAudioDevicePropertyActualSampleRate, LockTime(dev, dev->targetRate), true, dev->targetRate);
+	}
+	return noErr;
+}
+
+OSStatus HAL::SetProperty(AudioObjectID object, const AudioObjectPropertyAddress &address,
+						  UInt32 size, const void *value, std::unique_lock<std::mutex> &lock)
+{
+	if (object == kAudioObjectSystemObject) {
+		if (address.mSelector == kAudioHardwarePropertyDefaultOutputDevice
+				|| address.mSelector == kAudioHardwarePropertyDefaultInputDevice) {
+			if (size < sizeof(AudioDeviceID)) {
+				return kAudioHardwareBadPropertySizeError;
+			}
+			bool input = (address.mSelector == kAudioHardwarePropertyDefaultInputDevice);
+			std::map<AudioDeviceID, Device *>::iterator it = mDevices.find(*(const AudioDeviceID *) value);
+			if (it == mDevices.end() || !(input ? it->second->spec.input : it->second->spec.output)) {
+				return kAudioHardwareBadDeviceError;
+			}
+			AudioDeviceID &current = input ? mDefaultInput : mDefaultOutput;
+			if (current != it->first) {
+				current = it->first;
+				Post(kAudioObjectSystemObject, address.mSelector, 0);
+			}
+			return noErr;
+		}
+		return kAudioHardwareUnknownPropertyError;
+	}
+	Device *dev = DeviceForObject(object);
+	if (!dev) {
+		return kAudioHardwareBadObjectError;
+	}
+	if (dev->spec.faults.failureProbability > 0 && Uniform() < dev->spec.faults.failureProbability) {
+		return dev->spec.faults.failureStatus;
+	}
+	switch (address.mSelector) {
+		case kAudioDevicePropertyNominalSampleRate:
+			if (object != dev->id) {
+				break;
+			}
+			if (size < sizeof(Float64)) {
+				return kAudioHardwareBadPropertySizeError;
+			}
+			return SetRate(dev, *(const Float64 *) value, lock);
+		case kAudioDevicePropertyClockSource:
+			if (object != dev->id) {
+				break;
+			}
+			if (size < sizeof(UInt32)) {
+				return kAudioHardwareBadPropertySizeError;
+			}
+			return SetClockSource(dev, *(const UInt32 *) value);
+		case kAudioDevicePropertyBufferFrameSize: {
+			if (object != dev->id) {
+				break;
+			}
+			if (size < sizeof(UInt32)) {
+				return kAudioHardwareBadPropertySizeError;
+			}
+			UInt32 frames = *(const UInt32 *) value;
+			if (frames < dev->spec.minBufferFrames || frames > dev->spec.maxBufferFrames) {
+				return kAudioHardwareIllegalOperationError;
+			}
+			if (frames != dev->bufferFrames) {
+				dev->bufferFrames = frames;
+				dev->reconfigurations += 1;
+				Post(dev->id, kAudioDevicePropertyBufferFrameSize, dev->spec.notifyDelay);
+			}
+			return noErr;
+		}
+		case kAudioDevicePropertyStreamFormat:
+		case kAudioStreamPropertyPhysicalFormat: {
+			// (kAudioStreamPropertyVirtualFormat has the same selector as kAudioDevicePropertyStreamFormat)
+			if (size < sizeof(AudioStreamBasicDescription)) {
+				return kAudioHardwareBadPropertySizeError;
+			}
+			const AudioStreamBasicDescription &format = *(const AudioStreamBasicDescription *) value;
+			if (address.mSelector == kAudioStreamPropertyPhysicalFormat) {
+				if (object == dev->id) {
+					break;
+				}
+				bool isFloat = (format.mFormatFlags & kAudioFormatFlagIsFloat) != 0;
+				if (format.mFormatID != kAudioFormatLinearPCM || format.mChannelsPerFrame != dev->spec.channels
+						|| (isFloat ? format.mBitsPerChannel != 32
+							: (format.mBitsPerChannel != 16 && format.mBitsPerChannel != 24 && format.mBitsPerChannel != 32))
+				   ) {
+					return kAudioDeviceUnsupportedFormatError;
+				}
+				Float64 rate = format.mSampleRate;
+				if (!SupportsRate(dev->spec, rate)) {
+					return kAudioDeviceUnsupportedFormatError;
+				}
+				AudioStreamBasicDescription previous = dev->physicalFormat;
+				dev->physicalFormat = MakeFormat(dev->nominalRate, dev->spec.channels, format.mBitsPerChannel, isFloat);
+				Post(object, kAudioStreamPropertyPhysicalFormat, dev->spec.notifyDelay);
+				unsigned long rateChanges = dev->rateChanges;
+				OSStatus err = SetRate(dev, rate, lock);
+				// a change of format and rate is a single reconfiguration
+				if (err == noErr && dev->rateChanges == rateChanges
+						&& memcmp(&previous, &dev->physicalFormat, sizeof(previous)) != 0) {
+					dev->reconfigurations += 1;
+				}
+				return err;
+			}
+			// the virtual format: only its rate can change
+			return SetRate(dev, format.mSampleRate, lock);
+		}
+		default:
+			break;
+	}
+	std::vector<unsigned char> data;
+	bool isArray;
+	return (GetProperty(object, address, 0, NULL, data, isArray, true) == noErr)
+		? kAudioHardwareIllegalOperationError : kAudioHardwareUnknownPropertyError;
+}
+
+void HAL::Dispatch()
+{
+	std::unique_lock<std::mutex> lock(mLock);
+	for (;;) {
+		double now = Now(), wake = now + 1;
+		// the injected notifications
+		for (std::map<AudioDeviceID, Device *>::iterator it = mDevices.begin() ; it != mDevices.end() ; ++it) {
+			Device *dev = it->second;
+			while (dev->nextSpurious <= now) {
+				Post(dev->id, kAudioDevicePropertyNominalSampleRate, 0);
+				dev->nextSpurious += NextInterval(dev->spec.faults.spuriousNotificationsPerSecond);
+			}
+			while (dev->nextOverload <= now) {
+				Post(dev->id, kAudioDeviceProcessorOverload, 0);
+				dev->nextOverload += NextInterval(dev->spec.faults.overloadsPerSecond);
+			}
+			wake = std::min(wake, std::min(dev->nextSpurious, dev->nextOverload));
+		}
+		if (mEvents.empty() || mEvents.begin()->when > now) {
+			if (!mEvents.empty()) {
+				wake = std::min(wake, mEvents.begin()->when);
+			}
+			mWake.wait_for(lock, std::chrono::duration<double>(wake - now));
+			continue;
+		}
+		Event e = *mEvents.begin();
+		mEvents.erase(mEvents.begin());
+		mInFlight = e.seq;
+		if (e.setsActualRate || e.setsNominalRate) {
+			std::map<AudioDeviceID, Device *>::iterator it = mDevices.find(e.object);
+			if (it == mDevices.end() || it->second->targetRate != e.rate) {
+				// the device went away, or was switched again before it locked or reported the rate
+				mInFlight = 0;
+				mFlushed.notify_all();
+				continue;
+			}
+			if (e.setsActualRate) {
+				it->second->actualRate = e.rate;
+			} else {
+				ReportRate(it->second, e.rate);
+			}
+		}
+		AudioObjectPropertyAddress address = { e.selector, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+		// take the delivery lock first: see RemovePropertyListener
+		lock.unlock();
+		{
+			std::lock_guard<std::recursive_mutex> delivery(mDeliveryLock);
+			std::vector<Listener> listeners;
+			lock.lock();
+			for (size_t i = 0 ; i < mListeners.size() ; ++i) {
+				if (mListeners[i].object == e.object && Matches(mListeners[i].address, address)) {
+					listeners.push_back(mListeners[i]);
+				}
+			}
+			mCalls.notifications += listeners.size();
+			lock.unlock();
+			for (size_t i = 0 ; i < listeners.size() ; ++i) {
+				listeners[i].proc(e.object, 1, &address, listeners[i].clientData);
+			}
+		}
+		lock.lock();
+		mInFlight = 0;
+		mFlushed.notify_all();
+	}
+}
+
+void HAL::Flush()
+{
+	std::unique_lock<std::mutex> lock(mLock);
+	unsigned long last = mNextSeq - 1;
+	for (;;) {
+		bool pending = (mInFlight && mInFlight <= last);
+		for (std::set<Event>::const_iterator it = mEvents.begin() ; !pending && it != mEvents.end() ; ++it) {
+			pending = (it->seq <= last);
+		}
+		if (!pending) {
+			break;
+		}
+		mFlushed.wait(lock);
+	}
+}
+
+} // namespace
+
+// ---- the AudioObject API ----
+
+// the depth of AudioObject API calls on this thread (listeners can call the API)
+static thread_local int tCallDepth = 0;
+
+namespace {
+struct CallScope {
+	CallScope()
+	{
+		tCallDepth += 1;
+	}
+	~CallScope()
+	{
+		tCallDepth -= 1;
+	}
+};
+} // namespace
+
+bool SimHAL::InCall()
+{
+	return tCallDepth > 0;
+}
+
+Boolean AudioObjectHasProperty(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.Populate();
+	hal.mCalls.has += 1;
+	std::vector<unsigned char> data;
+	bool isArray;
+	return inAddress && hal.GetProperty(inObjectID, *inAddress, 0, NULL, data, isArray, true) == noErr;
+}
+
+OSStatus AudioObjectIsPropertySettable(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+									   Boolean *outIsSettable)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.Populate();
+	hal.mCalls.isSettable += 1;
+	std::vector<unsigned char> data;
+	bool isArray;
+	if (!inAddress || !outIsSettable) {
+		return paramErr;
+	}
+	OSStatus err = hal.GetProperty(inObjectID, *inAddress, 0, NULL, data, isArray, true);
+	if (err == noErr) {
+		switch (inAddress->mSelector) {
+			case kAudioHardwarePropertyDefaultOutputDevice:
+			case kAudioHardwarePropertyDefaultInputDevice:
+				*outIsSettable = (inObjectID == kAudioObjectSystemObject);
+				break;
+			case kAudioDevicePropertyNominalSampleRate:
+			case kAudioDevicePropertyBufferFrameSize:
+			case kAudioDevicePropertyClockSource:
+			case kAudioDevicePropertyStreamFormat:
+			case kAudioStreamPropertyPhysicalFormat:
+				*outIsSettable = (inObjectID != kAudioObjectSystemObject);
+				break;
+			default:
+				*outIsSettable = false;
+				break;
+		}
+	}
+	return err;
+}
+
+OSStatus AudioObjectGetPropertyDataSize(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+										UInt32 inQualifierDataSize, const void *inQualifierData, UInt32 *outDataSize)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.Populate();
+	hal.mCalls.getSize += 1;
+	if (!inAddress || !outDataSize) {
+		return paramErr;
+	}
+	double stall = hal.Stall(inObjectID);
+	std::vector<unsigned char> data;
+	bool isArray;
+	OSStatus err = hal.GetProperty(inObjectID, *inAddress, inQualifierDataSize, inQualifierData, data, isArray, true);
+	if (err == noErr) {
+		*outDataSize = (UInt32) data.size();
+	}
+	lock.unlock();
+	SleepFor(stall);
+	return err;
+}
+
+OSStatus AudioObjectGetPropertyData(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+									UInt32 inQualifierDataSize, const void *inQualifierData, UInt32 *ioDataSize, void *outData)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.Populate();
+	hal.mCalls.get += 1;
+	if (!inAddress || !ioDataSize || !outData) {
+		return paramErr;
+	}
+	double stall = hal.Stall(inObjectID);
+	if (inAddress->mSelector == kAudioDevicePropertyClockSourceNameForIDCFString) {
+		// translations take their input from the data
+		inQualifierDataSize = *ioDataSize;
+		inQualifierData = outData;
+	}
+	std::vector<unsigned char> data;
+	bool isArray;
+	OSStatus err = hal.GetProperty(inObjectID, *inAddress, inQualifierDataSize, inQualifierData, data, isArray, false);
+	if (err == noErr) {
+		if (*ioDataSize < data.size() && !isArray) {
+			err = kAudioHardwareBadPropertySizeError;
+		} else {
+			UInt32 n = std::min(*ioDataSize, (UInt32) data.size());
+			if (n) {
+				memcpy(outData, &data[0], n);
+			}
+			if (inAddress->mSelector == kAudioDevicePropertyDeviceName && n) {
+				// a truncated name is still a C string
+				static_cast<char *>(outData)[n - 1] = '\0';
+			}
+			*ioDataSize = n;
+		}
+	}
+	lock.unlock();
+	SleepFor(stall);
+	return err;
+}
+
+OSStatus AudioObjectSetPropertyData(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+									UInt32 inQualifierDataSize, const void *inQualifierData, UInt32 inDataSize, const void *inData)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	double start = Now();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.Populate();
+	hal.mCalls.set += 1;
+	if (!inAddress || !inData) {
+		return paramErr;
+	}
+	double stall = hal.Stall(inObjectID);
+	if (stall > 0) {
+		lock.unlock();
+		SleepFor(stall);
+		lock.lock();
+	}
+	OSStatus err = hal.SetProperty(inObjectID, *inAddress, inDataSize, inData, lock);
+	if (err != noErr) {
+		hal.mCalls.failures += 1;
+	}
+	hal.mCalls.setSeconds += Now() - start;
+	return err;
+}
+
+OSStatus AudioObjectAddPropertyListener(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+										AudioObjectPropertyListenerProc inListener, void *inClientData)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.Populate();
+	hal.mCalls.addListener += 1;
+	if (!inAddress || !inListener) {
+		return paramErr;
+	}
+	if (inObjectID != kAudioObjectSystemObject && !hal.DeviceForObject(inObjectID)) {
+		return kAudioHardwareBadObjectError;
+	}
+	Listener l = { inObjectID, *inAddress, inListener, inClientData };
+	hal.mListeners.push_back(l);
+	return noErr;
+}
+
+OSStatus AudioObjectRemovePropertyListener(AudioObjectID inObjectID, const AudioObjectPropertyAddress *inAddress,
+										   AudioObjectPropertyListenerProc inListener, void *inClientData)
+{
+	CallScope scope;
+	HAL &hal = TheHAL();
+	// wait for a running invocation of the listener to return (unless that is where we are called from)
+	std::lock_guard<std::recursive_mutex> delivery(hal.mDeliveryLock);
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	hal.mCalls.removeListener += 1;
+	if (!inAddress || !inListener) {
+		return paramErr;
+	}
+	for (std::vector<Listener>::iterator it = hal.mListeners.begin() ; it != hal.mListeners.end() ; ++it) {
+		if (it->object == inObjectID && it->proc == inListener && it->clientData == inClientData
+				&& it->address.mSelector == inAddress->mSelector && it->address.mScope == inAddress->mScope
+				&& it->address.mElement == inAddress->mElement) {
+			hal.mListeners.erase(it);
+			return noErr;
+		}
+	}
+	return kAudioHardwareIllegalOperationError;
+}
+
+// ---- scripting and control ----
+
+AudioDeviceID SimHAL::AddDevice(const SimDeviceSpec &spec, bool makeDefault)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	return hal.AddDevice(spec, makeDefault);
+}
+
+bool SimHAL::RemoveDevice(AudioDeviceID device)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	std::map<AudioDeviceID, Device *>::iterator it = hal.mDevices.find(device);
+	if (it == hal.mDevices.end()) {
+		return false;
+	}
+	hal.RemoveDevice(it->second);
+	return true;
+}
+
+AudioDeviceID SimHAL::FindDevice(const char *name)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	Device *dev = hal.FindDevice(name);
+	return dev ? dev->id : kAudioDeviceUnknown;
+}
+
+bool SimHAL::SetDefaultDevice(AudioDeviceID device, bool forInput)
+{
+	AudioObjectPropertyAddress address = { forInput ? kAudioHardwarePropertyDefaultInputDevice : kAudioHardwarePropertyDefaultOutputDevice,
+										   kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+	HAL &hal = TheHAL();
+	std::unique_lock<std::mutex> lock(hal.mLock);
+	return hal.SetProperty(kAudioObjectSystemObject, address, sizeof(device), &device, lock) == noErr;
+}
+
+bool SimHAL::SetFaults(AudioDeviceID device, const SimFaults &faults)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	bool found = false;
+	double now = Now();
+	for (std::map<AudioDeviceID, Device *>::iterator it = hal.mDevices.begin() ; it != hal.mDevices.end() ; ++it) {
+		if (device == kAudioObjectUnknown || it->first == device) {
+			it->second->spec.faults = faults;
+			hal.ScheduleFaults(it->second, now);
+			found = true;
+		}
+	}
+	hal.mWake.notify_one();
+	return found;
+}
+
+bool SimHAL::GetDeviceState(AudioDeviceID device, SimDeviceState &state)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	std::map<AudioDeviceID, Device *>::iterator it = hal.mDevices.find(device);
+	if (it == hal.mDevices.end()) {
+		return false;
+	}
+	state.nominalRate = it->second->nominalRate;
+	state.actualRate = it->second->actualRate;
+	state.bufferFrames = it->second->bufferFrames;
+	state.physicalFormat = it->second->physicalFormat;
+	state.rateChanges = it->second->rateChanges;
+	state.reconfigurations = it->second->reconfigurations;
+	state.clockSource = it->second->clockSource;
+	state.clockSourceChanges = it->second->clockSourceChanges;
+	return true;
+}
+
+bool SimHAL::Notify(AudioDeviceID device, AudioObjectPropertySelector selector)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	if (device != kAudioObjectSystemObject && !hal.DeviceForObject(device)) {
+		return false;
+	}
+	hal.Post(device, selector, 0);
+	return true;
+}
+
+void SimHAL::Flush()
+{
+	TheHAL().Flush();
+}
+
+void SimHAL::Reset()
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	while (!hal.mDevices.empty()) {
+		hal.RemoveDevice(hal.mDevices.begin()->second);
+	}
+	hal.mPopulated = true;
+	memset(&hal.mCalls, 0, sizeof(hal.mCalls));
+}
+
+void SimHAL::Seed(unsigned long seed)
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	hal.mRandom.seed(seed);
+}
+
+SimCallCounts SimHAL::Calls()
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	return hal.mCalls;
+}
+
+void SimHAL::ResetCalls()
+{
+	HAL &hal = TheHAL();
+	std::lock_guard<std::mutex> lock(hal.mLock);
+	memset(&hal.mCalls, 0, sizeof(hal.mCalls));
+}
+
+// split a script line into words; double quotes group words, # starts a comment
+static std::vector<std::string> Words(const char *line)
+{
+	std::vector<std::string> words;
+	std::string word;
+	bool quoted = false, inWord = false;
+	for (const char *c = line ; *c && *c != '\n' && *c != '\r' ; ++c) {
+		if (*c == '"') {
+			quoted = !quoted;
+			inWord = true;
+		} else if (!quoted && *c == '#') {
+			break;
+		} else if (!quoted && (*c == ' ' || *c == '\t')) {
+			if (inWord) {
+				words.push_back(word);
+				word.clear();
+				inWord = false;
+			}
+		} else {
+			word += *c;
+			inWord = true;
+		}
+	}
+	if (inWord) {
+		words.push_back(word);
+	}
+	return words;
+}
+
+static OSStatus ParseStatus(const std::string &s)
+{
+	if (s.size() == 4 && !isdigit((unsigned char) s[0]) && s[0] != '-') {
+		return (OSStatus) (((UInt32) (unsigned char) s[0] << 24) | ((UInt32) (unsigned char) s[1] << 16)
+						   | ((UInt32) (unsigned char) s[2] << 8) | (UInt32) (unsigned char) s[3]);
+	}
+	return (OSStatus) strtol(s.c_str(), NULL, 0);
+}
+
+bool SimHAL::RunScriptLine(const char *line, std::string *error)
+{
+	std::vector<std::string> words = Words(line);
+	if (words.empty()) {
+		return true;
+	}
+	const std::string &command = words[0];
+	std::string fail;
+	if (command == "device" && words.size() >= 2) {
+		SimDeviceSpec spec;
+		bool makeDefault = false, ratesGiven = false;
+		spec.name = words[1];
+		for (size_t i = 2 ; i < words.size() && fail.empty() ; ++i) {
+			const std::string &w = words[i];
+			size_t eq = w.find('=');
+			std::string key = w.substr(0, eq), value = (eq == std::string::npos) ? "" : w.substr(eq + 1);
+			double v = atof(value.c_str());
+			if (key == "default") {
+				makeDefault = true;
+			} else if (key == "rates" || key == "range") {
+				if (!ratesGiven) {
+					spec.rates.clear();
+					ratesGiven = true;
+				}
+				if (key == "range") {
+					AudioValueRange r = { atof(value.c_str()), 0 };
+					size_t dash = value.find('-');
+					r.mMaximum = (dash == std::string::npos) ? r.mMinimum : atof(value.c_str() + dash + 1);
+					spec.rates.push_back(r);
+				} else {
+					for (const char *p = value.c_str() ; *p ; ) {
+						char *end;
+						AudioValueRange r;
+						r.mMinimum = r.mMaximum = strtod(p, &end);
+						if (end == p) {
+							fail = "bad rate list " + value;
+							break;
+						}
+						spec.rates.push_back(r);
+						p = (*end == ',') ? end + 1 : end;
+					}
+				}
+			} else if (key == "uid") {
+				spec.uid = value;
+			} else if (key == "rate") {
+				spec.nominalRate = v;
+			} else if (key == "channels") {
+				spec.channels = (UInt32) v;
+			} else if (key == "bits") {
+				spec.bits = (UInt32) v;
+			} else if (key == "input") {
+				spec.input = (v != 0);
+			} else if (key == "output") {
+				spec.output = (v != 0);
+			} else if (key == "buffer") {
+				spec.bufferFrames = (UInt32) v;
+			} else if (key == "buffermin") {
+				spec.minBufferFrames = (UInt32) v;
+			} else if (key == "buffermax") {
+				spec.maxBufferFrames = (UInt32) v;
+			} else if (key == "latency") {
+				spec.latencyFrames = (UInt32) v;
+			} else if (key == "safety") {
+				spec.safetyOffsetFrames = (UInt32) v;
+			} else if (key == "streamlatency") {
+				spec.streamLatencyFrames = (UInt32) v;
+			} else if (key == "domain") {
+				spec.clockDomain = (UInt32) v;
+			} else if (key == "setlatency") {
+				spec.setLatency = v / 1000.0;
+			} else if (key == "settle") {
+				spec.settleTime = v / 1000.0;
+			} else if (key == "notify") {
+				spec.notifyDelay = v / 1000.0;
+			} else if (key == "nominallag") {
+				spec.nominalLag = v / 1000.0;
+			} else if (key == "clocks") {
+				for (const char *p = value.c_str() ; *p ; ) {
+					char *end, name[64];
+					SimClockSource source;
+					source.baseRate = strtod(p, &end);
+					if (end == p) {
+						fail = "bad rate list " + value;
+						break;
+					}
+					if (source.baseRate > 0) {
+						snprintf(name, sizeof(name), "Internal %gkHz", source.baseRate / 1000);
+					} else {
+						snprintf(name, sizeof(name), "External");
+					}
+					source.name = name;
+					spec.clockSources.push_back(source);
+					p = (*end == ',') ? end + 1 : end;
+				}
+			} else if (key == "clock") {
+				spec.clockSource = (UInt32) v;
+			} else if (key == "relock") {
+				spec.relockTime = v / 1000.0;
+			} else if (key == "refuse" || key == "ignore") {
+				std::vector<Float64> &list = (key == "refuse") ? spec.refusedRates : spec.ignoredRates;
+				for (const char *p = value.c_str() ; *p ; ) {
+					char *end;
+					list.push_back(strtod(p, &end));
+					if (end == p) {
+						fail = "bad rate list " + value;
+						break;
+					}
+					p = (*end == ',') ? end + 1 : end;
+				}
+			} else {
+				fail = "unknown device parameter " + key;
+			}
+		}
+		if (fail.empty() && !SupportsRate(spec, spec.nominalRate)) {
+			spec.nominalRate = spec.rates.empty() ? spec.nominalRate : spec.rates[0].mMinimum;
+		}
+		if (fail.empty()) {
+			AddDevice(spec, makeDefault);
+		}
+	} else if (command == "faults") {
+		SimFaults faults;
+		AudioDeviceID device = kAudioObjectUnknown;
+		for (size_t i = 1 ; i < words.size() && fail.empty() ; ++i) {
+			const std::string &w = words[i];
+			size_t eq = w.find('=');
+			std::string key = w.substr(0, eq), value = (eq == std::string::npos) ? "" : w.substr(eq + 1);
+			size_t colon = value.find(':');
+			std::string second = (colon == std::string::npos) ? "" : value.substr(colon + 1);
+			if (key == "device") {
+				if ((device = FindDevice(value.c_str())) == kAudioDeviceUnknown) {
+					fail = "no device " + value;
+				}
+			} else if (key == "slow") {
+				faults.slowCallProbability = atof(value.c_str());
+				faults.slowCallSeconds = atof(second.c_str()) / 1000.0;
+			} else if (key == "fail") {
+				faults.failureProbability = atof(value.c_str());
+				if (!second.empty()) {
+					faults.failureStatus = ParseStatus(second);
+				}
+			} else if (key == "spurious") {
+				faults.spuriousNotificationsPerSecond = atof(value.c_str());
+			} else if (key == "overload") {
+				faults.overloadsPerSecond = atof(value.c_str());
+			} else {
+				fail = "unknown fault " + key;
+			}
+		}
+		if (fail.empty() && !SetFaults(device, faults)) {
+			fail = "no devices to inject faults into";
+		}
+	} else if (command == "default" && words.size() >= 2) {
+		AudioDeviceID device = FindDevice(words[1].c_str());
+		if (!SetDefaultDevice(device, words.size() > 2 && words[2] == "input")) {
+			fail = "cannot make " + words[1] + " the default device";
+		}
+	} else if (command == "remove" && words.size() >= 2) {
+		if (!RemoveDevice(FindDevice(words[1].c_str()))) {
+			fail = "no device " + words[1];
+		}
+	} else if (command == "seed" && words.size() >= 2) {
+		Seed(strtoul(words[1].c_str(), NULL, 0));
+	} else {
+		fail = "cannot parse \"" + std::string(line) + "\"";
+	}
+	if (!fail.empty() && error) {
+		*error = fail;
+	}
+	return fail.empty();
+}
+
+bool SimHAL::RunScript(const char *path, std::string *error)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		if (error) {
+			*error = std::string("cannot open ") + path;
+		}
+		return false;
+	}
+	char line[1024];
+	int lineNr = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp)) {
+		std::string lineError;
+		lineNr += 1;
+		if (!(ok = RunScriptLine(line, &lineError)) && error) {
+			char where[32];
+			snprintf(where, sizeof(where), ":%d: ", lineNr);
+			*error = path + std::string(where) + lineError;
+		}
+	}
+	fclose(fp);
+	return ok;
+}
@@ -0,0 +1,153 @@
+/*=============================================================================
+	SimHAL.h
+
+	An in-process stand-in for the CoreAudio HAL, so that the device code
+	(AudioDevice.mm, AudioDeviceList.cpp, AudioDeviceSet.cpp) can be built
+	and exercised on hosts without CoreAudio. Build with
+	-DBP_SIMULATED_HAL and -I<repo>/SimHAL; the headers in this directory
+	then take the place of the system frameworks.
+
+	The HAL's state is a set of virtual devices, each described by a
+	SimDeviceSpec: supported rates (discrete values and/or ranges), buffer
+	size range, latencies, clock domain, and the timing of a rate change:
+	how long the set call blocks, how long the hardware takes to lock to
+	the new rate, and how long before listeners are told. Listeners are
+	called asynchronously on a notification thread of the HAL, as they
+	are on macOS.
+	A device can have clock sources, each made for a family of rates (the
+	multiples of 44.1kHz or of 48kHz) or for any rate; it then relocks
+	slowly to a rate outside the family of the selected source.
+	Faults can be injected per device: calls that stall, set calls that
+	fail, spurious rate notifications and processor overloads.
+
+	Devices are created programmatically or from a script (see RunScript);
+	when the environment variable SIMHAL_SCRIPT names a script, it is run
+	on the first HAL call. Without any device, a default stereo output
+	device is created.
+=============================================================================*/
+
+#ifndef __SimHAL_h__
+#define __SimHAL_h__
+
+#include <CoreAudio/CoreAudio.h>
+
+#include <string>
+#include <vector>
+
+struct SimFaults {
+	// the probability that a property call stalls, and for how long (seconds)
+	double slowCallProbability, slowCallSeconds;
+	// the probability that a set call fails, and the error it returns
+	double failureProbability;
+	OSStatus failureStatus;
+	// the mean number of nominal rate notifications per second without an actual change
+	double spuriousNotificationsPerSecond;
+	// the mean number of kAudioDeviceProcessorOverload notifications per second
+	double overloadsPerSecond;
+
+	SimFaults();
+};
+
+struct SimClockSource {
+	std::string name;
+	// the rate the clock runs at; it serves the rates of its family. 0 for a clock
+	// that serves any rate, like an external one.
+	Float64 baseRate;
+};
+
+struct SimDeviceSpec {
+	std::string name, uid;
+	// entries with mMinimum == mMaximum are discrete rates, the others ranges
+	std::vector<AudioValueRange> rates;
+	Float64 nominalRate;
+	// the physical format: integer samples of this many bits. The streams offer 16, 24 and
+	// 32 bit integer and 32 bit float formats at every rate.
+	UInt32 channels, bits;
+	bool input, output;
+	UInt32 bufferFrames, minBufferFrames, maxBufferFrames;
+	UInt32 latencyFrames, safetyOffsetFrames, streamLatencyFrames;
+	UInt32 clockDomain;
+	// seconds a rate change blocks the caller, before the hardware has locked to the
+	// new rate (the actual rate follows), and before listeners are notified
+	double setLatency, settleTime, notifyDelay;
+	// seconds after a rate change before the nominal rate reads back as the new rate (and
+	// listeners are told), as with hardware that reports a change late; the hardware only
+	// locks after that. 0 updates it before the set call returns.
+	double nominalLag;
+	// the clock sources (with IDs 1, 2, ..), the one selected initially, and the time the
+	// hardware takes instead of settleTime to lock to a rate its source isn't made for.
+	// Selecting a source doesn't block; the hardware relocks to the current rate.
+	std::vector<SimClockSource> clockSources;
+	UInt32 clockSource;
+	double relockTime;
+	// advertised rates the device won't take: set calls to a refused rate fail,
+	// those to an ignored rate succeed but leave the rate as it was
+	std::vector<Float64> refusedRates, ignoredRates;
+	SimFaults faults;
+
+	// a stereo 24 bit output device with the usual discrete rates from 44.1 to 192kHz
+	SimDeviceSpec();
+};
+
+struct SimDeviceState {
+	Float64 nominalRate, actualRate;
+	UInt32 bufferFrames;
+	AudioStreamBasicDescription physicalFormat;
+	// completed nominal rate changes, and all completed changes of the rate, the physical
+	// format or the buffer size (a format change that takes the rate along counts once)
+	unsigned long rateChanges, reconfigurations;
+	// the selected clock source (0 for a device without), and the number of times it changed
+	UInt32 clockSource;
+	unsigned long clockSourceChanges;
+};
+
+struct SimCallCounts {
+	unsigned long has, isSettable, getSize, get, set, addListener, removeListener;
+	// listener invocations, and set calls that failed (injected or refused)
+	unsigned long notifications, failures;
+	// time spent in set calls, in seconds
+	double setSeconds;
+};
+
+class SimHAL {
+public:
+	static AudioDeviceID AddDevice(const SimDeviceSpec &spec, bool makeDefault = false);
+	static bool RemoveDevice(AudioDeviceID device);
+	static AudioDeviceID FindDevice(const char *name);
+	static bool SetDefaultDevice(AudioDeviceID device, bool forInput = false);
+	// kAudioObjectUnknown sets the faults of all devices
+	static bool SetFaults(AudioDeviceID device, const SimFaults &faults);
+	static bool GetDeviceState(AudioDeviceID device, SimDeviceState &state);
+	// post a notification of the given device property, as if the hardware had changed it
+	static bool Notify(AudioDeviceID device, AudioObjectPropertySelector selector);
+	// wait until all notifications posted so far have been delivered
+	static void Flush();
+	// remove all devices and reset the call counts
+	static void Reset();
+	// seeds the generator behind the injected faults, for reproducible runs
+	static void Seed(unsigned long seed);
+
+	static SimCallCounts Calls();
+	static void ResetCalls();
+	// true on a thread that is inside a call of the AudioObject API, so that tools that account
+	// for the work of the device code (its allocations, for one) can leave out the HAL's
+	static bool InCall();
+
+	// Scripts have one command per line; # starts a comment. Names with spaces are quoted.
+	//	device <name> [uid=..] [rates=44100,48000,..] [range=min-max].. [rate=..] [channels=..]
+	//			[bits=..] [input=0|1] [output=0|1] [buffer=..] [buffermin=..] [buffermax=..]
+	//			[latency=..] [safety=..] [streamlatency=..] [domain=..] [setlatency=ms]
+	//			[settle=ms] [notify=ms] [nominallag=ms] [refuse=rate,..] [ignore=rate,..]
+	//			[clocks=rate,..] [clock=n] [relock=ms] [default]
+	//		clocks gives the base rates of the clock sources, 0 for an external clock; they are
+	//		named "Internal 44.1kHz", "External" and so on.
+	//	faults [device=<name>] [slow=probability:ms] [fail=probability[:status]]
+	//			[spurious=per second] [overload=per second]
+	//	default <name> [input]
+	//	remove <name>
+	//	seed <n>
+	static bool RunScript(const char *path, std::string *error = NULL);
+	static bool RunScriptLine(const char *line, std::string *error = NULL);
+};
+
+#endif // __SimHAL_h__
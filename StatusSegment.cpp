@@ -0,0 +1,136 @@
+/*=============================================================================
+	StatusSegment.cpp
+
+=============================================================================*/
+
+#include "StatusSegment.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+
+// how often Read tries to get a consistent copy before giving up
+static const int kReadAttempts = 1000;
+
+StatusSegment::StatusSegment()
+	: mSegment(NULL)
+	, mWriter(false)
+{
+	memset(&mStatus, 0, sizeof(mStatus));
+}
+
+StatusSegment::~StatusSegment()
+{
+	Close();
+}
+
+const char *StatusSegment::DefaultName()
+{
+	return "/BPSampleRate.status";
+}
+
+bool StatusSegment::Create(const char *name)
+{
+	Close();
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	// macOS only allows to size a segment once; an existing one of the right size is reused
+	if (fstat(fd, &st) != 0 || (st.st_size != sizeof(Segment) && ftruncate(fd, sizeof(Segment)) != 0)) {
+		close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	mSegment = static_cast<Segment *>(p);
+	mWriter = true;
+	mName = name;
+	mSegment->magic = kMagic;
+	mSegment->version = kVersion;
+	mSegment->size = sizeof(Segment);
+	mStatus.pid = (uint32_t) getpid();
+	mSegment->sequence.store(0, std::memory_order_relaxed);
+	Publish();
+	return true;
+}
+
+bool StatusSegment::Open(const char *name)
+{
+	Close();
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Segment)) {
+		close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	mSegment = static_cast<Segment *>(p);
+	if (mSegment->magic != kMagic || mSegment->version != kVersion || mSegment->size != sizeof(Segment)) {
+		Close();
+		return false;
+	}
+	mWriter = false;
+	mName = name;
+	return true;
+}
+
+void StatusSegment::Close()
+{
+	if (mSegment) {
+		munmap(mSegment, sizeof(Segment));
+		mSegment = NULL;
+		if (mWriter) {
+			// readers that have it mapped keep the last status; new ones no longer find it
+			shm_unlink(mName.c_str());
+		}
+	}
+}
+
+void StatusSegment::Publish()
+{
+	if (!mSegment || !mWriter) {
+		return;
+	}
+	mStatus.updated = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+	uint32_t sequence = mSegment->sequence.load(std::memory_order_relaxed);
+	mSegment->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&mSegment->status, &mStatus, sizeof(mStatus));
+	mSegment->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool StatusSegment::Read(Status &status) const
+{
+	if (!mSegment) {
+		return false;
+	}
+	for (int i = 0 ; i < kReadAttempts ; ++i) {
+		uint32_t before = mSegment->sequence.load(std::memory_order_acquire);
+		if (before & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(&status, &mSegment->status, sizeof(status));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (mSegment->sequence.load(std::memory_order_relaxed) == before) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,89 @@
+/*=============================================================================
+	StatusSegment.h
+
+	The plugin's current state and its counters, published in a POSIX
+	shared memory segment so that monitors can follow it at any frequency
+	without asking the HAL or waiting for the iTunes thread. The plugin is
+	the only writer; it publishes a complete copy of the status under a
+	sequence lock: the sequence number is odd while an update is in
+	progress, and a reader retries until it has copied the status between
+	two reads of the same even number. Readers never block the writer.
+	The layout is plain data of fixed size, so that tools in any language
+	can read it; see tools/BPStatus for an example.
+=============================================================================*/
+
+#ifndef __StatusSegment_h__
+#define __StatusSegment_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+class StatusSegment {
+public:
+	enum {
+		kMagic = 0x42505354,		// 'BPST'
+		kVersion = 2
+	};
+
+	struct Status {
+		uint32_t pid;
+		uint32_t playing;
+		// the default output device
+		uint32_t deviceID;
+		char deviceName[128];
+		// the rate of the current track, the rate requested from the device for it,
+		// and the device's nominal rate as the plugin last saw it
+		double contentRate, chosenRate, nominalRate;
+		// monotonic counters: rate changes, requests that needed no change,
+		// failed requests, and HAL calls made by the device code
+		uint64_t switches, skippedSwitches, failures, halCalls;
+		// the pulse messages received (each one wakes iTunes and the plugin up),
+		// and the pulse rate the plugin last asked for
+		uint64_t pulses;
+		uint32_t pulseRate;
+		// when the status was published, in seconds since the epoch
+		double updated;
+	};
+
+	struct Segment {
+		uint32_t magic, version, size;
+		std::atomic<uint32_t> sequence;
+		Status status;
+	};
+
+	StatusSegment();
+	~StatusSegment();
+
+	// create (or take over) the segment for writing, with a name like "/BPSampleRate.status"
+	bool Create(const char *name);
+	// map an existing segment for reading
+	bool Open(const char *name);
+	void Close();
+	bool Valid() const
+	{
+		return mSegment != NULL;
+	}
+
+	// the writer's copy of the status: change it, then Publish() it
+	Status &Edit()
+	{
+		return mStatus;
+	}
+	void Publish();
+
+	// a consistent copy of the status; false if the segment is gone or kept changing
+	bool Read(Status &status) const;
+
+	// "/BPSampleRate.status"
+	static const char *DefaultName();
+
+protected:
+	Segment *mSegment;
+	bool mWriter;
+	std::string mName;
+	Status mStatus;
+};
+
+#endif // __StatusSegment_h__
@@ -0,0 +1,154 @@
+/*=============================================================================
+	SwitchCosts.cpp
+
+=============================================================================*/
+
+#include "SwitchCosts.h"
+#include "AudioDevice.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+SwitchCosts::SwitchCosts(const char *path, double maxAge)
+	: mPath(path ? std::string(path) : DefaultPath())
+	, mTmpPath(mPath + ".tmp")
+	, mMaxAge(maxAge)
+	, mCount(0)
+	, mDirty(false)
+{
+	// here rather than in Save(), which shouldn't allocate
+	for (size_t slash = mPath.find('/', 1) ; slash != std::string::npos ; slash = mPath.find('/', slash + 1)) {
+		mkdir(mPath.substr(0, slash).c_str(), 0755);
+	}
+	Load();
+}
+
+SwitchCosts::~SwitchCosts()
+{
+	Save();
+}
+
+std::string SwitchCosts::DefaultPath()
+{
+	const char *home = getenv("HOME");
+	return std::string(home ? home : "/tmp") + "/Library/Caches/iTunesBPSampleRate/SwitchCosts";
+}
+
+void SwitchCosts::Load()
+{
+	FILE *fp = fopen(mPath.c_str(), "r");
+	if (!fp) {
+		return;
+	}
+	double now = (double) time(NULL);
+	double from, to, seconds, when;
+	unsigned int samples;
+	char uid[512];
+	// from, to, seconds, samples, time, and the UID, which may contain spaces, up to the end of the line
+	while (fscanf(fp, "%lf %lf %lf %u %lf %511[^\n]", &from, &to, &seconds, &samples, &when, uid) == 6) {
+		if (now - when > mMaxAge) {
+			mDirty = true;
+			continue;
+		}
+		Transition *t = Find(uid, from, to, true);
+		t->cost.seconds = seconds;
+		t->cost.samples = samples;
+		t->cost.when = when;
+	}
+	fclose(fp);
+}
+
+SwitchCosts::Transition *SwitchCosts::Find(const char *uid, double from, double to, bool add)
+{
+	Transition *oldest = NULL;
+	for (size_t i = 0 ; i < mCount ; ++i) {
+		Transition &t = mTransitions[i];
+		if (t.from == from && t.to == to && strcmp(t.uid, uid) == 0) {
+			return &t;
+		}
+		if (!oldest || t.cost.when < oldest->cost.when) {
+			oldest = &t;
+		}
+	}
+	if (!add) {
+		return NULL;
+	}
+	Transition *t = (mCount < kMaxTransitions) ? &mTransitions[mCount++] : oldest;
+	strncpy(t->uid, uid, sizeof(t->uid) - 1);
+	t->uid[sizeof(t->uid) - 1] = '\0';
+	t->from = from;
+	t->to = to;
+	memset(&t->cost, 0, sizeof(t->cost));
+	return t;
+}
+
+double SwitchCosts::Expected(const char *uid, double from, double to) const
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	double total = 0;
+	unsigned n = 0;
+	for (size_t i = 0 ; i < mCount ; ++i) {
+		const Transition &t = mTransitions[i];
+		if (strcmp(t.uid, uid) == 0) {
+			if (t.from == from && t.to == to) {
+				return t.cost.seconds;
+			}
+			total += t.cost.seconds;
+			n += 1;
+		}
+	}
+	return n ? total / n : -1;
+}
+
+void SwitchCosts::Record(const char *uid, double from, double to, double seconds)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	Cost &c = Find(uid, from, to, true)->cost;
+	c.samples += 1;
+	c.seconds += (seconds - c.seconds) / std::min<uint32_t>(c.samples, kWindow);
+	c.when = (double) time(NULL);
+	mDirty = true;
+}
+
+bool SwitchCosts::Save()
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	if (!mDirty) {
+		return true;
+	}
+	int fd = open(mTmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = true;
+	for (size_t i = 0 ; i < mCount && ok ; ++i) {
+		const Transition &t = mTransitions[i];
+		char line[384];
+		int n = snprintf(line, sizeof(line), "%.17g %.17g %.6f %u %.0f %s\n", t.from, t.to, t.cost.seconds,
+						 (unsigned int) t.cost.samples, t.cost.when, t.uid);
+		ok = n > 0 && (size_t) n < sizeof(line) && write(fd, line, n) == n;
+	}
+	ok = (close(fd) == 0) && ok && rename(mTmpPath.c_str(), mPath.c_str()) == 0;
+	if (ok) {
+		mDirty = false;
+	} else {
+		unlink(mTmpPath.c_str());
+	}
+	return ok;
+}
+
+void SwitchCosts::Log() const
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	for (size_t i = 0 ; i < mCount ; ++i) {
+		const Transition &t = mTransitions[i];
+		ADLog("Device %s switches from %gHz to %gHz in %.1fms (%u switches)", t.uid, t.from, t.to,
+			  t.cost.seconds * 1000, (unsigned int) t.cost.samples);
+	}
+}
@@ -0,0 +1,86 @@
+/*=============================================================================
+	SwitchCosts.h
+
+	A persistent record of how long each device takes to switch from one
+	nominal rate to another: from the set call until the hardware has
+	locked on the new rate (the actual rate has followed), which is the
+	time the audio is interrupted. AudioDevice measures every switch it
+	makes and adds it here; the plugin compares the expected cost of a
+	switch with the duration of the track it is for, and leaves a short
+	track (a preview, an interstitial) at the current rate when the relock
+	would take a large part of it. Costs are kept per device UID and
+	transition as a running mean that follows the most recent switches,
+	and expire after a while like the rejected rates. The record is kept
+	in a table of fixed size, the transition measured longest ago making
+	room for a new one, and written to a text file in the plugin's cache
+	folder; neither a switch nor writing the record allocates, so that both
+	can happen on the message thread. Switches are usually measured on a
+	HAL thread, hence the lock.
+=============================================================================*/
+
+#ifndef __SwitchCosts_h__
+#define __SwitchCosts_h__
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+class SwitchCosts {
+public:
+	enum {
+		// the number of recent switches the running mean follows
+		kWindow = 8,
+		kMaxTransitions = 256
+	};
+
+	struct Cost {
+		// the mean time to relock over the last kWindow switches, in seconds, and the
+		// number of switches measured
+		double seconds;
+		uint32_t samples;
+		// when the transition was measured last, in seconds since the epoch
+		double when;
+	};
+
+	// entries older than maxAge seconds are dropped when the record is loaded
+	SwitchCosts(const char *path = NULL, double maxAge = 90 * 86400.0);
+	~SwitchCosts();
+
+	// the expected cost of switching the device from one rate to another, in seconds: the
+	// mean of the transition, or of the device's other transitions if this one is new;
+	// -1 if no switch of the device has been measured.
+	double Expected(const char *uid, double from, double to) const;
+	// a switch that took seconds from the set call until the device had locked on the new rate
+	void Record(const char *uid, double from, double to, double seconds);
+	// write the record if it has changed
+	bool Save();
+
+	size_t Count() const
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		return mCount;
+	}
+	void Log() const;
+	// ~/Library/Caches/iTunesBPSampleRate/SwitchCosts
+	static std::string DefaultPath();
+
+protected:
+	struct Transition {
+		char uid[256];
+		double from, to;
+		Cost cost;
+	};
+
+	void Load();
+	// the entry of the transition, added if it is new; must be called with mLock held
+	Transition *Find(const char *uid, double from, double to, bool add);
+
+	std::string mPath, mTmpPath;
+	double mMaxAge;
+	Transition mTransitions[kMaxTransitions];
+	size_t mCount;
+	bool mDirty;
+	mutable std::mutex mLock;
+};
+
+#endif // __SwitchCosts_h__
@@ -0,0 +1,103 @@
+/*=============================================================================
+	TrackHints.cpp
+
+=============================================================================*/
+
+#include "TrackHints.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+TrackHints::TrackHints(const char *path)
+	: mPath(path ? std::string(path) : DefaultPath())
+	, mDirty(false)
+{
+	Load();
+}
+
+TrackHints::~TrackHints()
+{
+	Save();
+}
+
+std::string TrackHints::DefaultPath()
+{
+	const char *home = getenv("HOME");
+	return std::string(home ? home : "/tmp") + "/Library/Caches/iTunesBPSampleRate/TrackHints";
+}
+
+uint64_t TrackHints::TrackKey(const uint16_t *fileName, uint64_t size)
+{
+	// 64 bit FNV-1a over the UTF-16 code units, mixed with the size
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (unsigned i = 1 ; i <= fileName[0] && i < 256 ; ++i) {
+		h = (h ^ (fileName[i] & 0xff)) * 0x100000001b3ULL;
+		h = (h ^ (fileName[i] >> 8)) * 0x100000001b3ULL;
+	}
+	h ^= size * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 33);
+}
+
+void TrackHints::Load()
+{
+	FILE *fp = fopen(mPath.c_str(), "r");
+	if (!fp) {
+		return;
+	}
+	unsigned long long key;
+	unsigned int rate, cutoff;
+	while (fscanf(fp, "%llx %u %u", &key, &rate, &cutoff) == 3) {
+		Hint hint = { rate, cutoff };
+		mHints[key] = hint;
+	}
+	fclose(fp);
+}
+
+bool TrackHints::Lookup(uint64_t key, Hint &hint)
+{
+	std::map<uint64_t, Hint>::const_iterator it = mHints.find(key);
+	if (it == mHints.end()) {
+		return false;
+	}
+	hint = it->second;
+	return true;
+}
+
+void TrackHints::Store(uint64_t key, const Hint &hint)
+{
+	Hint &h = mHints[key];
+	if (h.effectiveRate != hint.effectiveRate || h.cutoffHz != hint.cutoffHz) {
+		h = hint;
+		mDirty = true;
+	}
+}
+
+bool TrackHints::Save()
+{
+	if (!mDirty) {
+		return true;
+	}
+	for (size_t slash = mPath.find('/', 1) ; slash != std::string::npos ; slash = mPath.find('/', slash + 1)) {
+		mkdir(mPath.substr(0, slash).c_str(), 0755);
+	}
+	std::string tmp = mPath + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) {
+		return false;
+	}
+	for (std::map<uint64_t, Hint>::const_iterator it = mHints.begin() ; it != mHints.end() ; ++it) {
+		fprintf(fp, "%016llx %u %u\n", (unsigned long long) it->first,
+				(unsigned int) it->second.effectiveRate, (unsigned int) it->second.cutoffHz);
+	}
+	bool ok = (fclose(fp) == 0) && rename(tmp.c_str(), mPath.c_str()) == 0;
+	if (ok) {
+		mDirty = false;
+	} else {
+		unlink(tmp.c_str());
+	}
+	return ok;
+}
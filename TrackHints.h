@@ -0,0 +1,53 @@
+/*=============================================================================
+	TrackHints.h
+
+	A small persistent cache of what was learnt about individual tracks
+	while they played, so that later plays can act on it right away. The
+	key is a hash of the track's file name and size as iTunes reports them.
+	The cache is kept in memory and written to a text file in the plugin's
+	cache folder when it changes.
+=============================================================================*/
+
+#ifndef __TrackHints_h__
+#define __TrackHints_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+class TrackHints {
+public:
+	struct Hint {
+		// the lowest rate that reproduces the track without loss, 0 if unknown
+		uint32_t effectiveRate;
+		// the estimated upper limit of the track's spectrum
+		uint32_t cutoffHz;
+	};
+
+	TrackHints(const char *path = NULL);
+	~TrackHints();
+
+	// fileName is an ITUniStr255: UTF-16 with a leading length
+	static uint64_t TrackKey(const uint16_t *fileName, uint64_t size);
+
+	bool Lookup(uint64_t key, Hint &hint);
+	void Store(uint64_t key, const Hint &hint);
+	// write the cache if it has changed
+	bool Save();
+
+	size_t Count()
+	{
+		return mHints.size();
+	}
+	// ~/Library/Caches/iTunesBPSampleRate/TrackHints
+	static std::string DefaultPath();
+
+protected:
+	void Load();
+
+	std::string mPath;
+	std::map<uint64_t, Hint> mHints;
+	bool mDirty;
+};
+
+#endif // __TrackHints_h__
@@ -0,0 +1,135 @@
+/*=============================================================================
+	WorkStealingPool.cpp
+
+=============================================================================*/
+
+#include "WorkStealingPool.h"
+
+// the pool and worker index of the calling thread
+static thread_local WorkStealingPool *tPool = NULL;
+static thread_local int tWorker = -1;
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+	: mPending(0)
+	, mSteals(0)
+	, mQueued(0)
+	, mNext(0)
+	, mQuit(false)
+{
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+		if (threads == 0) {
+			threads = 2;
+		}
+	}
+	for (unsigned i = 0 ; i < threads ; ++i) {
+		mQueues.push_back(new Queue);
+	}
+	for (unsigned i = 0 ; i < threads ; ++i) {
+		mWorkers.push_back(std::thread(&WorkStealingPool::Worker, this, i));
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mQuit = true;
+	}
+	mWork.notify_all();
+	for (size_t i = 0 ; i < mWorkers.size() ; ++i) {
+		mWorkers[i].join();
+	}
+	for (size_t i = 0 ; i < mQueues.size() ; ++i) {
+		delete mQueues[i];
+	}
+}
+
+int WorkStealingPool::CurrentWorker()
+{
+	return tWorker;
+}
+
+void WorkStealingPool::Submit(const Task &task)
+{
+	unsigned target;
+	mPending += 1;
+	if (tPool == this) {
+		target = (unsigned) tWorker;
+		std::lock_guard<std::mutex> lock(mQueues[target]->lock);
+		mQueues[target]->tasks.push_front(task);
+	} else {
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			target = mNext++ % mQueues.size();
+		}
+		std::lock_guard<std::mutex> lock(mQueues[target]->lock);
+		mQueues[target]->tasks.push_back(task);
+	}
+	{
+		// under mLock, so that a worker cannot miss it between its failed Pop() and its wait
+		std::lock_guard<std::mutex> lock(mLock);
+		mQueued += 1;
+	}
+	mWork.notify_one();
+}
+
+bool WorkStealingPool::Pop(unsigned self, Task &task)
+{
+	{
+		Queue &q = *mQueues[self];
+		std::lock_guard<std::mutex> lock(q.lock);
+		if (!q.tasks.empty()) {
+			task = q.tasks.front();
+			q.tasks.pop_front();
+			mQueued -= 1;
+			return true;
+		}
+	}
+	// steal from the back of the others' deques, i.e. the oldest and typically largest tasks
+	unsigned n = (unsigned) mQueues.size();
+	for (unsigned i = 1 ; i < n ; ++i) {
+		Queue &q = *mQueues[(self + i) % n];
+		std::lock_guard<std::mutex> lock(q.lock);
+		if (!q.tasks.empty()) {
+			task = q.tasks.back();
+			q.tasks.pop_back();
+			mQueued -= 1;
+			mSteals += 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkStealingPool::Worker(unsigned self)
+{
+	tPool = this;
+	tWorker = (int) self;
+	Task task;
+	for (;;) {
+		if (Pop(self, task)) {
+			task();
+			task = Task();
+			if (--mPending == 0) {
+				std::lock_guard<std::mutex> lock(mLock);
+				mIdle.notify_all();
+			}
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(mLock);
+		mWork.wait(lock, [this]() { return mQuit || mQueued.load() > 0; });
+		if (mQuit) {
+			break;
+		}
+	}
+	tPool = NULL;
+	tWorker = -1;
+}
+
+void WorkStealingPool::Wait()
+{
+	// the last task to complete notifies under mLock, after counting down: no need to poll
+	std::unique_lock<std::mutex> lock(mLock);
+	mIdle.wait(lock, [this]() { return mPending.load() == 0; });
+}
@@ -0,0 +1,71 @@
+/*=============================================================================
+	WorkStealingPool.h
+
+	A small thread pool for bulk jobs made up of many independent tasks of
+	unpredictable cost, like walking and scanning a music library. Every
+	worker has its own task deque: tasks it spawns go to the front of its
+	own deque and are taken from there (depth first, good locality), while
+	idle workers steal from the back of the others' deques. That keeps all
+	workers busy without a single contended queue.
+=============================================================================*/
+
+#ifndef __WorkStealingPool_h__
+#define __WorkStealingPool_h__
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+class WorkStealingPool {
+public:
+	typedef std::function<void()> Task;
+
+	// threads = 0 selects the number of CPUs
+	WorkStealingPool(unsigned threads = 0);
+	~WorkStealingPool();
+
+	// queue a task. Called from a task, the task goes to the calling worker's own deque.
+	void Submit(const Task &task);
+	// wait until all submitted tasks, including those they submitted, have completed
+	void Wait();
+
+	unsigned Threads()
+	{
+		return (unsigned) mQueues.size();
+	}
+	// the index of the calling worker thread, or -1 when not called from a task
+	static int CurrentWorker();
+
+	// the number of tasks that were executed by another worker than the one that queued them
+	unsigned long Steals()
+	{
+		return mSteals.load();
+	}
+
+protected:
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	bool Pop(unsigned self, Task &task);
+	void Worker(unsigned self);
+
+	std::vector<Queue *> mQueues;
+	std::vector<std::thread> mWorkers;
+	std::mutex mLock;
+	std::condition_variable mWork, mIdle;
+	// tasks queued but not yet completed
+	std::atomic<unsigned long> mPending, mSteals;
+	// tasks in the deques, counted up under mLock once queued and down once taken: what idle
+	// workers wait for. It can go below 0 for the moment between a task being queued and counted.
+	std::atomic<long> mQueued;
+	unsigned mNext;
+	bool mQuit;
+};
+
+#endif // __WorkStealingPool_h__
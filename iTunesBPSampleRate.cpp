@@ -61,16 +61,349 @@
 
 #include "iTunesPlugIn.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <wchar.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
 
 #include "AudioDevice.h"
+#include "AudioDeviceSet.h"
+#include "BPPreferences.h"
+#include "RateIndex.h"
+#include "SilenceDetector.h"
+#include "BandwidthAnalyzer.h"
+#include "TrackHints.h"
+#include "DropoutDetector.h"
+#include "MessageTrace.h"
+#include "SessionHistory.h"
+#include "StatusSegment.h"
+#include "RejectedRates.h"
+#include "DeviceReaper.h"
+#include "DeviceJournal.h"
+#include "SwitchCosts.h"
 
 typedef struct BPStruct {
 	BPPluginData bpPluginData;
 	AudioDevice *defaultADevice;
+	// additional devices that follow the content rate together with defaultADevice
+	AudioDeviceSet *targets;
+	// bit depth and channel count of the content, for physical format matching
+	UInt32 contentBits, contentChannels;
+	// true sample rates of the library's files, if an index has been built
+	RateIndex *rateIndex;
+	// silence-aligned switching: a rate change during playback waits for a quiet
+	// waveform block, or for switchDeadline, whichever comes first.
+	Boolean alignSwitches, switchPending;
+	Float64 pendingRate;
+	UInt32 pendingBits;
+	double switchRequested, switchDeadline, switchWindow;
+	unsigned quietPeak;
+	double quietMean;
+	// upsampled content detection: the spectrum of the current track (trackKey) is analysed
+	// while it plays, and the result stored as a hint for its next play.
+	BandwidthAnalyzer *bandwidth;
+	TrackHints *hints;
+	UInt64 trackKey;
+	Float64 trackRate;
+	// dropout measurement: the waveform is watched for gaps after each switch of defaultADevice
+	// (seenSwitches counts the switches already handed to the detector).
+	DropoutDetector *dropouts;
+	UInt32 seenSwitches;
+	// the messages we receive, recorded for replay with tools/BPPluginHost if a MessageTracePath is set
+	MessageTrace *trace;
+	// what happened to the tracks played in this session
+	SessionHistory *history;
+	// our state and counters in shared memory for external monitors, if PublishStatus is set
+	StatusSegment *status;
+	// the rates devices would not take, remembered across sessions for RejectedRateDays
+	RejectedRates *rejected;
+	// the devices are opened in the background at load time (loadTime); defaultADevice and
+	// targets are only used once AwaitDevices() has collected them (deviceReady is then NULL)
+	std::future<AudioDevice*> *deviceReady;
+	double loadTime, readyTime;
+	// releases the devices we no longer use in the background, if ReleaseDevicesInBackground is set
+	DeviceReaper *reaper;
+	// the initial settings of the devices we change, to restore them after a crash (RestoreJournal)
+	DeviceJournal *journal;
+	// what switches cost each device, learned across sessions (SwitchCostDays), and the part of
+	// a track's duration a switch may take before it isn't worth it (MaxSwitchCostFraction)
+	SwitchCosts *costs;
+	double maxSwitchCost;
+	// the pulse rate we ask for (see UpdatePulseRate): fastPulseRate while a switch is held or
+	// settling (for settleWindow after it) or the track's spectrum is analysed, idlePulseRate
+	// otherwise; both are 0 if nothing needs pulses.
+	UInt32 pulseRate, fastPulseRate, idlePulseRate;
+	double settleWindow;
+	// the pulses received since pulsesSince, and how many of them at the fast rate
+	unsigned long pulses, fastPulses;
+	double pulsesSince;
 } BPStruct;
 
+static double SteadyTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-------------------------------------------------------------------------------------------------
+//	PublishStatus
+//-------------------------------------------------------------------------------------------------
+//
+static void PublishStatus( BPStruct *bpData )
+{
+	if( bpData->status ){
+	  StatusSegment::Status &status = bpData->status->Edit();
+	  AudioDevice *dev = bpData->defaultADevice;
+		status.playing = bpData->bpPluginData.playing;
+		status.deviceID = (dev)? dev->ID() : kAudioDeviceUnknown;
+		snprintf( status.deviceName, sizeof(status.deviceName), "%s", (dev)? dev->GetName() : "" );
+		status.nominalRate = (dev)? dev->CurrentNominalSampleRate() : 0;
+		status.halCalls = AudioDevice::HALCalls();
+		bpData->status->Publish();
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+//	OpenDevices
+//-------------------------------------------------------------------------------------------------
+//
+// runs in the background from the time the plugin is loaded: getting a device's properties and
+// rate lists and registering the listeners takes long enough to be noticed during iTunes' launch
+static AudioDevice *OpenDevices( BPStruct *bpData )
+{ OSStatus err;
+	// devices left changed by an iTunes that crashed are put back first, so that we see their
+	// true initial settings
+	if( bpData->journal && bpData->journal->StaleCount() ){
+		bpData->journal->RestoreStale();
+	}
+  AudioDevice *dev = GetDefaultDevice( false, err );
+	if( err != noErr ){
+		CFLog( "Cannot open the default output device: %d", (int) err );
+	}
+	bpData->targets->AddTargetsFromPreferences();
+	bpData->readyTime = SteadyTime();
+	return dev;
+}
+
+//-------------------------------------------------------------------------------------------------
+//	AwaitDevices
+//-------------------------------------------------------------------------------------------------
+//
+// collect the devices OpenDevices() opened, waiting for it unless wait is false, in which case
+// nothing happens if it hasn't finished yet.
+static void AwaitDevices( BPStruct *bpData, bool wait )
+{
+	if( bpData->deviceReady ){
+	  double start = SteadyTime();
+		if( !wait && bpData->deviceReady->wait_for( std::chrono::seconds(0) ) != std::future_status::ready ){
+			return;
+		}
+		bpData->defaultADevice = bpData->deviceReady->get();
+		delete bpData->deviceReady;
+		bpData->deviceReady = NULL;
+		if( bpData->readyTime > start ){
+			CFLog( "Devices ready %.1fms after the plugin was loaded, %.1fms of which spent waiting for them",
+				(bpData->readyTime - bpData->loadTime) * 1000, (bpData->readyTime - start) * 1000 );
+		}
+		else{
+			CFLog( "Devices ready %.1fms after the plugin was loaded", (bpData->readyTime - bpData->loadTime) * 1000 );
+		}
+		if( bpData->dropouts && bpData->defaultADevice ){
+			bpData->seenSwitches = bpData->defaultADevice->Switches();
+		}
+		PublishStatus( bpData );
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+//	SwitchSampleRate
+//-------------------------------------------------------------------------------------------------
+//
+static void SwitchSampleRate( BPStruct *bpData, Float64 sampleRate, UInt32 contentBits, bool immediate )
+{
+	if( bpData->alignSwitches && !immediate && bpData->bpPluginData.playing ){
+		if( !bpData->switchPending ){
+			bpData->switchRequested = SteadyTime();
+			bpData->switchDeadline = bpData->switchRequested + bpData->switchWindow;
+			if( bpData->pulseRate && bpData->pulseRate < bpData->fastPulseRate ){
+				// the search for a quiet block only starts with the next (slow) pulse
+				bpData->switchDeadline += 1.0 / bpData->pulseRate;
+			}
+		}
+		bpData->switchPending = true;
+		bpData->pendingRate = sampleRate;
+		bpData->pendingBits = contentBits;
+		if( bpData->history && bpData->defaultADevice ){
+			bpData->history->NoteSwitch( SessionHistory::kHeld, bpData->defaultADevice->ID(),
+				bpData->defaultADevice->CurrentNominalSampleRate(), 0 );
+		}
+	}
+	else{
+	  double start = SteadyTime();
+	  double held = (bpData->switchPending)? start - bpData->switchRequested : 0;
+	  UInt32 switches = (bpData->defaultADevice)? bpData->defaultADevice->Switches() : 0;
+	  OSStatus err;
+		bpData->switchPending = false;
+		err = bpData->targets->SetNominalSampleRate( bpData->defaultADevice, sampleRate,
+			contentBits, bpData->contentChannels );
+		if( bpData->defaultADevice ){
+		  AudioDevice *dev = bpData->defaultADevice;
+		  SessionHistory::Outcome outcome = (err != noErr)? SessionHistory::kFailed
+				: (dev->Switches() != switches)? SessionHistory::kSwitched : SessionHistory::kUnchanged;
+			if( bpData->history ){
+				bpData->history->NoteSwitch( outcome, dev->ID(), dev->CurrentNominalSampleRate(), SteadyTime() - start, held );
+			}
+			if( bpData->status ){
+			  StatusSegment::Status &status = bpData->status->Edit();
+				status.chosenRate = sampleRate;
+				status.switches += (outcome == SessionHistory::kSwitched);
+				status.skippedSwitches += (outcome == SessionHistory::kUnchanged);
+				status.failures += (outcome == SessionHistory::kFailed);
+			}
+		}
+		PublishStatus( bpData );
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+//	SwitchWorthIt
+//-------------------------------------------------------------------------------------------------
+//
+// false if the switch for content at sampleRate would interrupt the audio for too large a part of
+// the track, as for the previews and interstitials of a few seconds
+static bool SwitchWorthIt( BPStruct *bpData, Float64 sampleRate, const ITTrackInfo *trackInfo )
+{ AudioDevice *dev = bpData->defaultADevice;
+  double duration, cost;
+
+	if( !bpData->costs || bpData->maxSwitchCost <= 0 || !dev
+	   || !(trackInfo->validFields & kITTITotalTimeFieldMask) || !trackInfo->totalTimeInMS
+	){
+		return true;
+	}
+	duration = trackInfo->totalTimeInMS / 1000.0;
+	// 0 if there is nothing to switch, -1 if the device has yet to be measured
+	cost = dev->ExpectedSwitchCost( sampleRate );
+	if( cost <= bpData->maxSwitchCost * duration ){
+		return true;
+	}
+	CFLog( "Leaving \"%s\" at %gHz for %gHz content: a switch takes ~%.0fms of a %.1fs track", dev->GetName(),
+		dev->CurrentNominalSampleRate(), sampleRate, cost * 1000, duration );
+	return false;
+}
+
+//-------------------------------------------------------------------------------------------------
+//	LearnBandwidth
+//-------------------------------------------------------------------------------------------------
+//
+// store what the analysis of the current track has taught us, if anything
+static void LearnBandwidth( BPStruct *bpData )
+{
+	if( bpData->bandwidth && bpData->trackKey && bpData->bandwidth->Confident() ){
+	  TrackHints::Hint hint;
+		hint.effectiveRate = (UInt32) bpData->bandwidth->EffectiveRate( bpData->trackRate );
+		hint.cutoffHz = (UInt32) bpData->bandwidth->CutoffHz();
+		bpData->hints->Store( bpData->trackKey, hint );
+		CFLog( "Track at %gHz has content up to ~%uHz over %u blocks; effective rate %uHz",
+			bpData->trackRate, hint.cutoffHz, bpData->bandwidth->Blocks(), hint.effectiveRate );
+	}
+	bpData->trackKey = 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+//	ProcessRenderData
+//-------------------------------------------------------------------------------------------------
+//
+void ProcessRenderData( BPPluginData *bpPluginData, UInt32 timeStampID, const RenderVisualData *renderData )
+{
+	bpPluginData->renderTimeStampID = timeStampID;
+	if( renderData == NULL ){
+		memset( &bpPluginData->renderData, 0, sizeof(bpPluginData->renderData) );
+		return;
+	}
+	bpPluginData->renderData = *renderData;
+}
+
+//-------------------------------------------------------------------------------------------------
+//	SwitchOnQuietBlock
+//-------------------------------------------------------------------------------------------------
+//
+// carry out a pending switch if the last waveform block was quiet, or if we waited long enough.
+static void SwitchOnQuietBlock( BPStruct *bpData, bool haveData )
+{ const RenderVisualData *rd = &bpData->bpPluginData.renderData;
+  const uint8_t *channels[kVisualMaxDataChannels] = { rd->waveformData[0], rd->waveformData[1] };
+  WaveformLevel level = { 0, 0 };
+  const char *reason = NULL;
+
+	if( !bpData->switchPending ){
+		return;
+	}
+	if( !haveData || rd->numWaveformChannels == 0 ){
+		reason = "no waveform data";
+	}
+	else if( IsQuietWaveform( channels, rd->numWaveformChannels, kVisualNumWaveformEntries,
+			bpData->quietPeak, bpData->quietMean, &level )
+	){
+		reason = "quiet block";
+	}
+	else if( SteadyTime() >= bpData->switchDeadline ){
+		reason = "deadline";
+	}
+	if( reason ){
+		CFLog( "Switching to %gHz on %s (peak %u, mean %.2f), %.0fms after the request",
+			bpData->pendingRate, reason, level.peak, level.sumAbs / (double) kVisualNumWaveformEntries,
+			(SteadyTime() - bpData->switchRequested) * 1000.0 );
+		SwitchSampleRate( bpData, bpData->pendingRate, bpData->pendingBits, true );
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+//	UpdatePulseRate
+//-------------------------------------------------------------------------------------------------
+//
+// pulses wake iTunes and us up: they come fast only while something waits for them, and at
+// the idle rate otherwise. The rate can only be changed in reply to a pulse, so the idle rate
+// is what lets us notice that something needs them again.
+void UpdatePulseRate( BPPluginData * bpPluginData, UInt32 * ioPulseRate )
+{ BPStruct *bpData = (BPStruct*) bpPluginData;	// bpPluginData is its first member
+  AudioDevice *dev = bpData->defaultADevice;
+  bool busy;
+
+	if( !bpData->fastPulseRate ){
+		return;
+	}
+	// a held switch looks for a quiet block
+	busy = bpData->switchPending
+		// a switch settles: its dropouts are measured, and the status follows the new rate
+		|| (dev && dev->LastSwitchTime() > 0 && SteadyTime() - dev->LastSwitchTime() < bpData->settleWindow)
+		// the spectrum of the current track is still too little known
+		|| (bpData->trackKey && bpPluginData->playing && !bpData->bandwidth->Confident());
+	*ioPulseRate = (busy)? bpData->fastPulseRate : bpData->idlePulseRate;
+	if( *ioPulseRate != bpData->pulseRate ){
+		bpData->pulseRate = *ioPulseRate;
+		if( bpData->status ){
+			bpData->status->Edit().pulseRate = bpData->pulseRate;
+			PublishStatus( bpData );
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+//	LogPulses
+//-------------------------------------------------------------------------------------------------
+//
+// the wakeups pulses caused since the last call, while playing or stopped
+static void LogPulses( BPStruct *bpData, const char *state )
+{ double now = SteadyTime();
+
+	if( bpData->pulses && now > bpData->pulsesSince ){
+		CFLog( "%lu pulses in %.1fs %s (%.2f/s), %lu of them at %uHz", bpData->pulses, now - bpData->pulsesSince,
+			state, bpData->pulses / (now - bpData->pulsesSince), bpData->fastPulses, (unsigned int) bpData->fastPulseRate );
+	}
+	bpData->pulses = bpData->fastPulses = 0;
+	bpData->pulsesSince = now;
+}
+
 //-------------------------------------------------------------------------------------------------
 //	UpdateInfoTimeOut
 //-------------------------------------------------------------------------------------------------
@@ -85,29 +418,77 @@ void UpdateInfoTimeOut( BPPluginData * bpPluginData )
 //	UpdateTrackInfo
 //-------------------------------------------------------------------------------------------------
 //
-void UpdateTrackInfo( BPStruct *bpData, ITTrackInfo * trackInfo, ITStreamInfo * streamInfo )
+void UpdateTrackInfo( BPStruct *bpData, ITTrackInfo * trackInfo, ITStreamInfo * streamInfo, bool immediate = true )
 { BPPluginData *bpPluginData = NULL;
 	if( bpData ){
 		bpPluginData = &bpData->bpPluginData;
-		if( trackInfo->validFields & kITTISampleRateFieldMask ){
-			bpData->defaultADevice->SetNominalSampleRate(trackInfo->sampleRateFloat);
+		if( trackInfo ){
+		  Float64 sampleRate = (trackInfo->validFields & kITTISampleRateFieldMask)? trackInfo->sampleRateFloat : 0;
+		  UInt32 contentBits = bpData->contentBits;
+		  RateIndex::Entry entry;
+			// the file's own header has the final word if it is in the index
+			if( bpData->rateIndex && (trackInfo->validFields & kITTIFileNameFieldMask)
+			   && bpData->rateIndex->LookupTrack( trackInfo->fileName,
+					(trackInfo->validFields & kITTISizeFieldMask)? trackInfo->sizeInBytes : 0, entry )
+			){
+				if( entry.sampleRate != sampleRate ){
+					CFLog( "UpdateTrackInfo: iTunes reports %gHz, the file header %uHz", sampleRate, entry.sampleRate );
+				}
+				sampleRate = entry.sampleRate;
+				if( entry.bitsPerChannel ){
+					contentBits = entry.bitsPerChannel;
+				}
+			}
+			if( bpData->status ){
+				bpData->status->Edit().contentRate = sampleRate;
+			}
+			if( bpData->bandwidth && sampleRate > 0 ){
+			  UInt64 key = TrackHints::TrackKey( trackInfo->fileName,
+					(trackInfo->validFields & kITTISizeFieldMask)? trackInfo->sizeInBytes : 0 );
+			  TrackHints::Hint hint;
+				// a change message can also just announce new information about the current track
+				if( key != bpData->trackKey ){
+					LearnBandwidth( bpData );
+					if( bpData->hints->Lookup( key, hint ) ){
+						if( hint.effectiveRate && hint.effectiveRate < sampleRate ){
+							CFLog( "UpdateTrackInfo: content at %gHz only goes up to ~%uHz, using %uHz",
+								sampleRate, hint.cutoffHz, hint.effectiveRate );
+							sampleRate = hint.effectiveRate;
+						}
+					}
+					else{
+						// we assume the spectrum spans the content's band
+						bpData->trackKey = key;
+						bpData->trackRate = sampleRate;
+						bpData->bandwidth->Reset( sampleRate / 2 );
+					}
+				}
+			}
+			if( sampleRate > 0 ){
+				if( bpData->history ){
+					bpData->history->BeginTrack( TrackHints::TrackKey( trackInfo->fileName,
+							(trackInfo->validFields & kITTISizeFieldMask)? trackInfo->sizeInBytes : 0 ),
+						SteadyTime(), sampleRate, contentBits,
+						(trackInfo->validFields & kITTIAlbumFieldMask)? trackInfo->album : NULL );
+				}
+				if( SwitchWorthIt( bpData, sampleRate, trackInfo ) ){
+					SwitchSampleRate( bpData, sampleRate, contentBits, immediate );
+				}
+				else{
+				  AudioDevice *dev = bpData->defaultADevice;
+					// the track plays at the current rate, converted by the HAL; a switch still held
+					// for the previous track is moot
+					bpData->switchPending = false;
+					if( bpData->history ){
+						bpData->history->NoteSwitch( SessionHistory::kSkipped, dev->ID(), dev->CurrentNominalSampleRate(), 0 );
+					}
+				}
+			}
 		}
 	}
 	else{
 		return;
 	}
-	if( trackInfo ){
-		bpPluginData->trackInfo = *trackInfo;
-	}
-	else{
-		memset( &bpPluginData->trackInfo, 0, sizeof(bpPluginData->trackInfo) );
-	}
-	if( streamInfo ){
-		bpPluginData->streamInfo = *streamInfo;
-	}
-	else{
-		memset( &bpPluginData->streamInfo, 0, sizeof(bpPluginData->streamInfo) );
-	}
 
 	UpdateInfoTimeOut( bpPluginData );
 #ifdef DEBUG
@@ -144,6 +525,10 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 
 	status = noErr;
 
+	if( bpData && bpData->trace ){
+		bpData->trace->Append( message, messageInfo, SteadyTime() );
+	}
+
 	switch( message ){
 		/*
 			Sent when the visual plugin is registered.  The plugin should do minimal
@@ -160,10 +545,106 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 				break;
 			}
 
+			bpData->loadTime = SteadyTime();
 			bpPluginData = &bpData->bpPluginData;
 			bpPluginData->appCookie	= messageInfo->u.initMessage.appCookie;
 			bpPluginData->appProc	= messageInfo->u.initMessage.appProc;
-			bpData->defaultADevice = GetDefaultDevice( false, status );
+			if( BPPrefDouble( "RejectedRateDays", 30 ) > 0 ){
+				bpData->rejected = new RejectedRates( NULL, BPPrefDouble( "RejectedRateDays", 30 ) * 86400 );
+				bpData->rejected->Log();
+				AudioDevice::SetRejectedRates( bpData->rejected );
+			}
+			if( BPPrefDouble( "SwitchCostDays", 90 ) > 0 ){
+				bpData->costs = new SwitchCosts( NULL, BPPrefDouble( "SwitchCostDays", 90 ) * 86400 );
+				bpData->maxSwitchCost = BPPrefDouble( "MaxSwitchCostFraction", 0.1 );
+				CFLog( "Loaded the costs of %lu device rate transitions", (unsigned long) bpData->costs->Count() );
+				AudioDevice::SetSwitchCosts( bpData->costs );
+			}
+			if( BPPrefBool( "RestoreJournal", true ) ){
+				bpData->journal = new DeviceJournal;
+				if( bpData->journal->Valid() ){
+					AudioDevice::SetJournal( bpData->journal );
+				}
+				else{
+					delete bpData->journal;
+					bpData->journal = NULL;
+				}
+			}
+			if( BPPrefBool( "ReleaseDevicesInBackground", true ) ){
+				bpData->reaper = new DeviceReaper;
+				AudioDevice::SetReaper( bpData->reaper );
+			}
+			AudioDevice::SetPhysicalFormatMatching( BPPrefBool( "MatchPhysicalFormat", false ) );
+			AudioDevice::SetClockSourceSelection( BPPrefBool( "SelectClockSource", false ) );
+			AudioDevice::SetBufferDuration( BPPrefDouble( "BufferDurationMS", 0 ) );
+			AudioDevice::SetOverloadWindow( BPPrefDouble( "OverloadWindowMS", 2000 ) / 1000.0 );
+			bpData->targets = new AudioDeviceSet;
+			bpData->alignSwitches = BPPrefBool( "SilenceAlignedSwitching", false );
+			bpData->switchWindow = BPPrefDouble( "QuietDeadlineMS", 1000 ) / 1000.0;
+			bpData->quietPeak = (unsigned) BPPrefDouble( "QuietPeak", 2 );
+			bpData->quietMean = BPPrefDouble( "QuietMean", 0.5 );
+			if( BPPrefBool( "DetectUpsampledContent", false ) ){
+				bpData->bandwidth = new BandwidthAnalyzer;
+				bpData->hints = new TrackHints;
+			}
+			if( BPPrefBool( "MeasureDropouts", false ) ){
+				bpData->dropouts = new DropoutDetector;
+			}
+			// as registered (see RegisterVisualPlugin)
+			if( bpData->alignSwitches || bpData->bandwidth || bpData->dropouts ){
+				bpData->fastPulseRate = (UInt32) BPPrefDouble( "SwitchPulseRateHz", 30 );
+				bpData->idlePulseRate = std::min( (UInt32) BPPrefDouble( "IdlePulseRateHz", kPlayingPulseRateInHz ),
+					bpData->fastPulseRate );
+				bpData->settleWindow = BPPrefDouble( "SettlePulseMS", 500 ) / 1000.0;
+				if( bpData->dropouts ){
+					bpData->settleWindow = std::max( bpData->settleWindow, bpData->dropouts->Window() );
+				}
+				bpData->pulseRate = bpData->fastPulseRate;
+			}
+			bpData->pulsesSince = SteadyTime();
+			bpData->deviceReady = new std::future<AudioDevice*>( std::async( std::launch::async, OpenDevices, bpData ) );
+			{ char path[1024];
+				if( !BPPrefString( "RateIndexPath", path, sizeof(path) ) ){
+					snprintf( path, sizeof(path), "%s", RateIndex::DefaultPath().c_str() );
+				}
+				bpData->rateIndex = new RateIndex;
+				if( bpData->rateIndex->Load( path ) ){
+					CFLog( "Loaded the rate index %s with %lu entries", path, (unsigned long) bpData->rateIndex->Count() );
+				}
+				else{
+					delete bpData->rateIndex;
+					bpData->rateIndex = NULL;
+				}
+				if( BPPrefDouble( "SessionHistorySize", 1024 ) >= 1 ){
+					bpData->history = new SessionHistory( (size_t) BPPrefDouble( "SessionHistorySize", 1024 ) );
+				}
+				if( BPPrefBool( "PublishStatus", false ) ){
+					if( !BPPrefString( "StatusSegmentName", path, sizeof(path) ) ){
+						snprintf( path, sizeof(path), "%s", StatusSegment::DefaultName() );
+					}
+					bpData->status = new StatusSegment;
+					if( bpData->status->Create( path ) ){
+						CFLog( "Publishing the status in the shared memory segment %s", path );
+						PublishStatus( bpData );
+					}
+					else{
+						CFLog( "Cannot create the shared memory segment %s", path );
+						delete bpData->status;
+						bpData->status = NULL;
+					}
+				}
+				if( BPPrefString( "MessageTracePath", path, sizeof(path) ) ){
+					bpData->trace = new MessageTrace;
+					if( bpData->trace->Create( path ) ){
+						CFLog( "Recording the messages to %s", path );
+					}
+					else{
+						CFLog( "Cannot create the message trace %s", path );
+						delete bpData->trace;
+						bpData->trace = NULL;
+					}
+				}
+			}
 
 			messageInfo->u.initMessage.refCon = (void *)bpData;
 			break;
@@ -173,7 +654,86 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 		*/		
 		case kVisualPluginCleanupMessage:{
 			if ( bpData != NULL ){
-				delete bpData->defaultADevice;
+				AwaitDevices( bpData, true );
+				if( bpData->targets ){
+				  double timeout = BPPrefDouble( "CleanupTimeoutMS", 2000 ) / 1000.0;
+					// the targets finish their last change before they are released (the destructor waits for
+					// them regardless): say which ones hold up the unload
+					if( !bpData->targets->WaitForCompletion( timeout ) ){
+						for( int i = 0 ; i < bpData->targets->Count() ; i++ ){
+						  AudioDeviceSet::TargetStatus tstatus;
+							if( bpData->targets->GetStatus( i, tstatus ) && tstatus.state == AudioDeviceSet::kTargetPending ){
+								if( tstatus.requestedRate > 0 ){
+									CFLog( "Target \"%s\" still changing to %gHz after %gs",
+										bpData->targets->Target(i)->GetName(), tstatus.requestedRate, timeout );
+								}
+								else{
+									CFLog( "Target \"%s\" still being reset after %gs", bpData->targets->Target(i)->GetName(), timeout );
+								}
+							}
+						}
+					}
+				}
+				// this releases the target devices, in the background if we have a reaper
+				delete bpData->targets;
+				delete bpData->rateIndex;
+				LearnBandwidth( bpData );
+				delete bpData->bandwidth;
+				// this saves the hints
+				delete bpData->hints;
+				if( bpData->dropouts ){
+					bpData->dropouts->Log();
+					delete bpData->dropouts;
+				}
+				AudioDevice::Release( bpData->defaultADevice );
+				{ bool released = true;
+					if( bpData->reaper ){
+					  double timeout = BPPrefDouble( "CleanupTimeoutMS", 2000 ) / 1000.0;
+					  size_t abandoned = bpData->reaper->Flush( timeout );
+						bpData->reaper->Log();
+						if( abandoned ){
+							// a device still being released reads the reaper, the rejected rates, the journal and the costs
+							// through AudioDevice's statics: they stay set, and are leaked with the reaper rather than deleted
+							// or swapped under its feet
+							CFLog( "%lu devices not released within %gs", (unsigned long) abandoned, timeout );
+							released = false;
+						}
+						else{
+							AudioDevice::SetReaper( NULL );
+							delete bpData->reaper;
+						}
+					}
+					if( bpData->costs ){
+						// what has been learnt so far, including in this session
+						bpData->costs->Log();
+						bpData->costs->Save();
+					}
+					if( released ){
+						if( bpData->rejected ){
+							AudioDevice::SetRejectedRates( NULL );
+							delete bpData->rejected;
+						}
+						if( bpData->costs ){
+							AudioDevice::SetSwitchCosts( NULL );
+							delete bpData->costs;
+						}
+						if( bpData->journal ){
+							AudioDevice::SetJournal( NULL );
+							delete bpData->journal;
+						}
+					}
+				}
+				if( bpData->history ){
+					bpData->history->EndTrack( SteadyTime() );
+					bpData->history->Log( SteadyTime() );
+					delete bpData->history;
+				}
+				// this removes the segment
+				delete bpData->status;
+				if( bpData->trace ){
+					CFLog( "Recorded %lu messages", bpData->trace->Count() );
+					delete bpData->trace;
+				}
 				free( bpData );
 			}
 			CFLog( "kVisualPluginCleanupMessage" );
@@ -249,9 +809,46 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 			will allow drawing to support spectral analysis-type plugins but drawing
 			will be limited to the system refresh rate.
 		*/
-//		case kVisualPluginPulseMessage:{
-//			break;
-//		}
+		case kVisualPluginPulseMessage:{
+			if( bpData ){
+				// the devices are collected by the first message that needs them, or the first pulse after they're ready
+				AwaitDevices( bpData, false );
+				ProcessRenderData( bpPluginData, messageInfo->u.pulseMessage.timeStampID, messageInfo->u.pulseMessage.renderData );
+				SwitchOnQuietBlock( bpData, messageInfo->u.pulseMessage.renderData != NULL );
+				bpData->pulses += 1;
+				bpData->fastPulses += (bpData->pulseRate == bpData->fastPulseRate);
+				if( bpData->status ){
+					bpData->status->Edit().pulses += 1;
+				}
+				if( bpData->trackKey && messageInfo->u.pulseMessage.renderData
+				   && bpPluginData->renderData.numSpectrumChannels > 0
+				){ const RenderVisualData *rd = &bpPluginData->renderData;
+				  const uint8_t *channels[kVisualMaxDataChannels] = { rd->spectrumData[0], rd->spectrumData[1] };
+					bpData->bandwidth->AddBlock( channels, rd->numSpectrumChannels );
+				}
+				if( bpData->status && bpData->defaultADevice
+				   && bpData->defaultADevice->CurrentNominalSampleRate() != bpData->status->Edit().nominalRate
+				){
+					// the device changed rate by itself, or a change we asked for has completed
+					PublishStatus( bpData );
+				}
+				if( bpData->dropouts && bpData->defaultADevice ){
+				  AudioDevice *dev = bpData->defaultADevice;
+					if( dev->Switches() != bpData->seenSwitches ){
+						bpData->seenSwitches = dev->Switches();
+						bpData->dropouts->NoteSwitch( dev->GetName(), dev->LastSwitchTime() );
+					}
+					if( messageInfo->u.pulseMessage.renderData && bpPluginData->renderData.numWaveformChannels > 0 ){
+					  const RenderVisualData *rd = &bpPluginData->renderData;
+					  const uint8_t *channels[kVisualMaxDataChannels] = { rd->waveformData[0], rd->waveformData[1] };
+						bpData->dropouts->AddBlock( channels, rd->numWaveformChannels, kVisualNumWaveformEntries,
+							SteadyTime(), dev->CurrentNominalSampleRate() );
+					}
+				}
+				UpdatePulseRate( bpPluginData, &messageInfo->u.pulseMessage.newPulseRateInHz );
+			}
+			break;
+		}
 		/*
 			It's time for the plugin to draw a new frame.
 			
@@ -266,12 +863,27 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 			Sent when the player starts.
 		*/
 		case kVisualPluginPlayMessage:{
+			LogPulses( bpData, "stopped" );
 			bpPluginData->playing = true;
+			AwaitDevices( bpData, true );
 
 			// reopen the default device if it has changed in the meantime:
 			bpData->defaultADevice = GetDefaultDevice( false, status, bpData->defaultADevice );
 
+			{ const AudioStreamBasicDescription *audioFormat = &messageInfo->u.playMessage.audioFormat;
+				// iTunes may hand us its (float) playback format rather than the content's format;
+				// fall back to the configured bit depth in that case.
+				if( audioFormat->mBitsPerChannel && !(audioFormat->mFormatFlags & kAudioFormatFlagIsFloat) ){
+					bpData->contentBits = audioFormat->mBitsPerChannel;
+				}
+				else{
+					bpData->contentBits = (UInt32) BPPrefDouble( "ContentBitDepth", 24 );
+				}
+				bpData->contentChannels = audioFormat->mChannelsPerFrame;
+			}
+
 			UpdateTrackInfo( bpData, messageInfo->u.playMessage.trackInfo, messageInfo->u.playMessage.streamInfo );
+			PublishStatus( bpData );
 		
 			break;
 		}
@@ -279,9 +891,10 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 			Sent when the player changes the current track information.  This
 			is used when the information about a track changes.
 		*/
-        case kVisualPluginPulseMessage:
 		case kVisualPluginChangeTrackMessage:{
-			UpdateTrackInfo( bpData, messageInfo->u.changeTrackMessage.trackInfo, messageInfo->u.changeTrackMessage.streamInfo );
+			// this arrives while the new track is already playing
+			AwaitDevices( bpData, true );
+			UpdateTrackInfo( bpData, messageInfo->u.changeTrackMessage.trackInfo, messageInfo->u.changeTrackMessage.streamInfo, false );
 
 			break;
 		}
@@ -297,13 +910,35 @@ static OSStatus VisualPluginHandler(OSType message, VisualPluginMessageInfo *mes
 			Sent when the player stops or pauses.
 		*/
 		case kVisualPluginStopMessage:{
+			LogPulses( bpData, "playing" );
 			bpPluginData->playing = false;
+			AwaitDevices( bpData, true );
+			// nothing is playing anymore, so there is no reason to hold back
+			bpData->switchPending = false;
+			if( bpData->hints ){
+				LearnBandwidth( bpData );
+				bpData->hints->Save();
+			}
+			if( bpData->costs ){
+				bpData->costs->Save();
+			}
+			if( bpData->dropouts ){
+				bpData->dropouts->Log();
+			}
+			if( bpData->trace ){
+				bpData->trace->Flush();
+			}
+			if( bpData->history ){
+				bpData->history->EndTrack( SteadyTime() );
+			}
 			
+			bpData->targets->ResetNominalSampleRate( bpData->defaultADevice );
 			if( bpData->defaultADevice ){
-				bpData->defaultADevice->ResetNominalSampleRate();
+				bpData->defaultADevice->LogOverloads();
 				// reopen the default device if it has changed in the meantime:
 				bpData->defaultADevice = GetDefaultDevice( false, status, bpData->defaultADevice );
 			}
+			PublishStatus( bpData );
 			break;
 		}
 		/*
@@ -343,6 +978,19 @@ OSStatus RegisterVisualPlugin( PluginMessageInfo *messageInfo, PlayerMessageInfo
 	playerMessageInfo.u.registerVisualPluginMessage.pulseRateInHz		= kStoppedPulseRateInHz;	// update my state N times a second
 	playerMessageInfo.u.registerVisualPluginMessage.numWaveformChannels	= 0;
 	playerMessageInfo.u.registerVisualPluginMessage.numSpectrumChannels	= 0;
+	if( BPPrefBool( "SilenceAlignedSwitching", false ) || BPPrefBool( "MeasureDropouts", false ) ){
+		// we need the waveform, often enough to catch short pauses
+		playerMessageInfo.u.registerVisualPluginMessage.numWaveformChannels	= 2;
+	}
+	if( BPPrefBool( "DetectUpsampledContent", false ) ){
+		playerMessageInfo.u.registerVisualPluginMessage.numSpectrumChannels	= 2;
+	}
+	if( playerMessageInfo.u.registerVisualPluginMessage.numWaveformChannels
+	   || playerMessageInfo.u.registerVisualPluginMessage.numSpectrumChannels
+	){
+		// to begin with: UpdatePulseRate() slows them down once nothing waits for them
+		playerMessageInfo.u.registerVisualPluginMessage.pulseRateInHz		= (UInt32) BPPrefDouble( "SwitchPulseRateHz", 30 );
+	}
 	
 	playerMessageInfo.u.registerVisualPluginMessage.minWidth			= 64;
 	playerMessageInfo.u.registerVisualPluginMessage.minHeight			= 64;
@@ -73,7 +73,7 @@
 
 struct BPPluginData;
 
-#if TARGET_OS_MAC
+#if TARGET_OS_MAC && !defined(BP_SIMULATED_HAL)
 #import <Cocoa/Cocoa.h>
 
 // "namespace" our ObjC classname to avoid load conflicts between multiple visualizer plugins
@@ -99,9 +99,6 @@ struct BPPluginData
 	RenderVisualData		renderData;
 	UInt32				renderTimeStampID;
 
-	ITTrackInfo			trackInfo;
-	ITStreamInfo			streamInfo;
-
 	// Plugin-specific data
 
 	Boolean				playing;								// is iTunes currently playing audio?
@@ -204,9 +204,14 @@ OptionBits GetVisualOptions( void )
 
 void CFLog( const char *format, ... )
 { va_list ap;
+  char message[1024];
 	va_start( ap, format );
-	NSLogv( [NSString stringWithFormat:@"%s",format], ap );
+	// formatted on the stack: no NSString of our own for every message
+	vsnprintf( message, sizeof(message), format, ap );
 	va_end(ap);
+	@autoreleasepool{
+		NSLog( @"%s", message );
+	}
 }
 
 //-------------------------------------------------------------------------------------------------
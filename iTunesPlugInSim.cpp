@@ -0,0 +1,62 @@
+/*=============================================================================
+	iTunesPlugInSim.cpp
+
+	The platform part of the plugin for builds against the simulated HAL
+	(-DBP_SIMULATED_HAL, see SimHAL/SimHAL.h): what iTunesPlugInMac.mm
+	provides on the Mac, without a view. A host that stands in for iTunes
+	calls iTunesPluginMainMachO directly.
+=============================================================================*/
+
+#include "iTunesPlugIn.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define kTVisualPluginName		"iTunes BitPerfect SampleRate (audio only)"
+
+void GetVisualName( ITUniStr255 name )
+{ size_t length = strlen( kTVisualPluginName );
+
+	name[0] = (UniChar) length;
+	for( size_t i = 0 ; i < length ; ++i ){
+		name[i + 1] = (UniChar) kTVisualPluginName[i];
+	}
+}
+
+OptionBits GetVisualOptions( void )
+{
+	return 0;
+}
+
+void CFLog( const char *format, ... )
+{ va_list ap;
+	va_start( ap, format );
+	vfprintf( stderr, format, ap );
+	va_end( ap );
+	fputc( '\n', stderr );
+}
+
+OSStatus iTunesPluginMainMachO( OSType message, PluginMessageInfo * messageInfo, void * refCon )
+{ OSStatus		status;
+  static PlayerMessageInfo playerMessageInfo;
+	(void) refCon;
+
+	switch ( message )
+	{
+		case kPluginInitMessage:
+			status = RegisterVisualPlugin( messageInfo, playerMessageInfo );
+			break;
+
+		case kPluginCleanupMessage:
+			CFLog( "kPluginCleanupMessage" );
+			status = noErr;
+			break;
+
+		default:
+			status = unimpErr;
+			break;
+	}
+
+	return status;
+}
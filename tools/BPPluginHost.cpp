@@ -0,0 +1,693 @@
+/*=============================================================================
+	BPPluginHost.cpp
+
+	Stands in for iTunes: loads the plugin through iTunesPluginMainMachO,
+	with an appProc that accepts its registration, and drives synthetic
+	message streams into the registered VisualPluginHandler. The plugin
+	runs on the simulated HAL (SimHAL), so that each scenario can report
+	the handler's latency per message type along with the HAL calls the
+	messages caused.
+
+	Scenarios:
+	play	Play, pulses, ChangeTrack, pulses, Stop, for one track after another
+	skip	rapid ChangeTracks between tracks at different rates, a pulse in between
+	pause	Play/Stop storms on one track
+	device	playback while the default output device changes between two devices
+	pulse	one long Play with a pulse stream of loud and quiet waveform blocks
+	idle	one Play of -d seconds with two track changes, with pulses at the
+			rate the plugin asks for (not run by default: it takes real time)
+	replay	the messages of a trace recorded by the plugin (see MessageTrace.h)
+
+	Usage:	BPPluginHost [-s script] [-S scenario,..] [-n messages] [-r messages/s]
+					[-R rate,rate,..] [-p trace [-x speed]] [-a [-w messages]] [-d seconds] [-v]
+	-n is the number of messages per scenario; -r paces them (0: as fast as
+	possible). -p replays a trace, by default as the only scenario, at its
+	recorded pace times the -x speed factor (0: as fast as possible). Runs
+	are repeatable: the message streams are fixed, and so are the faults of
+	the simulated HAL unless the script seeds it differently. Only the
+	number of listener notifications depends on timing: a notification
+	reaches the listeners that are still registered when it is delivered.
+	-a counts the heap allocations the handler makes (those inside the
+	simulated HAL excepted) once -w messages of each scenario have warmed
+	it up, and makes the exit status 1 if there were any.
+	Like iTunes, the host passes each pulse the rate the plugin asked for
+	in reply to the previous one. The other scenarios send their pulses
+	regardless, but report how many wakeups per second they would have
+	caused at those rates.
+	The plugin's settings come from BPSR_<key> environment variables; -v
+	keeps its log output (on stderr).
+=============================================================================*/
+
+#include "iTunesPlugIn.h"
+#include "MessageTrace.h"
+#include "SimHAL.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+extern OSStatus iTunesPluginMainMachO(OSType message, PluginMessageInfo *messageInfo, void *refCon);
+
+// Allocation counting (-a): the heap allocations the handler makes on the host's thread, except
+// those of the (simulated) HAL. With glibc, malloc, calloc and realloc are counted (operator new
+// goes through malloc); elsewhere only operator new is.
+static thread_local bool tCountAllocations = false;
+static unsigned long gAllocations = 0, gAllocatedBytes = 0;
+
+static inline void CountAllocation(size_t size)
+{
+	if (tCountAllocations && !SimHAL::InCall()) {
+		gAllocations += 1;
+		gAllocatedBytes += size;
+	}
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+	CountAllocation(size);
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+	CountAllocation(count * size);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	CountAllocation(size);
+	return __libc_realloc(ptr, size);
+}
+#else
+void *operator new(size_t size)
+{
+	CountAllocation(size);
+	void *p = malloc(size);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+#endif
+
+static double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int Usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s script] [-S play,skip,pause,device,pulse,idle,replay] [-n messages] [-r messages/s]"
+			" [-R rate,rate,..] [-p trace [-x speed]] [-a [-w messages]] [-d seconds] [-v]\n", name);
+	return 1;
+}
+
+static bool ParseRates(char *p, std::vector<Float64> &rates)
+{
+	while (*p) {
+		char *end;
+		Float64 rate = strtod(p, &end);
+		if (end == p) {
+			return false;
+		}
+		rates.push_back(rate);
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return true;
+}
+
+static const char *MessageName(OSType message)
+{
+	switch (message) {
+		case kVisualPluginPlayMessage:
+			return "Play";
+		case kVisualPluginChangeTrackMessage:
+			return "ChangeTrack";
+		case kVisualPluginPulseMessage:
+			return "Pulse";
+		case kVisualPluginStopMessage:
+			return "Stop";
+		default:
+			return "other";
+	}
+}
+
+// the plugin as iTunes sees it: what it registered, and its handler's refCon
+static PlayerRegisterVisualPluginMessage gRegistration;
+static bool gRegistered = false;
+static void *gRefCon = NULL;
+
+static OSStatus AppProc(void *appCookie, OSType message, PlayerMessageInfo *messageInfo)
+{
+	switch (message) {
+		case kPlayerRegisterVisualPluginMessage:
+			gRegistration = messageInfo->u.registerVisualPluginMessage;
+			gRegistered = true;
+			return noErr;
+		default:
+			return unimpErr;
+	}
+}
+
+class Host {
+public:
+	Host(double messageRate, const std::vector<Float64> &rates)
+		: mMessageRate(messageRate)
+		, mRates(rates)
+		, mTrack(0)
+		, mTimeStamp(0)
+		, mSent(0)
+		, mStart(0)
+		, mPulseRate(0)
+		, mPulses(0)
+		, mRegisteredPulses(0)
+		, mPulseSpan(0)
+		, mLastPulse(0)
+		, mCountAllocations(false)
+		, mWarmUp(0)
+	{
+		memset(&mRenderData, 0, sizeof(mRenderData));
+		memset(&mTrackInfo, 0, sizeof(mTrackInfo));
+		memset(&mStreamInfo, 0, sizeof(mStreamInfo));
+	}
+
+	bool Load();
+	void Unload();
+
+	void Begin();
+	unsigned long Sent() const
+	{
+		return mSent;
+	}
+	// count the allocations made by the handler after the first warmUp messages of each scenario
+	void CountAllocations(unsigned long warmUp)
+	{
+		mCountAllocations = true;
+		mWarmUp = warmUp;
+	}
+	unsigned long Allocations() const;
+	void Report(const char *scenario, const std::vector<AudioDeviceID> &devices,
+				const std::vector<unsigned long> &rateChangesBefore);
+
+	void Play(unsigned long track);
+	void ChangeTrack(unsigned long track);
+	// due as for Send()
+	void Pulse(bool quiet, double due = -1);
+	// a pulse at the rate the plugin asked for, unless that is at or after until, in which
+	// case it sleeps until then and returns false
+	bool PacedPulse(double until);
+	void Stop();
+	bool Replay(const char *path, double speed);
+
+private:
+	// due is the time to send the message at; by default the message rate decides
+	OSStatus Send(OSType message, VisualPluginMessageInfo &info, double due = -1);
+	void SetTrack(unsigned long track);
+
+	double mMessageRate;
+	std::vector<Float64> mRates;
+	unsigned long mTrack;
+	ITTrackInfo mTrackInfo;
+	ITStreamInfo mStreamInfo;
+	RenderVisualData mRenderData;
+	UInt32 mTimeStamp;
+	// the current scenario: messages sent, when it began and the handler latencies per message
+	unsigned long mSent;
+	double mStart;
+	std::map<OSType, std::vector<double> > mLatencies;
+	// the pulse rate the plugin asked for, and the current scenario's pulses: their number, those
+	// at the registered rate, the time they span at the rates asked for, and when the last was due
+	UInt32 mPulseRate;
+	unsigned long mPulses, mRegisteredPulses;
+	double mPulseSpan, mLastPulse;
+	bool mCountAllocations;
+	unsigned long mWarmUp;
+	// per message, and their size in bytes
+	std::map<OSType, std::pair<unsigned long, unsigned long> > mAllocations;
+};
+
+bool Host::Load()
+{
+	PluginMessageInfo pluginInfo;
+	memset(&pluginInfo, 0, sizeof(pluginInfo));
+	pluginInfo.u.initMessage.majorVersion = kITPluginMajorMessageVersion;
+	pluginInfo.u.initMessage.minorVersion = kITPluginMinorMessageVersion;
+	pluginInfo.u.initMessage.appCookie = this;
+	pluginInfo.u.initMessage.appProc = AppProc;
+	OSStatus err = iTunesPluginMainMachO(kPluginInitMessage, &pluginInfo, NULL);
+	if (err != noErr || !gRegistered || !gRegistration.handler) {
+		printf("The plugin did not register (%d)\n", (int) err);
+		return false;
+	}
+
+	VisualPluginMessageInfo info;
+	memset(&info, 0, sizeof(info));
+	info.u.initMessage.messageMajorVersion = kITVisualPluginMajorMessageVersion;
+	info.u.initMessage.messageMinorVersion = kITVisualPluginMinorMessageVersion;
+	info.u.initMessage.appCookie = this;
+	info.u.initMessage.appProc = AppProc;
+	gRefCon = gRegistration.registerRefCon;
+	err = gRegistration.handler(kVisualPluginInitMessage, &info, gRefCon);
+	if (err != noErr) {
+		printf("kVisualPluginInitMessage failed (%d)\n", (int) err);
+		return false;
+	}
+	gRefCon = info.u.initMessage.refCon;
+	gRegistration.handler(kVisualPluginEnableMessage, &info, gRefCon);
+	mPulseRate = gRegistration.pulseRateInHz;
+
+	char name[256];
+	size_t length = std::min<size_t>(gRegistration.name[0], sizeof(name) - 1);
+	for (size_t i = 0 ; i < length ; ++i) {
+		name[i] = (char) gRegistration.name[i + 1];
+	}
+	name[length] = '\0';
+	printf("\"%s\": pulses at %uHz, %u waveform and %u spectrum channels\n", name,
+		   (unsigned int) gRegistration.pulseRateInHz, (unsigned int) gRegistration.numWaveformChannels,
+		   (unsigned int) gRegistration.numSpectrumChannels);
+	return true;
+}
+
+void Host::Unload()
+{
+	VisualPluginMessageInfo info;
+	memset(&info, 0, sizeof(info));
+	gRegistration.handler(kVisualPluginCleanupMessage, &info, gRefCon);
+	PluginMessageInfo pluginInfo;
+	memset(&pluginInfo, 0, sizeof(pluginInfo));
+	iTunesPluginMainMachO(kPluginCleanupMessage, &pluginInfo, NULL);
+}
+
+void Host::Begin()
+{
+	mLatencies.clear();
+	mAllocations.clear();
+	mSent = 0;
+	mPulses = mRegisteredPulses = 0;
+	mPulseSpan = 0;
+	SimHAL::Flush();
+	SimHAL::ResetCalls();
+	mLastPulse = mStart = Now();
+}
+
+OSStatus Host::Send(OSType message, VisualPluginMessageInfo &info, double due)
+{
+	if (due < 0 && mMessageRate > 0) {
+		due = mStart + mSent / mMessageRate;
+	}
+	double now = Now();
+	if (due > now) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(due - now));
+	}
+	bool count = mCountAllocations && mSent >= mWarmUp;
+	unsigned long allocations = gAllocations, bytes = gAllocatedBytes;
+	double t = Now();
+	tCountAllocations = count;
+	OSStatus err = gRegistration.handler(message, &info, gRefCon);
+	tCountAllocations = false;
+	mLatencies[message].push_back(Now() - t);
+	if (count) {
+		std::pair<unsigned long, unsigned long> &a = mAllocations[message];
+		a.first += gAllocations - allocations;
+		a.second += gAllocatedBytes - bytes;
+	}
+	mSent += 1;
+	return err;
+}
+
+unsigned long Host::Allocations() const
+{
+	unsigned long n = 0;
+	for (std::map<OSType, std::pair<unsigned long, unsigned long> >::const_iterator it = mAllocations.begin() ;
+		 it != mAllocations.end() ; ++it) {
+		n += it->second.first;
+	}
+	return n;
+}
+
+void Host::SetTrack(unsigned long track)
+{
+	char fileName[64], album[64];
+	mTrack = track;
+	snprintf(fileName, sizeof(fileName), "Track %lu.flac", track);
+	snprintf(album, sizeof(album), "Album %lu", track / 10);
+	memset(&mTrackInfo, 0, sizeof(mTrackInfo));
+	mTrackInfo.validFields = kITTIFileNameFieldMask | kITTIAlbumFieldMask | kITTISizeFieldMask | kITTISampleRateFieldMask
+		| kITTITotalTimeFieldMask;
+	mTrackInfo.fileName[0] = (UniChar) strlen(fileName);
+	for (size_t i = 0 ; fileName[i] ; ++i) {
+		mTrackInfo.fileName[i + 1] = (UniChar) fileName[i];
+	}
+	mTrackInfo.album[0] = (UniChar) strlen(album);
+	for (size_t i = 0 ; album[i] ; ++i) {
+		mTrackInfo.album[i + 1] = (UniChar) album[i];
+	}
+	mTrackInfo.sizeInBytes = 20000000 + track;
+	mTrackInfo.sampleRateFloat = (float) mRates[track % mRates.size()];
+	// every eighth track is a preview of a few seconds, the others last a few minutes
+	mTrackInfo.totalTimeInMS = (track % 8 == 7) ? 5000 : 180000 + (UInt32) (track % 5) * 20000;
+}
+
+void Host::Play(unsigned long track)
+{
+	SetTrack(track);
+	VisualPluginMessageInfo info;
+	memset(&info, 0, sizeof(info));
+	info.u.playMessage.trackInfo = &mTrackInfo;
+	info.u.playMessage.streamInfo = &mStreamInfo;
+	AudioStreamBasicDescription &format = info.u.playMessage.audioFormat;
+	format.mSampleRate = mTrackInfo.sampleRateFloat;
+	format.mFormatID = kAudioFormatLinearPCM;
+	format.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
+	format.mChannelsPerFrame = 2;
+	format.mBitsPerChannel = (track & 1) ? 16 : 24;
+	format.mBytesPerFrame = format.mBytesPerPacket = format.mChannelsPerFrame * format.mBitsPerChannel / 8;
+	format.mFramesPerPacket = 1;
+	info.u.playMessage.volume = 100;
+	Send(kVisualPluginPlayMessage, info);
+}
+
+void Host::ChangeTrack(unsigned long track)
+{
+	SetTrack(track);
+	VisualPluginMessageInfo info;
+	memset(&info, 0, sizeof(info));
+	info.u.changeTrackMessage.trackInfo = &mTrackInfo;
+	info.u.changeTrackMessage.streamInfo = &mStreamInfo;
+	Send(kVisualPluginChangeTrackMessage, info);
+}
+
+void Host::Pulse(bool quiet, double due)
+{
+	mRenderData.numWaveformChannels = gRegistration.numWaveformChannels;
+	mRenderData.numSpectrumChannels = gRegistration.numSpectrumChannels;
+	// odd tracks have the spectrum of content upsampled from half their rate
+	size_t band = (mTrack & 1) ? kVisualNumSpectrumEntries / 2 : kVisualNumSpectrumEntries;
+	for (int c = 0 ; c < kVisualMaxDataChannels ; ++c) {
+		for (int i = 0 ; i < kVisualNumWaveformEntries ; ++i) {
+			mRenderData.waveformData[c][i] = quiet ? 128
+				: (UInt8) (128 + 60 * sin(2 * M_PI * (i + mTimeStamp * kVisualNumWaveformEntries) / 97.0 + c));
+		}
+		for (int i = 0 ; i < kVisualNumSpectrumEntries ; ++i) {
+			mRenderData.spectrumData[c][i] = (quiet || (size_t) i >= band) ? 0 : (UInt8) (200 - 150 * i / kVisualNumSpectrumEntries);
+		}
+	}
+	VisualPluginMessageInfo info;
+	memset(&info, 0, sizeof(info));
+	info.u.pulseMessage.renderData = (mRenderData.numWaveformChannels || mRenderData.numSpectrumChannels) ? &mRenderData : NULL;
+	info.u.pulseMessage.timeStampID = ++mTimeStamp;
+	info.u.pulseMessage.newPulseRateInHz = mPulseRate;
+	mLastPulse = (due >= 0) ? due : Now();
+	Send(kVisualPluginPulseMessage, info, due);
+	mPulses += 1;
+	mRegisteredPulses += (mPulseRate == gRegistration.pulseRateInHz);
+	if (mPulseRate) {
+		mPulseSpan += 1.0 / mPulseRate;
+	}
+	mPulseRate = info.u.pulseMessage.newPulseRateInHz;
+}
+
+bool Host::PacedPulse(double until)
+{
+	double due = mPulseRate ? mLastPulse + 1.0 / mPulseRate : until;
+	if (due >= until) {
+		double now = Now();
+		if (until > now) {
+			std::this_thread::sleep_for(std::chrono::duration<double>(until - now));
+		}
+		return false;
+	}
+	Pulse(false, due);
+	return true;
+}
+
+void Host::Stop()
+{
+	VisualPluginMessageInfo info;
+	memset(&info, 0, sizeof(info));
+	Send(kVisualPluginStopMessage, info);
+}
+
+bool Host::Replay(const char *path, double speed)
+{
+	MessageTrace trace;
+	if (!trace.Open(path)) {
+		printf("Cannot read the trace %s\n", path);
+		return false;
+	}
+	OSType message;
+	VisualPluginMessageInfo info;
+	double t;
+	while (trace.Next(message, info, t)) {
+		// the host has loaded the plugin already
+		if (message == kVisualPluginInitMessage || message == kVisualPluginCleanupMessage) {
+			continue;
+		}
+		Send(message, info, (speed > 0) ? mStart + t / speed : 0);
+	}
+	return true;
+}
+
+void Host::Report(const char *scenario, const std::vector<AudioDeviceID> &devices,
+				  const std::vector<unsigned long> &rateChangesBefore)
+{
+	double elapsed = Now() - mStart;
+	SimHAL::Flush();
+	SimCallCounts calls = SimHAL::Calls();
+	unsigned long rateChanges = 0;
+	for (size_t i = 0 ; i < devices.size() ; ++i) {
+		SimDeviceState state;
+		if (SimHAL::GetDeviceState(devices[i], state)) {
+			rateChanges += state.rateChanges - rateChangesBefore[i];
+		}
+	}
+	printf("%s: %lu messages in %.3fs, %lu rate changes\n", scenario, mSent, elapsed, rateChanges);
+	for (std::map<OSType, std::vector<double> >::iterator it = mLatencies.begin() ; it != mLatencies.end() ; ++it) {
+		std::vector<double> &d = it->second;
+		std::sort(d.begin(), d.end());
+		printf("\t%-12s %7lu: p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n", MessageName(it->first),
+			   (unsigned long) d.size(), d[d.size() / 2] * 1000, d[d.size() * 9 / 10] * 1000,
+			   d[d.size() * 99 / 100] * 1000, d.back() * 1000);
+	}
+	printf("\tHAL calls: %lu get, %lu get size, %lu set (%lu failed, %.3fs), %lu has, %lu listener notifications\n",
+		   calls.get, calls.getSize, calls.set, calls.failures, calls.setSeconds, calls.has, calls.notifications);
+	if (mPulses && mPulseSpan > 0) {
+		printf("\tpulses: %lu, %lu at the registered %uHz; %.2f wakeups/s at the rates asked for, now %uHz\n",
+			   mPulses, mRegisteredPulses, (unsigned int) gRegistration.pulseRateInHz, mPulses / mPulseSpan,
+			   (unsigned int) mPulseRate);
+	}
+	if (mCountAllocations) {
+		unsigned long counted = (mSent > mWarmUp) ? mSent - mWarmUp : 0;
+		printf("\tallocations in %lu messages after %lu to warm up: %lu\n", counted, mWarmUp, Allocations());
+		for (std::map<OSType, std::pair<unsigned long, unsigned long> >::iterator it = mAllocations.begin() ;
+			 it != mAllocations.end() ; ++it) {
+			if (it->second.first) {
+				printf("\t%-12s %7lu allocations, %lu bytes\n", MessageName(it->first), it->second.first, it->second.second);
+			}
+		}
+	}
+}
+
+static AudioDeviceID DefaultOutputDevice()
+{
+	AudioObjectPropertyAddress address = { kAudioHardwarePropertyDefaultOutputDevice,
+										   kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+	AudioDeviceID device = kAudioDeviceUnknown;
+	UInt32 size = sizeof(device);
+	if (AudioObjectGetPropertyData(kAudioObjectSystemObject, &address, 0, NULL, &size, &device) != noErr) {
+		return kAudioDeviceUnknown;
+	}
+	return device;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *script = NULL, *tracePath = NULL;
+	double speed = 1;
+	std::vector<std::string> scenarios;
+	unsigned long messages = 10000;
+	double messageRate = 0;
+	std::vector<Float64> rates;
+	bool verbose = false, countAllocations = false;
+	unsigned long warmUp = 1000;
+	double duration = 10;
+	for (int i = 1 ; i < argc ; ++i) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			script = argv[++i];
+		} else if (!strcmp(argv[i], "-S") && i + 1 < argc) {
+			for (char *s = strtok(argv[++i], ",") ; s ; s = strtok(NULL, ",")) {
+				scenarios.push_back(s);
+			}
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			messages = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			messageRate = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-R") && i + 1 < argc) {
+			if (!ParseRates(argv[++i], rates)) {
+				return Usage(argv[0]);
+			}
+		} else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+			speed = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-a")) {
+			countAllocations = true;
+		} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+			warmUp = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			duration = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-v")) {
+			verbose = true;
+		} else {
+			return Usage(argv[0]);
+		}
+	}
+	if (scenarios.empty() && tracePath) {
+		scenarios.push_back("replay");
+	} else if (scenarios.empty()) {
+		static const char *all[] = { "play", "skip", "pause", "device", "pulse" };
+		scenarios.assign(all, all + sizeof(all) / sizeof(all[0]));
+	}
+	if (rates.empty()) {
+		static const Float64 standard[] = { 44100, 96000, 48000, 192000, 88200, 176400 };
+		rates.assign(standard, standard + sizeof(standard) / sizeof(Float64));
+	}
+	if (script) {
+		std::string error;
+		if (!SimHAL::RunScript(script, &error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	}
+	if (!verbose) {
+		freopen("/dev/null", "w", stderr);
+	}
+
+	// the device scenario alternates between the default device and a second one
+	AudioDeviceID primary = DefaultOutputDevice();
+	SimDeviceSpec spec;
+	spec.name = "BPPluginHost alternate output";
+	spec.uid = "BPPluginHost:alternate";
+	AudioDeviceID alternate = SimHAL::AddDevice(spec);
+	std::vector<AudioDeviceID> devices;
+	devices.push_back(primary);
+	devices.push_back(alternate);
+
+	Host host(messageRate, rates);
+	if (!host.Load()) {
+		return 1;
+	}
+	if (countAllocations) {
+		host.CountAllocations(warmUp);
+		messages += warmUp;
+	}
+	unsigned long track = 0, allocations = 0;
+	for (size_t s = 0 ; s < scenarios.size() ; ++s) {
+		const std::string &scenario = scenarios[s];
+		std::vector<unsigned long> rateChanges;
+		for (size_t i = 0 ; i < devices.size() ; ++i) {
+			SimDeviceState state;
+			rateChanges.push_back(SimHAL::GetDeviceState(devices[i], state) ? state.rateChanges : 0);
+		}
+		host.Begin();
+		if (scenario == "play") {
+			while (host.Sent() < messages) {
+				host.Play(track);
+				for (int i = 0 ; i < 10 ; ++i) {
+					host.Pulse(false);
+				}
+				host.ChangeTrack(++track);
+				for (int i = 0 ; i < 10 ; ++i) {
+					host.Pulse(i == 0);
+				}
+				host.Stop();
+				track += 1;
+			}
+		} else if (scenario == "skip") {
+			host.Play(track);
+			while (host.Sent() + 1 < messages) {
+				host.ChangeTrack(++track);
+				host.Pulse(false);
+			}
+			host.Stop();
+		} else if (scenario == "pause") {
+			while (host.Sent() < messages) {
+				host.Play(track);
+				host.Stop();
+			}
+			track += 1;
+		} else if (scenario == "device") {
+			bool onAlternate = false;
+			while (host.Sent() < messages) {
+				onAlternate = !onAlternate;
+				SimHAL::SetDefaultDevice(onAlternate ? alternate : primary);
+				host.Play(track++);
+				for (int i = 0 ; i < 5 ; ++i) {
+					host.Pulse(false);
+				}
+				host.Stop();
+			}
+			SimHAL::SetDefaultDevice(primary);
+		} else if (scenario == "pulse") {
+			host.Play(track);
+			while (host.Sent() + 1 < messages) {
+				// a quiet block now and then, as between tracks
+				host.Pulse(host.Sent() % 50 < 3);
+			}
+			host.Stop();
+			track += 1;
+		} else if (scenario == "idle") {
+			double start = Now();
+			host.Play(track);
+			for (int part = 1 ; part <= 3 ; ++part) {
+				while (host.PacedPulse(start + duration * part / 3)) {
+				}
+				if (part < 3) {
+					host.ChangeTrack(++track);
+				}
+			}
+			host.Stop();
+			track += 1;
+		} else if (scenario == "replay" && tracePath) {
+			if (!host.Replay(tracePath, speed)) {
+				continue;
+			}
+		} else {
+			printf("Unknown scenario \"%s\"\n", scenario.c_str());
+			continue;
+		}
+		host.Report(scenario.c_str(), devices, rateChanges);
+		allocations += host.Allocations();
+	}
+	host.Unload();
+	return (countAllocations && allocations) ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+/*=============================================================================
+	BPRateScan.cpp
+
+	Builds the rate index the plugin consults on track changes, by scanning
+	music folders in parallel, or looks files up in an existing index.
+
+	Usage:	BPRateScan [-t threads] [-o index] <folder> [folder...]
+			BPRateScan -l [-o index] <file> [file...]
+	The index is written to ~/Library/Caches/iTunesBPSampleRate/RateIndex
+	by default.
+=============================================================================*/
+
+#include "RateIndex.h"
+#include "AudioHeader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int Usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t threads] [-o index] <folder> [folder...]\n"
+			"       %s -l [-o index] <file> [file...]\n", name, name);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned threads = 0;
+	bool lookup = false;
+	std::string indexPath = RateIndex::DefaultPath();
+	int i = 1;
+	for ( ; i < argc && argv[i][0] == '-' ; ++i) {
+		if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			threads = (unsigned) atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			indexPath = argv[++i];
+		} else if (!strcmp(argv[i], "-l")) {
+			lookup = true;
+		} else {
+			return Usage(argv[0]);
+		}
+	}
+	if (i == argc) {
+		return Usage(argv[0]);
+	}
+	RateIndex index;
+	if (lookup) {
+		if (!index.Load(indexPath.c_str())) {
+			fprintf(stderr, "cannot load the index %s\n", indexPath.c_str());
+			return 1;
+		}
+		for ( ; i < argc ; ++i) {
+			RateIndex::Entry entry;
+			struct stat st;
+			const char *name = strrchr(argv[i], '/');
+			name = name ? name + 1 : argv[i];
+			if (index.LookupPath(argv[i], entry)) {
+				printf("%s: %uHz %u bits %u channels\n", argv[i], entry.sampleRate, entry.bitsPerChannel, entry.channels);
+			} else if (stat(argv[i], &st) == 0 && index.LookupName(name, (uint64_t) st.st_size, entry)) {
+				printf("%s: %uHz %u bits %u channels (by name)\n", argv[i], entry.sampleRate, entry.bitsPerChannel, entry.channels);
+			} else {
+				printf("%s: not in the index\n", argv[i]);
+			}
+		}
+		return 0;
+	}
+	std::vector<std::string> folders(argv + i, argv + argc);
+	RateIndex::ScanStats stats;
+	index.Build(folders, threads, &stats);
+	if (!index.Write(indexPath.c_str())) {
+		perror(indexPath.c_str());
+		return 1;
+	}
+	printf("%lu directories, %lu audio files, %lu scanned, %lu failed, %lu tasks stolen\n",
+		   stats.directories, stats.files, stats.scanned, stats.failed, stats.steals);
+	printf("%lu index entries written to %s in %.2fs (%.0f files/s)\n", (unsigned long) index.Count(),
+		   indexPath.c_str(), stats.seconds, stats.seconds > 0 ? stats.files / stats.seconds : 0.0);
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*=============================================================================
+	BPResample.cpp
+
+	Offline sample rate conversion of WAV files with the polyphase resampler,
+	e.g. to prepare 176.4kHz content for a device that tops out at 96kHz.
+	Reads 16, 24 or 32 bit integer or 32 bit float PCM and writes the same
+	sample format unless told otherwise; integer output is TPDF dithered.
+
+	Usage: BPResample [-q medium|high] [-b 16|24|32|f] <rate> <in.wav> <out.wav>
+=============================================================================*/
+
+#include "Resampler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+static const size_t kChunkFrames = 16384;
+
+struct WavFormat {
+	unsigned channels, bits;
+	bool isFloat;
+	uint32_t rate;
+};
+
+static uint32_t GetLE(const unsigned char *p, int n)
+{
+	uint32_t v = 0;
+	for (int i = n - 1 ; i >= 0 ; --i) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static void PutLE(unsigned char *p, uint32_t v, int n)
+{
+	for (int i = 0 ; i < n ; ++i, v >>= 8) {
+		p[i] = (unsigned char)(v & 0xff);
+	}
+}
+
+// parse the RIFF header and leave fp positioned at the start of the sample data
+static bool ReadHeader(FILE *fp, WavFormat &fmt, uint32_t &dataBytes)
+{
+	unsigned char hdr[12], chunk[8], body[40];
+	if (fread(hdr, 1, 12, fp) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+		return false;
+	}
+	bool haveFormat = false;
+	while (fread(chunk, 1, 8, fp) == 8) {
+		uint32_t size = GetLE(chunk + 4, 4);
+		if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+			size_t n = size < sizeof(body) ? size : sizeof(body);
+			if (fread(body, 1, n, fp) != n) {
+				return false;
+			}
+			unsigned tag = GetLE(body, 2);
+			if (tag == 0xFFFE && n >= 26) {
+				// WAVE_FORMAT_EXTENSIBLE: the actual format is in the subformat GUID
+				tag = GetLE(body + 24, 2);
+			}
+			fmt.channels = GetLE(body + 2, 2);
+			fmt.rate = GetLE(body + 4, 4);
+			fmt.bits = GetLE(body + 14, 2);
+			fmt.isFloat = (tag == 3);
+			if ((tag != 1 && tag != 3) || fmt.channels == 0
+					|| (fmt.isFloat ? fmt.bits != 32 : (fmt.bits != 16 && fmt.bits != 24 && fmt.bits != 32))) {
+				fprintf(stderr, "unsupported sample format (tag %u, %u bits)\n", tag, fmt.bits);
+				return false;
+			}
+			fseek(fp, (long)(size - n + (size & 1)), SEEK_CUR);
+			haveFormat = true;
+		} else if (!memcmp(chunk, "data", 4)) {
+			dataBytes = size;
+			return haveFormat;
+		} else {
+			fseek(fp, (long)(size + (size & 1)), SEEK_CUR);
+		}
+	}
+	return false;
+}
+
+static bool WriteHeader(FILE *fp, const WavFormat &fmt, uint32_t dataBytes)
+{
+	unsigned char hdr[44];
+	unsigned blockAlign = fmt.channels * fmt.bits / 8;
+	memcpy(hdr, "RIFF", 4);
+	PutLE(hdr + 4, 36 + dataBytes, 4);
+	memcpy(hdr + 8, "WAVEfmt ", 8);
+	PutLE(hdr + 16, 16, 4);
+	PutLE(hdr + 20, fmt.isFloat ? 3 : 1, 2);
+	PutLE(hdr + 22, fmt.channels, 2);
+	PutLE(hdr + 24, fmt.rate, 4);
+	PutLE(hdr + 28, fmt.rate * blockAlign, 4);
+	PutLE(hdr + 32, blockAlign, 2);
+	PutLE(hdr + 34, fmt.bits, 2);
+	memcpy(hdr + 36, "data", 4);
+	PutLE(hdr + 40, dataBytes, 4);
+	return fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr);
+}
+
+static void Decode(const unsigned char *p, size_t samples, const WavFormat &fmt, float *out)
+{
+	for (size_t i = 0 ; i < samples ; ++i) {
+		switch (fmt.bits) {
+			case 16:
+				out[i] = (int16_t) GetLE(p, 2) / 32768.0f;
+				p += 2;
+				break;
+			case 24:
+				out[i] = (int32_t)(GetLE(p, 3) << 8) / 2147483648.0f;
+				p += 3;
+				break;
+			default:
+				if (fmt.isFloat) {
+					uint32_t v = GetLE(p, 4);
+					memcpy(&out[i], &v, 4);
+				} else {
+					out[i] = (float)((int32_t) GetLE(p, 4) / 2147483648.0);
+				}
+				p += 4;
+				break;
+		}
+	}
+}
+
+// uniform random number in [-0.5, 0.5)
+static double Random(uint32_t &state)
+{
+	state = state * 1664525 + 1013904223;
+	return (state >> 8) / 16777216.0 - 0.5;
+}
+
+static void Encode(const float *in, size_t samples, const WavFormat &fmt, unsigned char *p, uint32_t &dither)
+{
+	for (size_t i = 0 ; i < samples ; ++i) {
+		if (fmt.isFloat) {
+			uint32_t v;
+			memcpy(&v, &in[i], 4);
+			PutLE(p, v, 4);
+			p += 4;
+			continue;
+		}
+		double scale = ldexp(1.0, fmt.bits - 1);
+		double v = in[i] * scale;
+		if (fmt.bits < 32) {
+			// triangular PDF dither of 1 LSB peak
+			v += Random(dither) + Random(dither);
+		}
+		v = floor(v + 0.5);
+		if (v > scale - 1) {
+			v = scale - 1;
+		} else if (v < -scale) {
+			v = -scale;
+		}
+		PutLE(p, (uint32_t)(int32_t) v, fmt.bits / 8);
+		p += fmt.bits / 8;
+	}
+}
+
+static int Usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-q medium|high] [-b 16|24|32|f] <rate> <in.wav> <out.wav>\n", name);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	Resampler::Quality quality = Resampler::kQualityHigh;
+	const char *bits = NULL;
+	int i = 1;
+	for ( ; i < argc && argv[i][0] == '-' ; ++i) {
+		if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+			quality = strcmp(argv[++i], "medium") ? Resampler::kQualityHigh : Resampler::kQualityMedium;
+		} else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			bits = argv[++i];
+		} else {
+			return Usage(argv[0]);
+		}
+	}
+	if (argc - i != 3) {
+		return Usage(argv[0]);
+	}
+	double outRate = atof(argv[i]);
+	FILE *in = fopen(argv[i + 1], "rb");
+	if (!in) {
+		perror(argv[i + 1]);
+		return 1;
+	}
+	WavFormat inFmt;
+	uint32_t dataBytes = 0;
+	if (!ReadHeader(in, inFmt, dataBytes)) {
+		fprintf(stderr, "%s: not a supported WAV file\n", argv[i + 1]);
+		return 1;
+	}
+	WavFormat outFmt = inFmt;
+	outFmt.rate = (uint32_t) outRate;
+	if (bits) {
+		outFmt.isFloat = (bits[0] == 'f');
+		outFmt.bits = outFmt.isFloat ? 32 : (unsigned) atoi(bits);
+		if (!outFmt.isFloat && outFmt.bits != 16 && outFmt.bits != 24 && outFmt.bits != 32) {
+			return Usage(argv[0]);
+		}
+	}
+	Resampler resampler(inFmt.rate, outRate, inFmt.channels, quality);
+	if (!resampler.Valid()) {
+		fprintf(stderr, "conversion from %uHz to %gHz is not supported\n", inFmt.rate, outRate);
+		return 1;
+	}
+	FILE *out = fopen(argv[i + 2], "wb");
+	if (!out || !WriteHeader(out, outFmt, 0)) {
+		perror(argv[i + 2]);
+		return 1;
+	}
+	fprintf(stderr, "%uHz -> %gHz: %u/%u, %u taps per phase, %s kernel, %.1f frames latency\n",
+			inFmt.rate, outRate, resampler.InterpolationFactor(), resampler.DecimationFactor(),
+			(unsigned) resampler.FlushFrames(), Resampler::KernelName(Resampler::ActiveKernel()), resampler.Latency());
+
+	const unsigned channels = inFmt.channels;
+	const size_t inFrameBytes = channels * inFmt.bits / 8, outFrameBytes = channels * outFmt.bits / 8;
+	// the filter delays the signal; drop that many frames from the start of the output
+	size_t skip = (size_t) floor(resampler.Latency() + 0.5);
+	size_t maxOut = resampler.MaxOutputFrames(kChunkFrames > resampler.FlushFrames() ? kChunkFrames : resampler.FlushFrames());
+	std::vector<unsigned char> raw(kChunkFrames * inFrameBytes), encoded(maxOut * outFrameBytes);
+	std::vector<float> samples(kChunkFrames * channels), converted(maxOut * channels);
+	uint32_t remaining = dataBytes - dataBytes % inFrameBytes, written = 0, dither = 1;
+	// and stop at the duration of the input
+	size_t total = (size_t) ceil((double)(remaining / inFrameBytes) * outRate / inFmt.rate);
+	bool flushed = false;
+	while (!flushed) {
+		size_t frames = 0, produced;
+		if (remaining > 0) {
+			frames = fread(&raw[0], inFrameBytes, std::min<size_t>(kChunkFrames, remaining / inFrameBytes), in);
+			remaining = frames ? remaining - (uint32_t)(frames * inFrameBytes) : 0;
+		}
+		if (frames > 0) {
+			Decode(&raw[0], frames * channels, inFmt, &samples[0]);
+			produced = resampler.Process(&samples[0], frames, &converted[0]);
+		} else {
+			produced = resampler.Flush(&converted[0]);
+			flushed = true;
+		}
+		size_t drop = std::min(skip, produced);
+		skip -= drop;
+		produced = std::min(produced - drop, total);
+		total -= produced;
+		Encode(&converted[drop * channels], produced * channels, outFmt, &encoded[0], dither);
+		if (fwrite(&encoded[0], outFrameBytes, produced, out) != produced) {
+			perror(argv[i + 2]);
+			return 1;
+		}
+		written += (uint32_t)(produced * outFrameBytes);
+	}
+	if (written & 1) {
+		fputc(0, out);
+	}
+	rewind(out);
+	WriteHeader(out, outFmt, written);
+	fclose(out);
+	fclose(in);
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*=============================================================================
+	BPStatus.cpp
+
+	Prints the status the plugin publishes in shared memory (see
+	StatusSegment.h) when its PublishStatus setting is on. Reading the
+	segment costs a memory copy: neither the HAL nor iTunes are involved.
+
+	Usage:	BPStatus [-s segment] [-w milliseconds]
+	-w keeps printing the status at that interval, and the counters' rates
+	of change.
+=============================================================================*/
+
+#include "StatusSegment.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+static int Usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s segment] [-w milliseconds]\n", name);
+	return 1;
+}
+
+static void Print(const StatusSegment::Status &s)
+{
+	printf("pid %u, %s; \"%s\" (%u) at %gHz; content %gHz, requested %gHz\n", s.pid, s.playing ? "playing" : "stopped",
+		   s.deviceName, s.deviceID, s.nominalRate, s.contentRate, s.chosenRate);
+	printf("\t%llu switches, %llu skipped, %llu failed, %llu HAL calls, %llu pulses (now at %uHz)\n",
+		   (unsigned long long) s.switches, (unsigned long long) s.skippedSwitches, (unsigned long long) s.failures,
+		   (unsigned long long) s.halCalls, (unsigned long long) s.pulses, s.pulseRate);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = StatusSegment::DefaultName();
+	double interval = 0;
+	for (int i = 1 ; i < argc ; ++i) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			name = argv[++i];
+		} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+			interval = strtod(argv[++i], NULL) / 1000.0;
+		} else {
+			return Usage(argv[0]);
+		}
+	}
+
+	StatusSegment segment;
+	if (!segment.Open(name)) {
+		printf("No status segment %s\n", name);
+		return 1;
+	}
+	StatusSegment::Status status, previous;
+	if (!segment.Read(status)) {
+		printf("Cannot read a consistent status from %s\n", name);
+		return 1;
+	}
+	Print(status);
+	fflush(stdout);
+	while (interval > 0) {
+		previous = status;
+		std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+		if (!segment.Read(status)) {
+			continue;
+		}
+		if (status.updated != previous.updated) {
+			Print(status);
+			printf("\t%.1f switches/s, %.1f HAL calls/s, %.1f pulses/s\n", (status.switches - previous.switches) / interval,
+				   (status.halCalls - previous.halCalls) / interval, (status.pulses - previous.pulses) / interval);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*=============================================================================
+	BPSwitchBench.cpp
+
+	Runs AudioDevice's rate switching against the simulated HAL (SimHAL)
+	and reports how long the switches take and how many HAL calls they
+	cost. The virtual devices, their timing and the faults to inject come
+	from a SimHAL script.
+
+	Usage:	BPSwitchBench [-s script] [-d device] [-n switches] [-r rate,rate,..]
+					[-b bits,bits,..] [-B milliseconds] [-t milliseconds [-p]] [-c] [-l] [-v]
+	-b matches the physical formats to content of those bit depths, one
+	switch after the other like the rates, -B tunes
+	the buffer to that duration, and -t waits at most that long for the
+	hardware to settle after each switch. Switches are reconfiguration
+	transactions (AudioDevice::Reconfigure) unless -p makes them piecemeal:
+	the rate, the physical formats and the buffer size one after the other,
+	each followed by its own wait. The reconfigurations are counted by the
+	simulated HAL.
+	-c selects the device's clock source for the family of each rate (see
+	AudioDevice::SetClockSourceSelection); compare the settling time with
+	and without it on a device with a clock per family, like
+		device "Dual Clock DAC" clocks=44100,48000 settle=50 relock=800
+	The rates the device was found not to take are listed at the end. A
+	device that reports a new rate late must not have any rate rejected
+	when it is switched faster than that, like
+		device "Late DAC" nominallag=300
+	without -t, while one that ignores a rate, like
+		device "Deaf DAC" ignore=88200
+	has it rejected once it has been found to stay at the old rate twice,
+	each time after a wait of a few seconds (-t 3000).
+	-l lists the devices; -v keeps the device code's log output (on stderr).
+=============================================================================*/
+
+#include "AudioDevice.h"
+#include "AudioDeviceList.h"
+#include "SimHAL.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+static double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int Usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s script] [-d device] [-n switches] [-r rate,rate,..] [-b bits,bits,..] [-B milliseconds]"
+			" [-t milliseconds [-p]] [-c] [-l] [-v]\n", name);
+	return 1;
+}
+
+// wait until the simulated device's actual rate is its nominal rate; returns the time waited
+static double Settle(AudioDeviceID device, double timeout)
+{
+	double start = Now();
+	SimDeviceState state;
+	while (SimHAL::GetDeviceState(device, state) && state.actualRate != state.nominalRate && Now() - start < timeout) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return Now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *script = NULL, *deviceName = NULL;
+	unsigned long switches = 1000;
+	std::vector<Float64> rates;
+	bool list = false, verbose = false, piecemeal = false, selectClock = false;
+	std::vector<UInt32> bits;
+	double bufferMS = 0, settleTimeout = 0;
+	for (int i = 1 ; i < argc ; ++i) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			script = argv[++i];
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			deviceName = argv[++i];
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			switches = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			for (char *p = argv[++i] ; *p ; ) {
+				char *end;
+				Float64 rate = strtod(p, &end);
+				if (end == p) {
+					return Usage(argv[0]);
+				}
+				rates.push_back(rate);
+				p = (*end == ',') ? end + 1 : end;
+			}
+		} else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			for (char *p = argv[++i] ; *p ; ) {
+				char *end;
+				UInt32 depth = (UInt32) strtoul(p, &end, 10);
+				if (end == p) {
+					return Usage(argv[0]);
+				}
+				bits.push_back(depth);
+				p = (*end == ',') ? end + 1 : end;
+			}
+		} else if (!strcmp(argv[i], "-B") && i + 1 < argc) {
+			bufferMS = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			settleTimeout = strtod(argv[++i], NULL) / 1000.0;
+		} else if (!strcmp(argv[i], "-p")) {
+			piecemeal = true;
+		} else if (!strcmp(argv[i], "-c")) {
+			selectClock = true;
+		} else if (!strcmp(argv[i], "-l")) {
+			list = true;
+		} else if (!strcmp(argv[i], "-v")) {
+			verbose = true;
+		} else {
+			return Usage(argv[0]);
+		}
+	}
+	if (rates.empty()) {
+		static const Float64 standard[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+		rates.assign(standard, standard + sizeof(standard) / sizeof(Float64));
+	}
+	if (script) {
+		std::string error;
+		if (!SimHAL::RunScript(script, &error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	}
+	if (!verbose) {
+		freopen("/dev/null", "w", stderr);
+	}
+
+	if (list) {
+		AudioDeviceList devices(false);
+		for (size_t i = 0 ; i < devices.GetList().size() ; ++i) {
+			printf("%u\t%s\n", (unsigned int) devices.GetList()[i].mID, devices.GetList()[i].mName);
+		}
+	}
+
+	AudioDevice *dev;
+	OSStatus err = noErr;
+	if (deviceName) {
+		AudioDeviceID id = SimHAL::FindDevice(deviceName);
+		if (id == kAudioDeviceUnknown) {
+			printf("No device \"%s\"\n", deviceName);
+			return 1;
+		}
+		dev = new AudioDevice(id);
+	} else {
+		dev = AudioDevice::GetDefaultDevice(false, err);
+	}
+	if (!dev || !dev->Valid()) {
+		printf("No output device (%d)\n", (int) err);
+		return 1;
+	}
+
+	AudioDevice::SetBufferDuration(bufferMS);
+	AudioDevice::SetClockSourceSelection(selectClock);
+	SimDeviceState state;
+	SimHAL::GetDeviceState(dev->ID(), state);
+	unsigned long reconfigurations = state.reconfigurations, clockSourceChanges = state.clockSourceChanges, unsettled = 0;
+	double settling = 0;
+	SimHAL::ResetCalls();
+	std::vector<double> durations;
+	unsigned long failures = 0;
+	double start = Now();
+	for (unsigned long i = 0 ; i < switches ; ++i) {
+		Float64 rate = rates[i % rates.size()];
+		UInt32 contentBits = bits.empty() ? 0 : bits[i % bits.size()];
+		double t = Now();
+		OSStatus err;
+		if (piecemeal) {
+			// the rate (with the buffer, which follows it), then the formats, each with its own wait
+			dev->SetContentFormat(0, 0);
+			err = dev->SetNominalSampleRate(rate);
+			if (settleTimeout > 0) {
+				settling += Settle(dev->ID(), settleTimeout);
+			}
+			if (err == noErr && contentBits) {
+				dev->SetContentFormat(contentBits, 0);
+				err = dev->MatchPhysicalFormat(dev->CurrentNominalSampleRate());
+				if (settleTimeout > 0) {
+					settling += Settle(dev->ID(), settleTimeout);
+				}
+			}
+		} else {
+			AudioDevice::Reconfiguration target = { rate, contentBits, 0, 0, settleTimeout, false };
+			AudioDevice::ReconfigurationReport report;
+			err = dev->Reconfigure(target, &report);
+			settling += report.settleSeconds;
+			unsettled += report.settled ? 0 : 1;
+		}
+		if (err != noErr) {
+			failures += 1;
+		}
+		durations.push_back(Now() - t);
+	}
+	double elapsed = Now() - start;
+	SimHAL::GetDeviceState(dev->ID(), state);
+	reconfigurations = state.reconfigurations - reconfigurations;
+	std::string rejected;
+	for (size_t i = 0 ; i < rates.size() ; ++i) {
+		if (dev->IsRejectedRate(rates[i])) {
+			char rate[32];
+			snprintf(rate, sizeof(rate), "%s%gHz", rejected.empty() ? "" : ", ", rates[i]);
+			rejected += rate;
+		}
+	}
+	clockSourceChanges = state.clockSourceChanges - clockSourceChanges;
+	dev->ResetNominalSampleRate();
+	SimHAL::Flush();
+	SimCallCounts calls = SimHAL::Calls();
+
+	std::sort(durations.begin(), durations.end());
+	printf("\"%s\": %lu switch requests in %.3fs, %lu rate changes, %lu failed\n", dev->GetName(),
+		   switches, elapsed, (unsigned long) dev->Switches(), failures);
+	if (!durations.empty()) {
+		printf("SetNominalSampleRate: p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n",
+			   durations[durations.size() / 2] * 1000, durations[durations.size() * 9 / 10] * 1000,
+			   durations[durations.size() * 99 / 100] * 1000, durations.back() * 1000);
+	}
+	printf("%s: %lu reconfigurations (%.2f per switch request), %.3fs settling%s\n",
+		   piecemeal ? "piecemeal" : "transactions", reconfigurations, switches ? (double) reconfigurations / switches : 0.0,
+		   settling, unsettled ? " (some did not settle)" : "");
+	if (clockSourceChanges || selectClock) {
+		printf("clock sources: %lu changes, %s\n", clockSourceChanges, selectClock ? "selected per rate family" : "left alone");
+	}
+	printf("rejected rates: %s\n", rejected.empty() ? "none" : rejected.c_str());
+	printf("HAL calls: %lu get, %lu get size, %lu set (%lu failed, %.3fs), %lu has, %lu listener notifications\n",
+		   calls.get, calls.getSize, calls.set, calls.failures, calls.setSeconds, calls.has, calls.notifications);
+	delete dev;
+	return 0;
+}
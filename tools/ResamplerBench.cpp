@@ -0,0 +1,129 @@
+/*=============================================================================
+	ResamplerBench.cpp
+
+	Throughput benchmark for the polyphase resampler: converts a stereo test
+	signal for each supported ratio with each inner product implementation
+	the CPU offers, and reports the rate in input frames per second per core.
+	With -t N, N converters run concurrently on as many threads, which shows
+	how the throughput holds up when all cores are busy.
+
+	Usage: ResamplerBench [-t threads] [-s seconds] [-c channels] [-q medium|high]
+=============================================================================*/
+
+#include "Resampler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+static const size_t kChunkFrames = 4096;
+
+static const struct {
+	double in, out;
+} kRatios[] = {
+	{ 88200, 44100 },
+	{ 96000, 48000 },
+	{ 176400, 44100 },
+	{ 192000, 48000 },
+	{ 44100, 48000 },
+	{ 48000, 44100 },
+	{ 88200, 96000 },
+	{ 96000, 88200 },
+	{ 192000, 44100 }
+};
+
+static double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// convert for the given duration; returns the number of input frames converted
+static double Run(double inRate, double outRate, unsigned channels, Resampler::Quality quality,
+				  double seconds, double *elapsed)
+{
+	Resampler resampler(inRate, outRate, channels, quality);
+	std::vector<float> in(kChunkFrames * channels), out(resampler.MaxOutputFrames(kChunkFrames) * channels);
+	for (size_t i = 0 ; i < kChunkFrames ; ++i) {
+		for (unsigned c = 0 ; c < channels ; ++c) {
+			in[i * channels + c] = (float)(0.5 * sin(2 * M_PI * 1000 * (i + c) / inRate));
+		}
+	}
+	// warm up, and make sure the filter bank has been designed
+	resampler.Process(&in[0], kChunkFrames, &out[0]);
+	double frames = 0, start = Now(), now;
+	do {
+		for (int i = 0 ; i < 16 ; ++i) {
+			resampler.Process(&in[0], kChunkFrames, &out[0]);
+		}
+		frames += 16 * kChunkFrames;
+		now = Now();
+	} while (now - start < seconds);
+	*elapsed = now - start;
+	return frames;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = 1;
+	double seconds = 1;
+	unsigned channels = 2;
+	Resampler::Quality quality = Resampler::kQualityHigh;
+	for (int i = 1 ; i < argc ; ++i) {
+		if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			seconds = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			channels = (unsigned) atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+			quality = strcmp(argv[++i], "medium") ? Resampler::kQualityHigh : Resampler::kQualityMedium;
+		} else {
+			fprintf(stderr, "Usage: %s [-t threads] [-s seconds] [-c channels] [-q medium|high]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1 || channels < 1 || seconds <= 0) {
+		fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+		return 1;
+	}
+	Resampler::Kernel best = Resampler::ActiveKernel();
+	printf("%u channels, %s quality, %d thread(s), best kernel %s\n", channels,
+		   quality == Resampler::kQualityHigh ? "high" : "medium", threads, Resampler::KernelName(best));
+	printf("%-18s %5s %5s %6s %8s %16s %10s\n", "ratio", "L", "M", "taps", "kernel", "frames/s/core", "x realtime");
+	for (size_t r = 0 ; r < sizeof(kRatios) / sizeof(kRatios[0]) ; ++r) {
+		double inRate = kRatios[r].in, outRate = kRatios[r].out;
+		Resampler probe(inRate, outRate, channels, quality);
+		if (!probe.Valid()) {
+			continue;
+		}
+		for (int k = Resampler::kKernelScalar ; k <= Resampler::kKernelAVX2 ; ++k) {
+			if (!Resampler::SelectKernel((Resampler::Kernel) k)) {
+				continue;
+			}
+			std::vector<double> frames(threads), elapsed(threads);
+			std::vector<std::thread> workers;
+			for (int t = 0 ; t < threads ; ++t) {
+				workers.push_back(std::thread([&, t]() {
+					frames[t] = Run(inRate, outRate, channels, quality, seconds, &elapsed[t]);
+				}));
+			}
+			double perCore = 0;
+			for (int t = 0 ; t < threads ; ++t) {
+				workers[t].join();
+				perCore += frames[t] / elapsed[t];
+			}
+			perCore /= threads;
+			char label[32];
+			snprintf(label, sizeof(label), "%g -> %g", inRate, outRate);
+			printf("%-18s %5u %5u %6u %8s %16.0f %10.1f\n", label, probe.InterpolationFactor(),
+				   probe.DecimationFactor(), (unsigned) probe.FlushFrames(),
+				   Resampler::KernelName((Resampler::Kernel) k), perCore, perCore / inRate);
+		}
+	}
+	Resampler::SelectKernel(best);
+	return 0;
+}